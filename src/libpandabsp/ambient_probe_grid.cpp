@@ -0,0 +1,235 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file ambient_probe_grid.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "ambient_probe_grid.h"
+#include "bsploader.h"
+#include "bspfile.h"
+#include "lightmap_palettes.h"
+
+#include <algorithm>
+
+AmbientProbeGrid::AmbientProbeGrid() :
+        _inv_spacing( 0.0f ),
+        _brick_stride_y( 0 ),
+        _brick_stride_z( 0 ),
+        _gamma( 1.0f )
+{
+        _size[0] = _size[1] = _size[2] = 0;
+}
+
+void AmbientProbeGrid::clear()
+{
+        _samples.clear();
+        _bricks.clear();
+        _size[0] = _size[1] = _size[2] = 0;
+        _brick_stride_y = 0;
+        _brick_stride_z = 0;
+}
+
+static void copy_probe_sample( const dprobegridsample_t *sample, fltx4 *sides )
+{
+        for ( int j = 0; j < 6; j++ )
+        {
+                fltx4 &side = sides[j];
+                side = Four_Zeros;
+                SubFloat( side, 0 ) = sample->cube[j][0];
+                SubFloat( side, 1 ) = sample->cube[j][1];
+                SubFloat( side, 2 ) = sample->cube[j][2];
+        }
+}
+
+/**
+ * Loads the probe grid of the level, if it was compiled with one.
+ */
+void AmbientProbeGrid::setup( const bspdata_t *data, PN_stdfloat gamma )
+{
+        clear();
+
+        if ( data->probegrid.size() != 1 )
+        {
+                return;
+        }
+
+        const dprobegrid_t *grid = &data->probegrid[0];
+        int bricks[3];
+        for ( int i = 0; i < 3; i++ )
+        {
+                bricks[i] = ( grid->size[i] + PROBEGRID_BRICK_SIZE - 1 ) / PROBEGRID_BRICK_SIZE;
+        }
+        size_t numprobes = (size_t)grid->size[0] * grid->size[1] * grid->size[2];
+        size_t numbricks = (size_t)bricks[0] * bricks[1] * bricks[2];
+
+        // Maps from before the bricks have a sample for every probe.
+        bool dense = data->probegridbricks.empty();
+
+        bool valid = grid->size[0] >= 2 && grid->size[1] >= 2 && grid->size[2] >= 2 &&
+                grid->spacing > 0.0f;
+        if ( valid && dense )
+        {
+                valid = data->probegridsamples.size() == numprobes;
+        }
+        else if ( valid )
+        {
+                valid = data->probegridbricks.size() == numbricks;
+                for ( size_t i = 0; valid && i < numbricks; i++ )
+                {
+                        const dprobegridbrick_t *brick = &data->probegridbricks[i];
+                        valid = ( brick->numsamples == 1 || brick->numsamples == PROBEGRID_BRICK_PROBES ) &&
+                                brick->firstsample >= 0 &&
+                                (size_t)brick->firstsample + brick->numsamples <= data->probegridsamples.size();
+                }
+        }
+        if ( !valid )
+        {
+                bspfile_cat.warning()
+                        << "Ignoring malformed ambient probe grid\n";
+                return;
+        }
+
+        _origin = LPoint3( grid->origin[0], grid->origin[1], grid->origin[2] ) / PANDA_TO_HAMMER;
+        _inv_spacing = PANDA_TO_HAMMER / grid->spacing;
+        for ( int i = 0; i < 3; i++ )
+        {
+                _size[i] = grid->size[i];
+        }
+        _brick_stride_y = bricks[0];
+        _brick_stride_z = bricks[0] * bricks[1];
+        _gamma = gamma;
+
+        _bricks.resize( numbricks );
+
+        if ( !dense )
+        {
+                _samples.resize( data->probegridsamples.size() * 6 );
+                for ( size_t i = 0; i < data->probegridsamples.size(); i++ )
+                {
+                        copy_probe_sample( &data->probegridsamples[i], &_samples[i * 6] );
+                }
+
+                for ( size_t i = 0; i < numbricks; i++ )
+                {
+                        const dprobegridbrick_t *brick = &data->probegridbricks[i];
+                        _bricks[i].first = brick->firstsample;
+                        _bricks[i].mask = brick->numsamples == 1 ? 0 : PROBEGRID_BRICK_SIZE - 1;
+                }
+                return;
+        }
+
+        // Lay the dense grid out in whole bricks, so it is sampled the same
+        // way.
+        _samples.resize( numbricks * PROBEGRID_BRICK_PROBES * 6, Four_Zeros );
+        for ( size_t i = 0; i < numbricks; i++ )
+        {
+                _bricks[i].first = (int)( i * PROBEGRID_BRICK_PROBES );
+                _bricks[i].mask = PROBEGRID_BRICK_SIZE - 1;
+        }
+        for ( int z = 0; z < _size[2]; z++ )
+        {
+                for ( int y = 0; y < _size[1]; y++ )
+                {
+                        for ( int x = 0; x < _size[0]; x++ )
+                        {
+                                size_t probe = x + (size_t)_size[0] * ( y + (size_t)_size[1] * z );
+                                copy_probe_sample( &data->probegridsamples[probe],
+                                                   &_samples[get_probe_index( x, y, z ) * 6] );
+                        }
+                }
+        }
+}
+
+/**
+ * Fills in the six colors of the ambient cube at the indicated point.
+ * Points outside of the grid get the light of the closest point on it.
+ */
+void AmbientProbeGrid::sample( const LPoint3 &pos, LVector3 *cube ) const
+{
+        sample4( &pos, cube, 1 );
+}
+
+/**
+ * Samples the grid at many points. cubes receives six colors per point.
+ */
+void AmbientProbeGrid::sample_batch( const LPoint3 *pts, LVector3 *cubes, size_t count ) const
+{
+        for ( size_t i = 0; i < count; i += 4 )
+        {
+                sample4( pts + i, cubes + i * 6, (int)std::min( count - i, (size_t)4 ) );
+        }
+}
+
+void AmbientProbeGrid::sample4( const LPoint3 *pts, LVector3 *cubes, int count ) const
+{
+        nassertv( is_valid() );
+
+        fltx4 px = Four_Zeros;
+        fltx4 py = Four_Zeros;
+        fltx4 pz = Four_Zeros;
+        for ( int lane = 0; lane < count; lane++ )
+        {
+                SubFloat( px, lane ) = pts[lane][0];
+                SubFloat( py, lane ) = pts[lane][1];
+                SubFloat( pz, lane ) = pts[lane][2];
+        }
+
+        // Into grid space, clamped onto the grid.
+        fltx4 inv_spacing = ReplicateX4( _inv_spacing );
+        fltx4 gx = MulSIMD( SubSIMD( px, ReplicateX4( _origin[0] ) ), inv_spacing );
+        fltx4 gy = MulSIMD( SubSIMD( py, ReplicateX4( _origin[1] ) ), inv_spacing );
+        fltx4 gz = MulSIMD( SubSIMD( pz, ReplicateX4( _origin[2] ) ), inv_spacing );
+        gx = MinSIMD( MaxSIMD( gx, Four_Zeros ), ReplicateX4( (float)( _size[0] - 1 ) ) );
+        gy = MinSIMD( MaxSIMD( gy, Four_Zeros ), ReplicateX4( (float)( _size[1] - 1 ) ) );
+        gz = MinSIMD( MaxSIMD( gz, Four_Zeros ), ReplicateX4( (float)( _size[2] - 1 ) ) );
+
+        // The cell the point is in, the last cell for points on the far side.
+        fltx4 cx = MinSIMD( FloorSIMD( gx ), ReplicateX4( (float)( _size[0] - 2 ) ) );
+        fltx4 cy = MinSIMD( FloorSIMD( gy ), ReplicateX4( (float)( _size[1] - 2 ) ) );
+        fltx4 cz = MinSIMD( FloorSIMD( gz ), ReplicateX4( (float)( _size[2] - 2 ) ) );
+        fltx4 fx = SubSIMD( gx, cx );
+        fltx4 fy = SubSIMD( gy, cy );
+        fltx4 fz = SubSIMD( gz, cz );
+
+        for ( int lane = 0; lane < count; lane++ )
+        {
+                blend_cell( (int)SubFloat( cx, lane ), (int)SubFloat( cy, lane ), (int)SubFloat( cz, lane ),
+                            SubFloat( fx, lane ), SubFloat( fy, lane ), SubFloat( fz, lane ), cubes + lane * 6 );
+        }
+}
+
+void AmbientProbeGrid::blend_cell( int x, int y, int z, float fx, float fy, float fz, LVector3 *cube ) const
+{
+        fltx4 sides[6] = { Four_Zeros, Four_Zeros, Four_Zeros, Four_Zeros, Four_Zeros, Four_Zeros };
+
+        for ( int corner = 0; corner < 8; corner++ )
+        {
+                int dx = corner & 1;
+                int dy = ( corner >> 1 ) & 1;
+                int dz = ( corner >> 2 ) & 1;
+
+                float weight = ( dx ? fx : 1.0f - fx ) *
+                        ( dy ? fy : 1.0f - fy ) *
+                        ( dz ? fz : 1.0f - fz );
+                fltx4 w = ReplicateX4( weight );
+
+                const fltx4 *probe = &_samples[get_probe_index( x + dx, y + dy, z + dz ) * 6];
+                for ( int i = 0; i < 6; i++ )
+                {
+                        sides[i] = MaddSIMD( w, probe[i], sides[i] );
+                }
+        }
+
+        for ( int i = 0; i < 6; i++ )
+        {
+                const fltx4 &color = sides[i];
+                cube[i].set( gamma_encode( SubFloat( color, 0 ) / 255.0f, _gamma ),
+                             gamma_encode( SubFloat( color, 1 ) / 255.0f, _gamma ),
+                             gamma_encode( SubFloat( color, 2 ) / 255.0f, _gamma ) );
+        }
+}
@@ -0,0 +1,95 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file ambient_probe_grid.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef AMBIENT_PROBE_GRID_H
+#define AMBIENT_PROBE_GRID_H
+
+#include "config_bsp.h"
+#include "bspfile.h"
+#include "mathlib/ssemath.h"
+
+#include <pvector.h>
+#include <luse.h>
+
+/**
+ * The regular grid of ambient probes that p3rad bakes with -probegrid.
+ * Each probe holds an ambient cube, so the ambient light at any point is a
+ * trilinear blend of the cubes of the eight surrounding probes, found by
+ * indexing rather than searching. Sampling returns an ambient cube in the
+ * same space as the per-leaf ambient probes.
+ *
+ * The probes are kept in bricks of PROBEGRID_BRICK_SIZE probes along each
+ * axis, like in the file. A brick that is all inside of solid has one set of
+ * samples for all of its probes, so memory goes with the open space of the
+ * level rather than its bounds.
+ */
+class EXPCL_PANDABSP AmbientProbeGrid
+{
+public:
+        AmbientProbeGrid();
+
+        void setup( const bspdata_t *data, PN_stdfloat gamma );
+        void clear();
+
+        INLINE bool is_valid() const
+        {
+                return !_samples.empty();
+        }
+
+        void sample( const LPoint3 &pos, LVector3 *cube ) const;
+        void sample_batch( const LPoint3 *pts, LVector3 *cubes, size_t count ) const;
+
+private:
+        void sample4( const LPoint3 *pts, LVector3 *cubes, int count ) const;
+        INLINE int get_probe_index( int x, int y, int z ) const;
+        void blend_cell( int x, int y, int z, float fx, float fy, float fz, LVector3 *cube ) const;
+
+private:
+        // Six per stored probe, one for each side of its ambient cube, as
+        // red, green, blue and an unused lane.
+        pvector<fltx4> _samples;
+
+        struct brick_t
+        {
+                // Where the brick's probes start in _samples, in probes.
+                int first;
+                // PROBEGRID_BRICK_SIZE - 1 if each probe has its own samples,
+                // 0 if they all share the first.
+                int mask;
+        };
+        pvector<brick_t> _bricks;
+
+        LPoint3 _origin;
+        PN_stdfloat _inv_spacing;
+        int _size[3];
+        // Distance between neighboring bricks along y and z, in bricks.
+        int _brick_stride_y;
+        int _brick_stride_z;
+
+        PN_stdfloat _gamma;
+};
+
+/**
+ * Returns where the six samples of the indicated probe are in _samples, in
+ * probes.
+ */
+INLINE int AmbientProbeGrid::get_probe_index( int x, int y, int z ) const
+{
+        const brick_t &brick = _bricks[( x / PROBEGRID_BRICK_SIZE ) +
+                                       ( y / PROBEGRID_BRICK_SIZE ) * _brick_stride_y +
+                                       ( z / PROBEGRID_BRICK_SIZE ) * _brick_stride_z];
+        int local = ( x & brick.mask ) +
+                ( y & brick.mask ) * PROBEGRID_BRICK_SIZE +
+                ( z & brick.mask ) * PROBEGRID_BRICK_SIZE * PROBEGRID_BRICK_SIZE;
+        return brick.first + local;
+}
+
+#endif // AMBIENT_PROBE_GRID_H
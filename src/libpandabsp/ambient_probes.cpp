@@ -33,6 +33,9 @@
 #include <modelNode.h>
 #include <pstatTimer.h>
 #include <lineSegs.h>
+#include <lightMutexHolder.h>
+#include <asyncTaskManager.h>
+#include <thread.h>
 
 #include <bitset>
 
@@ -53,6 +56,7 @@ static PStatCollector ambientboost_collector( "AmbientProbes:UpdateNodes:BoostAm
 static PStatCollector xformlight_collector( "AmbientProbes:XformLight" );
 static PStatCollector loadcubemap_collector( "AmbientProbes:UpdateNodes:LoadCubemap" );
 static PStatCollector findcubemap_collector( "AmbientProbes:UpdateNodes:FindCubemap" );
+static PStatCollector updatedirty_collector( "AmbientProbes:UpdateDirtyNodes" );
 
 static ConfigVariableBool cfg_lightaverage
 ( "light-average", true, "Activates/deactivate light averaging" );
@@ -68,6 +72,13 @@ static ConfigVariableDouble r_ambientfraction
 static ConfigVariableDouble r_ambientfactor
 ( "r_ambientfactor", 5.0, "Boost ambient cube by no more than this factor." );
 
+static ConfigVariableInt cfg_probethreads
+( "ambient-probe-threads", 2, "Number of threads that update the lighting of moving nodes before cull. "
+  "0 updates them on the cull thread." );
+
+// Fewest dirty nodes worth handing to another thread.
+static constexpr size_t DIRTY_NODES_PER_TASK = 8;
+
 using std::cos;
 using std::sin;
 
@@ -82,7 +93,12 @@ AmbientProbeManager::AmbientProbeManager() :
         _sunlight( nullptr ),
         //_light_kdtree( nullptr ),
         //_probe_kdtree( nullptr ),
-        _envmap_kdtree( nullptr )
+        _envmap_kdtree( nullptr ),
+        _active_updates( 0 ),
+        _cleaning( 0 ),
+        _next_dirty_node( 0 ),
+        _last_dirty_frame( -1 ),
+        _tracked_lock( "AmbientProbeManager-tracked" )
 {
         dummy_light->id = -1;
         dummy_light->leaf = 0;
@@ -94,7 +110,12 @@ AmbientProbeManager::AmbientProbeManager( BSPLoader *loader ) :
         _sunlight( nullptr ),
         //_light_kdtree( nullptr ),
         //_probe_kdtree( nullptr ),
-        _envmap_kdtree( nullptr )
+        _envmap_kdtree( nullptr ),
+        _active_updates( 0 ),
+        _cleaning( 0 ),
+        _next_dirty_node( 0 ),
+        _last_dirty_frame( -1 ),
+        _tracked_lock( "AmbientProbeManager-tracked" )
 {
 }
 
@@ -149,7 +170,7 @@ void AmbientProbeManager::process_ambient_probes()
                         VectorCopy( pos, light->pos );
                         VectorScale( light->pos, 1 / 16.0, light->pos );
 
-                        light->leaf = _loader->find_leaf( light->pos );
+                        light->leaf = _loader->do_find_leaf( light->pos );
                         light->color = color_from_value( ValueForKey( ent, "_light" ), true, true ).get_xyz();
                         light->type = lighttype_from_classname( classname );
 
@@ -245,21 +266,52 @@ void AmbientProbeManager::process_ambient_probes()
                 for ( int leafnum = 0; leafnum < _loader->_bspdata->dmodels[0].visleafs + 1; leafnum++ )
                 {
                         if ( light->type != LIGHTTYPE_SUN &&
-                             _loader->is_cluster_visible( light->leaf, leafnum ) )
+                             _loader->do_is_cluster_visible( light->leaf, leafnum ) )
                         {
                                 _light_pvs[leafnum].push_back( light );
                         }
                 }
         }
 
+        // Drop the lights that the compiler found can't reach a leaf from
+        // anywhere inside it, so they are never traced.
+        const pvector<unsigned int> &leaflightvis = _loader->_bspdata->leaflightvis;
+        size_t words = LEAFLIGHTVIS_WORDS( _all_lights.size() );
+        bool have_lightvis = words > 0 && leaflightvis.size() == _light_pvs.size() * words;
+        _light_candidates.clear();
+        _light_candidates.resize( _light_pvs.size() );
+        for ( size_t leafnum = 0; leafnum < _light_pvs.size(); leafnum++ )
+        {
+                const pvector<light_t *> &lights = _light_pvs[leafnum];
+                if ( !have_lightvis )
+                {
+                        _light_candidates[leafnum] = lights;
+                        continue;
+                }
+
+                const unsigned int *bits = &leaflightvis[leafnum * words];
+                for ( size_t i = 0; i < lights.size(); i++ )
+                {
+                        int id = lights[i]->id;
+                        if ( bits[id >> 5] & ( 1u << ( id & 31 ) ) )
+                        {
+                                _light_candidates[leafnum].push_back( lights[i] );
+                        }
+                }
+        }
+
+        _light_vis.setup( _light_candidates );
+
+        _probe_grid.setup( _loader->_bspdata, _loader->_gamma );
+
         for ( size_t i = 0; i < _loader->_bspdata->leafambientindex.size(); i++ )
         {
                 dleafambientindex_t *ambidx = &_loader->_bspdata->leafambientindex[i];
                 dleaf_t *leaf = _loader->_bspdata->dleafs + i;
                 _probes[i] = pvector<PT( ambientprobe_t )>();
 
-                _probe_kdtrees[i] = new KDTree( 3 );
-                vector<vector<double>> probe_points;
+                _probe_kdtrees[i] = new PointKDTree;
+                pvector<LPoint3> probe_points;
 
                 for ( int j = 0; j < ambidx->num_ambient_samples; j++ )
                 {
@@ -305,13 +357,13 @@ void AmbientProbeManager::process_ambient_probes()
                         _probes[i].push_back( probe );
 
                         // insert probe into the k-d tree so we can find them quickly
-                        probe_points.push_back( { probe->pos[0], probe->pos[1], probe->pos[2] } );
+                        probe_points.push_back( probe->pos );
                         _all_probes.push_back( probe );
                 }
 
                 if ( probe_points.size() )
                 {
-                        _probe_kdtrees[i]->build( probe_points );
+                        _probe_kdtrees[i]->build( probe_points.data(), probe_points.size() );
                 }
         }
 
@@ -321,8 +373,9 @@ void AmbientProbeManager::process_ambient_probes()
 void AmbientProbeManager::load_cubemaps()
 {
         std::cout << _loader->_bspdata->cubemaps.size() << " cubemaps " << std::endl;
-        _envmap_kdtree = new KDTree( 3 );
-        vector<vector<double>> envmap_points;
+        lumpview_t<colorrgbexp32_t> cubemapdata = GetLumpView<colorrgbexp32_t>( _loader->_bspdata, LUMP_CUBEMAPDATA );
+        _envmap_kdtree = new PointKDTree;
+        pvector<LPoint3> envmap_points;
         for ( size_t i = 0; i < _loader->_bspdata->cubemaps.size(); i++ )
         {
                 dcubemap_t *dcm = &_loader->_bspdata->cubemaps[i];
@@ -341,12 +394,12 @@ void AmbientProbeManager::load_cubemaps()
                 if ( match )
                         continue;
 
-                cm->leaf = _loader->find_leaf( cm->pos );
+                cm->leaf = _loader->do_find_leaf( cm->pos );
                 cm->size = dcm->size;
                 cm->has_full_cubemap = true;
 
                 // insert into k-d tree
-                envmap_points.push_back( { cm->pos[0], cm->pos[1], cm->pos[2] } );
+                envmap_points.push_back( cm->pos );
 
 		// Cubemap is in linear space.
                 cm->cubemap_tex = new Texture( "cubemap_tex" );
@@ -375,7 +428,7 @@ void AmbientProbeManager::load_cubemaps()
                         {
                                 for ( int x = 0; x < dcm->size; x++ )
                                 {
-                                        colorrgbexp32_t *col = &_loader->_bspdata->cubemapdata[dcm->imgofs[j] + xel];
+                                        colorrgbexp32_t *col = &cubemapdata[dcm->imgofs[j] + xel];
                                         LVector3 vcol;
                                         ColorRGBExp32ToVector( *col, vcol );
                                         img.set_xel( x, y, vcol );
@@ -394,7 +447,7 @@ void AmbientProbeManager::load_cubemaps()
 
         if ( envmap_points.size() )
         {
-                _envmap_kdtree->build( envmap_points );
+                _envmap_kdtree->build( envmap_points.data(), envmap_points.size() );
         }      
 }
 
@@ -414,15 +467,6 @@ INLINE bool AmbientProbeManager::is_sky_visible( const LPoint3 &point )
         return trace.has_hit() && trace.hit_contents == CONTENTS_SKY;
 }
 
-INLINE bool AmbientProbeManager::is_light_visible( const LPoint3 &point, const light_t *light )
-{
-        Ray ray( ( point + LPoint3( 0, 0, 0.05 ) ) * 16, light->pos * 16, LPoint3::zero(), LPoint3::zero() );
-        Trace trace;
-        CM_BoxTrace( ray, 0, CONTENTS_SOLID, false, _loader->_colldata, trace );
-
-        return !trace.has_hit();
-}
-
 INLINE LMatrix4 pack_lightdata( const light_t *light )
 {
         return LMatrix4( light->pos, light->direction, light->falloff, light->color );
@@ -443,30 +487,69 @@ INLINE void apply_lightdatas( int n, const light_t *light, CNodeShaderInput *inp
                 input->active_lights++;
 }
 
+/**
+ * By default, the lighting position is the position of the node.
+ * An effect can be applied to offset the lighting position.
+ */
+CPT( TransformState ) AmbientProbeManager::get_lighting_transform( const PandaNode *node,
+                                                                   const TransformState *net_ts )
+{
+	if ( node->has_effect( LightingOriginEffect::get_class_type() ) )
+	{
+		const LightingOriginEffect *effect =
+			DCAST( LightingOriginEffect,
+			       node->get_effect( LightingOriginEffect::get_class_type() ) );
+		LQuaternion quat = net_ts->get_norm_quat();
+		LVector3 world_offset = quat.xform( effect->get_lighting_origin() );
+		return net_ts->set_pos( net_ts->get_pos() + world_offset );
+	}
+
+        return net_ts;
+}
+
+/**
+ * Updates the lighting state of the indicated node and returns the state
+ * to render it with. May be called from several threads at once. If
+ * ambient_cube is given, it is used as the node's ambient cube instead of
+ * sampling the probe grid.
+ */
 const RenderState *AmbientProbeManager::update_node( PandaNode *node,
 						     CPT( TransformState ) curr_trans,
-						     bool should_update )
+						     bool should_update,
+                                                     const LVector3 *ambient_cube )
 {
         PStatTimer timer( updatenode_collector );
 
-        MutexHolder holder( _cache_mutex );
-
         if ( !node || !curr_trans )
         {
                 return nullptr;
         }
 
-	// By default, the lighting position is the position of the node.
-	// An effect can be applied to offset the lighting position.
-	if ( node->has_effect( LightingOriginEffect::get_class_type() ) )
-	{
-		const LightingOriginEffect *effect =
-			DCAST( LightingOriginEffect,
-			       node->get_effect( LightingOriginEffect::get_class_type() ) );
-		LQuaternion quat = curr_trans->get_norm_quat();
-		LVector3 world_offset = quat.xform( effect->get_lighting_origin() );
-		curr_trans = curr_trans->set_pos( curr_trans->get_pos() + world_offset );
-	}
+        AtomicAdjust::inc( _active_updates );
+        if ( AtomicAdjust::get( _cleaning ) )
+        {
+                // The level is being unloaded.
+                AtomicAdjust::dec( _active_updates );
+                return nullptr;
+        }
+
+        const RenderState *state;
+        {
+                LightMutexHolder holder( get_node_lock( node ) );
+                state = do_update_node( node, curr_trans, should_update, ambient_cube );
+        }
+
+        AtomicAdjust::dec( _active_updates );
+
+        return state;
+}
+
+const RenderState *AmbientProbeManager::do_update_node( PandaNode *node,
+							CPT( TransformState ) curr_trans,
+							bool should_update,
+                                                        const LVector3 *ambient_cube )
+{
+        curr_trans = get_lighting_transform( node, curr_trans );
 
         finddata_collector.start();
         bool new_instance = false;
@@ -479,10 +562,15 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
                 input->last_transform = curr_trans;
                 node->set_user_data( input );
                 new_instance = true;
+
+                LightMutexHolder holder( _tracked_lock );
+                _tracked_nodes.push_back( node );
         }
 
         finddata_collector.stop();
 
+        input->last_frame = ClockObject::get_global_clock()->get_frame_count();
+
 	if ( !should_update && !new_instance )
 	{
 		// Just retrieving the current state, no updating.
@@ -528,13 +616,34 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
 
         int leaf_id = _loader->find_leaf( curr_net );
 
+        bool ambientcube_changed = false;
+
         if ( pos_changed )
         {
                 // Update ambient cube
-                if ( _probes[leaf_id].size() > 0 )
+                int probes_idx = _probes.find( leaf_id );
+                if ( _probe_grid.is_valid() )
+                {
+                        // The grid is continuous, so there is nothing to
+                        // smooth over time.
+                        update_ac_collector.start();
+                        if ( ambient_cube != nullptr )
+                        {
+                                memcpy( input->boxcolor, ambient_cube, sizeof( LVector3 ) * 6 );
+                        }
+                        else
+                        {
+                                _probe_grid.sample( curr_net, input->boxcolor );
+                        }
+                        input->amb_probe = nullptr;
+                        ambientcube_changed = true;
+                        update_ac_collector.stop();
+                }
+                else if ( probes_idx != -1 && _probes.get_data( probes_idx ).size() > 0 )
                 {
+                        const pvector<PT( ambientprobe_t )> &leaf_probes = _probes.get_data( probes_idx );
                         update_ac_collector.start();
-                        ambientprobe_t *sample = find_closest_in_kdtree( get_probe_kdtree( leaf_id ), curr_net, _probes[leaf_id] );
+                        ambientprobe_t *sample = find_closest_in_kdtree( get_probe_kdtree( leaf_id ), curr_net, leaf_probes );
                         input->amb_probe = sample;
                         update_ac_collector.stop();
 
@@ -544,9 +653,9 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
                         {
                                 std::cout << "\t" << sample->cube[i] << std::endl;
                         }
-                        for ( size_t j = 0; j < _probes[leaf_id].size(); j++ )
+                        for ( size_t j = 0; j < leaf_probes.size(); j++ )
                         {
-                                _probes[leaf_id][j]->visnode.set_color_scale( LColor( 0, 0, 1, 1 ), 1 );
+                                leaf_probes[j]->visnode.set_color_scale( LColor( 0, 0, 1, 1 ), 1 );
                         }
                         if ( !sample->visnode.is_empty() )
                         {
@@ -580,8 +689,6 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
                 input->last_transform = curr_trans;
         }
 
-        bool ambientcube_changed = false;
-
         interp_ac_collector.start();
         if ( input->amb_probe )
         {
@@ -603,10 +710,8 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
         update_locallights_collector.start();
         if ( pos_changed )
         {
-                input->occluded_lights.reset();
-
                 // Update local light sources
-                input->locallights = _light_pvs[leaf_id];
+                input->locallights = _light_candidates[leaf_id];
                 // Sort local lights from closest to furthest distance from node, we will choose the two closest lights.
                 std::sort( input->locallights.begin(), input->locallights.end(), [curr_net]( const light_t *a, const light_t *b )
                 {
@@ -662,19 +767,9 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
         {
                 light_t *light = input->locallights[i];
 
-                bool occluded = false;
-
-                if ( pos_changed )
-                {
-                        if ( i != input->sky_idx && !is_light_visible( curr_net, light ) )
-                        {
-                                // The light is occluded, don't add it.
-                                input->occluded_lights.set( i );
-                                occluded = true;
-                        }
-                }
-
-                if ( occluded || input->occluded_lights.test( i ) )
+                // Lights are traced from the leaf on a per-frame budget, so a
+                // light can come into view a few frames after the node moves.
+                if ( i != input->sky_idx && !_light_vis.is_light_visible( leaf_id, light, curr_net, _loader->_colldata ) )
                 {
                         // light occluded
                         continue;
@@ -838,6 +933,156 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
         return input->state_with_input;
 }
 
+/**
+ * Updates the lighting of every node that was rendered last frame and has
+ * moved since, spread across the ambient probe threads. Run before cull so
+ * the cull traversal finds the nodes already up to date.
+ */
+void AmbientProbeManager::update_dirty_nodes()
+{
+        PStatTimer timer( updatedirty_collector );
+
+        int frame = ClockObject::get_global_clock()->get_frame_count();
+        if ( frame == _last_dirty_frame )
+        {
+                // Already done for this frame by another main camera.
+                return;
+        }
+        _last_dirty_frame = frame;
+
+        // Take a snapshot of the tracked nodes. Node locks are never taken
+        // while holding _tracked_lock, since update_node() takes them the
+        // other way around.
+        _tracked_snapshot.clear();
+        {
+                LightMutexHolder holder( _tracked_lock );
+
+                size_t num_alive = 0;
+                for ( size_t i = 0; i < _tracked_nodes.size(); i++ )
+                {
+                        PT( PandaNode ) node = _tracked_nodes[i].lock();
+                        if ( node == nullptr )
+                        {
+                                // Node went away, stop tracking it.
+                                continue;
+                        }
+                        _tracked_nodes[num_alive++] = _tracked_nodes[i];
+                        _tracked_snapshot.push_back( node );
+                }
+                _tracked_nodes.resize( num_alive );
+        }
+
+        _dirty_nodes.clear();
+        for ( size_t i = 0; i < _tracked_snapshot.size(); i++ )
+        {
+                PandaNode *node = _tracked_snapshot[i];
+
+                CPT( TransformState ) net_ts;
+                LPoint3 lighting_pos;
+                {
+                        LightMutexHolder node_holder( get_node_lock( node ) );
+                        CNodeShaderInput *input = DCAST( CNodeShaderInput, node->get_user_data() );
+                        if ( input == nullptr || input->last_frame < frame - 1 || input->last_transform == nullptr )
+                        {
+                                // Not being rendered.
+                                continue;
+                        }
+
+                        // last_transform is the lighting transform, so compare
+                        // against that and not the node's own position.
+                        net_ts = NodePath::any_path( node ).get_net_transform();
+                        lighting_pos = get_lighting_transform( node, net_ts )->get_pos();
+                        LVector3 pos_delta = lighting_pos - input->last_transform->get_pos();
+                        if ( pos_delta.length_squared() < EQUAL_EPSILON )
+                        {
+                                continue;
+                        }
+                }
+
+                nodeupdate_t update;
+                update.node = node;
+                update.net_ts = net_ts;
+                update.lighting_pos = lighting_pos;
+                _dirty_nodes.push_back( update );
+        }
+        _tracked_snapshot.clear();
+
+        if ( _dirty_nodes.empty() )
+        {
+                return;
+        }
+
+        if ( _probe_grid.is_valid() )
+        {
+                // Sample the ambient light of every node in one go.
+                _dirty_points.resize( _dirty_nodes.size() );
+                for ( size_t i = 0; i < _dirty_nodes.size(); i++ )
+                {
+                        _dirty_points[i] = _dirty_nodes[i].lighting_pos;
+                        _dirty_points[i][2] += ON_EPSILON;
+                }
+                _dirty_ambient.resize( _dirty_nodes.size() * 6 );
+                _probe_grid.sample_batch( _dirty_points.data(), _dirty_ambient.data(), _dirty_points.size() );
+        }
+
+        AtomicAdjust::set( _next_dirty_node, 0 );
+
+        // Only bring in as many threads as there is work for.
+        int num_threads = std::min( cfg_probethreads.get_value(), (int)( _dirty_nodes.size() / DIRTY_NODES_PER_TASK ) );
+        if ( num_threads <= 0 || !Thread::is_threading_supported() )
+        {
+                update_nodes_task( nullptr, this );
+                return;
+        }
+
+        if ( _update_chain == nullptr )
+        {
+                _update_chain = AsyncTaskManager::get_global_ptr()->make_task_chain( "ambient-probes" );
+                _update_chain->set_num_threads( num_threads );
+                _update_chain->set_thread_priority( TP_high );
+        }
+
+        for ( int i = 0; i < num_threads; i++ )
+        {
+                PT( GenericAsyncTask ) task = new GenericAsyncTask( "updateDirtyNodes", update_nodes_task, this );
+                task->set_task_chain( "ambient-probes" );
+                AsyncTaskManager::get_global_ptr()->add( task );
+        }
+
+        // Help out, then wait for the stragglers.
+        update_nodes_task( nullptr, this );
+        _update_chain->wait_for_tasks();
+}
+
+/**
+ * Takes dirty nodes off the list and updates them until there are none left.
+ */
+AsyncTask::DoneStatus AmbientProbeManager::update_nodes_task( GenericAsyncTask *task, void *data )
+{
+        AmbientProbeManager *mgr = (AmbientProbeManager *)data;
+
+        AtomicAdjust::Integer count = (AtomicAdjust::Integer)mgr->_dirty_nodes.size();
+        while ( true )
+        {
+                AtomicAdjust::Integer i = AtomicAdjust::get( mgr->_next_dirty_node );
+                if ( i >= count )
+                {
+                        break;
+                }
+                if ( AtomicAdjust::compare_and_exchange( mgr->_next_dirty_node, i, i + 1 ) != i )
+                {
+                        // Another thread took it.
+                        continue;
+                }
+
+                const nodeupdate_t &update = mgr->_dirty_nodes[i];
+                const LVector3 *ambient_cube = mgr->_probe_grid.is_valid() ? &mgr->_dirty_ambient[i * 6] : nullptr;
+                mgr->update_node( update.node, update.net_ts, true, ambient_cube );
+        }
+
+        return AsyncTask::DS_done;
+}
+
 INLINE void xform_light( light_t *light, const LMatrix4 &cam_mat )
 {
         if ( light->type != LIGHTTYPE_SUN ) // sun has no position, just direction
@@ -876,20 +1121,49 @@ void AmbientProbeManager::xform_lights( const TransformState *cam_trans )
 }
 
 template<class T>
-T AmbientProbeManager::find_closest_in_kdtree( KDTree *tree, const LPoint3 &pos,
+T AmbientProbeManager::find_closest_in_kdtree( const PointKDTree *tree, const LPoint3 &pos,
                                                const pvector<T> &items )
 {
         if ( !tree )
                 return nullptr;
 
-        std::vector<double> data = { pos[0], pos[1], pos[2] };
-        auto res = tree->query( data );
-        return items[res.first];
+        int index = tree->find_nearest( pos );
+        if ( index < 0 )
+                return nullptr;
+
+        return items[index];
+}
+
+/**
+ * Finds the n items closest to pos, nearest first. out, indices and
+ * dists_sqr are scratch space provided by the caller and must each hold n
+ * elements. Returns the number of items found.
+ */
+template<class T>
+int AmbientProbeManager::find_closest_n_in_kdtree( const PointKDTree *tree, const LPoint3 &pos,
+                                                   const pvector<T> &items, int n, T *out,
+                                                   int *indices, float *dists_sqr )
+{
+        if ( !tree )
+                return 0;
+
+        int found = tree->find_k_nearest( pos, n, indices, dists_sqr );
+        for ( int i = 0; i < found; i++ )
+        {
+                out[i] = items[indices[i]];
+        }
+
+        return found;
 }
 
 void AmbientProbeManager::cleanup()
 {
-        MutexHolder holder( _cache_mutex );
+        // Turn away new node updates and wait for the ones in progress.
+        AtomicAdjust::set( _cleaning, 1 );
+        while ( AtomicAdjust::get( _active_updates ) != 0 )
+        {
+                Thread::relax();
+        }
 
         _sunlight = nullptr;
         //_probe_kdtree = nullptr;
@@ -899,6 +1173,18 @@ void AmbientProbeManager::cleanup()
         _probes.clear();
         _all_probes.clear();
         _light_pvs.clear();
+        _light_candidates.clear();
+        _light_vis.clear();
+        _probe_grid.clear();
+        _dirty_ambient.clear();
+        _dirty_points.clear();
         _all_lights.clear();
         _cubemaps.clear();
+
+        {
+                LightMutexHolder holder( _tracked_lock );
+                _tracked_nodes.clear();
+        }
+
+        AtomicAdjust::set( _cleaning, 0 );
 }
@@ -22,11 +22,18 @@
 #include <cullableObject.h>
 #include <shaderAttrib.h>
 #include <updateSeq.h>
+#include <lightMutex.h>
+#include <weakPointerTo.h>
+#include <asyncTaskChain.h>
+#include <genericAsyncTask.h>
+#include <atomicAdjust.h>
 
 #include <unordered_map>
 #include <bitset>
 
-#include "kdtree/KDTree.h"
+#include "point_kdtree.h"
+#include "lightvis_scheduler.h"
+#include "ambient_probe_grid.h"
 
 #include "config_bsp.h"
 
@@ -75,6 +82,9 @@ struct light_t : public ReferenceCount
 
 #define LIGHTING_UNINITIALIZED -1
 
+// Number of locks the nodes are spread across
+#define AMBIENT_NODE_LOCKS 64
+
 #ifndef CPPPARSER
 class CNodeShaderInput : public TypedReferenceCount
 {
@@ -100,13 +110,15 @@ public:
 
         UpdateSeq node_sequence;
 
+        // Frame the node's lighting was last updated on.
+        int last_frame;
+
         ambientprobe_t *amb_probe;
         cubemap_t *cubemap;
         PT( Texture ) cubemap_tex;
         bool cubemap_changed;
         pvector<light_t *> locallights;
         int sky_idx;
-        std::bitset<0xFFF> occluded_lights;
 
         CPT( RenderState ) state_with_input;
         CPT( TransformState ) last_transform;
@@ -152,17 +164,18 @@ public:
                 memset( boxcolor_boosted, 0, sizeof( LVector3 ) * 6 );
 
                 lighting_time = LIGHTING_UNINITIALIZED;
+                last_frame = -1;
         }
 
         CNodeShaderInput( const CNodeShaderInput &other ) :
                 TypedReferenceCount(),
                 lighting_time( other.lighting_time ),
                 node_sequence( other.node_sequence ),
+                last_frame( other.last_frame ),
                 amb_probe( other.amb_probe ),
                 locallights( other.locallights ),
                 sky_idx( other.sky_idx ),
                 active_lights( other.active_lights ),
-                occluded_lights( other.occluded_lights ),
                 cubemap_tex( other.cubemap_tex ),
                 state_with_input( other.state_with_input ),
                 last_transform( other.last_transform )
@@ -194,17 +207,20 @@ public:
 
         void process_ambient_probes();
 
-	const RenderState *update_node( PandaNode *node, CPT( TransformState ) net_ts, bool should_update = true );
+	const RenderState *update_node( PandaNode *node, CPT( TransformState ) net_ts, bool should_update = true,
+                                        const LVector3 *ambient_cube = nullptr );
+        void update_dirty_nodes();
 
         void load_cubemaps();
 
         template<class T>
-        T find_closest_in_kdtree( KDTree *tree, const LPoint3 &pos,
+        T find_closest_in_kdtree( const PointKDTree *tree, const LPoint3 &pos,
                                   const pvector<T> &items );
 
         template<class T>
-        T find_closest_n_in_kdtree( KDTree *tree, const LPoint3 &pos,
-                                  const pvector<T> &items, int n );
+        int find_closest_n_in_kdtree( const PointKDTree *tree, const LPoint3 &pos,
+                                      const pvector<T> &items, int n, T *out,
+                                      int *indices, float *dists_sqr );
 
         void cleanup();
 
@@ -212,11 +228,11 @@ public:
         //{
         //        return _light_kdtree;
         //}
-        INLINE KDTree *get_envmap_kdtree() const
+        INLINE PointKDTree *get_envmap_kdtree() const
         {
                 return _envmap_kdtree;
         }
-        INLINE KDTree *get_probe_kdtree( int leaf ) const
+        INLINE PointKDTree *get_probe_kdtree( int leaf ) const
         {
                 int itr = _probe_kdtrees.find( leaf );
                 if ( itr == -1 )
@@ -238,23 +254,38 @@ public:
         void xform_lights( const TransformState *cam_trans );
 
 private:
+        const RenderState *do_update_node( PandaNode *node, CPT( TransformState ) net_ts, bool should_update,
+                                           const LVector3 *ambient_cube );
+        static AsyncTask::DoneStatus update_nodes_task( GenericAsyncTask *task, void *data );
+        static CPT( TransformState ) get_lighting_transform( const PandaNode *node, const TransformState *net_ts );
+
+        INLINE LightMutex &get_node_lock( const PandaNode *node )
+        {
+                return _node_locks[( (uintptr_t)node >> 4 ) % AMBIENT_NODE_LOCKS];
+        }
+
         INLINE bool is_sky_visible( const LPoint3 &point );
-        INLINE bool is_light_visible( const LPoint3 &point, const light_t *light );
 
 private:
         BSPLoader *_loader;
 
         // NodePaths to be influenced by the ambient probes.
         SimpleHashMap<int, pvector<PT( ambientprobe_t )>, int_hash> _probes;
-        SimpleHashMap<int, PT( KDTree ), int_hash> _probe_kdtrees;
+        SimpleHashMap<int, PT( PointKDTree ), int_hash> _probe_kdtrees;
         pvector<ambientprobe_t *> _all_probes;
         pvector<PT( light_t )> _all_lights;
         pvector<PT( cubemap_t )> _cubemaps;
         pvector<pvector<light_t *>> _light_pvs;
+        // Lights in each leaf's PVS that the compiler found can reach the
+        // leaf at all. Same as _light_pvs on maps without the lump.
+        pvector<pvector<light_t *>> _light_candidates;
+        LightVisScheduler _light_vis;
+        // Used instead of the per-leaf probes when the map has one.
+        AmbientProbeGrid _probe_grid;
         light_t *_sunlight;
 
        // PT( KDTree ) _light_kdtree;
-        PT( KDTree ) _envmap_kdtree;
+        PT( PointKDTree ) _envmap_kdtree;
 
         NodePath _vis_root;
 
@@ -262,7 +293,37 @@ private:
 
         double _last_garbage_collect_time;
 
-        Mutex _cache_mutex;
+        // The probes, lights and cubemaps are only written while loading and
+        // unloading, so nodes are updated under a lock of their own. A node
+        // can be culled by more than one thread at once.
+        LightMutex _node_locks[AMBIENT_NODE_LOCKS];
+
+        // Number of update_node() calls in progress, and whether cleanup()
+        // is waiting for them to finish.
+        AtomicAdjust::Integer _active_updates;
+        AtomicAdjust::Integer _cleaning;
+
+        // Every node that has lighting state, for the pre-cull pass.
+        LightMutex _tracked_lock;
+        pvector<WPT( PandaNode )> _tracked_nodes;
+        // Live tracked nodes, copied out so that they can be checked without
+        // holding _tracked_lock.
+        pvector<PT( PandaNode )> _tracked_snapshot;
+
+        struct nodeupdate_t
+        {
+                PT( PandaNode ) node;
+                CPT( TransformState ) net_ts;
+                LPoint3 lighting_pos;
+        };
+        pvector<nodeupdate_t> _dirty_nodes;
+        // Ambient cube of each dirty node, six colors per node, sampled
+        // from the probe grid all at once at _dirty_points.
+        pvector<LPoint3> _dirty_points;
+        pvector<LVector3> _dirty_ambient;
+        AtomicAdjust::Integer _next_dirty_node;
+        PT( AsyncTaskChain ) _update_chain;
+        int _last_dirty_frame;
 
 public:
         friend class NodeWeakCallback;
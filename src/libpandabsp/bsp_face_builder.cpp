@@ -0,0 +1,603 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file bsp_face_builder.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "bsp_face_builder.h"
+#include "bsploader.h"
+#include "mathlib.h"
+
+#include <geomTriangles.h>
+#include <geomVertexArrayFormat.h>
+#include <geomVertexWriter.h>
+#include <internalName.h>
+#include <texture.h>
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+// Post-transform cache size that triangle orders are tuned for.
+static const int vcache_size = 32;
+
+enum
+{
+        FV_pos = 0,
+        FV_normal = 3,
+        FV_uv = 6,
+        FV_lightmap_uv = 8,
+        FV_tangent = 10,
+        FV_binormal = 13,
+        FV_COUNT = 16,
+};
+
+BSPFaceBuilder::BSPFaceBuilder( BSPLoader *loader, bool positions_only ) :
+        _loader( loader ),
+        _bspdata( loader->get_bspdata() ),
+        _positions_only( positions_only )
+{
+        PT( GeomVertexArrayFormat ) array = new GeomVertexArrayFormat;
+        array->add_column( InternalName::get_vertex(), 3, GeomEnums::NT_float32, GeomEnums::C_point );
+        if ( !_positions_only )
+        {
+                array->add_column( InternalName::get_normal(), 3, GeomEnums::NT_float32, GeomEnums::C_normal );
+                array->add_column( InternalName::get_texcoord(), 2, GeomEnums::NT_float32, GeomEnums::C_texcoord );
+                array->add_column( InternalName::get_texcoord_name( "lightmap" ), 2, GeomEnums::NT_float32, GeomEnums::C_texcoord );
+                array->add_column( InternalName::get_tangent(), 3, GeomEnums::NT_float32, GeomEnums::C_vector );
+                array->add_column( InternalName::get_binormal(), 3, GeomEnums::NT_float32, GeomEnums::C_vector );
+        }
+        _format = GeomVertexFormat::register_format( array );
+        _vertex_floats = _positions_only ? 3 : FV_COUNT;
+        nassertv( _format->get_array( 0 )->get_stride() == _vertex_floats * (int)sizeof( float ) );
+
+        if ( !_positions_only )
+        {
+                // Vertex normals are stored face after face.
+                _face_first_normal.resize( _bspdata->numfaces );
+                int normal_index = 0;
+                for ( int i = 0; i < _bspdata->numfaces; i++ )
+                {
+                        _face_first_normal[i] = normal_index;
+                        normal_index += _bspdata->dfaces[i].numedges;
+                }
+        }
+}
+
+/**
+ * Returns the index of the ith vertex of the face, going around it in the
+ * order that faces front-facing in Panda.
+ */
+int BSPFaceBuilder::get_face_vertex( const dface_t *face, int i ) const
+{
+        int surf_edge = _bspdata->dsurfedges[face->firstedge + face->numedges - 1 - i];
+        if ( surf_edge >= 0 )
+        {
+                return _bspdata->dedges[surf_edge].v[0];
+        }
+
+        return _bspdata->dedges[-surf_edge].v[1];
+}
+
+/**
+ * Returns the center of the face in hammer units.
+ */
+LPoint3 BSPFaceBuilder::get_face_centroid( int facenum ) const
+{
+        const dface_t *face = _bspdata->dfaces + facenum;
+
+        LPoint3 centroid( 0 );
+        for ( int i = 0; i < face->numedges; i++ )
+        {
+                const float *point = _bspdata->dvertexes[get_face_vertex( face, i )].point;
+                centroid += LPoint3( point[0], point[1], point[2] );
+        }
+
+        if ( face->numedges > 0 )
+        {
+                centroid /= face->numedges;
+        }
+
+        return centroid;
+}
+
+/**
+ * Returns the normal of the face from the winding of its vertices.
+ */
+LVector3 BSPFaceBuilder::get_face_normal( int facenum ) const
+{
+        const dface_t *face = _bspdata->dfaces + facenum;
+
+        LVector3 normal( 0 );
+        for ( int i = 0; i < face->numedges; i++ )
+        {
+                const float *a = _bspdata->dvertexes[get_face_vertex( face, i )].point;
+                const float *b = _bspdata->dvertexes[get_face_vertex( face, ( i + 1 ) % face->numedges )].point;
+                normal[0] += ( a[1] - b[1] ) * ( a[2] + b[2] );
+                normal[1] += ( a[2] - b[2] ) * ( a[0] + b[0] );
+                normal[2] += ( a[0] - b[0] ) * ( a[1] + b[1] );
+        }
+        normal.normalize();
+
+        return normal;
+}
+
+/**
+ * Adds the face to the group for the indicated state. tex is the base
+ * texture, which the texture coordinates are normalized to. Returns false
+ * if the face has no area.
+ */
+bool BSPFaceBuilder::add_face( int facenum, const RenderState *state, const Texture *tex )
+{
+        const dface_t *face = _bspdata->dfaces + facenum;
+        int numverts = face->numedges;
+        if ( numverts < 3 )
+        {
+                return false;
+        }
+
+        size_t group_idx;
+        auto itr = _group_index.find( state );
+        if ( itr != _group_index.end() )
+        {
+                group_idx = itr->second;
+        }
+        else
+        {
+                group_idx = _groups.size();
+                _groups.push_back( facegroup_t() );
+                _groups[group_idx].state = state;
+                _group_index[state] = group_idx;
+        }
+        facegroup_t &group = _groups[group_idx];
+
+        pvector<float> verts( numverts * _vertex_floats, 0.0f );
+        for ( int i = 0; i < numverts; i++ )
+        {
+                const float *point = _bspdata->dvertexes[get_face_vertex( face, i )].point;
+                float *v = &verts[i * _vertex_floats];
+                v[FV_pos + 0] = point[0];
+                v[FV_pos + 1] = point[1];
+                v[FV_pos + 2] = point[2];
+        }
+
+        if ( !_positions_only )
+        {
+                const texinfo_t *texinfo = _bspdata->texinfo + face->texinfo;
+
+                // The widths and heights come from the actual loaded texture that was referenced.
+                float width = 1.0f;
+                float height = 1.0f;
+                if ( tex != nullptr )
+                {
+                        width = tex->get_orig_file_x_size();
+                        height = tex->get_orig_file_y_size();
+                }
+
+                for ( int i = 0; i < numverts; i++ )
+                {
+                        float *v = &verts[i * _vertex_floats];
+                        LVector3 pos( v[FV_pos + 0], v[FV_pos + 1], v[FV_pos + 2] );
+
+                        const float *normal = _bspdata->vertnormals[_bspdata->vertnormalindices[
+                                _face_first_normal[facenum] + face->numedges - 1 - i]].point;
+                        v[FV_normal + 0] = normal[0];
+                        v[FV_normal + 1] = normal[1];
+                        v[FV_normal + 2] = normal[2];
+
+                        v[FV_uv + 0] = ( DotProduct( pos, texinfo->vecs[0] ) + texinfo->vecs[0][3] ) / width;
+                        v[FV_uv + 1] = -( DotProduct( pos, texinfo->vecs[1] ) + texinfo->vecs[1][3] ) / height;
+
+                        LTexCoord luv = _loader->get_lightcoords( facenum, pos );
+                        v[FV_lightmap_uv + 0] = luv[0];
+                        v[FV_lightmap_uv + 1] = luv[1];
+                }
+
+                // The texture mapping is affine across the face, so every
+                // triangle of the fan gives the same directions.
+                LVector3 sdir( 0 ), tdir( 0 );
+                const float *v0 = &verts[0];
+                for ( int i = 1; i < numverts - 1; i++ )
+                {
+                        const float *v1 = &verts[i * _vertex_floats];
+                        const float *v2 = &verts[( i + 1 ) * _vertex_floats];
+
+                        LVector3 e1( v1[0] - v0[0], v1[1] - v0[1], v1[2] - v0[2] );
+                        LVector3 e2( v2[0] - v0[0], v2[1] - v0[1], v2[2] - v0[2] );
+                        float du1 = v1[FV_uv + 0] - v0[FV_uv + 0];
+                        float dv1 = v1[FV_uv + 1] - v0[FV_uv + 1];
+                        float du2 = v2[FV_uv + 0] - v0[FV_uv + 0];
+                        float dv2 = v2[FV_uv + 1] - v0[FV_uv + 1];
+
+                        float r = du1 * dv2 - du2 * dv1;
+                        if ( fabsf( r ) < 1e-12f )
+                        {
+                                continue;
+                        }
+                        sdir += ( e1 * dv2 - e2 * dv1 ) / r;
+                        tdir += ( e2 * du1 - e1 * du2 ) / r;
+                }
+
+                for ( int i = 0; i < numverts; i++ )
+                {
+                        float *v = &verts[i * _vertex_floats];
+                        LVector3 n( v[FV_normal + 0], v[FV_normal + 1], v[FV_normal + 2] );
+
+                        LVector3 tangent = sdir - n * n.dot( sdir );
+                        if ( !tangent.normalize() )
+                        {
+                                tangent = LVector3::zero();
+                        }
+                        LVector3 binormal = tdir - n * n.dot( tdir );
+                        if ( !binormal.normalize() )
+                        {
+                                binormal = LVector3::zero();
+                        }
+
+                        v[FV_tangent + 0] = tangent[0];
+                        v[FV_tangent + 1] = tangent[1];
+                        v[FV_tangent + 2] = tangent[2];
+                        v[FV_binormal + 0] = binormal[0];
+                        v[FV_binormal + 1] = binormal[1];
+                        v[FV_binormal + 2] = binormal[2];
+                }
+        }
+
+        int first_vertex = -1;
+        int prev_vertex = -1;
+        facerange_t range;
+        range.first_index = (int)group.indices.size();
+        for ( int i = 0; i < numverts; i++ )
+        {
+                int vertex = add_vertex( group, &verts[i * _vertex_floats] );
+                if ( i == 0 )
+                {
+                        first_vertex = vertex;
+                }
+                else if ( i > 1 )
+                {
+                        // Fan out from the first vertex.
+                        group.indices.push_back( first_vertex );
+                        group.indices.push_back( prev_vertex );
+                        group.indices.push_back( vertex );
+                }
+                prev_vertex = vertex;
+        }
+        range.num_indices = (int)group.indices.size() - range.first_index;
+        group.faces.push_back( range );
+
+        return true;
+}
+
+/**
+ * Returns the index of the vertex in the group, adding it if the group
+ * doesn't already have an identical one.
+ */
+int BSPFaceBuilder::add_vertex( facegroup_t &group, const float *vertex )
+{
+        size_t vertex_bytes = _vertex_floats * sizeof( float );
+
+        // FNV-1a over the bytes of the vertex.
+        size_t hash = 2166136261u;
+        const unsigned char *bytes = (const unsigned char *)vertex;
+        for ( size_t i = 0; i < vertex_bytes; i++ )
+        {
+                hash = ( hash ^ bytes[i] ) * 16777619u;
+        }
+
+        auto range = group.weld.equal_range( hash );
+        for ( auto itr = range.first; itr != range.second; ++itr )
+        {
+                if ( memcmp( &group.vertices[itr->second * _vertex_floats], vertex, vertex_bytes ) == 0 )
+                {
+                        return itr->second;
+                }
+        }
+
+        int index = (int)( group.vertices.size() / _vertex_floats );
+        group.vertices.insert( group.vertices.end(), vertex, vertex + _vertex_floats );
+        group.weld.insert( std::make_pair( hash, index ) );
+
+        return index;
+}
+
+CPT( GeomPrimitive ) BSPFaceBuilder::make_triangles( const int *indices, int num_indices, int num_vertices ) const
+{
+        PT( GeomTriangles ) tris = new GeomTriangles( GeomEnums::UH_static );
+        tris->set_index_type( num_vertices > 0xffff ? GeomEnums::NT_uint32 : GeomEnums::NT_uint16 );
+
+        PT( GeomVertexArrayData ) index_data = new GeomVertexArrayData( tris->get_index_format(), GeomEnums::UH_static );
+        index_data->unclean_set_num_rows( num_indices );
+        {
+                PT( GeomVertexArrayDataHandle ) handle = index_data->modify_handle();
+                unsigned char *data = handle->get_write_pointer();
+                if ( num_vertices > 0xffff )
+                {
+                        memcpy( data, indices, num_indices * sizeof( uint32_t ) );
+                }
+                else
+                {
+                        uint16_t *data16 = (uint16_t *)data;
+                        for ( int i = 0; i < num_indices; i++ )
+                        {
+                                data16[i] = (uint16_t)indices[i];
+                        }
+                }
+        }
+        tris->set_vertices( index_data, num_indices );
+
+        return tris;
+}
+
+/**
+ * Makes a GeomNode with the faces that were added, each Geom with the
+ * state of its group. If geom_per_face is false, all of the faces of a
+ * group go into one Geom.
+ */
+PT( GeomNode ) BSPFaceBuilder::make_geom_node( const std::string &name, bool geom_per_face )
+{
+        PT( GeomNode ) node = new GeomNode( name );
+
+        for ( size_t i = 0; i < _groups.size(); i++ )
+        {
+                facegroup_t &group = _groups[i];
+                int num_vertices = (int)( group.vertices.size() / _vertex_floats );
+
+                PT( GeomVertexData ) vdata = new GeomVertexData( name, _format, GeomEnums::UH_static );
+                vdata->unclean_set_num_rows( num_vertices );
+                {
+                        PT( GeomVertexArrayDataHandle ) handle = vdata->modify_array_handle( 0 );
+                        memcpy( handle->get_write_pointer(), group.vertices.data(),
+                                group.vertices.size() * sizeof( float ) );
+                }
+
+                if ( geom_per_face )
+                {
+                        for ( size_t j = 0; j < group.faces.size(); j++ )
+                        {
+                                const facerange_t &range = group.faces[j];
+                                PT( Geom ) geom = new Geom( vdata );
+                                geom->add_primitive( make_triangles( &group.indices[range.first_index],
+                                                                     range.num_indices, num_vertices ) );
+                                geom->set_bounds_type( BoundingVolume::BT_box );
+                                node->add_geom( geom, group.state );
+                        }
+                }
+                else
+                {
+                        optimize_vertex_cache( group.indices.data(), group.indices.size(), num_vertices );
+
+                        PT( Geom ) geom = new Geom( vdata );
+                        geom->add_primitive( make_triangles( group.indices.data(),
+                                                             (int)group.indices.size(), num_vertices ) );
+                        geom->set_bounds_type( BoundingVolume::BT_box );
+                        node->add_geom( geom, group.state );
+                }
+        }
+
+        _groups.clear();
+        _group_index.clear();
+
+        return node;
+}
+
+static INLINE float vcache_score( int cache_pos, int remaining_tris )
+{
+        if ( remaining_tris == 0 )
+        {
+                // Nothing left to draw with this vertex.
+                return -1.0f;
+        }
+
+        float score = 0.0f;
+        if ( cache_pos >= 0 )
+        {
+                if ( cache_pos < 3 )
+                {
+                        // Used by the last triangle, a fixed score so that
+                        // strips and fans don't get preferred in one direction.
+                        score = 0.75f;
+                }
+                else
+                {
+                        float scale = 1.0f - (float)( cache_pos - 3 ) / ( vcache_size - 3 );
+                        score = powf( scale, 1.5f );
+                }
+        }
+
+        // Finish off vertices with few triangles left, so they leave the
+        // cache for good.
+        return score + 2.0f / sqrtf( (float)remaining_tris );
+}
+
+/**
+ * Reorders a triangle list so that vertices are reused while they are still
+ * in the post-transform cache, using Tom Forsyth's linear-speed algorithm.
+ */
+void BSPFaceBuilder::optimize_vertex_cache( int *indices, size_t num_indices, int num_vertices )
+{
+        int num_tris = (int)( num_indices / 3 );
+        if ( num_tris < 2 || num_vertices <= 0 )
+        {
+                return;
+        }
+
+        // The triangles that use each vertex. The live ones of vertex v are
+        // vert_tris[vert_first[v]] to vert_tris[vert_first[v] + remaining[v]].
+        pvector<int> vert_first( num_vertices + 1, 0 );
+        for ( size_t i = 0; i < num_indices; i++ )
+        {
+                vert_first[indices[i] + 1]++;
+        }
+        for ( int v = 0; v < num_vertices; v++ )
+        {
+                vert_first[v + 1] += vert_first[v];
+        }
+
+        pvector<int> remaining( num_vertices, 0 );
+        pvector<int> vert_tris( num_indices );
+        for ( size_t i = 0; i < num_indices; i++ )
+        {
+                int v = indices[i];
+                vert_tris[vert_first[v] + remaining[v]++] = (int)( i / 3 );
+        }
+
+        pvector<int> cache_pos( num_vertices, -1 );
+        pvector<float> vert_score( num_vertices );
+        for ( int v = 0; v < num_vertices; v++ )
+        {
+                vert_score[v] = vcache_score( -1, remaining[v] );
+        }
+
+        pvector<float> tri_score( num_tris );
+        pvector<unsigned char> tri_done( num_tris, 0 );
+        int best_tri = 0;
+        for ( int t = 0; t < num_tris; t++ )
+        {
+                tri_score[t] = vert_score[indices[t * 3]] +
+                        vert_score[indices[t * 3 + 1]] +
+                        vert_score[indices[t * 3 + 2]];
+                if ( tri_score[t] > tri_score[best_tri] )
+                {
+                        best_tri = t;
+                }
+        }
+
+        pvector<int> output;
+        output.reserve( num_indices );
+
+        int cache[vcache_size + 3];
+        int cache_count = 0;
+        int scan = 0;
+
+        for ( int n = 0; n < num_tris; n++ )
+        {
+                if ( best_tri < 0 )
+                {
+                        // Nothing in the cache has triangles left, start on
+                        // the next one that hasn't been drawn.
+                        while ( tri_done[scan] )
+                        {
+                                scan++;
+                        }
+                        best_tri = scan;
+                }
+
+                tri_done[best_tri] = 1;
+                const int *tri = indices + best_tri * 3;
+                int new_cache[vcache_size + 3];
+                int new_count = 0;
+
+                for ( int k = 0; k < 3; k++ )
+                {
+                        int v = tri[k];
+                        output.push_back( v );
+
+                        // Take the triangle off of the vertex's live list.
+                        int *live = &vert_tris[vert_first[v]];
+                        for ( int j = 0; j < remaining[v]; j++ )
+                        {
+                                if ( live[j] == best_tri )
+                                {
+                                        live[j] = live[--remaining[v]];
+                                        break;
+                                }
+                        }
+
+                        bool cached = false;
+                        for ( int j = 0; j < new_count; j++ )
+                        {
+                                cached |= new_cache[j] == v;
+                        }
+                        if ( !cached )
+                        {
+                                new_cache[new_count++] = v;
+                        }
+                }
+
+                // The rest of the old cache moves back behind the triangle.
+                for ( int j = 0; j < cache_count; j++ )
+                {
+                        int v = cache[j];
+                        if ( v != tri[0] && v != tri[1] && v != tri[2] )
+                        {
+                                new_cache[new_count++] = v;
+                        }
+                }
+
+                for ( int j = 0; j < new_count; j++ )
+                {
+                        int v = new_cache[j];
+                        cache_pos[v] = j < vcache_size ? j : -1;
+                        vert_score[v] = vcache_score( cache_pos[v], remaining[v] );
+                }
+
+                // Only triangles touching the cache changed score.
+                best_tri = -1;
+                float best_score = -1.0f;
+                for ( int j = 0; j < new_count; j++ )
+                {
+                        int v = new_cache[j];
+                        const int *live = &vert_tris[vert_first[v]];
+                        for ( int k = 0; k < remaining[v]; k++ )
+                        {
+                                int t = live[k];
+                                tri_score[t] = vert_score[indices[t * 3]] +
+                                        vert_score[indices[t * 3 + 1]] +
+                                        vert_score[indices[t * 3 + 2]];
+                                if ( tri_score[t] > best_score )
+                                {
+                                        best_score = tri_score[t];
+                                        best_tri = t;
+                                }
+                        }
+                }
+
+                cache_count = std::min( new_count, vcache_size );
+                memcpy( cache, new_cache, cache_count * sizeof( int ) );
+        }
+
+        memcpy( indices, output.data(), num_indices * sizeof( int ) );
+}
+
+/**
+ * Reorders the triangles of each indexed triangle list in the Geom for the
+ * vertex cache.
+ */
+void BSPFaceBuilder::optimize_vertex_cache( Geom *geom )
+{
+        int num_vertices = geom->get_vertex_data()->get_num_rows();
+
+        for ( size_t i = 0; i < geom->get_num_primitives(); i++ )
+        {
+                CPT( GeomPrimitive ) prim = geom->get_primitive( i );
+                if ( !prim->is_of_type( GeomTriangles::get_class_type() ) || !prim->is_indexed() )
+                {
+                        continue;
+                }
+
+                int num_indices = prim->get_num_vertices();
+                pvector<int> indices( num_indices );
+                for ( int j = 0; j < num_indices; j++ )
+                {
+                        indices[j] = prim->get_vertex( j );
+                }
+
+                optimize_vertex_cache( indices.data(), num_indices, num_vertices );
+
+                PT( GeomPrimitive ) new_prim = prim->make_copy();
+                {
+                        GeomVertexWriter writer( new_prim->modify_vertices(), 0 );
+                        for ( int j = 0; j < num_indices; j++ )
+                        {
+                                writer.set_data1i( indices[j] );
+                        }
+                }
+                geom->set_primitive( i, new_prim );
+        }
+}
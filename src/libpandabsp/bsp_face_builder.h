@@ -0,0 +1,93 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file bsp_face_builder.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef BSP_FACE_BUILDER_H
+#define BSP_FACE_BUILDER_H
+
+#include "config_bsp.h"
+#include "bspfile.h"
+
+#include <pvector.h>
+#include <pmap.h>
+#include <luse.h>
+#include <renderState.h>
+#include <geom.h>
+#include <geomNode.h>
+#include <geomVertexFormat.h>
+
+#include <unordered_map>
+
+class BSPLoader;
+class Texture;
+
+/**
+ * Builds the Geoms of brush faces straight from the face, edge and texinfo
+ * lumps, without going through the egg loader.
+ *
+ * Faces are grouped by their RenderState, which carries the material, the
+ * lightmap palette and the cubemap. The faces of a group share one
+ * GeomVertexData, with identical vertices welded together, and each face
+ * is triangulated as a fan. Either every face gets its own Geom, which the
+ * world needs for leaf culling, or the whole group becomes one Geom with
+ * its triangles ordered for the post-transform vertex cache.
+ */
+class EXPCL_PANDABSP BSPFaceBuilder
+{
+public:
+        BSPFaceBuilder( BSPLoader *loader, bool positions_only = false );
+
+        bool add_face( int facenum, const RenderState *state, const Texture *tex = nullptr );
+        PT( GeomNode ) make_geom_node( const std::string &name, bool geom_per_face );
+
+        LPoint3 get_face_centroid( int facenum ) const;
+        LVector3 get_face_normal( int facenum ) const;
+
+        static void optimize_vertex_cache( Geom *geom );
+        static void optimize_vertex_cache( int *indices, size_t num_indices, int num_vertices );
+
+private:
+        struct facerange_t
+        {
+                int first_index;
+                int num_indices;
+        };
+
+        struct facegroup_t
+        {
+                CPT( RenderState ) state;
+                // _vertex_floats floats per vertex, laid out like _format.
+                pvector<float> vertices;
+                pvector<int> indices;
+                pvector<facerange_t> faces;
+                // Vertex hash to vertex index, for welding.
+                std::unordered_multimap<size_t, int> weld;
+        };
+
+        int get_face_vertex( const dface_t *face, int i ) const;
+        int add_vertex( facegroup_t &group, const float *vertex );
+        CPT( GeomPrimitive ) make_triangles( const int *indices, int num_indices, int num_vertices ) const;
+
+private:
+        BSPLoader *_loader;
+        const bspdata_t *_bspdata;
+        bool _positions_only;
+
+        CPT( GeomVertexFormat ) _format;
+        int _vertex_floats;
+
+        // Index of the first vertex normal of each face.
+        pvector<int> _face_first_normal;
+
+        pvector<facegroup_t> _groups;
+        pmap<const RenderState *, size_t> _group_index;
+};
+
+#endif // BSP_FACE_BUILDER_H
@@ -0,0 +1,228 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file bsp_leaftree.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "bsp_leaftree.h"
+#include "bspfile.h"
+
+#define LEAFTREE_CACHE_LINE 64
+
+BSPLeafTree::BSPLeafTree() :
+        _nodes( nullptr ),
+        _num_nodes( 0 )
+{
+}
+
+void BSPLeafTree::clear()
+{
+        _storage.clear();
+        _nodes = nullptr;
+        _num_nodes = 0;
+        _remap.clear();
+}
+
+void BSPLeafTree::setup( const bspdata_t *data )
+{
+        clear();
+
+        int numnodes = data->numnodes;
+        if ( numnodes <= 0 )
+        {
+                return;
+        }
+
+        // Lay the nodes out depth-first, front child first, starting with the
+        // world and then each brush model. Anything left over goes at the end.
+        _remap.resize( numnodes, -1 );
+        pvector<int> roots;
+        roots.push_back( 0 );
+        for ( int i = 1; i < data->nummodels; i++ )
+        {
+                roots.push_back( data->dmodels[i].headnode[0] );
+        }
+        for ( int i = 0; i < numnodes; i++ )
+        {
+                roots.push_back( i );
+        }
+
+        int next = 0;
+        pvector<int> stack;
+        for ( size_t r = 0; r < roots.size(); r++ )
+        {
+                if ( roots[r] < 0 || roots[r] >= numnodes )
+                {
+                        continue;
+                }
+
+                stack.push_back( roots[r] );
+                while ( !stack.empty() )
+                {
+                        int i = stack.back();
+                        stack.pop_back();
+
+                        if ( _remap[i] != -1 )
+                        {
+                                continue;
+                        }
+                        _remap[i] = next++;
+
+                        const dnode_t *node = &data->dnodes[i];
+                        if ( node->children[1] >= 0 )
+                        {
+                                stack.push_back( node->children[1] );
+                        }
+                        if ( node->children[0] >= 0 )
+                        {
+                                stack.push_back( node->children[0] );
+                        }
+                }
+        }
+
+        _storage.resize( numnodes * sizeof( leaftreenode_t ) + LEAFTREE_CACHE_LINE - 1 );
+        uintptr_t base = ( (uintptr_t)_storage.data() + LEAFTREE_CACHE_LINE - 1 ) & ~(uintptr_t)( LEAFTREE_CACHE_LINE - 1 );
+        _nodes = (leaftreenode_t *)base;
+        _num_nodes = numnodes;
+
+        for ( int i = 0; i < numnodes; i++ )
+        {
+                const dnode_t *node = &data->dnodes[i];
+                const dplane_t *plane = &data->dplanes[node->planenum];
+                leaftreenode_t *out = &_nodes[_remap[i]];
+
+                out->plane[0] = (float)plane->normal[0];
+                out->plane[1] = (float)plane->normal[1];
+                out->plane[2] = (float)plane->normal[2];
+                out->plane[3] = (float)( plane->dist / PANDA_TO_HAMMER );
+                out->type = (int)plane->type;
+                out->pad = 0;
+
+                for ( int j = 0; j < 2; j++ )
+                {
+                        int child = node->children[j];
+                        out->children[j] = child >= 0 ? _remap[child] : child;
+                }
+        }
+}
+
+/**
+ * Returns the index of the leaf that contains the point, walking down from
+ * the indicated dnode.
+ */
+int BSPLeafTree::find_leaf( const LPoint3 &pos, int headnode ) const
+{
+        if ( headnode < 0 )
+        {
+                return ~headnode;
+        }
+        if ( headnode >= _num_nodes )
+        {
+                return 0;
+        }
+
+        int i = _remap[headnode];
+        while ( i >= 0 )
+        {
+                const leaftreenode_t *node = &_nodes[i];
+
+                float distance;
+                if ( node->type < 3 )
+                {
+                        // Axial plane, the normal is 1 on one axis.
+                        distance = pos[node->type] - node->plane[3];
+                }
+                else
+                {
+                        distance = node->plane[0] * pos[0] +
+                                node->plane[1] * pos[1] +
+                                node->plane[2] * pos[2] - node->plane[3];
+                }
+
+                i = node->children[distance >= 0.0f ? 0 : 1];
+        }
+
+        return ~i;
+}
+
+/**
+ * Finds the leaf of each point. out[i] receives the leaf that contains
+ * pts[i]. Points are walked down the tree four at a time.
+ */
+void BSPLeafTree::find_leafs( const LPoint3 *pts, int *out, size_t count, int headnode ) const
+{
+        if ( headnode < 0 || headnode >= _num_nodes )
+        {
+                int leaf = headnode < 0 ? ~headnode : 0;
+                for ( size_t i = 0; i < count; i++ )
+                {
+                        out[i] = leaf;
+                }
+                return;
+        }
+
+        int root = _remap[headnode];
+        for ( size_t i = 0; i < count; i += 4 )
+        {
+                find_leafs4( pts + i, out + i, (int)std::min( count - i, (size_t)4 ), root );
+        }
+}
+
+void BSPLeafTree::find_leafs4( const LPoint3 *pts, int *out, int count, int root ) const
+{
+        fltx4 px = Four_Zeros;
+        fltx4 py = Four_Zeros;
+        fltx4 pz = Four_Zeros;
+        int idx[4];
+        for ( int lane = 0; lane < 4; lane++ )
+        {
+                if ( lane < count )
+                {
+                        SubFloat( px, lane ) = pts[lane][0];
+                        SubFloat( py, lane ) = pts[lane][1];
+                        SubFloat( pz, lane ) = pts[lane][2];
+                        idx[lane] = root;
+                }
+                else
+                {
+                        // Unused lane, already in leaf 0.
+                        idx[lane] = ~0;
+                }
+        }
+
+        // The sign bit of the AND is only set once every lane is in a leaf.
+        while ( ( idx[0] & idx[1] & idx[2] & idx[3] ) >= 0 )
+        {
+                // Lanes that reached a leaf keep testing against the root; their
+                // result is ignored.
+                const leaftreenode_t *n0 = &_nodes[idx[0] >= 0 ? idx[0] : root];
+                const leaftreenode_t *n1 = &_nodes[idx[1] >= 0 ? idx[1] : root];
+                const leaftreenode_t *n2 = &_nodes[idx[2] >= 0 ? idx[2] : root];
+                const leaftreenode_t *n3 = &_nodes[idx[3] >= 0 ? idx[3] : root];
+
+                // Load one plane per lane and transpose into normal x, y, z and dist.
+                fltx4 nx = LoadAlignedSIMD( n0->plane );
+                fltx4 ny = LoadAlignedSIMD( n1->plane );
+                fltx4 nz = LoadAlignedSIMD( n2->plane );
+                fltx4 dist = LoadAlignedSIMD( n3->plane );
+                TransposeSIMD( nx, ny, nz, dist );
+
+                fltx4 d = SubSIMD( MaddSIMD( nx, px, MaddSIMD( ny, py, MulSIMD( nz, pz ) ) ), dist );
+                int back = TestSignSIMD( CmpLtSIMD( d, Four_Zeros ) );
+
+                if ( idx[0] >= 0 ) idx[0] = n0->children[back & 1];
+                if ( idx[1] >= 0 ) idx[1] = n1->children[( back >> 1 ) & 1];
+                if ( idx[2] >= 0 ) idx[2] = n2->children[( back >> 2 ) & 1];
+                if ( idx[3] >= 0 ) idx[3] = n3->children[( back >> 3 ) & 1];
+        }
+
+        for ( int lane = 0; lane < count; lane++ )
+        {
+                out[lane] = ~idx[lane];
+        }
+}
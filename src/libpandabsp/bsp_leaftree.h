@@ -0,0 +1,82 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file bsp_leaftree.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef BSP_LEAFTREE_H
+#define BSP_LEAFTREE_H
+
+#include "config_bsp.h"
+#include "mathlib/ssemath.h"
+
+#include <pvector.h>
+#include <luse.h>
+
+struct bspdata_t;
+
+/**
+ * A BSP node with its splitting plane inlined. Two of these fit in a
+ * cache line.
+ */
+struct ALIGN_16BYTE leaftreenode_t
+{
+        // Plane normal and distance, the distance in Panda units.
+        float plane[4];
+
+        // Front and back child as an index into the flattened array,
+        // or ~leafnum if the child is a leaf.
+        int children[2];
+
+        // Plane type; less than 3 if the plane is along the X, Y or Z axis.
+        int type;
+
+        int pad;
+} ALIGN16_POST;
+
+/**
+ * The BSP tree of the level flattened into one cache line aligned array,
+ * for finding the leaf that contains a point. Nodes are stored depth-first
+ * so that the front child of a node usually sits right after it.
+ */
+class EXPCL_PANDABSP BSPLeafTree
+{
+public:
+        BSPLeafTree();
+
+        void setup( const bspdata_t *data );
+        void clear();
+
+        INLINE bool has_data() const
+        {
+                return _num_nodes > 0;
+        }
+
+        INLINE int get_num_nodes() const
+        {
+                return _num_nodes;
+        }
+
+        int find_leaf( const LPoint3 &pos, int headnode = 0 ) const;
+        void find_leafs( const LPoint3 *pts, int *out, size_t count, int headnode = 0 ) const;
+
+private:
+        void find_leafs4( const LPoint3 *pts, int *out, int count, int root ) const;
+
+private:
+        // Storage for the nodes, over-allocated so _nodes can start on a
+        // cache line.
+        pvector<unsigned char> _storage;
+        leaftreenode_t *_nodes;
+        int _num_nodes;
+
+        // Maps a dnode index to its index in _nodes.
+        pvector<int> _remap;
+};
+
+#endif // BSP_LEAFTREE_H
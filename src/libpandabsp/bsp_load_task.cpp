@@ -0,0 +1,186 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file bsp_load_task.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "bsp_load_task.h"
+#include "bsploader.h"
+
+#include <asyncTaskManager.h>
+#include <throw_event.h>
+#include <trueClock.h>
+
+IMPLEMENT_CLASS( BSPLoadTask );
+
+BSPLoadTask::BSPLoadTask( BSPLoader *loader, const Filename &filename, bool is_transition ) :
+        AsyncTask( "loadBSP-" + filename.get_basename() ),
+        _loader( loader ),
+        _filename( filename ),
+        _is_transition( is_transition ),
+        _started( false ),
+        _success( false ),
+        _stages_done( 0 ),
+        _worker_done( 0 ),
+        _worker_failed( 0 ),
+        _cancelled( 0 ),
+        _stage_times( BSPLoader::LS_COUNT, 0.0 ),
+        _stages_reported( 0 )
+{
+}
+
+/**
+ * Returns how many of the BSPLoader::LoadStage stages have finished.
+ */
+int BSPLoadTask::get_num_stages_done() const
+{
+        return (int)AtomicAdjust::get( _stages_done );
+}
+
+/**
+ * Returns the number of seconds the indicated stage took, or 0 if it hasn't
+ * finished yet.
+ */
+double BSPLoadTask::get_stage_time( int stage ) const
+{
+        nassertr( stage >= 0 && stage < BSPLoader::LS_COUNT, 0.0 );
+        if ( stage >= get_num_stages_done() )
+        {
+                return 0.0;
+        }
+        return _stage_times[stage];
+}
+
+/**
+ * Returns the fraction of the stages that have finished.
+ */
+PN_stdfloat BSPLoadTask::get_progress() const
+{
+        return (PN_stdfloat)get_num_stages_done() / BSPLoader::LS_COUNT;
+}
+
+bool BSPLoadTask::run_stage( int stage )
+{
+        TrueClock *clock = TrueClock::get_global_ptr();
+        double start = clock->get_short_time();
+
+        bool ok = _loader->run_load_stage( stage );
+
+        _stage_times[stage] = clock->get_short_time() - start;
+        if ( ok )
+        {
+                AtomicAdjust::set( _stages_done, stage + 1 );
+        }
+
+        return ok;
+}
+
+/**
+ * Throws the progress event for each stage that finished since last time.
+ */
+void BSPLoadTask::report_stages()
+{
+        int done = get_num_stages_done();
+        for ( ; _stages_reported < done; _stages_reported++ )
+        {
+                int stage = _stages_reported;
+
+                bspfile_cat.info()
+                        << BSPLoader::get_load_stage_name( stage ) << " took "
+                        << _stage_times[stage] << " seconds\n";
+
+                if ( !_progress_event.empty() )
+                {
+                        throw_event( _progress_event, EventParameter( this ),
+                                     EventParameter( stage ), EventParameter( _stage_times[stage] ) );
+                }
+        }
+}
+
+AsyncTask::DoneStatus BSPLoadTask::do_task()
+{
+        if ( !_started )
+        {
+                _started = true;
+                if ( !_loader->begin_read( _filename, _is_transition ) )
+                {
+                        return DS_done;
+                }
+
+                _worker = new GenericAsyncTask( get_name() + "-worker", worker_task, this );
+                _worker->set_task_chain( "bsp-loader" );
+                AsyncTaskManager::get_global_ptr()->add( _worker );
+
+                return DS_cont;
+        }
+
+        report_stages();
+
+        if ( !AtomicAdjust::get( _worker_done ) )
+        {
+                // Still loading, let the frame go on.
+                return DS_cont;
+        }
+
+        if ( AtomicAdjust::get( _worker_failed ) )
+        {
+                return DS_done;
+        }
+
+        // The rest creates the entities and makes the level active.
+        for ( int stage = BSPLoader::LS_first_main_thread_stage; stage < BSPLoader::LS_COUNT; stage++ )
+        {
+                if ( !run_stage( stage ) )
+                {
+                        report_stages();
+                        return DS_done;
+                }
+        }
+
+        report_stages();
+        _success = true;
+
+        return DS_done;
+}
+
+void BSPLoadTask::upon_death( AsyncTaskManager *manager, bool clean_exit )
+{
+        if ( _worker != nullptr && !AtomicAdjust::get( _worker_done ) )
+        {
+                // We were removed before the worker got through. Let it stop
+                // after the stage it's on, it is still using the loader.
+                AtomicAdjust::set( _cancelled, 1 );
+                _worker->wait();
+        }
+        _worker = nullptr;
+
+        _loader->end_read( this );
+
+        AsyncTask::upon_death( manager, clean_exit );
+}
+
+/**
+ * Runs the stages that don't need the main thread.
+ */
+AsyncTask::DoneStatus BSPLoadTask::worker_task( GenericAsyncTask *task, void *data )
+{
+        BSPLoadTask *self = (BSPLoadTask *)data;
+
+        for ( int stage = 0; stage < BSPLoader::LS_first_main_thread_stage; stage++ )
+        {
+                if ( AtomicAdjust::get( self->_cancelled ) || !self->run_stage( stage ) )
+                {
+                        AtomicAdjust::set( self->_worker_failed, 1 );
+                        break;
+                }
+        }
+
+        AtomicAdjust::set( self->_worker_done, 1 );
+
+        return AsyncTask::DS_done;
+}
@@ -0,0 +1,102 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file bsp_load_task.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef BSP_LOAD_TASK_H
+#define BSP_LOAD_TASK_H
+
+#include "config_bsp.h"
+
+#include <asyncTask.h>
+#include <genericAsyncTask.h>
+#include <filename.h>
+#include <atomicAdjust.h>
+
+class BSPLoader;
+
+/**
+ * A level being loaded by BSPLoader::read_async(). The task itself runs on
+ * the main thread and only does the stages that touch the application, the
+ * CPU-heavy stages run one after another on the "bsp-loader" task chain.
+ * The level becomes active when the task is done.
+ *
+ * Wait on it like any other task or future. If a progress event is set, it
+ * is thrown on the main thread as each stage finishes, with this task, the
+ * stage and the seconds the stage took.
+ */
+class EXPCL_PANDABSP BSPLoadTask : public AsyncTask
+{
+        DECLARE_CLASS( BSPLoadTask, AsyncTask );
+
+PUBLISHED:
+        INLINE const Filename &get_filename() const
+        {
+                return _filename;
+        }
+        INLINE bool get_is_transition() const
+        {
+                return _is_transition;
+        }
+
+        INLINE bool get_success() const
+        {
+                return _success;
+        }
+
+        int get_num_stages_done() const;
+        double get_stage_time( int stage ) const;
+        PN_stdfloat get_progress() const;
+
+        INLINE void set_progress_event( const std::string &event )
+        {
+                _progress_event = event;
+        }
+        INLINE const std::string &get_progress_event() const
+        {
+                return _progress_event;
+        }
+
+        MAKE_PROPERTY( filename, get_filename );
+        MAKE_PROPERTY( success, get_success );
+        MAKE_PROPERTY( progress, get_progress );
+        MAKE_PROPERTY( progress_event, get_progress_event, set_progress_event );
+
+public:
+        BSPLoadTask( BSPLoader *loader, const Filename &filename, bool is_transition );
+
+protected:
+        virtual DoneStatus do_task();
+        virtual void upon_death( AsyncTaskManager *manager, bool clean_exit );
+
+private:
+        bool run_stage( int stage );
+        void report_stages();
+        static AsyncTask::DoneStatus worker_task( GenericAsyncTask *task, void *data );
+
+private:
+        BSPLoader *_loader;
+        Filename _filename;
+        bool _is_transition;
+        bool _started;
+        bool _success;
+        std::string _progress_event;
+
+        PT( GenericAsyncTask ) _worker;
+        // Written by the worker and read by the main thread.
+        AtomicAdjust::Integer _stages_done;
+        AtomicAdjust::Integer _worker_done;
+        AtomicAdjust::Integer _worker_failed;
+        AtomicAdjust::Integer _cancelled;
+        pvector<double> _stage_times;
+
+        int _stages_reported;
+};
+
+#endif // BSP_LOAD_TASK_H
@@ -12,8 +12,11 @@
 #include "bsp_material.h"
 
 #include <lightMutex.h>
+#include <lightMutexHolder.h>
 
 static LightMutex g_matmutex( "MaterialMutex" );
+// Shaders are generated on several threads, and they look up stages by name.
+static LightMutex g_stagemutex( "TextureStageMutex" );
 
 //====================================================================//
 
@@ -25,6 +28,8 @@ TextureStages::tspool_t TextureStages::_stage_pool;
  */
 TextureStage *TextureStages::get( const std::string &name )
 {
+        LightMutexHolder holder( g_stagemutex );
+
         auto itr = _stage_pool.find( name );
         if ( itr != _stage_pool.end() )
         {
@@ -42,6 +47,8 @@ TextureStage *TextureStages::get( const std::string &name )
 
 TextureStage *TextureStages::get( const std::string &name, const std::string &uv_name )
 {
+        LightMutexHolder holder( g_stagemutex );
+
         auto itr = _stage_pool.find( name );
         if ( itr != _stage_pool.end() )
         {
@@ -103,6 +110,11 @@ TextureStage *TextureStages::get_glowmap()
         return get( "glowmap" );
 }
 
+TextureStage *TextureStages::get_static_prop_lighting()
+{
+        return get( "static_prop_lighting" );
+}
+
 //====================================================================//
 //====================================================================//
 
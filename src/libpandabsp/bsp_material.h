@@ -50,6 +50,7 @@ PUBLISHED:
         static TextureStage *get_heightmap();
         static TextureStage *get_glossmap();
         static TextureStage *get_glowmap();
+        static TextureStage *get_static_prop_lighting();
 
 private:
         typedef pmap<std::string, PT( TextureStage )> tspool_t;
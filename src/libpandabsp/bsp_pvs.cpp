@@ -0,0 +1,198 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file bsp_pvs.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "bsp_pvs.h"
+#include "bspfile.h"
+
+#include <lightMutexHolder.h>
+#include <configVariableBool.h>
+#include <configVariableInt.h>
+
+static ConfigVariableBool bsp_pvs_lazy
+( "bsp-pvs-lazy", false, "Decompress PVS rows when they are first needed and keep them in an LRU cache, "
+  "instead of decompressing the whole PVS when the level loads." );
+static ConfigVariableInt bsp_pvs_cache_rows
+( "bsp-pvs-cache-rows", 256, "Number of decompressed PVS rows to cache when bsp-pvs-lazy is on." );
+
+BSPPVS::BSPPVS() :
+        _bspdata( nullptr ),
+        _has_data( false ),
+        _lazy( false ),
+        _num_visleafs( 0 ),
+        _row_words( 0 ),
+        _cache_lock( "BSPPVS-cache" ),
+        _stamp( 0 )
+{
+}
+
+void BSPPVS::setup( bspdata_t *data )
+{
+        clear();
+
+        _bspdata = data;
+        _num_visleafs = data->dmodels[0].visleafs;
+        _row_words = ( _num_visleafs + 63 ) / 64;
+        _lazy = bsp_pvs_lazy;
+
+        for ( int i = 0; i < _num_visleafs + 1; i++ )
+        {
+                if ( data->dleafs[i].visofs != -1 )
+                {
+                        _has_data = true;
+                        break;
+                }
+        }
+
+        if ( !_has_data || _row_words == 0 )
+        {
+                _has_data = false;
+                return;
+        }
+
+        int num_rows = _num_visleafs + 1;
+
+        if ( !_lazy )
+        {
+                _matrix.resize( num_rows * _row_words );
+                for ( int i = 0; i < num_rows; i++ )
+                {
+                        decompress_row( i, &_matrix[i * _row_words] );
+                }
+        }
+        else
+        {
+                int num_slots = std::min( std::max( (int)bsp_pvs_cache_rows, 1 ), num_rows );
+                _cache.resize( num_slots * _row_words );
+                _slot_row.resize( num_slots, -1 );
+                _slot_stamp.resize( num_slots, 0 );
+                _row_slot.resize( num_rows, -1 );
+        }
+}
+
+void BSPPVS::clear()
+{
+        LightMutexHolder holder( _cache_lock );
+
+        _bspdata = nullptr;
+        _has_data = false;
+        _num_visleafs = 0;
+        _row_words = 0;
+        _matrix.clear();
+        _cache.clear();
+        _row_slot.clear();
+        _slot_row.clear();
+        _slot_stamp.clear();
+        _stamp = 0;
+}
+
+void BSPPVS::decompress_row( int leaf, uint64_t *row ) const
+{
+        memset( row, 0, _row_words * sizeof( uint64_t ) );
+
+        const dleaf_t *dleaf = &_bspdata->dleafs[leaf];
+        if ( dleaf->visofs == -1 )
+        {
+                return;
+        }
+
+        // The row is laid out little-endian, so bit (cluster - 1) of the row
+        // lines up with the byte layout that DecompressVis() writes.
+        lumpview_t<byte> visdata = GetLumpView<byte>( _bspdata, LUMP_VISIBILITY );
+        DecompressVis( visdata.data(), (int)visdata.size(), _num_visleafs,
+                       &visdata[dleaf->visofs], (byte *)row, (unsigned int)( _row_words * sizeof( uint64_t ) ) );
+}
+
+/**
+ * Returns the cache slot holding the row for the indicated leaf,
+ * decompressing it into the least recently used slot if necessary.
+ * Assumes the cache lock is held.
+ */
+int BSPPVS::fetch_row( int leaf ) const
+{
+        int slot = _row_slot[leaf];
+        if ( slot == -1 )
+        {
+                // Evict the least recently used row.
+                slot = 0;
+                for ( size_t i = 1; i < _slot_stamp.size(); i++ )
+                {
+                        if ( _slot_stamp[i] < _slot_stamp[slot] )
+                        {
+                                slot = (int)i;
+                        }
+                }
+
+                if ( _slot_row[slot] != -1 )
+                {
+                        _row_slot[_slot_row[slot]] = -1;
+                }
+
+                decompress_row( leaf, &_cache[slot * _row_words] );
+                _slot_row[slot] = leaf;
+                _row_slot[leaf] = slot;
+        }
+
+        _slot_stamp[slot] = ++_stamp;
+        return slot;
+}
+
+/**
+ * Returns the PVS row of the indicated leaf. If the PVS is lazy, the row is
+ * copied into scratch, which must hold get_row_words() words, since the
+ * cached row may be evicted by another thread at any time. Returns nullptr
+ * if there is no row for the leaf.
+ */
+const uint64_t *BSPPVS::get_row( int leaf, uint64_t *scratch ) const
+{
+        if ( !_has_data || leaf < 0 || leaf > _num_visleafs )
+        {
+                return nullptr;
+        }
+
+        if ( !_lazy )
+        {
+                return &_matrix[leaf * _row_words];
+        }
+
+        LightMutexHolder holder( _cache_lock );
+        int slot = fetch_row( leaf );
+        memcpy( scratch, &_cache[slot * _row_words], _row_words * sizeof( uint64_t ) );
+        return scratch;
+}
+
+/**
+ * Returns true if the cluster is in the PVS of the leaf.
+ */
+bool BSPPVS::is_visible( int leaf, int cluster ) const
+{
+        if ( !_has_data || leaf < 0 || leaf > _num_visleafs ||
+             cluster < 1 || cluster > _num_visleafs )
+        {
+                return false;
+        }
+
+        int bit = cluster - 1;
+        uint64_t mask = (uint64_t)1 << ( bit & 63 );
+
+        if ( !_lazy )
+        {
+                return ( _matrix[leaf * _row_words + ( bit >> 6 )] & mask ) != 0;
+        }
+
+        LightMutexHolder holder( _cache_lock );
+        int slot = fetch_row( leaf );
+        return ( _cache[slot * _row_words + ( bit >> 6 )] & mask ) != 0;
+}
+
+size_t BSPPVS::get_memory_usage() const
+{
+        return ( _matrix.size() + _cache.size() ) * sizeof( uint64_t );
+}
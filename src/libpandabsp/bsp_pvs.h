@@ -0,0 +1,115 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file bsp_pvs.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef BSP_PVS_H
+#define BSP_PVS_H
+
+#include "config_bsp.h"
+
+#include <pvector.h>
+#include <lightMutex.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+struct bspdata_t;
+
+/**
+ * Returns the index of the lowest set bit. word must not be 0.
+ */
+INLINE int pvs_ctz( uint64_t word )
+{
+#ifdef _MSC_VER
+        unsigned long idx;
+        _BitScanForward64( &idx, word );
+        return (int)idx;
+#else
+        return __builtin_ctzll( word );
+#endif
+}
+
+INLINE int pvs_popcount( uint64_t word )
+{
+#ifdef _MSC_VER
+        return (int)__popcnt64( word );
+#else
+        return __builtin_popcountll( word );
+#endif
+}
+
+/**
+ * The decompressed potentially visible set of the world. Each visleaf has a
+ * row of bits, bit (cluster - 1) being set if that cluster is visible from
+ * the leaf, which is the same layout DecompressVis() produces. Rows are
+ * padded out to 64-bit words so they can be scanned a word at a time.
+ *
+ * By default every row is decompressed up front into one contiguous matrix.
+ * With bsp-pvs-lazy, rows are decompressed from the visibility lump on
+ * demand and kept in a small LRU cache instead.
+ */
+class EXPCL_PANDABSP BSPPVS
+{
+public:
+        BSPPVS();
+
+        void setup( bspdata_t *data );
+        void clear();
+
+        INLINE bool has_data() const
+        {
+                return _has_data;
+        }
+
+        INLINE int get_num_visleafs() const
+        {
+                return _num_visleafs;
+        }
+
+        INLINE size_t get_row_words() const
+        {
+                return _row_words;
+        }
+
+        INLINE bool is_lazy() const
+        {
+                return _lazy;
+        }
+
+        const uint64_t *get_row( int leaf, uint64_t *scratch ) const;
+        bool is_visible( int leaf, int cluster ) const;
+
+        size_t get_memory_usage() const;
+
+private:
+        void decompress_row( int leaf, uint64_t *row ) const;
+        int fetch_row( int leaf ) const;
+
+private:
+        bspdata_t *_bspdata;
+        bool _has_data;
+        bool _lazy;
+        int _num_visleafs;
+        size_t _row_words;
+
+        // Row-major matrix of every row, when not lazy.
+        pvector<uint64_t> _matrix;
+
+        // LRU row cache, when lazy.
+        mutable LightMutex _cache_lock;
+        mutable pvector<uint64_t> _cache;
+        mutable pvector<int> _row_slot;
+        mutable pvector<int> _slot_row;
+        mutable pvector<unsigned int> _slot_stamp;
+        mutable unsigned int _stamp;
+};
+
+#endif // BSP_PVS_H
@@ -18,6 +18,7 @@
 #include <characterJointEffect.h>
 #include <renderModeAttrib.h>
 #include <modelRoot.h>
+#include <sceneSetup.h>
 
 #include <bitset>
 
@@ -40,7 +41,8 @@ IMPLEMENT_CLASS( BSPCullTraverser );
 
 BSPCullTraverser::BSPCullTraverser( CullTraverser *trav, BSPLoader *loader ) :
         CullTraverser( *trav ),
-        _loader( loader )
+        _loader( loader ),
+        _visible_leafs( loader->get_visible_leafs() )
 {
 }
 
@@ -74,7 +76,7 @@ bool BSPCullTraverser::is_in_view( CullTraverserData &data )
 		pvs_node_xform_collector.stop();
 
 		pvs_test_node_collector.start();
-		bool ret = loader->pvs_bounds_test( bbox, get_required_leaf_flags() );
+		bool ret = loader->pvs_bounds_test( _visible_leafs, bbox, get_required_leaf_flags() );
 		pvs_test_node_collector.stop();
 		return ret;
 	}
@@ -178,7 +180,7 @@ INLINE void BSPCullTraverser::add_geomnode_for_draw( GeomNode *node, CullTravers
 					pvs_test_geom_collector.start();
 					// Test geom bounds against visible leaf bounding boxes.
 					// Always test against PVS even if camera's bit isn't set in CAMERA_MASK_CULLING.
-					if ( !loader->pvs_bounds_test( net_geom_volume, get_required_leaf_flags() ) )
+					if ( !loader->pvs_bounds_test( _visible_leafs, net_geom_volume, get_required_leaf_flags() ) )
 					{
 						// Didn't intersect any, cull.
 						pvs_test_geom_collector.stop();
@@ -251,12 +253,11 @@ void BSPCullTraverser::traverse_below( CullTraverserData &data )
 
 			keep_going = false;
 
-			_loader->_leaf_aabb_lock.acquire();
-			bool should_render = _loader->_curr_leaf_idx != 0;
+			bool should_render = _visible_leafs != nullptr && _visible_leafs->get_view_leaf() != 0;
 
 			if ( should_render )
 			{
-				const GeomNode::Geoms &world_geoms = _loader->_leaf_world_geoms[_loader->_curr_leaf_idx];
+				const GeomNode::Geoms &world_geoms = _visible_leafs->get_world_geoms();
 
 				int num_world_geoms = world_geoms.get_num_geoms();
 				for ( int i = 0; i < num_world_geoms; i++ )
@@ -314,8 +315,6 @@ void BSPCullTraverser::traverse_below( CullTraverserData &data )
 				}
 			}
 
-			_loader->_leaf_aabb_lock.release();
-
 			wsp_trav_collector.stop();
 		}
 		else if ( _loader->has_active_level() &&
@@ -422,11 +421,29 @@ bool BSPRender::cull_callback( CullTraverser *trav, CullTraverserData &data )
         BSPCullTraverser bsp_trav( trav, _loader );
         bsp_trav.local_object();
 
-	if ( bsp_trav.has_camera_bits( CAMERA_MAIN ) && _loader->has_visibility() )
+	PT( VisibilityContext ) vis_context = VisibilityContext::get_for_camera( trav->get_scene()->get_camera_node() );
+	if ( vis_context != nullptr )
+	{
+		// This camera decides for itself which leafs to cull against.
+		bsp_trav.set_visibility_context( vis_context );
+		if ( _loader->has_visibility() )
+		{
+			bsp_trav.set_visible_leafs( vis_context->update( _loader, trav ) );
+		}
+	}
+	else if ( bsp_trav.has_camera_bits( CAMERA_MAIN ) && _loader->has_visibility() )
 	{
 		// Update visible leafs on main camera pass.
 		_loader->update_visibility(
 			trav->get_camera_transform()->get_pos() );
+		bsp_trav.set_visible_leafs( _loader->get_visible_leafs() );
+	}
+
+	if ( bsp_trav.has_camera_bits( CAMERA_MAIN ) && _loader->has_active_level() )
+	{
+		// Bring the lighting of moving nodes up to date across threads
+		// before the traversal reaches them.
+		_loader->_amb_probe_mgr.update_dirty_nodes();
 	}
 
         bsp_trav.traverse_below( data );
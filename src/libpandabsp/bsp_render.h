@@ -22,6 +22,8 @@
 
 #include "bspfile.h"
 #include "shader_generator.h"
+#include "bsp_visleafs.h"
+#include "bsp_viscontext.h"
 
 class BSPLoader;
 class CNodeShaderInput;
@@ -55,11 +57,34 @@ PUBLISHED:
 	 */
 	INLINE unsigned int get_required_leaf_flags() const
 	{
-		//if ( has_camera_bits( CAMERA_SHADOW ) )
-		//	return LEAF_FLAGS_SKY2D;
+		if ( _vis_context != nullptr )
+			return _vis_context->get_required_leaf_flags();
 		return 0u;
 	}
 
+public:
+	/**
+	 * Sets the snapshot of visible leafs that this traverser culls against.
+	 * Cameras that are not in the main camera's leaf can be given their own.
+	 */
+	INLINE void set_visible_leafs( const BSPVisibleLeafs *visible_leafs )
+	{
+		_visible_leafs = visible_leafs;
+	}
+	INLINE const BSPVisibleLeafs *get_visible_leafs() const
+	{
+		return _visible_leafs;
+	}
+
+	INLINE void set_visibility_context( VisibilityContext *context )
+	{
+		_vis_context = context;
+	}
+	INLINE VisibilityContext *get_visibility_context() const
+	{
+		return _vis_context;
+	}
+
 protected:
         virtual bool is_in_view( CullTraverserData &data );
 
@@ -69,6 +94,8 @@ private:
 
 private:
         BSPLoader *_loader;
+        CPT( BSPVisibleLeafs ) _visible_leafs;
+        PT( VisibilityContext ) _vis_context;
 };
 
 /**
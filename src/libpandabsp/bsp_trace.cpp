@@ -16,6 +16,7 @@
 
 #include <pstatTimer.h>
 #include <pstatCollector.h>
+#include <atomicAdjust.h>
 
 static PStatCollector piw_collector( "BSP:Trace:PointInWinding" );
 static PStatCollector ff_collector( "BSP:FaceFinder" );
@@ -309,24 +310,112 @@ bool IntersectRayWithBoxBrush( Trace *trace, const dbrush_t *brush, const cboxbr
 
 #define NEVER_UPDATED -99999
 
+// Brushes often span several leafs. So that a trace only clips against each
+// brush once, every thread keeps a mailbox with the check count of the last
+// trace that clipped each brush. Packet traces also record which of their
+// rays have clipped it.
+struct cmailboxentry_t
+{
+        unsigned int checkcount;
+        unsigned int lanes;
+};
+
+struct cmailbox_t
+{
+        cmailbox_t() :
+                generation( 0 ),
+                checkcount( 0 )
+        {
+        }
+
+        unsigned int generation;
+        unsigned int checkcount;
+        pvector<cmailboxentry_t> entries;
+};
+
+static thread_local cmailbox_t cm_mailbox;
+// Levels can be set up on any thread, so this is bumped atomically. The
+// first level gets generation 1, so that a fresh mailbox never matches.
+static AtomicAdjust::Integer cm_next_generation = 0;
+
+/**
+ * Returns this thread's mailbox, ready for a new trace.
+ */
+static cmailbox_t *CM_BeginMailbox( const collbspdata_t *data )
+{
+        cmailbox_t *mailbox = &cm_mailbox;
+
+        if ( mailbox->generation != data->generation )
+        {
+                // First trace against this level on this thread.
+                mailbox->generation = data->generation;
+                mailbox->checkcount = 0;
+                mailbox->entries.clear();
+                mailbox->entries.resize( data->numbrushes );
+        }
+
+        if ( ++mailbox->checkcount == 0 )
+        {
+                // Wrapped around, forget everything.
+                memset( mailbox->entries.data(), 0, mailbox->entries.size() * sizeof( cmailboxentry_t ) );
+                mailbox->checkcount = 1;
+        }
+
+        return mailbox;
+}
+
+/**
+ * Returns which of the indicated rays of the current trace have not yet
+ * clipped against the brush, and marks them as having done so.
+ */
+INLINE int CM_MailboxTest( cmailbox_t *mailbox, int brushidx, int lanes )
+{
+        cmailboxentry_t &entry = mailbox->entries[brushidx];
+        if ( entry.checkcount != mailbox->checkcount )
+        {
+                entry.checkcount = mailbox->checkcount;
+                entry.lanes = 0u;
+        }
+
+        int todo = lanes & ~(int)entry.lanes;
+        entry.lanes |= todo;
+        return todo;
+}
+
 template <bool IS_POINT>
 void CM_ClipBoxToBrush( Trace *trace, const dbrush_t *brush, int brush_idx )
 {
+        const cboxbrush_t *bbrush = &trace->bspdata->boxbrushes[brush_idx];
+
+        // reject the brush if the bounds of the sweep don't touch it
+        fltx4 outside = OrSIMD( CmpGtSIMD( bbrush->ssebounds_mins, trace->sse_sweep_maxs ),
+                                CmpLtSIMD( bbrush->ssebounds_maxs, trace->sse_sweep_mins ) );
+        if ( IsAnyNegative( SetWToZeroSIMD( outside ) ) )
+        {
+                return;
+        }
+
         // special SIMD accelerated case for box brushes ( 6 sides and axis-aligned )
-        if ( trace->bspdata->boxbrushes[brush_idx].is_box )
+        if ( bbrush->is_box )
         {
-                cboxbrush_t *bbrush = trace->bspdata->boxbrushes + brush_idx;
                 IntersectRayWithBoxBrush( trace, brush, bbrush );
                 return;
         }
 
-        if ( !brush->numsides )
+        if ( !bbrush->numplanes4 )
         {
                 return;
         }
 
-        const LVector3 &p1 = trace->start_pos;
-        const LVector3 &p2 = trace->end_pos;
+        fltx4 p1[3], p2[3], ext[3];
+        for ( int i = 0; i < 3; i++ )
+        {
+                p1[i] = ReplicateX4( trace->start_pos[i] );
+                p2[i] = ReplicateX4( trace->end_pos[i] );
+                ext[i] = ReplicateX4( trace->extents[i] );
+        }
+        const fltx4 negative_ones = NegSIMD( Four_Ones );
+
         int brush_contents = brush->contents;
 
         float enter_frac = NEVER_UPDATED;
@@ -334,78 +423,87 @@ void CM_ClipBoxToBrush( Trace *trace, const dbrush_t *brush, int brush_idx )
 
         bool getout = false;
         bool startout = false;
-        const dbrushside_t *leadside = nullptr;
-
-        float dist;
+        int leadside = -1;
 
-        const dbrushside_t *side = &trace->bspdata->bspdata->dbrushsides[brush->firstside];
-        for (const dbrushside_t * const sidelimit = side + brush->numsides; side < sidelimit; side++)
+        // test the planes of the brush four at a time
+        const cbrushplanes4_t *planes = &trace->bspdata->brushplanes[bbrush->firstplanes4];
+        for ( const cbrushplanes4_t * const planelimit = planes + bbrush->numplanes4; planes < planelimit; planes++ )
         {
-                const dplane_t *plane = trace->bspdata->bspdata->dplanes + side->planenum;
-                LVector3 plane_normal( plane->normal[0], plane->normal[1], plane->normal[2] );
-
+                fltx4 dist = planes->dist;
                 if ( !IS_POINT )
                 {
                         // general box case
-                        // push the plane out appropriately for mins/maxs
-
-                        dist = DotProductAbs( plane_normal, trace->extents );
-                        dist = plane->dist + dist;
+                        // push the planes out appropriately for mins/maxs
+                        dist = MaddSIMD( planes->absnormal[0], ext[0],
+                                         MaddSIMD( planes->absnormal[1], ext[1],
+                                                   MaddSIMD( planes->absnormal[2], ext[2], dist ) ) );
                 }
-                else
+
+                fltx4 d1 = SubSIMD( MaddSIMD( planes->normal[0], p1[0],
+                                              MaddSIMD( planes->normal[1], p1[1],
+                                                        MulSIMD( planes->normal[2], p1[2] ) ) ), dist );
+                fltx4 d2 = SubSIMD( MaddSIMD( planes->normal[0], p2[0],
+                                              MaddSIMD( planes->normal[1], p2[1],
+                                                        MulSIMD( planes->normal[2], p2[2] ) ) ), dist );
+
+                if ( IS_POINT )
                 {
-                        dist = plane->dist;
-                        // don't trace rays against bevel planes
-                        if ( side->bevel )
-                        {
-                                continue;
-                        }
+                        // don't trace rays against bevel planes, put them behind the ray
+                        d1 = MaskedAssign( planes->bevel, negative_ones, d1 );
+                        d2 = MaskedAssign( planes->bevel, negative_ones, d2 );
                 }
 
-                float d1 = p1.dot( plane_normal ) - dist;
-                float d2 = p2.dot( plane_normal ) - dist;
+                fltx4 front1 = CmpGtSIMD( d1, Four_Zeros );
+                fltx4 front2 = CmpGtSIMD( d2, Four_Zeros );
 
-                // if completely in front of face, no intersection
-                if ( d1 > 0.0 )
+                // if completely in front of any face, no intersection
+                if ( TestSignSIMD( AndSIMD( front1, front2 ) ) )
                 {
-                        startout = true;
+                        return;
+                }
 
-                        if ( d2 > 0.0 )
-                        {
-                                return;
-                        }
+                // planes we enter cross from front to back, planes we leave from back to front
+                int enter_mask = TestSignSIMD( front1 );
+                int leave_mask = TestSignSIMD( front2 );
+                if ( enter_mask )
+                {
+                        startout = true;
                 }
-                else
+                if ( leave_mask )
                 {
-                        if ( d2 <= 0.0 )
-                        {
-                                continue;
-                        }
                         getout = true;
                 }
+                if ( !( enter_mask | leave_mask ) )
+                {
+                        continue;
+                }
+
+                fltx4 denom = SubSIMD( d1, d2 );
+                denom = MaskedAssign( OrSIMD( front1, front2 ), denom, Four_Ones );
+                fltx4 enter_f = DivSIMD( MaxSIMD( SubSIMD( d1, Four_DistEpsilons ), Four_Zeros ), denom );
+                fltx4 leave_f = DivSIMD( AddSIMD( d1, Four_DistEpsilons ), denom );
 
-                // crosses face
-                if ( d1 > d2 )
+                // keep the first plane with the largest enter fraction, like the
+                // sides were walked one at a time
+                for ( int lane = 0; lane < 4; lane++ )
                 {
-                        // enter
-                        float f = ( d1 - DIST_EPSILON );
-                        if ( f < 0.f )
+                        int bit = 1 << lane;
+                        if ( enter_mask & bit )
                         {
-                                f = 0.f;
-                        }
-                        f = f / ( d1 - d2 );
-                        if ( f > enter_frac )
-                        {
-                                enter_frac = f;
-                                leadside = side;
+                                float f = SubFloat( enter_f, lane );
+                                if ( f > enter_frac )
+                                {
+                                        enter_frac = f;
+                                        leadside = planes->sides[lane];
+                                }
                         }
-                }
-                else
-                {	// leave
-                        float f = ( d1 + DIST_EPSILON ) / ( d1 - d2 );
-                        if ( f < leave_frac )
+                        else if ( leave_mask & bit )
                         {
-                                leave_frac = f;
+                                float f = SubFloat( leave_f, lane );
+                                if ( f < leave_frac )
+                                {
+                                        leave_frac = f;
+                                }
                         }
                 }
         }
@@ -471,7 +569,8 @@ void CM_ClipBoxToBrush( Trace *trace, const dbrush_t *brush, int brush_idx )
                         if ( enter_frac < 0 )
                                 enter_frac = 0;
                         trace->fraction = enter_frac;
-                        trace->plane = *( trace->bspdata->bspdata->dplanes + leadside->planenum );
+                        const dbrushside_t *side = &trace->bspdata->bspdata->dbrushsides[leadside];
+                        trace->plane = *( trace->bspdata->bspdata->dplanes + side->planenum );
                         trace->surface = (texinfo_t *)trace->bspdata->bspdata->texinfo + side->texinfo;
                         trace->hit_contents = brush_contents;
                 }
@@ -479,12 +578,10 @@ void CM_ClipBoxToBrush( Trace *trace, const dbrush_t *brush, int brush_idx )
 }
 
 template <bool IS_POINT>
-void CM_TraceToLeaf( Trace *trace, int leaf_idx, float start_frac, float end_frac )
+void CM_TraceToLeaf( Trace *trace, cmailbox_t *mailbox, int leaf_idx, float start_frac, float end_frac )
 {
         const dleaf_t *leaf = trace->bspdata->bspdata->dleafs + leaf_idx;
 
-        bool simd_loaded = false;
-
         //
         // trace ray/box sweep against all brushes in this leaf
         //
@@ -502,12 +599,11 @@ void CM_TraceToLeaf( Trace *trace, int leaf_idx, float start_frac, float end_fra
                         continue;
                 }
 
-                // only load SIMD if we have to
-                if ( trace->bspdata->boxbrushes[brushidx].is_box && !simd_loaded )
+                // already clipped against this brush in another leaf
+                if ( !CM_MailboxTest( mailbox, brushidx, 1 ) )
                 {
-                        trace->load_simd();
-                        simd_loaded = true;
-                }   
+                        continue;
+                }
 
                 CM_ClipBoxToBrush<IS_POINT>( trace, brush, brushidx );
                 if ( !trace->fraction )
@@ -523,7 +619,7 @@ void CM_TraceToLeaf( Trace *trace, int leaf_idx, float start_frac, float end_fra
 }
 
 template <bool IS_POINT>
-void CM_RecursiveHullCheckImpl( Trace *trace, int num, const float p1f, const float p2f,
+void CM_RecursiveHullCheckImpl( Trace *trace, cmailbox_t *mailbox, int num, const float p1f, const float p2f,
                                 const LVector3 &p1, const LVector3 &p2 )
 {
         if ( trace->fraction <= p1f )
@@ -588,7 +684,7 @@ void CM_RecursiveHullCheckImpl( Trace *trace, int num, const float p1f, const fl
         // if < 0, we are in a leaf node
         if ( num < 0 )
         {
-                CM_TraceToLeaf<IS_POINT>( trace, ~num, p1f, p2f );
+                CM_TraceToLeaf<IS_POINT>( trace, mailbox, ~num, p1f, p2f );
                 return;
         }
 
@@ -619,31 +715,292 @@ void CM_RecursiveHullCheckImpl( Trace *trace, int num, const float p1f, const fl
         midf = p1f + ( p2f - p1f ) * frac;
         VectorLerp( p1, p2, frac, mid );
 
-        CM_RecursiveHullCheckImpl<IS_POINT>( trace, node->children[side], p1f, midf, p1, mid );
+        CM_RecursiveHullCheckImpl<IS_POINT>( trace, mailbox, node->children[side], p1f, midf, p1, mid );
 
         // go past the node
         frac2 = clamp( frac2, 0.0f, 1.0f );
         midf = p1f + ( p2f - p1f ) * frac2;
         VectorLerp( p1, p2, frac2, mid );
 
-        CM_RecursiveHullCheckImpl<IS_POINT>( trace, node->children[side ^ 1], midf, p2f, mid, p2 );
+        CM_RecursiveHullCheckImpl<IS_POINT>( trace, mailbox, node->children[side ^ 1], midf, p2f, mid, p2 );
 }
 
 void CM_RecursiveHullCheck( Trace *trace, int headnode, const float p1f, const float p2f )
 {
+        cmailbox_t *mailbox = CM_BeginMailbox( trace->bspdata );
 
         if ( trace->is_point )
         {
-                CM_RecursiveHullCheckImpl<true>( trace, headnode, p1f, p2f,
+                CM_RecursiveHullCheckImpl<true>( trace, mailbox, headnode, p1f, p2f,
                                                  trace->start_pos, trace->end_pos );
         }
         else
         {
-                CM_RecursiveHullCheckImpl<false>( trace, headnode, p1f, p2f,
+                CM_RecursiveHullCheckImpl<false>( trace, mailbox, headnode, p1f, p2f,
                                                   trace->start_pos, trace->end_pos );
         }
 }
 
+//==============================================================================================//
+// Packet tracing. Several rays are walked down the tree together, and each brush in a leaf is
+// clipped against all of the rays that reached the leaf before moving on to the next brush.
+// Rays should be coherent (start near each other and go in a similar direction), otherwise
+// the packet splits up early and there is little to gain.
+//==============================================================================================//
+
+#define CM_PACKET_SIZE 4
+
+// Lane mask for each combination of active lanes.
+static const int32_t ALIGN_16BYTE g_LaneMasks[16][4] =
+{
+        {  0,  0,  0,  0 }, { -1,  0,  0,  0 }, {  0, -1,  0,  0 }, { -1, -1,  0,  0 },
+        {  0,  0, -1,  0 }, { -1,  0, -1,  0 }, {  0, -1, -1,  0 }, { -1, -1, -1,  0 },
+        {  0,  0,  0, -1 }, { -1,  0,  0, -1 }, {  0, -1,  0, -1 }, { -1, -1,  0, -1 },
+        {  0,  0, -1, -1 }, { -1,  0, -1, -1 }, {  0, -1, -1, -1 }, { -1, -1, -1, -1 },
+};
+
+INLINE fltx4 CM_LaneMaskSIMD( int lanes )
+{
+        return LoadAlignedSIMD( (const float *)g_LaneMasks[lanes] );
+}
+
+struct ALIGN_16BYTE cpacket_t
+{
+        // Half-extents of each ray's box, SoA.
+        fltx4 extents[3];
+
+        Trace *traces[CM_PACKET_SIZE];
+        cmailbox_t *mailbox;
+} ALIGN16_POST;
+
+// The part of each ray that lies inside the current node.
+struct ALIGN_16BYTE cpacketseg_t
+{
+        fltx4 p1[3];
+        fltx4 p2[3];
+        fltx4 p1f;
+        fltx4 p2f;
+} ALIGN16_POST;
+
+template <bool IS_POINT>
+void CM_TraceToLeafPacket( cpacket_t *packet, int leaf_idx, int lanes )
+{
+        const collbspdata_t *cdata = packet->traces[0]->bspdata;
+        const bspdata_t *bspdata = cdata->bspdata;
+        const dleaf_t *leaf = bspdata->dleafs + leaf_idx;
+
+        // All of the rays share the same contents mask.
+        int contents = packet->traces[0]->contents;
+
+        for ( int leafbrush = 0; leafbrush < leaf->numleafbrushes && lanes != 0; leafbrush++ )
+        {
+                int brushidx = bspdata->dleafbrushes[leaf->firstleafbrush + leafbrush];
+                const dbrush_t *brush = &bspdata->dbrushes[brushidx];
+
+                if ( !( brush->contents & contents ) )
+                {
+                        continue;
+                }
+
+                int todo = CM_MailboxTest( packet->mailbox, brushidx, lanes );
+                for ( int lane = 0; todo != 0; lane++, todo >>= 1 )
+                {
+                        if ( !( todo & 1 ) )
+                        {
+                                continue;
+                        }
+
+                        Trace *trace = packet->traces[lane];
+                        CM_ClipBoxToBrush<IS_POINT>( trace, brush, brushidx );
+                        if ( !trace->fraction )
+                        {
+                                // This ray is done.
+                                lanes &= ~( 1 << lane );
+                        }
+                }
+        }
+}
+
+template <bool IS_POINT>
+void CM_RecursiveHullCheckPacket( cpacket_t *packet, int num, int lanes, const cpacketseg_t &seg )
+{
+        // Drop the rays that already hit something nearer.
+        fltx4 fraction = Four_Zeros;
+        for ( int lane = 0; lane < CM_PACKET_SIZE; lane++ )
+        {
+                SubFloat( fraction, lane ) = packet->traces[lane]->fraction;
+        }
+        lanes &= ~TestSignSIMD( CmpLeSIMD( fraction, seg.p1f ) );
+        if ( lanes == 0 )
+        {
+                return;
+        }
+
+        fltx4 t1 = Four_Zeros, t2 = Four_Zeros, offset = Four_Zeros;
+        int front = 0, back = 0;
+        const dnode_t *node = nullptr;
+
+        // Walk down while all of the rays are on the same side.
+        while ( num >= 0 )
+        {
+                node = packet->traces[0]->bspdata->bspdata->dnodes + num;
+                const dplane_t *plane = packet->traces[0]->bspdata->bspdata->dplanes + node->planenum;
+                int type = plane->type;
+                fltx4 dist = ReplicateX4( (float)plane->dist );
+
+                if ( type < 3 )
+                {
+                        t1 = SubSIMD( seg.p1[type], dist );
+                        t2 = SubSIMD( seg.p2[type], dist );
+                        offset = IS_POINT ? Four_Zeros : packet->extents[type];
+                }
+                else
+                {
+                        fltx4 nx = ReplicateX4( (float)plane->normal[0] );
+                        fltx4 ny = ReplicateX4( (float)plane->normal[1] );
+                        fltx4 nz = ReplicateX4( (float)plane->normal[2] );
+                        t1 = SubSIMD( MaddSIMD( nx, seg.p1[0], MaddSIMD( ny, seg.p1[1], MulSIMD( nz, seg.p1[2] ) ) ), dist );
+                        t2 = SubSIMD( MaddSIMD( nx, seg.p2[0], MaddSIMD( ny, seg.p2[1], MulSIMD( nz, seg.p2[2] ) ) ), dist );
+                        if ( IS_POINT )
+                        {
+                                offset = Four_Zeros;
+                        }
+                        else
+                        {
+                                offset = MaddSIMD( ReplicateX4( (float)fabs( plane->normal[0] ) ), packet->extents[0],
+                                                   MaddSIMD( ReplicateX4( (float)fabs( plane->normal[1] ) ), packet->extents[1],
+                                                             MulSIMD( ReplicateX4( (float)fabs( plane->normal[2] ) ), packet->extents[2] ) ) );
+                        }
+                }
+
+                front = TestSignSIMD( AndSIMD( CmpGtSIMD( t1, offset ), CmpGtSIMD( t2, offset ) ) ) & lanes;
+                if ( front == lanes )
+                {
+                        num = node->children[0];
+                        continue;
+                }
+
+                fltx4 neg_offset = NegSIMD( offset );
+                back = TestSignSIMD( AndSIMD( CmpLtSIMD( t1, neg_offset ), CmpLtSIMD( t2, neg_offset ) ) ) & lanes;
+                if ( back == lanes )
+                {
+                        num = node->children[1];
+                        continue;
+                }
+
+                break;
+        }
+
+        // if < 0, we are in a leaf node
+        if ( num < 0 )
+        {
+                CM_TraceToLeafPacket<IS_POINT>( packet, ~num, lanes );
+                return;
+        }
+
+        // The rays that cross the plane. Same as the single ray case, put the
+        // crosspoint DIST_EPSILON pixels on the near side.
+        int straddle = lanes & ~( front | back );
+
+        fltx4 back_near = CmpLtSIMD( t1, t2 );
+        fltx4 parallel = CmpEqSIMD( t1, t2 );
+        fltx4 idist = DivSIMD( Four_Ones, MaskedAssign( parallel, Four_Ones, SubSIMD( t1, t2 ) ) );
+        fltx4 pad = AddSIMD( offset, Four_DistEpsilons );
+        fltx4 near_num = MaskedAssign( back_near, SubSIMD( t1, pad ), AddSIMD( t1, pad ) );
+        fltx4 far_num = MaskedAssign( back_near, AddSIMD( t1, pad ), SubSIMD( t1, pad ) );
+        fltx4 frac = MaskedAssign( parallel, Four_Ones, MulSIMD( near_num, idist ) );
+        fltx4 frac2 = MaskedAssign( parallel, Four_Zeros, MulSIMD( far_num, idist ) );
+        frac = MinSIMD( MaxSIMD( frac, Four_Zeros ), Four_Ones );
+        frac2 = MinSIMD( MaxSIMD( frac2, Four_Zeros ), Four_Ones );
+
+        fltx4 mid[3], mid2[3];
+        for ( int axis = 0; axis < 3; axis++ )
+        {
+                fltx4 delta = SubSIMD( seg.p2[axis], seg.p1[axis] );
+                mid[axis] = MaddSIMD( delta, frac, seg.p1[axis] );
+                mid2[axis] = MaddSIMD( delta, frac2, seg.p1[axis] );
+        }
+        fltx4 deltaf = SubSIMD( seg.p2f, seg.p1f );
+        fltx4 midf = MaddSIMD( deltaf, frac, seg.p1f );
+        fltx4 midf2 = MaddSIMD( deltaf, frac2, seg.p1f );
+
+        int back_near_lanes = TestSignSIMD( back_near ) & straddle;
+
+        // Visit the near side of the first crossing ray first.
+        int first = ( back_near_lanes & ( straddle & -straddle ) ) ? 1 : 0;
+
+        for ( int i = 0; i < 2; i++ )
+        {
+                int child = first ^ i;
+
+                // Crossing rays go into the near child up to the crosspoint,
+                // and into the far child from the crosspoint.
+                int near_lanes = child == 1 ? back_near_lanes : ( straddle & ~back_near_lanes );
+                int far_lanes = straddle & ~near_lanes;
+                int child_lanes = ( child == 0 ? front : back ) | straddle;
+                if ( child_lanes == 0 )
+                {
+                        continue;
+                }
+
+                fltx4 near_mask = CM_LaneMaskSIMD( near_lanes );
+                fltx4 far_mask = CM_LaneMaskSIMD( far_lanes );
+
+                cpacketseg_t child_seg;
+                for ( int axis = 0; axis < 3; axis++ )
+                {
+                        child_seg.p1[axis] = MaskedAssign( far_mask, mid2[axis], seg.p1[axis] );
+                        child_seg.p2[axis] = MaskedAssign( near_mask, mid[axis], seg.p2[axis] );
+                }
+                child_seg.p1f = MaskedAssign( far_mask, midf2, seg.p1f );
+                child_seg.p2f = MaskedAssign( near_mask, midf, seg.p2f );
+
+                CM_RecursiveHullCheckPacket<IS_POINT>( packet, node->children[child], child_lanes, child_seg );
+        }
+}
+
+/**
+ * Traces up to CM_PACKET_SIZE rays of the same kind together.
+ */
+static void CM_TracePacket( Trace *traces, const int *indices, int count, int headnode, bool is_point )
+{
+        if ( count == 1 )
+        {
+                CM_RecursiveHullCheck( &traces[indices[0]], headnode, 0, 1 );
+                return;
+        }
+
+        cpacket_t packet;
+        cpacketseg_t seg;
+        for ( int lane = 0; lane < CM_PACKET_SIZE; lane++ )
+        {
+                // Unused lanes point at the first ray, but are never active.
+                Trace *trace = &traces[indices[lane < count ? lane : 0]];
+                packet.traces[lane] = trace;
+
+                for ( int axis = 0; axis < 3; axis++ )
+                {
+                        SubFloat( packet.extents[axis], lane ) = trace->extents[axis];
+                        SubFloat( seg.p1[axis], lane ) = trace->start_pos[axis];
+                        SubFloat( seg.p2[axis], lane ) = trace->end_pos[axis];
+                }
+        }
+        seg.p1f = Four_Zeros;
+        seg.p2f = Four_Ones;
+
+        packet.mailbox = CM_BeginMailbox( packet.traces[0]->bspdata );
+
+        int lanes = ( 1 << count ) - 1;
+        if ( is_point )
+        {
+                CM_RecursiveHullCheckPacket<true>( &packet, headnode, lanes, seg );
+        }
+        else
+        {
+                CM_RecursiveHullCheckPacket<false>( &packet, headnode, lanes, seg );
+        }
+}
+
 void CM_ComputeTraceEndpoints( const Ray &ray, Trace *trace )
 {
         LVector3 start = ray.start + ray.start_offset;
@@ -675,16 +1032,10 @@ void CM_ComputeTraceEndpoints( const Ray &ray, Trace *trace )
 }
 
 static PStatCollector bt_collector( "BSP:CM_BoxTrace" );
+static PStatCollector btb_collector( "BSP:CM_BoxTraceBatch" );
 
-/**
- * Traces a line/ray along the BSP tree.
- * Starts at the specified node, only intersects with specified brush contents mask.
- * Results of the trace are filled in, use Trace::has_hit() to see if the line intersected something.
- */
-void CM_BoxTrace( const Ray &ray, int headnode, int brushmask, bool compute_endpoint, const collbspdata_t *bspdata, Trace &trace )
+INLINE void CM_SetupTrace( const Ray &ray, int brushmask, const collbspdata_t *bspdata, Trace &trace )
 {
-        PStatTimer timer( bt_collector );
-
         trace.contents = brushmask;
         trace.start_pos = ray.start;
         trace.end_pos = ray.start + ray.delta;
@@ -695,6 +1046,19 @@ void CM_BoxTrace( const Ray &ray, int headnode, int brushmask, bool compute_endp
         trace.maxs = ray.extents;
         trace.is_point = ray.is_ray;
         trace.bspdata = (collbspdata_t *)bspdata;
+        trace.load_simd();
+}
+
+/**
+ * Traces a line/ray along the BSP tree.
+ * Starts at the specified node, only intersects with specified brush contents mask.
+ * Results of the trace are filled in, use Trace::has_hit() to see if the line intersected something.
+ */
+void CM_BoxTrace( const Ray &ray, int headnode, int brushmask, bool compute_endpoint, const collbspdata_t *bspdata, Trace &trace )
+{
+        PStatTimer timer( bt_collector );
+
+        CM_SetupTrace( ray, brushmask, bspdata, trace );
 
         // general sweeping through the world
         CM_RecursiveHullCheck( &trace, headnode, 0, 1 );
@@ -705,60 +1069,232 @@ void CM_BoxTrace( const Ray &ray, int headnode, int brushmask, bool compute_endp
         }
 }
 
+/**
+ * Same as CM_BoxTrace(), but traces many rays at once. traces[i] receives the
+ * result of rays[i]. Rays are traced in packets of four, so neighbouring
+ * rays should be coherent.
+ */
+void CM_BoxTraceBatch( const Ray *rays, Trace *traces, int count, int headnode, int brushmask,
+                       bool compute_endpoint, const collbspdata_t *bspdata )
+{
+        PStatTimer timer( btb_collector );
+
+        for ( int i = 0; i < count; i++ )
+        {
+                CM_SetupTrace( rays[i], brushmask, bspdata, traces[i] );
+        }
+
+        // Point rays and box sweeps walk the tree differently, so a packet only
+        // holds one kind.
+        for ( int pass = 0; pass < 2; pass++ )
+        {
+                bool is_point = pass == 0;
+
+                int indices[CM_PACKET_SIZE];
+                int n = 0;
+                for ( int i = 0; i < count; i++ )
+                {
+                        if ( traces[i].is_point != is_point )
+                        {
+                                continue;
+                        }
+
+                        indices[n++] = i;
+                        if ( n == CM_PACKET_SIZE )
+                        {
+                                CM_TracePacket( traces, indices, n, headnode, is_point );
+                                n = 0;
+                        }
+                }
+
+                if ( n > 0 )
+                {
+                        CM_TracePacket( traces, indices, n, headnode, is_point );
+                }
+        }
+
+        if ( compute_endpoint )
+        {
+                for ( int i = 0; i < count; i++ )
+                {
+                        CM_ComputeTraceEndpoints( rays[i], &traces[i] );
+                }
+        }
+}
+
+/**
+ * Computes the tight bounds of a brush by clipping each of its sides by all
+ * of the others. Returns false if nothing is left of the brush.
+ */
+static bool CM_ComputeBrushBounds( const bspdata_t *bspdata, const dbrush_t *dbrush, LVector3 &mins, LVector3 &maxs )
+{
+        bool has_points = false;
+
+        for ( int i = 0; i < dbrush->numsides; i++ )
+        {
+                const dbrushside_t *side = &bspdata->dbrushsides[dbrush->firstside + i];
+                const dplane_t *plane = &bspdata->dplanes[side->planenum];
+
+                Winding winding( plane->normal, plane->dist );
+                for ( int j = 0; j < dbrush->numsides && winding.m_NumPoints > 0; j++ )
+                {
+                        const dbrushside_t *other = &bspdata->dbrushsides[dbrush->firstside + j];
+                        if ( other->planenum == side->planenum )
+                        {
+                                continue;
+                        }
+
+                        // keep the part of the side that is behind the other plane
+                        const dplane_t *oplane = &bspdata->dplanes[other->planenum];
+                        vec3_t normal;
+                        VectorSubtract( vec3_origin, oplane->normal, normal );
+                        if ( !winding.Chop( normal, -oplane->dist ) )
+                        {
+                                break;
+                        }
+                }
+
+                for ( unsigned int k = 0; k < winding.m_NumPoints; k++ )
+                {
+                        LVector3 point( winding.m_Points[k][0], winding.m_Points[k][1], winding.m_Points[k][2] );
+                        if ( !has_points )
+                        {
+                                mins = maxs = point;
+                                has_points = true;
+                                continue;
+                        }
+                        mins = mins.fmin( point );
+                        maxs = maxs.fmax( point );
+                }
+        }
+
+        return has_points;
+}
+
+/**
+ * Packs the sides of a non-box brush into groups of four planes.
+ */
+static void CM_SetupBrushPlanes( collbspdata_t *cdata, const dbrush_t *dbrush, cboxbrush_t &bbrush )
+{
+        const bspdata_t *bspdata = cdata->bspdata;
+
+        bbrush.firstplanes4 = (int)cdata->brushplanes.size();
+        bbrush.numplanes4 = ( dbrush->numsides + 3 ) / 4;
+
+        for ( int group = 0; group < bbrush.numplanes4; group++ )
+        {
+                cbrushplanes4_t planes;
+                memset( &planes, 0, sizeof( cbrushplanes4_t ) );
+
+                for ( int lane = 0; lane < 4; lane++ )
+                {
+                        int sidenum = group * 4 + lane;
+                        if ( sidenum >= dbrush->numsides )
+                        {
+                                // padding, a plane that everything is far behind
+                                SubFloat( planes.dist, lane ) = FLT_MAX;
+                                SubInt( planes.bevel, lane ) = 0xFFFFFFFF;
+                                planes.sides[lane] = -1;
+                                continue;
+                        }
+
+                        const dbrushside_t *side = &bspdata->dbrushsides[dbrush->firstside + sidenum];
+                        const dplane_t *plane = &bspdata->dplanes[side->planenum];
+                        for ( int i = 0; i < 3; i++ )
+                        {
+                                SubFloat( planes.normal[i], lane ) = (float)plane->normal[i];
+                                SubFloat( planes.absnormal[i], lane ) = (float)fabs( plane->normal[i] );
+                        }
+                        SubFloat( planes.dist, lane ) = (float)plane->dist;
+                        SubInt( planes.bevel, lane ) = side->bevel ? 0xFFFFFFFF : 0;
+                        planes.sides[lane] = dbrush->firstside + sidenum;
+                }
+
+                cdata->brushplanes.push_back( planes );
+        }
+}
+
 collbspdata_t *SetupCollisionBSPData( const bspdata_t *bspdata )
 {
         collbspdata_t *cdata = new collbspdata_t;
-        memset( cdata, 0, sizeof( collbspdata_t ) );
 
         cdata->bspdata = bspdata;
+        cdata->numbrushes = (int)bspdata->dbrushes.size();
+        cdata->generation = (unsigned int)AtomicAdjust::add( cm_next_generation, 1 );
+        cdata->boxbrushes.resize( bspdata->dbrushes.size() );
+
+        // slightly larger than the brush so the reject never disagrees with the plane tests
+        const LVector3 bounds_pad( 1.0f );
 
-        // find brushes with 6 sides, they are box brushes and we can accelerate the ray tracing
         for ( size_t brushnum = 0; brushnum < bspdata->dbrushes.size(); brushnum++ )
         {
                 const dbrush_t *dbrush = &bspdata->dbrushes[brushnum];
-                if ( dbrush->numsides == 6 )
-                {
-                        cboxbrush_t bbrush;
-                        memset( &bbrush, 0, sizeof( cboxbrush_t ) );
 
-                        int is_box = 1;
+                cboxbrush_t bbrush;
+                memset( &bbrush, 0, sizeof( cboxbrush_t ) );
 
-                        for ( int i = 0; i < 6; i++ )
-                        {
-                                const dbrushside_t *bside = &bspdata->dbrushsides[dbrush->firstside + i];
-                                const dplane_t *plane = &bspdata->dplanes[bside->planenum];
-                                const short t = bside->texinfo;
-                                const planetypes axis = plane->type;
-
-                                // only axis-aligned brushes are box brushes
-                                if ( plane->type > plane_z )
-                                {
-                                        is_box = 0;
-                                        break;
-                                }
+                // find brushes with 6 sides, they are box brushes and we can accelerate the ray tracing
+                int is_box = dbrush->numsides == 6;
+                for ( int i = 0; i < 6 && is_box; i++ )
+                {
+                        const dbrushside_t *bside = &bspdata->dbrushsides[dbrush->firstside + i];
+                        const dplane_t *plane = &bspdata->dplanes[bside->planenum];
+                        const short t = bside->texinfo;
+                        const planetypes axis = plane->type;
 
-                                if ( plane->normal[axis] == 1.0 )
-                                {
-                                        bbrush.maxs[axis] = plane->dist;
-                                        bbrush.surface_indices[axis + 3] = t;
-                                }
-                                else if ( plane->normal[axis] == -1.0 )
-                                {
-                                        bbrush.mins[axis] = -plane->dist;
-                                        bbrush.surface_indices[axis] = t;
-                                }
+                        // only axis-aligned brushes are box brushes
+                        if ( plane->type > plane_z )
+                        {
+                                is_box = 0;
+                                break;
+                        }
 
-                                bbrush.ssemins = LoadAlignedSIMD( LVector4( bbrush.mins, 0 ).get_data() );
-                                bbrush.ssemaxs = LoadAlignedSIMD( LVector4( bbrush.maxs, 0 ).get_data() );
+                        if ( plane->normal[axis] == 1.0 )
+                        {
+                                bbrush.maxs[axis] = plane->dist;
+                                bbrush.surface_indices[axis + 3] = t;
                         }
+                        else if ( plane->normal[axis] == -1.0 )
+                        {
+                                bbrush.mins[axis] = -plane->dist;
+                                bbrush.surface_indices[axis] = t;
+                        }
+                }
 
-                        if ( is_box )
+                LVector3 mins, maxs;
+                if ( is_box )
+                {
+                        bbrush.is_box = 1;
+                        bbrush.ssemins = LoadAlignedSIMD( LVector4( bbrush.mins, 0 ).get_data() );
+                        bbrush.ssemaxs = LoadAlignedSIMD( LVector4( bbrush.maxs, 0 ).get_data() );
+                        mins = bbrush.mins;
+                        maxs = bbrush.maxs;
+                }
+                else
+                {
+                        bbrush.mins = bbrush.maxs = LVector3::zero();
+                        CM_SetupBrushPlanes( cdata, dbrush, bbrush );
+                        if ( !CM_ComputeBrushBounds( bspdata, dbrush, mins, maxs ) )
                         {
-                                bbrush.is_box = 1;
-                                cdata->boxbrushes[brushnum] = bbrush;
+                                // couldn't build the brush, never reject it
+                                mins.set( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+                                maxs.set( FLT_MAX, FLT_MAX, FLT_MAX );
                         }
-                        
                 }
+
+                if ( dbrush->numsides > 0 )
+                {
+                        bbrush.ssebounds_mins = LoadAlignedSIMD( LVector4( mins - bounds_pad, 0 ).get_data() );
+                        bbrush.ssebounds_maxs = LoadAlignedSIMD( LVector4( maxs + bounds_pad, 0 ).get_data() );
+                }
+                else
+                {
+                        // nothing to collide with, an inverted box that rejects everything
+                        bbrush.ssebounds_mins = Four_FLT_MAX;
+                        bbrush.ssebounds_maxs = Four_Negative_FLT_MAX;
+                }
+
+                cdata->boxbrushes[brushnum] = bbrush;
         }
 
         return cdata;
@@ -33,6 +33,23 @@ public:
 
 };
 
+/**
+ * Four planes of a brush, stored structure-of-arrays so a trace can be
+ * tested against all four at once.
+ */
+struct ALIGN_16BYTE cbrushplanes4_t
+{
+        fltx4 normal[3];
+        fltx4 absnormal[3];
+        fltx4 dist;
+
+        // All bits set in the lanes of bevel planes, which rays skip.
+        fltx4 bevel;
+
+        // Index of the dbrushside_t of each lane, or -1 if the lane is padding.
+        int sides[4];
+} ALIGN16_POST;
+
 struct cboxbrush_t
 {
         LVector3 mins;
@@ -41,15 +58,32 @@ struct cboxbrush_t
         fltx4 ssemins;
         fltx4 ssemaxs;
 
+        // Tight bounds of the brush, for rejecting it before testing any planes.
+        fltx4 ssebounds_mins;
+        fltx4 ssebounds_maxs;
+
         unsigned short surface_indices[6];
 
         int is_box;
+
+        // Range of the brush's planes in collbspdata_t::brushplanes.
+        int firstplanes4;
+        int numplanes4;
 };
 
 struct collbspdata_t
 {
         const bspdata_t *bspdata;
-        cboxbrush_t boxbrushes[MAX_MAP_BRUSHES];
+        int numbrushes;
+
+        // Unique to each collbspdata_t that has been set up, so per-thread
+        // trace mailboxes know when they belong to an older level.
+        unsigned int generation;
+
+        pvector<cboxbrush_t> boxbrushes;
+
+        // Planes of every brush that isn't a box, padded to a multiple of four.
+        pvector<cbrushplanes4_t> brushplanes;
 };
 
 extern EXPCL_PANDABSP collbspdata_t *SetupCollisionBSPData( const bspdata_t *bspdata );
@@ -57,6 +91,9 @@ extern EXPCL_PANDABSP collbspdata_t *SetupCollisionBSPData( const bspdata_t *bsp
 extern EXPCL_PANDABSP void CM_BoxTrace( const Ray &ray, int headnode, int brushmask,
                          bool compute_endpoint, const collbspdata_t *bspdata, Trace &trace );
 
+extern EXPCL_PANDABSP void CM_BoxTraceBatch( const Ray *rays, Trace *traces, int count, int headnode, int brushmask,
+                              bool compute_endpoint, const collbspdata_t *bspdata );
+
 class BSPLoader;
 
 enum
@@ -0,0 +1,315 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file bsp_viscontext.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "bsp_viscontext.h"
+#include "bsploader.h"
+
+#include <lightMutexHolder.h>
+#include <cullTraverser.h>
+#include <sceneSetup.h>
+#include <lensNode.h>
+#include <lens.h>
+#include <geometricBoundingVolume.h>
+#include <geomNode.h>
+
+VisibilityContext::Attachments VisibilityContext::_attachments;
+LightMutex VisibilityContext::_attachments_lock( "VisibilityContext-attachments" );
+
+VisibilityContext::VisibilityContext( VisMode mode ) :
+        _mode( mode ),
+        _required_leaf_flags( 0u ),
+        _lock( "VisibilityContext" ),
+        _view_leaf( -1 )
+{
+}
+
+/**
+ * Adds a camera whose frustum limits the leafs culled against in
+ * VM_main_view_frustum mode. A camera that renders several views at once,
+ * such as the layered PSSM shadow camera, should be given the camera of each
+ * view. With no frustum cameras, the frustum of the culling camera is used.
+ */
+void VisibilityContext::add_frustum_camera( const NodePath &camera )
+{
+        LightMutexHolder holder( _lock );
+        _frustum_cameras.push_back( camera );
+        _source = nullptr;
+}
+
+void VisibilityContext::clear_frustum_cameras()
+{
+        LightMutexHolder holder( _lock );
+        _frustum_cameras.clear();
+        _source = nullptr;
+}
+
+/**
+ * Makes the indicated camera cull against this context.
+ */
+void VisibilityContext::attach( const NodePath &camera )
+{
+        nassertv( !camera.is_empty() );
+
+        LightMutexHolder holder( _attachments_lock );
+
+        attachment_t attachment;
+        attachment.camera = camera.node();
+        attachment.context = this;
+        _attachments[camera.node()] = attachment;
+}
+
+/**
+ * Makes the indicated camera cull against the main camera's leafs again.
+ */
+void VisibilityContext::detach( const NodePath &camera )
+{
+        nassertv( !camera.is_empty() );
+
+        LightMutexHolder holder( _attachments_lock );
+        _attachments.erase( camera.node() );
+}
+
+/**
+ * Returns the context attached to the indicated camera, or nullptr if there
+ * is none.
+ */
+PT( VisibilityContext ) VisibilityContext::get_for_camera( const PandaNode *camera )
+{
+        LightMutexHolder holder( _attachments_lock );
+
+        Attachments::iterator itr = _attachments.find( camera );
+        if ( itr == _attachments.end() )
+        {
+                return nullptr;
+        }
+
+        if ( itr->second.camera.was_deleted() )
+        {
+                // The camera went away without being detached, and this is
+                // a different node at the same address.
+                _attachments.erase( itr );
+                return nullptr;
+        }
+
+        return itr->second.context;
+}
+
+/**
+ * Forgets the leafs of every attached context. Called when the level is
+ * unloaded.
+ */
+void VisibilityContext::reset_all()
+{
+        LightMutexHolder holder( _attachments_lock );
+
+        for ( Attachments::iterator itr = _attachments.begin(); itr != _attachments.end(); ++itr )
+        {
+                itr->second.context->reset();
+        }
+}
+
+void VisibilityContext::reset()
+{
+        LightMutexHolder holder( _lock );
+
+        _view_leaf = -1;
+        _visible_leafs = nullptr;
+        _source = nullptr;
+        _frustum_transforms.clear();
+        _frustum_projections.clear();
+}
+
+/**
+ * Returns the leafs that the camera being culled by the indicated traverser
+ * should cull against, rebuilding them if the camera has moved.
+ */
+CPT( BSPVisibleLeafs ) VisibilityContext::update( BSPLoader *loader, CullTraverser *trav )
+{
+        LightMutexHolder holder( _lock );
+
+        switch ( _mode )
+        {
+        case VM_own_leaf:
+                return update_own_leaf( loader, trav );
+        case VM_main_view_frustum:
+                return update_main_view_frustum( loader, trav );
+        default:
+                return loader->get_visible_leafs();
+        }
+}
+
+CPT( BSPVisibleLeafs ) VisibilityContext::update_own_leaf( BSPLoader *loader, CullTraverser *trav )
+{
+        int leaf = loader->find_leaf( trav->get_camera_transform()->get_pos() );
+        if ( leaf != _view_leaf || _visible_leafs == nullptr )
+        {
+                _visible_leafs = loader->make_visible_leafs( leaf );
+                _view_leaf = leaf;
+        }
+
+        return _visible_leafs;
+}
+
+CPT( BSPVisibleLeafs ) VisibilityContext::update_main_view_frustum( BSPLoader *loader, CullTraverser *trav )
+{
+        CPT( BSPVisibleLeafs ) source = loader->get_visible_leafs();
+        if ( source == nullptr )
+        {
+                _visible_leafs = nullptr;
+                _source = nullptr;
+                _view_leaf = -1;
+                return nullptr;
+        }
+
+        // Gather the frustums that limit the main view's leafs.
+        pvector<CPT( TransformState )> transforms;
+        pvector<const Lens *> lenses;
+        if ( _frustum_cameras.empty() )
+        {
+                transforms.push_back( trav->get_camera_transform() );
+                lenses.push_back( trav->get_scene()->get_lens() );
+        }
+        else
+        {
+                for ( size_t i = 0; i < _frustum_cameras.size(); i++ )
+                {
+                        const NodePath &camera = _frustum_cameras[i];
+                        if ( camera.is_empty() || !camera.node()->is_of_type( LensNode::get_class_type() ) )
+                        {
+                                continue;
+                        }
+
+                        const Lens *lens = DCAST( LensNode, camera.node() )->get_lens();
+                        if ( lens == nullptr )
+                        {
+                                continue;
+                        }
+
+                        transforms.push_back( camera.get_net_transform() );
+                        lenses.push_back( lens );
+                }
+        }
+
+        pvector<LMatrix4> projections;
+        projections.reserve( lenses.size() );
+        for ( size_t i = 0; i < lenses.size(); i++ )
+        {
+                projections.push_back( lenses[i] != nullptr ? lenses[i]->get_projection_mat() : LMatrix4::ident_mat() );
+        }
+
+        if ( source == _source && transforms == _frustum_transforms && projections == _frustum_projections )
+        {
+                // Nothing moved since the last time.
+                return _visible_leafs;
+        }
+
+        _source = source;
+        _frustum_transforms = transforms;
+        _frustum_projections = projections;
+        _view_leaf = source->get_view_leaf();
+
+        pvector<PT( GeometricBoundingVolume )> frustums;
+        for ( size_t i = 0; i < lenses.size(); i++ )
+        {
+                if ( lenses[i] == nullptr )
+                {
+                        continue;
+                }
+
+                PT( BoundingVolume ) bounds = lenses[i]->make_bounds();
+                if ( bounds == nullptr || bounds->as_geometric_bounding_volume() == nullptr )
+                {
+                        continue;
+                }
+
+                PT( GeometricBoundingVolume ) frustum = bounds->as_geometric_bounding_volume();
+                frustum->xform( transforms[i]->get_mat() );
+                frustums.push_back( frustum );
+        }
+
+        if ( frustums.empty() )
+        {
+                // Nothing to limit the leafs by.
+                _visible_leafs = source;
+                return _visible_leafs;
+        }
+
+        PT( BSPVisibleLeafs ) visible_leafs = new BSPVisibleLeafs;
+        visible_leafs->set_view_leaf( source->get_view_leaf() );
+        visible_leafs->set_world_geoms( cull_world_geoms( loader, source->get_world_geoms(), frustums ) );
+        visible_leafs->reserve( source->get_num_leafs() );
+
+        for ( size_t i = 0; i < source->get_num_leafs(); i++ )
+        {
+                BoundingBox *bbox = source->get_leaf_bounds( i );
+                for ( size_t j = 0; j < frustums.size(); j++ )
+                {
+                        if ( frustums[j]->contains( bbox ) != BoundingVolume::IF_no_intersection )
+                        {
+                                visible_leafs->add_leaf( source->get_leaf( i ), bbox, source->get_leaf_flags( i ) );
+                                break;
+                        }
+                }
+        }
+
+        _visible_leafs = visible_leafs;
+        return _visible_leafs;
+}
+
+/**
+ * Returns the world Geoms that are in any of the indicated frustums, which
+ * are in world space. The Geoms come batched for the whole view leaf, so
+ * without this, every batch that the main view sees would be drawn even when
+ * it is nowhere near this context's frustums.
+ */
+GeomNode::Geoms VisibilityContext::cull_world_geoms( BSPLoader *loader, const GeomNode::Geoms &geoms,
+                                                     const pvector<PT( GeometricBoundingVolume )> &frustums )
+{
+        NodePath world = loader->get_model( 0 );
+        if ( world.is_empty() )
+        {
+                return geoms;
+        }
+
+        // The Geoms are in the space of the world model.
+        LMatrix4 to_world = invert( world.get_net_transform()->get_mat() );
+        pvector<PT( GeometricBoundingVolume )> world_frustums;
+        world_frustums.reserve( frustums.size() );
+        for ( size_t i = 0; i < frustums.size(); i++ )
+        {
+                PT( GeometricBoundingVolume ) frustum = DCAST( GeometricBoundingVolume, frustums[i]->make_copy() );
+                frustum->xform( to_world );
+                world_frustums.push_back( frustum );
+        }
+
+        PT( GeomNode ) node = new GeomNode( "drawlist" );
+
+        int num_geoms = geoms.get_num_geoms();
+        for ( int i = 0; i < num_geoms; i++ )
+        {
+                const Geom *geom = geoms.get_geom( i );
+                CPT( BoundingVolume ) bounds = geom->get_bounds();
+                const GeometricBoundingVolume *gbv = bounds->as_geometric_bounding_volume();
+
+                bool in_view = gbv == nullptr;
+                for ( size_t j = 0; !in_view && j < world_frustums.size(); j++ )
+                {
+                        in_view = world_frustums[j]->contains( gbv ) != BoundingVolume::IF_no_intersection;
+                }
+
+                if ( in_view )
+                {
+                        node->add_geom( (Geom *)geom, geoms.get_geom_state( i ) );
+                }
+        }
+
+        return node->get_geoms();
+}
@@ -0,0 +1,125 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file bsp_viscontext.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef BSP_VISCONTEXT_H
+#define BSP_VISCONTEXT_H
+
+#include "config_bsp.h"
+#include "bsp_visleafs.h"
+
+#include <referenceCount.h>
+#include <nodePath.h>
+#include <pandaNode.h>
+#include <weakPointerTo.h>
+#include <transformState.h>
+#include <lightMutex.h>
+#include <pmap.h>
+#include <geometricBoundingVolume.h>
+
+class BSPLoader;
+class CullTraverser;
+
+/**
+ * Decides which leafs a camera other than the main camera culls against.
+ * Attach one to a camera, and BSPCullTraverser will cull that camera's
+ * scene against the leafs the context picks instead of the main camera's.
+ */
+class EXPCL_PANDABSP VisibilityContext : public ReferenceCount
+{
+PUBLISHED:
+        enum VisMode
+        {
+                // Cull against the PVS of the leaf the camera itself is in.
+                // For cameras that can be anywhere in the level, such as cubemap cameras.
+                VM_own_leaf,
+
+                // Cull against the leafs that are potentially visible from the
+                // main camera and touched by the frustum of this camera, or by the
+                // frustum of any of the frustum cameras. The world batches of the
+                // main view are limited to those frustums the same way. For shadow
+                // and reflection cameras, which only need to draw what affects the
+                // main view.
+                VM_main_view_frustum,
+        };
+
+        VisibilityContext( VisMode mode = VM_own_leaf );
+
+        INLINE void set_mode( VisMode mode )
+        {
+                _mode = mode;
+        }
+        INLINE VisMode get_mode() const
+        {
+                return _mode;
+        }
+
+        /**
+         * Sets the flags that must be set on a leaf for it to be rendered
+         * by the cameras using this context.
+         */
+        INLINE void set_required_leaf_flags( unsigned int flags )
+        {
+                _required_leaf_flags = flags;
+        }
+        INLINE unsigned int get_required_leaf_flags() const
+        {
+                return _required_leaf_flags;
+        }
+
+        void add_frustum_camera( const NodePath &camera );
+        void clear_frustum_cameras();
+
+        INLINE int get_view_leaf() const
+        {
+                return _view_leaf;
+        }
+
+        void attach( const NodePath &camera );
+        static void detach( const NodePath &camera );
+
+public:
+        static PT( VisibilityContext ) get_for_camera( const PandaNode *camera );
+        static void reset_all();
+
+        CPT( BSPVisibleLeafs ) update( BSPLoader *loader, CullTraverser *trav );
+        void reset();
+
+private:
+        CPT( BSPVisibleLeafs ) update_own_leaf( BSPLoader *loader, CullTraverser *trav );
+        CPT( BSPVisibleLeafs ) update_main_view_frustum( BSPLoader *loader, CullTraverser *trav );
+        static GeomNode::Geoms cull_world_geoms( BSPLoader *loader, const GeomNode::Geoms &geoms,
+                                                 const pvector<PT( GeometricBoundingVolume )> &frustums );
+
+private:
+        VisMode _mode;
+        unsigned int _required_leaf_flags;
+        pvector<NodePath> _frustum_cameras;
+
+        LightMutex _lock;
+        int _view_leaf;
+        CPT( BSPVisibleLeafs ) _visible_leafs;
+
+        // What the frustum-limited set was last built from.
+        CPT( BSPVisibleLeafs ) _source;
+        pvector<CPT( TransformState )> _frustum_transforms;
+        pvector<LMatrix4> _frustum_projections;
+
+        struct attachment_t
+        {
+                WPT( PandaNode ) camera;
+                PT( VisibilityContext ) context;
+        };
+        typedef pmap<const PandaNode *, attachment_t> Attachments;
+        static Attachments _attachments;
+        static LightMutex _attachments_lock;
+};
+
+#endif // BSP_VISCONTEXT_H
@@ -0,0 +1,185 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file bsp_visleafs.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "bsp_visleafs.h"
+
+BSPVisibleLeafs::BSPVisibleLeafs() :
+        _view_leaf( -1 )
+{
+}
+
+void BSPVisibleLeafs::clear()
+{
+        _view_leaf = -1;
+        _world_geoms = GeomNode::Geoms();
+        _groups.clear();
+        _bboxes.clear();
+        _flags.clear();
+        _leafs.clear();
+}
+
+void BSPVisibleLeafs::reserve( size_t count )
+{
+        _groups.reserve( ( count + 3 ) / 4 );
+        _bboxes.reserve( count );
+        _flags.reserve( count );
+        _leafs.reserve( count );
+}
+
+void BSPVisibleLeafs::add_leaf( int leafnum, BoundingBox *bbox, unsigned int flags )
+{
+        size_t n = _leafs.size();
+        int lane = (int)( n & 3 );
+
+        if ( lane == 0 )
+        {
+                visleafaabb4_t group;
+                for ( int i = 0; i < 3; i++ )
+                {
+                        group.mins[i] = Four_FLT_MAX;
+                        group.maxs[i] = Four_Negative_FLT_MAX;
+                }
+                group.flags[0] = group.flags[1] = group.flags[2] = group.flags[3] = 0u;
+                _groups.push_back( group );
+        }
+
+        visleafaabb4_t &group = _groups.back();
+        const LPoint3 &mins = bbox->get_minq();
+        const LPoint3 &maxs = bbox->get_maxq();
+        for ( int i = 0; i < 3; i++ )
+        {
+                SubFloat( group.mins[i], lane ) = mins[i];
+                SubFloat( group.maxs[i], lane ) = maxs[i];
+        }
+        group.flags[lane] = flags;
+
+        _bboxes.push_back( bbox );
+        _flags.push_back( flags );
+        _leafs.push_back( leafnum );
+}
+
+/**
+ * Returns true if the box intersects any of the leafs that have one of
+ * required_flags set (or any leaf, if required_flags is 0).
+ */
+bool BSPVisibleLeafs::test_box( const LPoint3 &mins, const LPoint3 &maxs, unsigned int required_flags ) const
+{
+        fltx4 bmins[3] = { ReplicateX4( mins[0] ), ReplicateX4( mins[1] ), ReplicateX4( mins[2] ) };
+        fltx4 bmaxs[3] = { ReplicateX4( maxs[0] ), ReplicateX4( maxs[1] ), ReplicateX4( maxs[2] ) };
+
+        size_t num_groups = _groups.size();
+        for ( size_t i = 0; i < num_groups; i++ )
+        {
+                const visleafaabb4_t &group = _groups[i];
+
+                fltx4 overlap = AndSIMD( CmpLeSIMD( group.mins[0], bmaxs[0] ), CmpGeSIMD( group.maxs[0], bmins[0] ) );
+                overlap = AndSIMD( overlap, AndSIMD( CmpLeSIMD( group.mins[1], bmaxs[1] ), CmpGeSIMD( group.maxs[1], bmins[1] ) ) );
+                overlap = AndSIMD( overlap, AndSIMD( CmpLeSIMD( group.mins[2], bmaxs[2] ), CmpGeSIMD( group.maxs[2], bmins[2] ) ) );
+
+                int mask = TestSignSIMD( overlap );
+                if ( mask != 0 && ( mask & get_flag_mask( group, required_flags ) ) != 0 )
+                {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/**
+ * Returns true if the sphere intersects any of the leafs that have one of
+ * required_flags set (or any leaf, if required_flags is 0).
+ */
+bool BSPVisibleLeafs::test_sphere( const LPoint3 &center, PN_stdfloat radius, unsigned int required_flags ) const
+{
+        fltx4 c[3] = { ReplicateX4( center[0] ), ReplicateX4( center[1] ), ReplicateX4( center[2] ) };
+        fltx4 radius_sqr = ReplicateX4( radius * radius );
+
+        size_t num_groups = _groups.size();
+        for ( size_t i = 0; i < num_groups; i++ )
+        {
+                const visleafaabb4_t &group = _groups[i];
+
+                // Squared distance from the center to the closest point on each box.
+                fltx4 dist_sqr = Four_Zeros;
+                for ( int axis = 0; axis < 3; axis++ )
+                {
+                        fltx4 d = MaxSIMD( MaxSIMD( SubSIMD( group.mins[axis], c[axis] ),
+                                                    SubSIMD( c[axis], group.maxs[axis] ) ),
+                                           Four_Zeros );
+                        dist_sqr = MaddSIMD( d, d, dist_sqr );
+                }
+
+                int mask = TestSignSIMD( CmpLeSIMD( dist_sqr, radius_sqr ) );
+                if ( mask != 0 && ( mask & get_flag_mask( group, required_flags ) ) != 0 )
+                {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/**
+ * Tests the volume against each leaf box through BoundingVolume::contains().
+ * Used for volume types without a fast path.
+ */
+bool BSPVisibleLeafs::test_generic( const GeometricBoundingVolume *bounds, unsigned int required_flags ) const
+{
+        size_t num_leafs = _bboxes.size();
+        for ( size_t i = 0; i < num_leafs; i++ )
+        {
+                if ( required_flags != 0u && ( _flags[i] & required_flags ) == 0u )
+                {
+                        continue;
+                }
+
+                if ( _bboxes[i]->contains( bounds ) != BoundingVolume::IF_no_intersection )
+                {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+bool BSPVisibleLeafs::test_bounds( const GeometricBoundingVolume *bounds, unsigned int required_flags ) const
+{
+        if ( !bounds->is_empty() && !bounds->is_infinite() )
+        {
+                const BoundingBox *box = bounds->as_bounding_box();
+                if ( box != nullptr )
+                {
+                        return test_box( box->get_minq(), box->get_maxq(), required_flags );
+                }
+
+                const BoundingSphere *sphere = bounds->as_bounding_sphere();
+                if ( sphere != nullptr )
+                {
+                        return test_sphere( sphere->get_center(), sphere->get_radius(), required_flags );
+                }
+        }
+
+        return test_generic( bounds, required_flags );
+}
+
+/**
+ * Tests many volumes at once. results[i] is set to whether bounds[i]
+ * intersects any of the visible leafs.
+ */
+void BSPVisibleLeafs::test_bounds_batch( const GeometricBoundingVolume * const *bounds, size_t count,
+                                         bool *results, unsigned int required_flags ) const
+{
+        for ( size_t i = 0; i < count; i++ )
+        {
+                results[i] = bounds[i] != nullptr && test_bounds( bounds[i], required_flags );
+        }
+}
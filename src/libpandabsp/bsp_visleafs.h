@@ -0,0 +1,133 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file bsp_visleafs.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef BSP_VISLEAFS_H
+#define BSP_VISLEAFS_H
+
+#include "config_bsp.h"
+#include "mathlib/ssemath.h"
+
+#include <pvector.h>
+#include <referenceCount.h>
+#include <boundingBox.h>
+#include <boundingSphere.h>
+#include <geomNode.h>
+
+/**
+ * Bounds and flags of four leafs, laid out for testing all four at once.
+ * Unused lanes hold an inverted box that nothing can intersect.
+ */
+struct ALIGN_16BYTE visleafaabb4_t
+{
+        fltx4 mins[3];
+        fltx4 maxs[3];
+        unsigned int flags[4];
+} ALIGN16_POST;
+
+/**
+ * The set of leafs that are potentially visible from a leaf, with their
+ * bounding boxes stored structure-of-arrays so a bounding volume can be
+ * tested against four leafs per instruction.
+ *
+ * BSPLoader publishes these as snapshots that are shared between threads,
+ * so a snapshot must not be modified once it has been published.
+ */
+class EXPCL_PANDABSP BSPVisibleLeafs : public ReferenceCount
+{
+public:
+        BSPVisibleLeafs();
+
+        void clear();
+        void reserve( size_t count );
+        void add_leaf( int leafnum, BoundingBox *bbox, unsigned int flags );
+
+        INLINE size_t get_num_leafs() const
+        {
+                return _leafs.size();
+        }
+
+        INLINE int get_leaf( size_t n ) const
+        {
+                return _leafs[n];
+        }
+
+        INLINE BoundingBox *get_leaf_bounds( size_t n ) const
+        {
+                return _bboxes[n];
+        }
+
+        INLINE unsigned int get_leaf_flags( size_t n ) const
+        {
+                return _flags[n];
+        }
+
+        INLINE void set_view_leaf( int leaf )
+        {
+                _view_leaf = leaf;
+        }
+
+        /**
+         * Returns the leaf that this set is visible from.
+         */
+        INLINE int get_view_leaf() const
+        {
+                return _view_leaf;
+        }
+
+        INLINE void set_world_geoms( const GeomNode::Geoms &geoms )
+        {
+                _world_geoms = geoms;
+        }
+
+        /**
+         * Returns the batched world Geoms to render from the view leaf.
+         */
+        INLINE const GeomNode::Geoms &get_world_geoms() const
+        {
+                return _world_geoms;
+        }
+
+        bool test_bounds( const GeometricBoundingVolume *bounds, unsigned int required_flags = 0u ) const;
+        bool test_box( const LPoint3 &mins, const LPoint3 &maxs, unsigned int required_flags = 0u ) const;
+        bool test_sphere( const LPoint3 &center, PN_stdfloat radius, unsigned int required_flags = 0u ) const;
+
+        void test_bounds_batch( const GeometricBoundingVolume * const *bounds, size_t count,
+                                bool *results, unsigned int required_flags = 0u ) const;
+
+private:
+        INLINE int get_flag_mask( const visleafaabb4_t &group, unsigned int required_flags ) const
+        {
+                if ( required_flags == 0u )
+                {
+                        return 0xF;
+                }
+
+                return ( ( group.flags[0] & required_flags ) != 0u ? 1 : 0 ) |
+                        ( ( group.flags[1] & required_flags ) != 0u ? 2 : 0 ) |
+                        ( ( group.flags[2] & required_flags ) != 0u ? 4 : 0 ) |
+                        ( ( group.flags[3] & required_flags ) != 0u ? 8 : 0 );
+        }
+
+        bool test_generic( const GeometricBoundingVolume *bounds, unsigned int required_flags ) const;
+
+private:
+        int _view_leaf;
+        GeomNode::Geoms _world_geoms;
+
+        pvector<visleafaabb4_t> _groups;
+
+        // Kept for volumes that don't have a fast path.
+        pvector<BoundingBox *> _bboxes;
+        pvector<unsigned int> _flags;
+        pvector<int> _leafs;
+};
+
+#endif // BSP_VISLEAFS_H
@@ -0,0 +1,341 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file bsp_world_drawlists.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "bsp_world_drawlists.h"
+#include "bsp_pvs.h"
+
+#include <configVariableInt.h>
+#include <geomTriangles.h>
+#include <pmap.h>
+#include <pStatCollector.h>
+#include <pstatTimer.h>
+
+#include <algorithm>
+
+static ConfigVariableInt cfg_draw_list_cache
+( "bsp-world-draw-list-cache", 8, "Number of leafs whose world draw lists are kept around after the "
+  "view leaf moves on." );
+
+static PStatCollector build_drawlist_collector( "Cull:BSP:WorldSpawn:BuildDrawList" );
+
+BSPWorldDrawLists::BSPWorldDrawLists()
+{
+}
+
+void BSPWorldDrawLists::clear()
+{
+        _batches.clear();
+        _leaf_ranges.clear();
+        _draw_lists.clear();
+}
+
+/**
+ * Builds the shared index buffers and the draw ranges of each leaf from the
+ * per-face Geoms of the world. The world Geoms are expected to be in world
+ * space, one face each, with the faces of a state sharing a vertex data.
+ */
+void BSPWorldDrawLists::build( const GeomNode *world, const BSPPVS &pvs, const pvector<PT( BoundingBox )> &leaf_bboxs )
+{
+        clear();
+
+        int numvisleafs = pvs.get_num_visleafs();
+        int num_faces = world->get_num_geoms();
+
+        // Find the leafs that each face is in, and the batch it goes in.
+        pvector<pvector<int>> leaf_faces( numvisleafs + 1 );
+        pvector<int> face_batch( num_faces, -1 );
+        pvector<int> face_leaf( num_faces, numvisleafs + 1 );
+        pmap<std::pair<const RenderState *, const GeomVertexData *>, int> batch_index;
+
+        for ( int facenum = 0; facenum < num_faces; facenum++ )
+        {
+                CPT( Geom ) geom = world->get_geom( facenum );
+                if ( geom->get_num_primitives() != 1 )
+                {
+                        continue;
+                }
+
+                const GeometricBoundingVolume *face_gbv = geom->get_bounds()->as_geometric_bounding_volume();
+                for ( int leafnum = 1; leafnum <= numvisleafs && leafnum < (int)leaf_bboxs.size(); leafnum++ )
+                {
+                        if ( leaf_bboxs[leafnum]->contains( face_gbv ) != BoundingVolume::IF_no_intersection )
+                        {
+                                leaf_faces[leafnum].push_back( facenum );
+                                face_leaf[facenum] = std::min( face_leaf[facenum], leafnum );
+                        }
+                }
+
+                const RenderState *state = world->get_geom_state( facenum );
+                const GeomVertexData *vdata = geom->get_vertex_data();
+                auto key = std::make_pair( state, vdata );
+                auto itr = batch_index.find( key );
+                if ( itr == batch_index.end() )
+                {
+                        batch_t batch;
+                        batch.state = state;
+                        batch.vdata = vdata;
+                        batch.index_type = geom->get_primitive( 0 )->get_index_type();
+                        batch.index_stride = geom->get_primitive( 0 )->get_index_stride();
+                        itr = batch_index.insert( std::make_pair( key, (int)_batches.size() ) ).first;
+                        _batches.push_back( batch );
+                }
+                face_batch[facenum] = itr->second;
+        }
+
+        // Lay the faces of each batch out by leaf, so that the faces visible
+        // from a leaf tend to be next to each other in the index buffer.
+        pvector<int> order;
+        order.reserve( num_faces );
+        for ( int facenum = 0; facenum < num_faces; facenum++ )
+        {
+                if ( face_batch[facenum] != -1 )
+                {
+                        order.push_back( facenum );
+                }
+        }
+        std::stable_sort( order.begin(), order.end(), [&]( int a, int b )
+        {
+                if ( face_batch[a] != face_batch[b] )
+                {
+                        return face_batch[a] < face_batch[b];
+                }
+                return face_leaf[a] < face_leaf[b];
+        } );
+
+        // Where each face ended up, as its batch and index in the batch.
+        pvector<int> face_slot( num_faces, -1 );
+        for ( size_t i = 0; i < order.size(); i++ )
+        {
+                int facenum = order[i];
+                batch_t &batch = _batches[face_batch[facenum]];
+
+                CPT( Geom ) geom = world->get_geom( facenum );
+                CPT( GeomPrimitive ) prim = geom->get_primitive( 0 );
+                nassertd( prim->is_indexed() && prim->get_index_type() == batch.index_type )
+                {
+                        continue;
+                }
+
+                const BoundingBox *box = geom->get_bounds()->as_bounding_box();
+
+                batchface_t face;
+                face.first_index = (int)( batch.indices.size() / batch.index_stride );
+                face.num_indices = prim->get_num_vertices();
+                if ( box != nullptr )
+                {
+                        face.mins = box->get_minq();
+                        face.maxs = box->get_maxq();
+                }
+                else
+                {
+                        geom->calc_tight_bounds( face.mins, face.maxs );
+                }
+
+                CPT( GeomVertexArrayDataHandle ) handle = prim->get_vertices()->get_handle();
+                const unsigned char *data = handle->get_read_pointer( true );
+                batch.indices.insert( batch.indices.end(), data, data + face.num_indices * batch.index_stride );
+
+                face_slot[facenum] = (int)batch.faces.size();
+                batch.faces.push_back( face );
+        }
+
+        // Now the draw ranges of each leaf: every face in the leafs of its PVS,
+        // in index buffer order, with faces that follow each other merged.
+        _leaf_ranges.resize( numvisleafs + 1 );
+
+        pvector<uint64_t> scratch( pvs.get_row_words() );
+        pvector<int> face_stamp( num_faces, 0 );
+        pvector<std::pair<int, int>> visible;
+
+        for ( int leafnum = 1; leafnum <= numvisleafs; leafnum++ )
+        {
+                visible.clear();
+
+                auto add_leaf_faces = [&]( int visleaf )
+                {
+                        const pvector<int> &faces = leaf_faces[visleaf];
+                        for ( size_t i = 0; i < faces.size(); i++ )
+                        {
+                                int facenum = faces[i];
+                                if ( face_stamp[facenum] == leafnum || face_slot[facenum] == -1 )
+                                {
+                                        continue;
+                                }
+                                face_stamp[facenum] = leafnum;
+                                visible.push_back( std::make_pair( face_batch[facenum], face_slot[facenum] ) );
+                        }
+                };
+
+                add_leaf_faces( leafnum );
+
+                const uint64_t *row = pvs.get_row( leafnum, scratch.data() );
+                if ( row != nullptr )
+                {
+                        for ( size_t w = 0; w < pvs.get_row_words(); w++ )
+                        {
+                                uint64_t bits = row[w];
+                                while ( bits != 0 )
+                                {
+                                        int i = (int)( w * 64 ) + pvs_ctz( bits ) + 1;
+                                        bits &= bits - 1;
+
+                                        if ( i != leafnum && i <= numvisleafs )
+                                        {
+                                                add_leaf_faces( i );
+                                        }
+                                }
+                        }
+                }
+
+                std::sort( visible.begin(), visible.end() );
+
+                pvector<drawrange_t> &ranges = _leaf_ranges[leafnum];
+                for ( size_t i = 0; i < visible.size(); i++ )
+                {
+                        const batchface_t &face = _batches[visible[i].first].faces[visible[i].second];
+                        if ( !ranges.empty() &&
+                             ranges.back().batch == visible[i].first &&
+                             ranges.back().first_index + ranges.back().num_indices == face.first_index )
+                        {
+                                ranges.back().num_indices += face.num_indices;
+                                continue;
+                        }
+
+                        drawrange_t range;
+                        range.batch = visible[i].first;
+                        range.first_index = face.first_index;
+                        range.num_indices = face.num_indices;
+                        ranges.push_back( range );
+                }
+                ranges.shrink_to_fit();
+        }
+
+        bspfile_cat.info()
+                << "World has " << _batches.size() << " draw batches and "
+                << get_num_ranges() << " leaf draw ranges\n";
+}
+
+size_t BSPWorldDrawLists::get_num_ranges() const
+{
+        size_t count = 0;
+        for ( size_t i = 0; i < _leaf_ranges.size(); i++ )
+        {
+                count += _leaf_ranges[i].size();
+        }
+        return count;
+}
+
+/**
+ * Returns one Geom per state with every world face that is potentially
+ * visible from the indicated leaf. Not thread-safe, BSPLoader calls this
+ * with its leaf lock held.
+ */
+GeomNode::Geoms BSPWorldDrawLists::get_draw_list( int leaf )
+{
+        if ( leaf <= 0 || leaf >= (int)_leaf_ranges.size() )
+        {
+                return GeomNode::Geoms();
+        }
+
+        for ( auto itr = _draw_lists.begin(); itr != _draw_lists.end(); ++itr )
+        {
+                if ( itr->leaf == leaf )
+                {
+                        drawlist_t list = *itr;
+                        _draw_lists.erase( itr );
+                        _draw_lists.push_front( list );
+                        return list.geoms;
+                }
+        }
+
+        drawlist_t list;
+        list.leaf = leaf;
+        list.geoms = make_draw_list( leaf );
+        _draw_lists.push_front( list );
+
+        size_t max_lists = (size_t)std::max( 1, cfg_draw_list_cache.get_value() );
+        while ( _draw_lists.size() > max_lists )
+        {
+                _draw_lists.pop_back();
+        }
+
+        return list.geoms;
+}
+
+/**
+ * Copies the draw ranges of the leaf out of the shared index buffers.
+ */
+GeomNode::Geoms BSPWorldDrawLists::make_draw_list( int leaf ) const
+{
+        PStatTimer timer( build_drawlist_collector );
+
+        const pvector<drawrange_t> &ranges = _leaf_ranges[leaf];
+
+        PT( GeomNode ) node = new GeomNode( "drawlist" );
+
+        size_t first = 0;
+        while ( first < ranges.size() )
+        {
+                // The ranges are sorted by batch.
+                int batchnum = ranges[first].batch;
+                const batch_t &batch = _batches[batchnum];
+
+                size_t end = first;
+                int num_indices = 0;
+                while ( end < ranges.size() && ranges[end].batch == batchnum )
+                {
+                        num_indices += ranges[end].num_indices;
+                        end++;
+                }
+
+                PT( GeomTriangles ) tris = new GeomTriangles( GeomEnums::UH_static );
+                tris->set_index_type( batch.index_type );
+
+                PT( GeomVertexArrayData ) index_data = new GeomVertexArrayData( tris->get_index_format(), GeomEnums::UH_static );
+                index_data->unclean_set_num_rows( num_indices );
+
+                PT( BoundingBox ) bounds = new BoundingBox;
+                {
+                        PT( GeomVertexArrayDataHandle ) handle = index_data->modify_handle();
+                        unsigned char *data = handle->get_write_pointer();
+                        for ( size_t i = first; i < end; i++ )
+                        {
+                                const drawrange_t &range = ranges[i];
+                                size_t bytes = range.num_indices * batch.index_stride;
+                                memcpy( data, &batch.indices[range.first_index * batch.index_stride], bytes );
+                                data += bytes;
+
+                                // Grow the bounds by the faces of the range.
+                                auto fitr = std::lower_bound( batch.faces.begin(), batch.faces.end(), range.first_index,
+                                                              []( const batchface_t &face, int index )
+                                {
+                                        return face.first_index < index;
+                                } );
+                                for ( ; fitr != batch.faces.end() &&
+                                        fitr->first_index < range.first_index + range.num_indices; ++fitr )
+                                {
+                                        bounds->extend_by( fitr->mins );
+                                        bounds->extend_by( fitr->maxs );
+                                }
+                        }
+                }
+                tris->set_vertices( index_data, num_indices );
+
+                PT( Geom ) geom = new Geom( batch.vdata );
+                geom->add_primitive( tris );
+                geom->set_bounds( bounds );
+                node->add_geom( geom, batch.state );
+
+                first = end;
+        }
+
+        return node->get_geoms();
+}
@@ -0,0 +1,103 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file bsp_world_drawlists.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef BSP_WORLD_DRAWLISTS_H
+#define BSP_WORLD_DRAWLISTS_H
+
+#include "config_bsp.h"
+
+#include <pvector.h>
+#include <pdeque.h>
+#include <geomNode.h>
+#include <geomVertexData.h>
+#include <geomVertexArrayData.h>
+#include <boundingBox.h>
+#include <renderState.h>
+
+class BSPPVS;
+
+/**
+ * Draws the world from the view leaf without culling its faces every frame.
+ *
+ * The faces of the world that share a RenderState share one GeomVertexData
+ * and one index buffer, with the faces ordered by the leaf that they are in.
+ * Each leaf has a precomputed list of draw ranges into those index buffers:
+ * every face that is potentially visible from the leaf, with neighboring
+ * faces merged into a single range.
+ *
+ * When the view leaf changes, its ranges are copied into one Geom per state.
+ * The last few of these draw lists are kept around, so going back and forth
+ * between leafs doesn't rebuild anything.
+ */
+class EXPCL_PANDABSP BSPWorldDrawLists
+{
+public:
+        BSPWorldDrawLists();
+
+        void build( const GeomNode *world, const BSPPVS &pvs, const pvector<PT( BoundingBox )> &leaf_bboxs );
+        void clear();
+
+        GeomNode::Geoms get_draw_list( int leaf );
+
+        INLINE size_t get_num_batches() const
+        {
+                return _batches.size();
+        }
+
+        size_t get_num_ranges() const;
+
+private:
+        struct batchface_t
+        {
+                int first_index;
+                int num_indices;
+                LPoint3 mins;
+                LPoint3 maxs;
+        };
+
+        /**
+         * The faces that share a state, vertex data and index buffer.
+         */
+        struct batch_t
+        {
+                CPT( RenderState ) state;
+                CPT( GeomVertexData ) vdata;
+                GeomEnums::NumericType index_type;
+                int index_stride;
+                pvector<unsigned char> indices;
+                // In index buffer order.
+                pvector<batchface_t> faces;
+        };
+
+        struct drawrange_t
+        {
+                int batch;
+                int first_index;
+                int num_indices;
+        };
+
+        struct drawlist_t
+        {
+                int leaf;
+                GeomNode::Geoms geoms;
+        };
+
+        GeomNode::Geoms make_draw_list( int leaf ) const;
+
+private:
+        pvector<batch_t> _batches;
+        pvector<pvector<drawrange_t>> _leaf_ranges;
+
+        // Most recently used first.
+        pdeque<drawlist_t> _draw_lists;
+};
+
+#endif // BSP_WORLD_DRAWLISTS_H
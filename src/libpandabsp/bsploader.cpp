@@ -21,18 +21,15 @@
 #include "postprocess/hdr.h"
 #include "static_props.h"
 #include "planar_reflections.h"
+#include "bsp_face_builder.h"
+#include "static_prop_loader.h"
 
 #include <array>
 #include <bitset>
 #include <math.h>
 
 #include <asyncTaskManager.h>
-#include <eggData.h>
-#include <eggPolygon.h>
-#include <eggVertexUV.h>
-#include <eggWriter.h>
 #include <geomNode.h>
-#include <load_egg_file.h>
 #include <loader.h>
 #include <nodePathCollection.h>
 #include <pointLight.h>
@@ -62,8 +59,12 @@
 #include <geomVertexRewriter.h>
 #include <sceneGraphReducer.h>
 #include <characterJointEffect.h>
+#include <thread.h>
 #include <orthographicLens.h>
 #include <cullBinAttrib.h>
+#include <depthWriteAttrib.h>
+#include <textureAttrib.h>
+#include <transparencyAttrib.h>
 #include <materialAttrib.h>
 #include <materialPool.h>
 //#include <pnmFileTypeTGA.h>
@@ -76,7 +77,6 @@
 static LVector3 default_shadow_dir( 0.5, 0, -0.9 );
 static LVector4 default_shadow_color( 0.5, 0.5, 0.5, 1.0 );
 
-static PT( InternalName ) static_vertex_lighting_name = InternalName::make( "static_vertex_lighting" );
 
 static ConfigVariableBool dumpcubemaps( "dumpcubemaps", false );
 
@@ -222,30 +222,34 @@ int BSPLoader::find_leaf( const LPoint3 &pos, int headnode )
                 return 0;
         }
 
-	int i = headnode;
+        return do_find_leaf( pos, headnode );
+}
 
+/**
+ * Like find_leaf(), but doesn't check for an active level. For the load
+ * stages, which run after the leaf tree is built but before the level is
+ * made active.
+ */
+int BSPLoader::do_find_leaf( const LPoint3 &pos, int headnode ) const
+{
         // Walk the BSP tree to find the index of the leaf which contains the specified
         // position.
-        while ( i >= 0 )
-        {
-                const dnode_t *node = &_bspdata->dnodes[i];
-                const dplane_t *plane = &_bspdata->dplanes[node->planenum];
-                float distance = ( plane->normal[0] * pos.get_x() ) +
-                        ( plane->normal[1] * pos.get_y() ) +
-                        ( plane->normal[2] * pos.get_z() ) - ( plane->dist / PANDA_TO_HAMMER );
-
-                if ( distance >= 0.0 )
-                {
-                        i = node->children[0];
-                }
-                else
-                {
-                        i = node->children[1];
-                }
+        return _leaf_tree.find_leaf( pos, headnode );
+}
 
+/**
+ * Finds the leaf that contains each of the indicated points, several points
+ * at a time. out[i] receives the leaf of pts[i].
+ */
+void BSPLoader::find_leafs( const LPoint3 *pts, int *out, size_t count, int headnode )
+{
+        if ( !_active_level )
+        {
+                memset( out, 0, count * sizeof( int ) );
+                return;
         }
 
-        return ~i;
+        _leaf_tree.find_leafs( pts, out, count, headnode );
 }
 
 int BSPLoader::find_node( const LPoint3 &pos )
@@ -352,46 +356,6 @@ LTexCoord BSPLoader::get_lightcoords( int facenum, const LVector3 &point )
 	return lightcoord;
 }
 
-PT( EggVertex ) BSPLoader::make_vertex_ai( EggVertexPool *vpool, EggPolygon *poly, dedge_t *edge, int k )
-{
-        dvertex_t *vert = &_bspdata->dvertexes[edge->v[k]];
-        float *vpos = vert->point;
-        PT( EggVertex ) v = new EggVertex;
-        v->set_pos( LPoint3d( vpos[0], vpos[1], vpos[2] ) );
-        return v;
-}
-
-PT( EggVertex ) BSPLoader::make_vertex( EggVertexPool *vpool, EggPolygon *poly,
-                                        dedge_t *edge, texinfo_t *texinfo,
-                                        dface_t *face, int k, Texture *tex )
-{
-	int facenum = face - _bspdata->dfaces;
-        dvertex_t *vert = &_bspdata->dvertexes[edge->v[k]];
-        float *vpos = vert->point;
-        PT( EggVertex ) v = new EggVertex;
-        v->set_pos( LPoint3d( vpos[0], vpos[1], vpos[2] ) );
-
-        // The widths and heights are retrieved from the actual loaded textures that were referenced.
-        double df_width = 1.0;
-        double df_height = 1.0;
-        if ( tex != nullptr )
-        {
-                df_width = tex->get_orig_file_x_size();
-                df_height = tex->get_orig_file_y_size();
-        }
-
-        // Texture and lightmap coordinates
-        LTexCoord uv = get_vertex_uv( texinfo, vert );
-	LTexCoord luv = get_lightcoords( facenum, LVector3( vpos[0], vpos[1], vpos[2] ) );
-        LTexCoordd df_uv( uv.get_x() / df_width, -uv.get_y() / df_height );
-        LTexCoordd lm_uv( luv[0], luv[1] );
-
-        v->set_uv( df_uv );
-        v->set_uv( "lightmap", lm_uv );
-
-        return v;
-}
-
 CPT( BSPMaterial ) BSPLoader::try_load_texref( texref_t *tref )
 {
         if ( _texref_materials.find( tref ) != _texref_materials.end() )
@@ -570,16 +534,12 @@ NodePath BSPLoader::make_model_faces( int modelnum )
 
 	std::ostringstream ss;
 	ss << "model-faces-" << modelnum;
-	NodePath ret( ss.str() );
+
+	// Only the triangles are needed here.
+	BSPFaceBuilder builder( this, true );
 
 	for ( int facenum = mdl->firstface; facenum < mdl->firstface + mdl->numfaces; facenum++ )
 	{
-		PT( EggData ) data = new EggData;
-		PT( EggVertexPool ) vpool = new EggVertexPool( "facevpool" );
-		data->add_child( vpool );
-
-		PT( EggPolygon ) poly = new EggPolygon;
-		data->add_child( poly );
 		dface_t *face = _bspdata->dfaces + facenum;
 		texinfo_t *texinfo = &_bspdata->texinfo[face->texinfo];
 		texref_t *texref = &_bspdata->dtexrefs[texinfo->texref];
@@ -592,46 +552,17 @@ NodePath BSPLoader::make_model_faces( int modelnum )
 			continue;
 		}
 
-		for ( int j = face->numedges - 1; j >= 0; j-- )
-		{
-			int surf_edge = _bspdata->dsurfedges[face->firstedge + j];
-
-			dedge_t *edge;
-			int index;
-			if ( surf_edge >= 0 )
-			{
-				edge = &_bspdata->dedges[surf_edge];
-				index = 0;
-			}
-
-			else
-			{
-				edge = &_bspdata->dedges[-surf_edge];
-				index = 1;
-			}
-
-			PT( EggVertex ) v = make_vertex_ai( vpool, poly, edge, index );
-			vpool->add_vertex( v );
-			poly->add_vertex( v );
-		}
-
-		data->remove_unused_vertices( true );
-		data->remove_invalid_primitives( true );
-
-		LNormald norm;
-		poly->calculate_normal( norm );
 		int face_type = BSPFaceAttrib::FACETYPE_WALL;
-		if ( norm.almost_equal( LNormald::up(), 0.5 ) )
+		if ( builder.get_face_normal( facenum ).almost_equal( LVector3::up(), 0.5 ) )
 			face_type = BSPFaceAttrib::FACETYPE_FLOOR;
 
-		NodePath geom = ret.attach_new_node( load_egg_data( data ) );
-		geom.set_attrib( BSPFaceAttrib::make( bspmat->get_surface_prop(), face_type ) );
-		geom.set_attrib( BSPMaterialAttrib::make( bspmat ) );
-		geom.clear_model_nodes();
-		geom.flatten_strong();
+		CPT( RenderState ) state = RenderState::make(
+			BSPFaceAttrib::make( bspmat->get_surface_prop(), face_type ),
+			BSPMaterialAttrib::make( bspmat ) );
+		builder.add_face( facenum, state );
 	}
 
-	return ret;
+	return NodePath( builder.make_geom_node( ss.str(), false ) );
 }
 
 NodePath BSPLoader::make_faces_ai_base( const std::string &name, const vector_string &include_entities,
@@ -776,20 +707,12 @@ void BSPLoader::make_faces()
 
 	_face_lightmap_info.resize( _bspdata->numfaces );
 
-        // build table of per-face beginning index into vertnormalindices
-        int face_vertnormalindices[MAX_MAP_FACES];
-        memset( face_vertnormalindices, -1, sizeof( int ) * MAX_MAP_FACES );
-        int normal_index = 0;
-        for ( int i = 0; i < _bspdata->numfaces; i++ )
-        {
-                face_vertnormalindices[i] = normal_index;
-                normal_index += _bspdata->dfaces[i].numedges;
-        }
-
 	_model_data.resize( _bspdata->nummodels );
 
+        BSPFaceBuilder builder( this );
+
         // In BSP files, models are brushes that have been grouped together to be used as an entity.
-        // We can group all of the face GeomNodes of the model to a root node.
+        // We can group all of the face Geoms of the model under a root node.
         for ( int modelnum = 0; modelnum < _bspdata->nummodels; modelnum++ )
         {
                 dmodel_t *model = &_bspdata->dmodels[modelnum];
@@ -823,16 +746,9 @@ void BSPLoader::make_faces()
 
                 for ( int facenum = firstface; facenum < firstface + numfaces; facenum++ )
                 {
-                        PT( EggData ) data = new EggData;
-                        PT( EggVertexPool ) vpool = new EggVertexPool( "facevpool" );
-                        data->add_child( vpool );
-
                         dface_t *face = &_bspdata->dfaces[facenum];
 			_dface_dmodels[face] = model;
 
-                        PT( EggPolygon ) poly = new EggPolygon;
-                        data->add_child( poly );
-
                         texinfo_t *texinfo = &_bspdata->texinfo[face->texinfo];
 
                         texref_t *texref = &_bspdata->dtexrefs[texinfo->texref];
@@ -855,147 +771,82 @@ void BSPLoader::make_faces()
                                 continue;
                         }
 
-                        bool skip = false;
-
-                        bool mat_normalmap = bspmat->has_keyvalue( "$bumpmap" );
-
-                        bool has_lighting = ( face->lightofs != -1 && _want_lightmaps ) && !skip && bspmat->get_shader() == "LightmappedGeneric";
+                        bool has_lighting = ( face->lightofs != -1 && _want_lightmaps ) && bspmat->get_shader() == "LightmappedGeneric";
                         if ( has_lighting &&
                              bspmat->has_keyvalue( "$lightmapped" ) &&
                              atoi( bspmat->get_keyvalue( "$lightmapped" ).c_str() ) == 0 )
                         {
                                 has_lighting = false;
                         }
-                                
-                        bool has_texture = !skip;
 
                         // HACKHACK:
-                        // Read the material's $basetexture and alpha to determine
-                        // if a TransparencyAttrib is needed, and to get the size of the
+                        // Read the material's $basetexture to get the size of the
                         // texture for brush face texcoords
                         PT( Texture ) tex = nullptr;
                         if ( bspmat->has_keyvalue( "$basetexture" ) )
                         {
                                 tex = TexturePool::load_texture( bspmat->get_keyvalue( "$basetexture" ) );
                         }
-                        bool has_transparency = bspmat->has_transparency();
 
 			dface_lightmap_info_t lminfo;
 			init_dface_lightmap_info( &lminfo, facenum );
 			_face_lightmap_info[facenum] = lminfo;
-                        LVertexd centroid( 0 );
-                        int verts = 0;
 
-                        for ( int j = face->numedges - 1; j >= 0; j-- )
-                        {
-                                LNormald normal( 0 );
-                                if ( face_vertnormalindices[facenum] != -1 )
-                                {
-                                        int vert_normal_idx = face_vertnormalindices[facenum] + j;
-                                        vec3_t normalf_v;
-                                        VectorCopy( _bspdata->vertnormals[_bspdata->vertnormalindices[vert_normal_idx]].point, normalf_v );
-                                        normal = LNormald( normalf_v[0], normalf_v[1], normalf_v[2] );
-                                }
-
-                                int surf_edge = _bspdata->dsurfedges[face->firstedge + j];
-                                dedge_t *edge;
-				int index;
-				if ( surf_edge >= 0 )
-				{
-					edge = &_bspdata->dedges[surf_edge];
-					index = 0;
-				}   
-				else
-				{
-					edge = &_bspdata->dedges[-surf_edge];
-					index = 1;
-				}
+                        // Faces that render the same way go into the same vertex data.
+                        CPT( RenderState ) state = RenderState::make( BSPMaterialAttrib::make( bspmat ) );
 
-				PT( EggVertex ) v = make_vertex( vpool, poly, edge, texinfo,
-					face, index, tex );
-				v->set_normal( normal );
-				vpool->add_vertex( v );
-				poly->add_vertex( v );
-				centroid += v->get_pos3();
-				verts++;
-                        }
-
-                        data->remove_unused_vertices( true );
-                        data->remove_invalid_primitives( true );
-
-                        centroid /= verts;
-
-                        data->recompute_tangent_binormal( GlobPattern( "*" ) );
-
-                        NodePath faceroot = _result.attach_new_node( load_egg_data( data ) );
-
-                        if ( has_transparency )
+                        if ( bspmat->has_transparency() )
                         {
-                                faceroot.set_transparency( TransparencyAttrib::M_dual, 1 );
-                        }  
+                                state = state->add_attrib( TransparencyAttrib::make( TransparencyAttrib::M_dual ), 1 );
+                        }
 
 			if ( ( contents & CONTENTS_SKY ) != 0 )
 			{
 				// Draw 2D skybox faces first, and don't write depth
-				faceroot.set_bin( "background", 0 );
-				faceroot.set_depth_write( false );
+				state = state->add_attrib( CullBinAttrib::make( "background", 0 ) );
+				state = state->add_attrib( DepthWriteAttrib::make( DepthWriteAttrib::M_off ) );
 			}
 
+                        CPT( RenderAttrib ) tattr = TextureAttrib::make();
                         if ( has_lighting )
                         {
                                 if ( face->bumped_lightmap && bspmat->has_keyvalue( "$bumpmap" ) )
                                 {
-					faceroot.set_texture( TextureStages::get_bumped_lightmap(),
+					tattr = DCAST( TextureAttrib, tattr )->add_on_stage( TextureStages::get_bumped_lightmap(),
 						lminfo.palette_entry->palette->palette_tex );
                                 }
                                 else
                                 {
-                                        faceroot.set_texture( TextureStages::get_lightmap(),
+					tattr = DCAST( TextureAttrib, tattr )->add_on_stage( TextureStages::get_lightmap(),
 						lminfo.palette_entry->palette->palette_tex );
                                 }
                         }
 
-                        faceroot.wrt_reparent_to( modelroot );
-
-                        if ( bspmat->has_keyvalue( "$envmap" ) )
+                        if ( bspmat->has_keyvalue( "$envmap" ) &&
+                             bspmat->get_keyvalue( "$envmap" ) == "env_cubemap" )
                         {
-                                PT( Texture ) etex = nullptr;
-                                std::string envmap = bspmat->get_keyvalue( "$envmap" );
-                                if ( envmap == "env_cubemap" )
+                                // material wants us to use a cubemap_tex embedded in the level.
+                                // find the closest one to the center of the face.
+                                LPoint3 centroid = builder.get_face_centroid( facenum ) / 16.0;
+                                cubemap_t *cm = find_closest_cubemap( centroid );
+                                if ( cm )
                                 {
-                                        // material wants us to use a cubemap_tex embedded in the level.
-                                        // find the closest one to the center of the face.
-                                        centroid /= 16.0; // move from hammer space into panda space
-                                        cubemap_t *cm = find_closest_cubemap(
-                                                LPoint3( centroid[0], centroid[1], centroid[2] ) );
-                                        if ( cm )
-                                        {
-                                                faceroot.set_texture( TextureStages::get_cubemap(),
-                                                                      cm->cubemap_tex );
-                                        }
+					tattr = DCAST( TextureAttrib, tattr )->add_on_stage( TextureStages::get_cubemap(),
+						cm->cubemap_tex );
                                 }
                         }
 
-                        faceroot.set_attrib( BSPMaterialAttrib::make( bspmat ) );
-
-                        NodePathCollection gn_npc = faceroot.find_all_matches( "**/+GeomNode" );
-                        for ( int i = 0; i < gn_npc.get_num_paths(); i++ )
+                        if ( DCAST( TextureAttrib, tattr )->get_num_on_stages() > 0 )
                         {
-                                NodePath gnnp = gn_npc.get_path( i );
-                                PT( GeomNode ) gn = DCAST( GeomNode, gnnp.node() );
-                                for ( int j = 0; j < gn->get_num_geoms(); j++ )
-                                {
-                                        PT( Geom ) geom = gn->modify_geom( j );
-                                        geom->set_bounds_type( BoundingVolume::BT_box );
-                                        gn->set_geom( j, geom );
-                                }
+                                state = state->add_attrib( tattr );
                         }
 
-                        if ( skip )
-                        {
-                                faceroot.hide();
-                        }
+                        builder.add_face( facenum, state, tex );
                 }
+
+                // The world needs every face in its own Geom for leaf culling,
+                // the faces still share the vertex data of their group.
+                modelroot.attach_new_node( builder.make_geom_node( "faces", true ) );
         }
 
         bspfile_cat.info()
@@ -1053,63 +904,6 @@ void BSPLoader::get_model_bounds( int modelnum, LPoint3 &mins, LPoint3 &maxs )
         maxs /= 16.0;
 }
 
-void BuildGeomNodes_r( PandaNode *node, pvector<PT( GeomNode )> &list )
-{
-        if ( node->is_of_type( GeomNode::get_class_type() ) )
-        {
-                list.push_back( DCAST( GeomNode, node ) );
-        }
-
-        for ( int i = 0; i < node->get_num_children(); i++ )
-        {
-                BuildGeomNodes_r( node->get_child( i ), list );
-        }
-}
-
-pvector<PT( GeomNode )> BuildGeomNodes( const NodePath &root )
-{
-        pvector<PT( GeomNode )> list;
-
-        BuildGeomNodes_r( root.node(), list );
-
-        return list;
-}
-
-struct VDataDef
-{
-        CPT( GeomVertexData ) vdata;
-        CPT( Geom ) geom;
-};
-
-struct GNWG_result
-{
-        PT( GeomNode ) geomnode;
-        int geomidx;
-};
-
-INLINE GNWG_result get_geomnode_with_geom( const NodePath &root, CPT( Geom ) geom )
-{
-        GNWG_result result;
-        result.geomnode = nullptr;
-
-        NodePathCollection npc = root.find_all_matches( "**/+GeomNode" );
-        for ( int i = 0; i < npc.get_num_paths(); i++ )
-        {
-                PT( GeomNode ) gn = DCAST( GeomNode, npc.get_path( i ).node() );
-                for ( int j = 0; j < gn->get_num_geoms(); j++ )
-                {
-                        CPT( Geom ) g = gn->get_geom( j );
-                        if ( geom == g )
-                        {
-                                result.geomnode = gn;
-                                result.geomidx = j;
-                        }
-                }
-        }
-
-        return result;
-}
-
 void BSPLoader::clear_model_nodes_below( const NodePath &top )
 {
         NodePathCollection npc = top.find_all_matches( "**/+ModelNode" );
@@ -1126,318 +920,8 @@ void BSPLoader::clear_model_nodes_below( const NodePath &top )
 
 void BSPLoader::load_static_props()
 {
-        SimpleHashMap<int, NodePath, int_hash> leaf2props;
-
-        for ( size_t propnum = 0; propnum < _bspdata->dstaticprops.size(); propnum++ )
-        {
-                dstaticprop_t *prop = &_bspdata->dstaticprops[propnum];
-
-                PT( BSPProp ) propnode = new BSPProp( prop->name );
-                propnode->set_preserve_transform( ModelNode::PT_local );
-                NodePath propnp = _result.attach_new_node( propnode );
-                propnp.set_shader_auto( 1 );
-                PT( PandaNode ) proproot = Loader::get_global_ptr()->load_sync( prop->name );
-                if ( proproot == nullptr )
-                {
-                        bspfile_cat.warning()
-                                << "Could not load static prop " << prop->name << "\n";
-                        continue;
-                }
-
-                NodePath propmdl( proproot );
-                LPoint3 pos;
-                VectorCopy( prop->pos, pos );
-                LVector3 hpr;
-                VectorCopy( prop->hpr, hpr );
-                LVector3 scale;
-                VectorCopy( prop->scale, scale );
-                propnp.set_pos( pos / 16.0 );
-                propnp.set_hpr( hpr[1] - 90, hpr[0], hpr[2] );
-                propnp.set_scale( scale );
-                propmdl.reparent_to( propnp );
-                propmdl.clear_model_nodes();
-                propmdl.flatten_light();
-
-                entity_t *lightsrc = nullptr;
-                LColor lightsrc_col;
-                if ( prop->lightsrc != -1 )
-                {
-                        lightsrc = _bspdata->entities + prop->lightsrc;
-                        lightsrc_col = color_from_value( ValueForKey( lightsrc, "_light" ), true, true );
-                }
-
-		bool static_lighting = false;
-
-                if ( prop->first_vertex_data != -1 &&
-                     ( prop->flags & STATICPROPFLAGS_STATICLIGHTING ) != 0 &&
-                     ( prop->flags & STATICPROPFLAGS_DYNAMICLIGHTING ) == 0 )
-                {
-			static_lighting = true;
-                        bool use_cubemap = false;
-
-                        // prop has pre computed per vertex lighting
-                        pvector<VDataDef> vdatadefs;
-
-                        // this is actually the most annoying code in the world,
-                        // since panda3d makes geoms and all its data const pointers
-
-                        // build a list of unique GeomVertexDatas with a list of each Geom that shares it.
-                        // it better be in the same order as the dstaticprop vertex datas
-                        pvector<PT( GeomNode )> geomnodes = BuildGeomNodes( propmdl );
-                        for ( size_t i = 0; i < geomnodes.size(); i++ )
-                        {
-                                PT( GeomNode ) gn = geomnodes[i];
-                                for ( int j = 0; j < gn->get_num_geoms(); j++ )
-                                {
-                                        CPT( Geom ) geom = gn->get_geom( j );
-                                        CPT( GeomVertexData ) vdata = geom->get_vertex_data();
-
-                                        VDataDef def;
-                                        def.vdata = vdata;
-                                        def.geom = geom;
-                                        vdatadefs.push_back( def );
-                                }
-                        }
-
-                        // check for a mismatch
-                        if ( vdatadefs.size() != prop->num_vertex_datas )
-                        {
-                                bspfile_cat.warning()
-                                        << "Static prop " << prop->name << " vertex data count mismatch. "
-                                        << "Will appear fullbright. "
-                                        << "Has the model been changed since last map compile?\n";
-                                bspfile_cat.warning()
-                                        << "Loaded model has " << vdatadefs.size() << " unique vertex datas,\n"
-                                        << "dstaticprop has " << prop->num_vertex_datas << "\n";
-                                continue;
-                        }
-
-                        // now modulate the vertex colors to apply the lighting
-                        for ( int i = 0; i < prop->num_vertex_datas; i++ )
-                        {
-                                dstaticpropvertexdata_t *dvdata = &_bspdata->dstaticpropvertexdatas[prop->first_vertex_data + i];
-                                VDataDef *def = &vdatadefs[i];
-
-                                PT( GeomVertexData ) mod_vdata = new GeomVertexData( *def->vdata );
-                                if ( !mod_vdata->has_column( static_vertex_lighting_name ) )
-                                {
-                                        PT( GeomVertexFormat ) format = new GeomVertexFormat( *mod_vdata->get_format() );
-                                        PT( GeomVertexArrayFormat ) array = format->modify_array( 0 );
-                                        array->add_column( static_vertex_lighting_name, 4, GeomEnums::NT_uint16, GeomEnums::C_color );
-                                        format->set_array( 0, array );
-                                        mod_vdata->set_format( GeomVertexFormat::register_format( format ) );
-                                }
-                                GeomVertexWriter color_mod( mod_vdata, static_vertex_lighting_name );
-
-                                if ( dvdata->num_lighting_samples != mod_vdata->get_num_rows() )
-                                {
-                                        bspfile_cat.warning()
-                                                << "For static prop " << prop->name << ":\n"
-                                                << "number of lighting samples does not match number of vertices in vdata\n"
-                                                << "number of lighting samples: " << dvdata->num_lighting_samples << "\n"
-                                                << "number of vertices: " << mod_vdata->get_num_rows() << "\n";
-                                        continue;
-                                }
-
-                                for ( int j = 0; j < dvdata->num_lighting_samples; j++ )
-                                {
-                                        colorrgbexp32_t *sample = &_bspdata->staticproplighting[dvdata->first_lighting_sample + j];
-					LVector3 vtx_rgb;
-					ColorRGBExp32ToVector( *sample, vtx_rgb );
-					vtx_rgb /= 255.0f;
-                                        LColorf vtx_color( vtx_rgb[0], vtx_rgb[1], vtx_rgb[2], 1.0 );
-                                        // now apply it to the modified vertex data
-                                        color_mod.set_data4f( vtx_color );
-                                }
-
-                                // apply the modified vertex data to each geom that shares this vertex data
-                                CPT( Geom ) geom = def->geom;
-                                GNWG_result res = get_geomnode_with_geom( propmdl, geom );
-                                PT( Geom ) mod_geom = res.geomnode->modify_geom( res.geomidx );
-
-                                //if ( lightsrc != nullptr && res.geomnode->get_name() == "__lightsource__" )
-                                //{
-                                //        bspfile_cat.info()
-                                //                << "Applying color " << lightsrc_col << " to vertices on __lightsource__\n";
-                                //        for ( int j = 0; j < mod_vdata->get_num_rows(); j++ )
-                                //        {
-                                //                color_mod.set_row( j );
-                                //                color_mod.set_data4f( lightsrc_col );
-                                //        }
-                                //}
-
-                                if ( res.geomnode->get_name() == "__lightsource__" )
-                                {
-                                        continue;
-                                }
-                                else
-                                {
-                                        // game specific code, yuck
-                                        //
-                                        // don't apply vertex lighting to shadow models
-#ifdef CIO
-                                        bool shadow_skip = false;
-#endif
- 
-                                        for ( int j = 0; j < res.geomnode->get_num_geoms(); j++ )
-                                        {
-                                                const RenderState *state = res.geomnode->get_geom_state( j );
-#ifdef CIO
-                                                const TextureAttrib *tattr;
-                                                if ( state->get_attrib( tattr ) )
-                                                {
-                                                        if ( tattr->get_num_on_stages() == 0 )
-                                                        {
-                                                                continue;
-                                                        }
-                                                        Texture *tex = tattr->get_on_texture( tattr->get_on_stage( 0 ) );
-                                                        if ( tex->get_name().find( "square_drop_shadow" ) != string::npos ||
-                                                             tex->get_name().find( "drop-shadow" ) != string::npos )
-                                                        {
-                                                                // don't apply vertex lighting to a shadow model
-                                                                shadow_skip = true;
-                                                                break;
-                                                        }
-                                                }
-#endif
-                                                const BSPMaterialAttrib *bma;
-                                                state->get_attrib_def( bma );
-                                                if ( bma->get_material() && bma->get_material()->has_env_cubemap() )
-                                                {
-                                                        use_cubemap = true;
-                                                }
-                                        }
-
-#ifdef CIO
-                                        if ( shadow_skip )
-                                                continue;
-#endif
-                                }
-
-                                mod_geom->set_vertex_data( mod_vdata );
-                                res.geomnode->set_geom( res.geomidx, mod_geom );
-                        }
-
-                        if ( use_cubemap )
-                        {
-                                cubemap_t *cm = find_closest_cubemap( pos / 16.0 );
-                                if ( cm )
-                                {
-                                        propnp.set_texture( TextureStages::get_cubemap(), cm->cubemap_tex );
-                                }
-                        }
-		        
-
-                        // since this prop has static lighting applied to the vertices
-                        // ignore any dynamic lights.
-                        propnp.set_light_off( 1 );
-                }
-                else if ( prop->flags & STATICPROPFLAGS_NOLIGHTING )
-                {
-                        propnp.set_light_off( 1 );
-                }
-
-#ifdef CIO
-                if ( prop->flags & STATICPROPFLAGS_LIGHTMAPSHADOWS ||
-                     prop->flags & STATICPROPFLAGS_REALSHADOWS )
-                {
-                        // game specific code!
-
-                        // we want to strip the fake drop shadows
-                        // since we either have lightmap shadows
-                        // or realtime depth shadows
-
-                        // GeomNodes with the drop_shadow texture on any of the RenderStates
-                        // will be completely removed. it's a little brute force, but should work.
-
-                        NodePathCollection npc = propmdl.find_all_matches( "**/+GeomNode" );
-                        for ( int i = 0; i < npc.get_num_paths(); i++ )
-                        {
-                                NodePath np = npc[i];
-                                GeomNode *gn = DCAST( GeomNode, np.node() );
-                                for ( int j = 0; j < gn->get_num_geoms(); j++ )
-                                {
-                                        const RenderState *state = gn->get_geom_state( j );
-                                        const TextureAttrib *tattr;
-                                        if ( state->get_attrib( tattr ) )
-                                        {
-                                                if ( tattr->get_num_on_stages() == 0 )
-                                                {
-                                                        continue;
-                                                }
-                                                Texture *tex = tattr->get_on_texture( tattr->get_on_stage( 0 ) );
-                                                if ( tex->get_name().find( "square_drop_shadow" ) != string::npos ||
-                                                     tex->get_name().find( "drop-shadow" ) != string::npos )
-                                                {
-                                                        np.remove_node();
-                                                }
-                                        }
-                                }
-                        }
-                }
-#endif
-
-		// Indicate that any Geoms underneath this prop node are static prop geometry.
-		propnp.set_attrib( StaticPropAttrib::make( static_lighting ) );
-
-                if ( prop->flags & STATICPROPFLAGS_DOUBLESIDE )
-                {
-                        propmdl.set_two_sided( true, 1 );
-                }
-
-                if ( prop->flags & STATICPROPFLAGS_HARDFLATTEN )
-                {
-                        propmdl.clear_model_nodes();
-                        propmdl.flatten_strong();
-                }
-
-                //propnp.hide( CAMBITS_SHADOW );
-
-                // No lightmap shadows,
-                // but depth-map shadows?
-                if ( ( prop->flags & STATICPROPFLAGS_LIGHTMAPSHADOWS ) == 0 &&
-                        ( prop->flags & STATICPROPFLAGS_REALSHADOWS ) != 0 )
-                {
-                        propnp.show_through( CAMERA_SHADOW );
-                }
-
-                // only do group flattening if the prop doesn't
-                // use dynamic lighting (ambient probes).
-                //
-                // grouping all of the static props together
-                // will mess up the origin on each prop and they
-                // won't be dynamically lit correctly.
-
-                if ( ( prop->flags & STATICPROPFLAGS_GROUPFLATTEN ) != 0 &&
-                     ( prop->flags & STATICPROPFLAGS_DYNAMICLIGHTING ) == 0 )
-                {
-                        // find the leaf this prop resides in
-                        //int leaf = find_leaf( pos / 16.0 );
-                        int leaf = 0;
-                        if ( leaf2props.find( leaf ) == -1 )
-                        {
-                                std::ostringstream ss;
-                                ss << "propGroupLeaf" << leaf;
-                                leaf2props.store( leaf, _result.attach_new_node( new BSPProp( ss.str() ) ) );
-                        }
-                        // move the prop underneath that leaf node group
-                        propnp.wrt_reparent_to( leaf2props[leaf] );
-                }
-        }
-
-        // any props with the STATICPROPFLAGS_GROUPFLATTEN bit
-        // have been grouped together under a common node for each leaf
-        //
-        // this means that any props in the same leaf will be
-        // aggressively flattened together
-        //
-        // do the flattening
-        for ( size_t i = 0; i < leaf2props.size(); i++ )
-        {
-                NodePath groupnp = leaf2props.get_data( i );
-                clear_model_nodes_below( groupnp );
-                groupnp.flatten_strong();
-        }
+        StaticPropLoader props( this );
+        props.load();
 }
 
 void BSPLoader::remove_model( int modelnum )
@@ -1458,6 +942,16 @@ bool BSPLoader::is_cluster_visible( int curr_cluster, int cluster ) const
         {
                 return true;
         }
+
+        return do_is_cluster_visible( curr_cluster, cluster );
+}
+
+/**
+ * Like is_cluster_visible(), but doesn't check for an active level. For the
+ * load stages.
+ */
+bool BSPLoader::do_is_cluster_visible( int curr_cluster, int cluster ) const
+{
         if ( curr_cluster == cluster || curr_cluster == 0 )
         {
                 return true;
@@ -1467,55 +961,156 @@ bool BSPLoader::is_cluster_visible( int curr_cluster, int cluster ) const
                 return false;
         }
 
-        // 1 means that the specified leaf is visible from the current leaf
-        // 0 means it's not
-        int dat = _leaf_pvs[curr_cluster][( cluster - 1 ) >> 3] & ( 1 << ( ( cluster - 1 ) & 7 ) );
-        return dat != 0;
+        return _pvs.is_visible( curr_cluster, cluster );
 }
 
-void BSPLoader::update_leaf( int leaf )
+/**
+ * Fills in the set of leafs that are potentially visible from the indicated
+ * leaf. Assumes the leaf lock is held.
+ */
+void BSPLoader::fill_visible_leafs( BSPVisibleLeafs *visible_leafs, int leaf )
 {
-	LightMutexHolder holder( _leaf_aabb_lock );
+	visible_leafs->clear();
+	visible_leafs->set_view_leaf( leaf );
 
-	_curr_leaf_idx = leaf;
-	_visible_leaf_bboxs.clear();
-	_visible_leafs.clear();
+	visible_leafs->set_world_geoms( _world_draw_lists.get_draw_list( leaf ) );
 
-	// Add ourselves to the visible list.
-	_visible_leaf_bboxs.push_back( { _leaf_bboxs[leaf], _bspdata->dleafs[leaf].flags } );
-	_visible_leafs.push_back( leaf );
+	int numvisleafs = _bspdata->dmodels[0].visleafs;
 
-	if ( _vis_leafs )
-	{
-		_leaf_visnp[leaf].set_color_scale( LColor( 0, 1, 0, 1 ), 1 );
-	}
+	// Add ourselves to the visible list.
+	visible_leafs->add_leaf( leaf, _leaf_bboxs[leaf], _bspdata->dleafs[leaf].flags );
 
-	for ( int i = 1; i < _bspdata->dmodels[0].visleafs + 1; i++ )
+	if ( leaf == 0 )
 	{
-		if ( i == leaf )
+		// Everything is visible from the solid leaf.
+		visible_leafs->reserve( numvisleafs + 1 );
+		for ( int i = 1; i < numvisleafs + 1; i++ )
 		{
-			continue;
+			visible_leafs->add_leaf( i, _leaf_bboxs[i], _bspdata->dleafs[i].flags );
 		}
-		const dleaf_t *pleaf = &_bspdata->dleafs[i];
-		if ( is_cluster_visible( leaf, i ) )
+	}
+	else
+	{
+		// Walk the set bits of our PVS row a word at a time.
+		const uint64_t *row = _pvs.get_row( leaf, _pvs_row_scratch.data() );
+		if ( row != nullptr )
 		{
-			if ( _vis_leafs )
+			size_t numwords = _pvs.get_row_words();
+
+			int count = 0;
+			for ( size_t w = 0; w < numwords; w++ )
 			{
-				_leaf_visnp[i].set_color_scale( LColor( 0, 0, 1, 1 ), 1 );
+				count += pvs_popcount( row[w] );
 			}
-			_visible_leaf_bboxs.push_back( { _leaf_bboxs[i], pleaf->flags } );
-			_visible_leafs.push_back( i );
-		}
-		else
-		{
-			if ( _vis_leafs )
+			visible_leafs->reserve( count + 1 );
+
+			for ( size_t w = 0; w < numwords; w++ )
 			{
-				_leaf_visnp[i].set_color_scale( LColor( 1, 0, 0, 1 ), 1 );
+				uint64_t bits = row[w];
+				while ( bits != 0 )
+				{
+					int i = (int)( w * 64 ) + pvs_ctz( bits ) + 1;
+					bits &= bits - 1;
+
+					if ( i == leaf || i > numvisleafs )
+					{
+						continue;
+					}
+
+					visible_leafs->add_leaf( i, _leaf_bboxs[i], _bspdata->dleafs[i].flags );
+				}
 			}
 		}
 	}
 }
 
+/**
+ * Makes the indicated snapshot the one returned by get_visible_leafs().
+ * The snapshot must not be modified after this. Assumes the leaf lock is
+ * held.
+ */
+void BSPLoader::publish_visible_leafs( BSPVisibleLeafs *visible_leafs )
+{
+	PT( BSPVisibleLeafs ) prev = _visible_leafs_front;
+	_visible_leafs_front = visible_leafs;
+	AtomicAdjust::set_ptr( _visible_leafs_ptr, visible_leafs );
+
+	// A reader may have loaded the old pointer but not taken its reference
+	// yet. Once the reader count drops to zero, every later reader sees the
+	// new pointer, and we are free to let go of the old snapshot.
+	while ( AtomicAdjust::get( _visible_leafs_readers ) != 0 )
+	{
+		Thread::relax();
+	}
+
+	_visible_leafs_back = prev;
+}
+
+/**
+ * Returns the leafs that are potentially visible from the current leaf.
+ * Does not lock; the returned snapshot stays valid for as long as the caller
+ * holds on to it, even if the current leaf changes in the meantime. Returns
+ * nullptr if no leaf has been made current yet.
+ */
+CPT( BSPVisibleLeafs ) BSPLoader::get_visible_leafs() const
+{
+	AtomicAdjust::inc( _visible_leafs_readers );
+	CPT( BSPVisibleLeafs ) visible_leafs =
+		(const BSPVisibleLeafs *)AtomicAdjust::get_ptr( _visible_leafs_ptr );
+	AtomicAdjust::dec( _visible_leafs_readers );
+
+	return visible_leafs;
+}
+
+/**
+ * Builds a new snapshot of the leafs that are potentially visible from the
+ * indicated leaf, without changing the current leaf. Useful for cameras that
+ * are not in the same leaf as the main camera.
+ */
+PT( BSPVisibleLeafs ) BSPLoader::make_visible_leafs( int leaf )
+{
+	LightMutexHolder holder( _leaf_aabb_lock );
+
+	nassertr( leaf >= 0 && leaf < (int)_leaf_bboxs.size(), nullptr );
+
+	PT( BSPVisibleLeafs ) visible_leafs = new BSPVisibleLeafs;
+	fill_visible_leafs( visible_leafs, leaf );
+	return visible_leafs;
+}
+
+void BSPLoader::update_leaf( int leaf )
+{
+	LightMutexHolder holder( _leaf_aabb_lock );
+
+	_curr_leaf_idx = leaf;
+
+	// Build into the previous snapshot if the cull threads are done with it,
+	// otherwise into a new one.
+	PT( BSPVisibleLeafs ) visible_leafs = _visible_leafs_back;
+	_visible_leafs_back = nullptr;
+	if ( visible_leafs == nullptr || visible_leafs->get_ref_count() != 1 )
+	{
+		visible_leafs = new BSPVisibleLeafs;
+	}
+
+	fill_visible_leafs( visible_leafs, leaf );
+	publish_visible_leafs( visible_leafs );
+
+	if ( _vis_leafs )
+	{
+		int numvisleafs = _bspdata->dmodels[0].visleafs;
+		for ( int i = 1; i < numvisleafs + 1; i++ )
+		{
+			_leaf_visnp[i].set_color_scale( LColor( 1, 0, 0, 1 ), 1 );
+		}
+		for ( size_t i = 1; i < visible_leafs->get_num_leafs(); i++ )
+		{
+			_leaf_visnp[visible_leafs->get_leaf( i )].set_color_scale( LColor( 0, 0, 1, 1 ), 1 );
+		}
+		_leaf_visnp[leaf].set_color_scale( LColor( 0, 1, 0, 1 ), 1 );
+	}
+}
+
 void BSPLoader::update_visibility( const LPoint3 &pos )
 {
         // Update visibility
@@ -1574,7 +1169,106 @@ void BSPLoader::read_materials_file()
         }
 }
 
+/**
+ * Loads the indicated level, replacing the current one, and doesn't return
+ * until it is loaded.
+ */
 bool BSPLoader::read( const Filename &file, bool is_transition )
+{
+        nassertr_always( !is_loading(), false );
+
+        if ( !begin_read( file, is_transition ) )
+        {
+                return false;
+        }
+
+        for ( int stage = 0; stage < LS_COUNT; stage++ )
+        {
+                if ( !run_load_stage( stage ) )
+                {
+                        // Free whatever got built before it failed.
+                        cleanup( is_transition );
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+/**
+ * Starts loading the indicated level in the background, replacing the
+ * current one, and returns the task that is loading it. The current level
+ * is unloaded right away. The new one becomes active when the task is done.
+ * The loader shouldn't be used for anything else until then.
+ */
+PT( BSPLoadTask ) BSPLoader::read_async( const Filename &file, bool is_transition )
+{
+        nassertr_always( !is_loading(), nullptr );
+
+        AsyncTaskManager *mgr = AsyncTaskManager::get_global_ptr();
+        if ( mgr->find_task_chain( "bsp-loader" ) == nullptr )
+        {
+                AsyncTaskChain *chain = mgr->make_task_chain( "bsp-loader" );
+                chain->set_num_threads( 1 );
+        }
+
+        PT( BSPLoadTask ) task = new BSPLoadTask( this, file, is_transition );
+        _load_task = task;
+        mgr->add( task );
+
+        return task;
+}
+
+std::string BSPLoader::get_load_stage_name( int stage )
+{
+        switch ( stage )
+        {
+        case LS_read_file:
+                return "Read file";
+        case LS_visibility:
+                return "Visibility";
+        case LS_geometry:
+                return "Geometry";
+        case LS_static_props:
+                return "Static props";
+        case LS_ambient_probes:
+                return "Ambient probes";
+        case LS_collision:
+                return "Collision";
+        case LS_entities:
+                return "Entities";
+        case LS_finish:
+                return "Finish";
+        default:
+                return "Unknown";
+        }
+}
+
+/**
+ * Called by the BSPLoadTask when it is done, whether or not it got through.
+ * A level that was cancelled or failed part way is freed here, instead of
+ * being left around until the next load.
+ */
+void BSPLoader::end_read( BSPLoadTask *task )
+{
+        if ( _load_task != task )
+        {
+                return;
+        }
+
+        _load_task = nullptr;
+
+        if ( !task->get_success() )
+        {
+                cleanup( task->get_is_transition() );
+        }
+}
+
+/**
+ * Unloads the current level and gets ready to load the indicated one. Must
+ * be called on the main thread.
+ */
+bool BSPLoader::begin_read( const Filename &file, bool is_transition )
 {
 	cleanup( is_transition );
 
@@ -1610,116 +1304,162 @@ bool BSPLoader::read( const Filename &file, bool is_transition )
 
         if ( !_ai )
         {
-                read_materials_file();
-
                 // Scale down the entire loaded level as a conversion from Hammer units to Panda units.
                 // Hammer units are tiny compared to panda.
                 _result.set_scale( HAMMER_TO_PANDA );
         }
 
-        VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
-
-        bspfile_cat.info()
-                << "Reading " << file.get_fullpath() << "...\n";
-        nassertr( vfs->exists( file ), false );
-
-        string data;
-        nassertr( vfs->read_file( file, data, true ), false );
-        int length = data.length();
-        char *buffer = new char[length + 1];
-        memcpy( buffer, data.c_str(), length );
-        _bspdata = LoadBSPImage( (dheader_t *)buffer );
-
         _map_file = file;
+        _map_is_transition = is_transition;
 
-        ParseEntities( _bspdata );
+        return true;
+}
 
-        _leaf_aabb_lock.acquire();
-	_leaf_pvs.resize( MAX_MAP_LEAFS );
-	_has_pvs_data = false;
-        _leaf_bboxs.resize( MAX_MAP_LEAFS );
-        // Decompress the per leaf visibility data.
-        for ( int i = 0; i < _bspdata->dmodels[0].visleafs + 1; i++ )
+/**
+ * Does one of the LoadStage stages of loading the level that begin_read()
+ * was given. The stages before LS_first_main_thread_stage only build data
+ * the application can't see yet and may run on any thread.
+ */
+bool BSPLoader::run_load_stage( int stage )
+{
+        switch ( stage )
         {
-                dleaf_t *leaf = &_bspdata->dleafs[i];
-
-                uint8_t *pvs = new uint8_t[( MAX_MAP_LEAFS + 7 ) / 8];
-                memset( pvs, 0, ( _bspdata->dmodels[0].visleafs + 7 ) / 8 );
-
-                if ( leaf->visofs != -1 )
+        case LS_read_file:
                 {
-                        DecompressVis( _bspdata, &_bspdata->dvisdata[leaf->visofs], pvs, ( MAX_MAP_LEAFS + 7 ) / 8 );
-                        _has_pvs_data = true;
-                }
+                        if ( !_ai )
+                        {
+                                read_materials_file();
+                        }
 
-                _leaf_pvs[i] = pvs;
+                        VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
 
-                PT( BoundingBox ) bbox = new BoundingBox(
-                        LVector3( ( leaf->mins[0] - LEAF_NUDGE ) / 16.0, ( leaf->mins[1] - LEAF_NUDGE ) / 16.0, ( leaf->mins[2] - LEAF_NUDGE ) / 16.0 ),
-                        LVector3( ( leaf->maxs[0] + LEAF_NUDGE ) / 16.0, ( leaf->maxs[1] + LEAF_NUDGE ) / 16.0, ( leaf->maxs[2] + LEAF_NUDGE ) / 16.0 )
-                );
-                _leaf_bboxs[i] = bbox;
-        }
-        _leaf_aabb_lock.release();
+                        bspfile_cat.info()
+                                << "Reading " << _map_file.get_fullpath() << "...\n";
+                        nassertr( vfs->exists( _map_file ), false );
 
-	load_geometry();
+                        // Map the file instead of reading it into memory. The bulk lumps (lighting,
+                        // visibility, cubemaps) are only copied out of the mapping if something
+                        // needs to modify them.
+                        PT( BSPMappedImage ) image = new BSPMappedImage;
+                        nassertr( image->open( _map_file ), false );
+                        _bspdata = LoadBSPImage( image );
+                        nassertr( _bspdata != nullptr, false );
 
-        load_entities();
+                        ParseEntities( _bspdata );
+                }
+                break;
 
-        _active_level = true;
+        case LS_visibility:
+                {
+                        _leaf_aabb_lock.acquire();
+                        // Decompress the per leaf visibility data.
+                        _pvs.setup( _bspdata );
+                        _leaf_tree.setup( _bspdata );
+                        _pvs_row_scratch.resize( _pvs.get_row_words() );
+                        _has_pvs_data = _pvs.has_data();
+                        _leaf_bboxs.resize( _bspdata->numleafs );
+                        for ( int i = 0; i < _bspdata->dmodels[0].visleafs + 1; i++ )
+                        {
+                                dleaf_t *leaf = &_bspdata->dleafs[i];
 
-        if ( !_ai )
-        {
-                load_static_props();
+                                PT( BoundingBox ) bbox = new BoundingBox(
+                                        LVector3( ( leaf->mins[0] - LEAF_NUDGE ) / 16.0, ( leaf->mins[1] - LEAF_NUDGE ) / 16.0, ( leaf->mins[2] - LEAF_NUDGE ) / 16.0 ),
+                                        LVector3( ( leaf->maxs[0] + LEAF_NUDGE ) / 16.0, ( leaf->maxs[1] + LEAF_NUDGE ) / 16.0, ( leaf->maxs[2] + LEAF_NUDGE ) / 16.0 )
+                                );
+                                _leaf_bboxs[i] = bbox;
+                        }
+                        _leaf_aabb_lock.release();
+                }
+                break;
 
-                if ( _vis_leafs )
+        case LS_geometry:
+                load_geometry();
+                break;
+
+        case LS_static_props:
+                if ( !_ai )
                 {
-                        Randomizer random;
-                        // Make a cube outline of the bounds for each leaf so we can visualize them.
-                        for ( int leafnum = 0; leafnum < _bspdata->dmodels[0].visleafs + 1; leafnum++ )
+                        load_static_props();
+
+                        if ( _vis_leafs )
                         {
-                                dleaf_t *leaf = &_bspdata->dleafs[leafnum];
-                                LPoint3 mins( ( leaf->mins[0] - LEAF_NUDGE ) / 16.0, ( leaf->mins[1] - LEAF_NUDGE ) / 16.0, ( leaf->mins[2] - LEAF_NUDGE ) / 16.0 );
-                                LPoint3 maxs( ( leaf->maxs[0] + LEAF_NUDGE ) / 16.0, ( leaf->maxs[1] + LEAF_NUDGE ) / 16.0, ( leaf->maxs[2] + LEAF_NUDGE ) / 16.0 );
-                                NodePath leafvis = _result.attach_new_node( UTIL_make_cube_outline( mins, maxs, LColor( 1, 1, 1, 1 ), 2 ) );
-                                leafvis.clear_model_nodes();
-                                leafvis.flatten_strong();
-                                _leaf_visnp.push_back( leafvis );
+                                Randomizer random;
+                                // Make a cube outline of the bounds for each leaf so we can visualize them.
+                                for ( int leafnum = 0; leafnum < _bspdata->dmodels[0].visleafs + 1; leafnum++ )
+                                {
+                                        dleaf_t *leaf = &_bspdata->dleafs[leafnum];
+                                        LPoint3 mins( ( leaf->mins[0] - LEAF_NUDGE ) / 16.0, ( leaf->mins[1] - LEAF_NUDGE ) / 16.0, ( leaf->mins[2] - LEAF_NUDGE ) / 16.0 );
+                                        LPoint3 maxs( ( leaf->maxs[0] + LEAF_NUDGE ) / 16.0, ( leaf->maxs[1] + LEAF_NUDGE ) / 16.0, ( leaf->maxs[2] + LEAF_NUDGE ) / 16.0 );
+                                        NodePath leafvis = _result.attach_new_node( UTIL_make_cube_outline( mins, maxs, LColor( 1, 1, 1, 1 ), 2 ) );
+                                        leafvis.clear_model_nodes();
+                                        leafvis.flatten_strong();
+                                        _leaf_visnp.push_back( leafvis );
+                                }
                         }
                 }
+                break;
+
+        case LS_ambient_probes:
+                if ( !_ai )
+                {
+                        _amb_probe_mgr.process_ambient_probes();
+                }
+                break;
+
+        case LS_collision:
+                _colldata = SetupCollisionBSPData( _bspdata );
+                setup_raytrace_environment();
+                break;
 
-                _amb_probe_mgr.process_ambient_probes();
+        case LS_entities:
+                load_entities();
+                break;
 
-                // Don't let the static brushes cast depth-map shadows,
-                // they have lightmap shadows.
-                //get_model( 0 ).hide( CAMBITS_SHADOW );
+        case LS_finish:
+                _active_level = true;
 
-                // Check if we are casting cascaded shadows
-                if ( _want_shadows && _shgen && _amb_probe_mgr.get_sunlight() )
+                if ( !_ai )
                 {
-                         _shadow_dir = -_amb_probe_mgr.get_sunlight()->direction.get_xyz();
-
-                        // Create a fake DirectionalLight to contain the direction
-                        PT( DirectionalLight ) dl = new DirectionalLight( "fake-dl" );
-                        dl->set_direction( _shadow_dir );
-                        // Keep a reference to the fake light
-                        _fake_dl = NodePath( dl );
-                        _shgen->set_sun_light( _fake_dl );
+                        // Don't let the static brushes cast depth-map shadows,
+                        // they have lightmap shadows.
+                        //get_model( 0 ).hide( CAMBITS_SHADOW );
+
+                        // Check if we are casting cascaded shadows
+                        if ( _want_shadows && _shgen && _amb_probe_mgr.get_sunlight() )
+                        {
+                                 _shadow_dir = -_amb_probe_mgr.get_sunlight()->direction.get_xyz();
+
+                                // Create a fake DirectionalLight to contain the direction
+                                PT( DirectionalLight ) dl = new DirectionalLight( "fake-dl" );
+                                dl->set_direction( _shadow_dir );
+                                // Keep a reference to the fake light
+                                _fake_dl = NodePath( dl );
+                                _shgen->set_sun_light( _fake_dl );
+                        }
+                        else
+                        {
+                                // No cascaded shadows
+                                _shgen->set_sun_light( NodePath() );
+                        }
                 }
-		else
-		{
-			// No cascaded shadows
-			_shgen->set_sun_light( NodePath() );
-		}
-        }
 
-        _colldata = SetupCollisionBSPData( _bspdata );
+                finish_read( _map_is_transition );
+                break;
 
-	setup_raytrace_environment();
+        default:
+                nassertr( false, false );
+        }
 
         return true;
 }
 
+/**
+ * Called on the main thread once the level is loaded and active.
+ */
+void BSPLoader::finish_read( bool is_transition )
+{
+}
+
 void BSPLoader::setup_raytrace_environment()
 {
 	_trace->add_dmodel( &_bspdata->dmodels[0], TRACETYPE_WORLD );
@@ -1798,6 +1538,20 @@ void BSPLoader::do_optimizations()
                                 NodePath child = children[j];
                                 child.wrt_reparent_to( mdlroot );
 				child.flatten_strong();
+
+                                NodePathCollection gnpc = child.find_all_matches( "**/+GeomNode" );
+                                if ( child.node()->is_geom_node() )
+                                {
+                                        gnpc.add_path( child );
+                                }
+                                for ( int k = 0; k < gnpc.get_num_paths(); k++ )
+                                {
+                                        GeomNode *cgn = DCAST( GeomNode, gnpc[k].node() );
+                                        for ( int l = 0; l < cgn->get_num_geoms(); l++ )
+                                        {
+                                                BSPFaceBuilder::optimize_vertex_cache( cgn->modify_geom( l ) );
+                                        }
+                                }
                         }
                         
 			mdata.decal_rbc->clear_transform();
@@ -1817,67 +1571,27 @@ void BSPLoader::do_optimizations()
                         npc[i].flatten_strong();
                 }
 
-                // Another very important optimization is to try and flatten all faces together that are in the same PVS
-                // For each leaf, we will combine all potentially visible Geoms into as few batches as possible.
-                // This means that we will be duplicating Geoms (and lose a lot of view frustum culling on worldspawn, but
-                // it is worth it due to fewer batches).
+                // Render the world from per-leaf lists of draw ranges into
+                // shared index buffers, instead of culling each face every frame.
+                // A leaf's list covers every face in its PVS, so the faces only
+                // get culled when the view leaf changes.
 
                 NodePath worldspawn = get_model( 0 );
                 NodePath npgn = worldspawn.find( "**/+GeomNode" );
                 PT( GeomNode ) gn = DCAST( GeomNode, npgn.node() );
-                int num_geoms = gn->get_num_geoms();
-                CPT( RenderState ) node_state = npgn.get_net_state();
-
-                int numvisleafs = _bspdata->dmodels[0].visleafs + 1;
-
-                // List of potentially visible Geoms in each leaf
-                // ( concatenation of Geoms in that leaf + Geoms of leafs in PVS )
-                _leaf_world_geoms.clear();
-                _leaf_world_geoms.resize( numvisleafs + 1 );
 
+                // We are going to assume that world Geoms are already in world space
+                // ( and they definitely should be )
                 _leaf_aabb_lock.acquire();
+                _world_draw_lists.build( gn, _pvs, _leaf_bboxs );
+                _leaf_aabb_lock.release();
 
-                for ( int leafnum = 1; leafnum < numvisleafs; leafnum++ )
+                // The current snapshot was made before there were any world
+                // Geoms, so make a new one that has them.
+                if ( _curr_leaf_idx >= 0 )
                 {
-                        // Build a list of worldspawn Geoms that we can render from this leaf.
-                        // We will then flatten those Geoms into as few batches as possible.
-
-                        PT( GeomNode ) lgn = new GeomNode( "leafnode" );
-                        NodePath leafnode( lgn );
-
-                        for ( int geomnum = 0; geomnum < num_geoms; geomnum++ )
-                        {
-                                const Geom *geom = gn->get_geom( geomnum );
-
-                                // We are going to assume that world Geoms are already in world space
-                                // ( and they definitely should be )
-                                CPT( GeometricBoundingVolume ) geom_gbv = geom->get_bounds()
-                                        ->as_geometric_bounding_volume();
-
-                                for ( size_t pvsidx = 1; pvsidx < numvisleafs; pvsidx++ )
-                                {
-                                        if ( !is_cluster_visible( leafnum, pvsidx ) )
-                                                continue;
-
-                                        BoundingBox *leaf_bounds = _leaf_bboxs[pvsidx];
-
-                                        if ( leaf_bounds->contains( geom_gbv ) != BoundingVolume::IF_no_intersection )
-                                        {
-                                                lgn->add_geom( gn->modify_geom( geomnum ), gn->get_geom_state( geomnum ) );
-                                                break;
-                                        }
-                                }
-                        }
-
-                        // aggressively combine all geoms visibible from this leaf
-                        leafnode.clear_model_nodes();
-                        leafnode.flatten_strong();
-
-                        // We've created a batched list of Geoms to render when we are in this leaf.
-                        _leaf_world_geoms[leafnum] = lgn->get_geoms();
+                        update_leaf( _curr_leaf_idx );
                 }
-
-                _leaf_aabb_lock.release();
         }
 
         for ( int entnum = 0; entnum < _bspdata->numentities; entnum++ )
@@ -1945,6 +1659,8 @@ void BSPLoader::build_cubemaps()
         bspfile_cat.info()
                 << "Building cubemaps...\n";
 
+        // We are about to rewrite the cubemap lump, it can't stay in the file image.
+        MaterializeLump( _bspdata, LUMP_CUBEMAPDATA );
         _bspdata->cubemapdata.clear();
 
         // make the camera that will render the 6 faces of each cubemap_tex
@@ -1956,6 +1672,10 @@ void BSPLoader::build_cubemaps()
         cam->set_scene( _result );
         NodePath camnp = _result.attach_new_node( cam );
 
+        // Cull against the PVS of each cubemap's own leaf, not the main camera's.
+        PT( VisibilityContext ) vis_context = new VisibilityContext( VisibilityContext::VM_own_leaf );
+        vis_context->attach( camnp );
+
 	FrameBufferProperties fbprops;
 	fbprops.set_rgb_color( true );
 	fbprops.set_depth_bits( 24 );
@@ -2081,6 +1801,7 @@ void BSPLoader::build_cubemaps()
 
 	buf->remove_display_region( dr );
 	_win->get_engine()->remove_window( buf );
+	VisibilityContext::detach( camnp );
 	camnp.remove_node();
 
 	hdr_auto_exposure = old_hdr_auto_exposure;
@@ -2096,7 +1817,9 @@ void BSPLoader::build_cubemaps()
 
 void BSPLoader::cleanup( bool is_transition )
 {
-	if ( !_active_level )
+	// A level that failed to load part way through isn't active, but may
+	// have anything from just the root node to everything but the entities.
+	if ( !_active_level && _bspdata == nullptr && _result.is_empty() )
 		return;
 
 	if ( !_ai )
@@ -2127,7 +1850,7 @@ void BSPLoader::cleanup( bool is_transition )
 
         _amb_probe_mgr.cleanup();
 
-        for ( size_t i = 0; i < _bspdata->nummodels; i++ )
+        for ( size_t i = 0; i < _model_data.size(); i++ )
         {
 		brush_model_data_t &data = _model_data[i];
                 if ( !data.model_root.is_empty() )
@@ -2138,13 +1861,18 @@ void BSPLoader::cleanup( bool is_transition )
         _materials.clear();
 
         _leaf_aabb_lock.acquire();
-	_leaf_pvs.clear();
-        _leaf_world_geoms.clear();
-        _visible_leafs.clear();
+	_pvs.clear();
+        _leaf_tree.clear();
+        _world_draw_lists.clear();
+        publish_visible_leafs( nullptr );
+        _visible_leafs_back = nullptr;
         _leaf_bboxs.clear();
-        _visible_leaf_bboxs.clear();
+        _curr_leaf_idx = -1;
         _leaf_aabb_lock.release();
 
+        // Other cameras may still be holding leafs of this level.
+        VisibilityContext::reset_all();
+
         _has_pvs_data = false;
 
 	cleanup_entities( is_transition );
@@ -2185,6 +1913,8 @@ BSPLoader::BSPLoader() :
 	_want_lightmaps( true ),
 	_curr_leaf_idx( -1 ),
 	_leaf_aabb_lock( "leafAABBMutex" ),
+	_visible_leafs_ptr( nullptr ),
+	_visible_leafs_readers( 0 ),
 	_gamma( DEFAULT_GAMMA ),
 	_amb_probe_mgr( this ),
 	_decal_mgr( this ),
@@ -2198,7 +1928,9 @@ BSPLoader::BSPLoader() :
 	_bspdata( nullptr ),
 	_colldata( nullptr ),
 	_trace( new BSPTrace( this ) ),
-	_physics_world( nullptr )
+	_physics_world( nullptr ),
+	_map_is_transition( false ),
+	_load_task( nullptr )
 {
 }
 
@@ -2306,28 +2038,40 @@ BSPLoader *BSPLoader::get_global_ptr()
  */
 bool BSPLoader::pvs_bounds_test( const GeometricBoundingVolume *bounds, unsigned int required_leaf_flags )
 {
-        LightMutexHolder holder( _leaf_aabb_lock );
+        CPT( BSPVisibleLeafs ) visible_leafs = get_visible_leafs();
+        return pvs_bounds_test( visible_leafs, bounds, required_leaf_flags );
+}
 
-        size_t num_aabbs = _visible_leaf_bboxs.size();
-        for ( size_t i = 0; i < num_aabbs; i++ )
+/**
+ * Same as above, but tests against the indicated snapshot of visible leafs
+ * instead of the ones visible from the current leaf.
+ */
+bool BSPLoader::pvs_bounds_test( const BSPVisibleLeafs *visible_leafs, const GeometricBoundingVolume *bounds,
+                                 unsigned int required_leaf_flags )
+{
+        if ( visible_leafs == nullptr )
         {
-		const visibleleafdata_t &data = _visible_leaf_bboxs[i];
+                return false;
+        }
 
-		if ( required_leaf_flags != 0 && ( data.flags & required_leaf_flags ) == 0 )
-		{
-			// Leaf doesn't have a flag set that is needed for the test to pass.
-			continue;
-		}
+        return visible_leafs->test_bounds( bounds, required_leaf_flags );
+}
 
-                if (data.bbox->contains( bounds ) != BoundingVolume::IF_no_intersection )
-                {
-                        // Bounds intersected one of the potentially visible leafs.
-                        return true;
-                }
+/**
+ * Runs pvs_bounds_test() on many bounding volumes at once, all against the
+ * same snapshot. results[i] receives the result for bounds[i].
+ */
+void BSPLoader::pvs_bounds_test_batch( const GeometricBoundingVolume * const *bounds, size_t count,
+                                       bool *results, unsigned int required_leaf_flags )
+{
+        CPT( BSPVisibleLeafs ) visible_leafs = get_visible_leafs();
+        if ( visible_leafs == nullptr )
+        {
+                memset( results, 0, count * sizeof( bool ) );
+                return;
         }
 
-        // No intersections.
-        return false;
+        visible_leafs->test_bounds_batch( bounds, count, results, required_leaf_flags );
 }
 
 CPT( GeometricBoundingVolume ) BSPLoader::make_net_bounds( const TransformState *net_transform,
@@ -26,6 +26,7 @@
 #include <renderAttrib.h>
 #include <boundingBox.h>
 #include <lightReMutex.h>
+#include <atomicAdjust.h>
 #include <graphicsWindow.h>
 #include <bulletWorld.h>
 #include <bulletRigidBodyNode.h>
@@ -36,6 +37,12 @@
 #include "decals.h"
 #include "raytrace.h"
 #include "bsp_trace.h"
+#include "bsp_pvs.h"
+#include "bsp_leaftree.h"
+#include "bsp_visleafs.h"
+#include "bsp_world_drawlists.h"
+#include "bsp_viscontext.h"
+#include "bsp_load_task.h"
 
 NotifyCategoryDeclNoExport(bspfile);
 
@@ -56,9 +63,6 @@ struct bspdata_t;
 struct dmodel_t;
 #endif
 
-class EggVertex;
-class EggVertexPool;
-class EggPolygon;
 class Geom;
 class GeomNode;
 class BSPLoader;
@@ -228,6 +232,11 @@ PUBLISHED:
 	}
 
         virtual bool read( const Filename &file, bool is_transition = false );
+        PT( BSPLoadTask ) read_async( const Filename &file, bool is_transition = false );
+        INLINE bool is_loading() const
+        {
+                return _load_task != nullptr;
+        }
 	void do_optimizations();
 
 	void set_gamma( PN_stdfloat gamma, int overbright = 1 );
@@ -292,6 +301,8 @@ PUBLISHED:
         bool is_cluster_visible( int curr_cluster, int cluster ) const;
 
         bool pvs_bounds_test( const GeometricBoundingVolume *bounds, unsigned int required_leaf_flags = 0u );
+        bool pvs_bounds_test( const BSPVisibleLeafs *visible_leafs, const GeometricBoundingVolume *bounds,
+                              unsigned int required_leaf_flags = 0u );
         CPT( GeometricBoundingVolume ) make_net_bounds( const TransformState *net_transform,
                                                         const GeometricBoundingVolume *original );
 
@@ -344,6 +355,27 @@ PUBLISHED:
 		PT_physx,
 	};
 
+        // The stages of loading a level, in order. The stages from
+        // LS_first_main_thread_stage on call into the application and always
+        // run on the main thread, so the entities are created after the
+        // static props, ambient probes and collision are all set up.
+        enum LoadStage
+        {
+                LS_read_file,
+                LS_visibility,
+                LS_geometry,
+                LS_static_props,
+                LS_ambient_probes,
+                LS_collision,
+                LS_entities,
+                LS_finish,
+
+                LS_COUNT,
+                LS_first_main_thread_stage = LS_entities,
+        };
+
+        static std::string get_load_stage_name( int stage );
+
 public:
 	INLINE brush_model_data_t &get_brush_model_data( int modelnum )
 	{
@@ -386,9 +418,22 @@ public:
 
 	void update_visibility( const LPoint3 &pos );
 
+	void find_leafs( const LPoint3 *pts, int *out, size_t count, int headnode = 0 );
+
+	void pvs_bounds_test_batch( const GeometricBoundingVolume * const *bounds, size_t count,
+				    bool *results, unsigned int required_leaf_flags = 0u );
+
+	CPT( BSPVisibleLeafs ) get_visible_leafs() const;
+	PT( BSPVisibleLeafs ) make_visible_leafs( int leaf );
+
 protected:
 	virtual void load_geometry() = 0;
 	virtual void cleanup_entities( bool is_transition );
+        virtual void finish_read( bool is_transition );
+
+        bool begin_read( const Filename &file, bool is_transition );
+        bool run_load_stage( int stage );
+        void end_read( BSPLoadTask *task );
 
 	static int extract_modelnum_s( entity_t *ent );
 	static void flatten_node( const NodePath &node );
@@ -396,7 +441,12 @@ protected:
 
 	void setup_raytrace_environment();
 
+	int do_find_leaf( const LPoint3 &pos, int headnode = 0 ) const;
+	bool do_is_cluster_visible( int curr_cluster, int cluster ) const;
+
 	void update_leaf( int leaf );
+	void fill_visible_leafs( BSPVisibleLeafs *visible_leafs, int leaf );
+	void publish_visible_leafs( BSPVisibleLeafs *visible_leafs );
         
         void make_faces();
 
@@ -419,11 +469,6 @@ protected:
 
         CPT( BSPMaterial ) try_load_texref( texref_t *tref );
 
-        PT( EggVertex ) make_vertex( EggVertexPool *vpool, EggPolygon *poly,
-                                     dedge_t *edge, texinfo_t *texinfo,
-                                     dface_t *face, int k, Texture *tex );
-        PT( EggVertex ) make_vertex_ai( EggVertexPool *vpool, EggPolygon *poly, dedge_t *edge, int k );
-
         cubemap_t *find_closest_cubemap( const LPoint3 &pos );
 
 	void init_dface_lightmap_info( dface_lightmap_info_t *info, int facenum );
@@ -456,19 +501,17 @@ protected:
 
 	PT( BSPTrace ) _trace;
 
-	struct visibleleafdata_t
-	{
-		BoundingBox *bbox;
-		int flags;
-	};
-	pvector<visibleleafdata_t> _visible_leaf_bboxs;
-        pvector<int> _visible_leafs;
 	int _curr_leaf_idx;
         Filename _map_file;
+        bool _map_is_transition;
+        // The read_async() in progress.
+        BSPLoadTask *_load_task;
 
 	std::unordered_map<const dface_t *, const dmodel_t *> _dface_dmodels;
         pmap<texref_t *, CPT( BSPMaterial )> _texref_materials;
-        vector<uint8_t *> _leaf_pvs;
+        BSPPVS _pvs;
+        BSPLeafTree _leaf_tree;
+        pvector<uint64_t> _pvs_row_scratch;
 	pvector<NodePath> _leaf_visnp;
 	pvector<PT( BoundingBox )> _leaf_bboxs;
 	pvector<brush_model_data_t> _model_data;
@@ -484,9 +527,8 @@ protected:
 	typedef pmap<PT( BulletRigidBodyNode ), TriangleIndex2BSPCollisionData_t> BSPCollisionData_t;
 	BSPCollisionData_t _brush_collision_data;
 
-        // A per-leaf list of world Geoms.
-        // This list of Geoms will be rendered for the current leaf.
-        pvector<GeomNode::Geoms> _leaf_world_geoms;
+        // The world Geoms to render from each leaf.
+        BSPWorldDrawLists _world_draw_lists;
 
 	friend class BSPFaceAttrib;
         friend class BSPGeomNode;
@@ -494,13 +536,23 @@ protected:
         friend class BSPCullTraverser;
         friend class BSPRender;
         friend class BSPCullableObject;
+        friend class BSPLoadTask;
+        friend class StaticPropLoader;
 
         static BSPLoader *_global_ptr;
 
-        // While BSPLoader updates the visible leaf AABBs on the App thread,
-        // BSPGeomNode needs to access them from the Cull thread.
-        // So we'll use a mutex.
+        // Serializes the threads that build and publish visible leaf snapshots.
+        // Readers never take it; see get_visible_leafs().
         LightMutex _leaf_aabb_lock;
+
+        // The published snapshot of the leafs visible from the current leaf.
+        // _visible_leafs_ptr is the copy that readers load, _visible_leafs_front
+        // holds its reference. _visible_leafs_back is the previously published
+        // snapshot, which is reused for the next one if nobody else holds it.
+        AtomicAdjust::Pointer _visible_leafs_ptr;
+        mutable AtomicAdjust::Integer _visible_leafs_readers;
+        PT( BSPVisibleLeafs ) _visible_leafs_front;
+        PT( BSPVisibleLeafs ) _visible_leafs_back;
 };
 
 extern EXPCL_PANDABSP LColor color_from_value( const std::string &value, bool scale = true, bool gamma = false );
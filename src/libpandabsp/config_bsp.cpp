@@ -17,6 +17,7 @@
 
 #include "bsploader.h"
 #include "bsp_render.h"
+#include "bsp_load_task.h"
 #include "shader_generator.h"
 #include "bsp_material.h"
 #include "shader_spec.h"
@@ -81,6 +82,7 @@ void init_libpandabsp()
         BSPRender::init_type();
         BSPCullTraverser::init_type();
         BSPRoot::init_type();
+        BSPLoadTask::init_type();
         BSPProp::init_type();
         BSPModel::init_type();
         BSPShaderGenerator::init_type();
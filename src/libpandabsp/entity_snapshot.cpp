@@ -0,0 +1,763 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file entity_snapshot.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "entity_snapshot.h"
+#include "interpolated.h"
+
+#include <configVariableInt.h>
+#include <pStatCollector.h>
+#include <pStatTimer.h>
+
+#include <algorithm>
+
+NotifyCategoryDef( entitySnapshot, "" );
+
+static ConfigVariableInt snapshot_history
+( "snapshot-history", 64, "Number of past snapshots that are kept as baselines to delta compress against. "
+  "A client that hasn't acknowledged a snapshot in this many ticks is sent a full snapshot." );
+
+static PStatCollector encode_collector( "App:Snapshot:Encode" );
+static PStatCollector decode_collector( "App:Snapshot:Decode" );
+
+enum
+{
+	SNAPSHOT_OP_NEW,
+	SNAPSHOT_OP_CHANGED,
+	SNAPSHOT_OP_REMOVED,
+};
+
+/**
+ * Packs values of any number of bits, least significant bit first.
+ */
+class SnapshotBitWriter
+{
+public:
+	SnapshotBitWriter() :
+		_acc( 0 ),
+		_num_bits( 0 )
+	{
+	}
+
+	INLINE void write( uint32_t value, int bits )
+	{
+		if ( bits < 32 )
+		{
+			value &= ( 1u << bits ) - 1;
+		}
+		_acc |= (uint64_t)value << _num_bits;
+		_num_bits += bits;
+		while ( _num_bits >= 8 )
+		{
+			_bytes.push_back( (unsigned char)( _acc & 0xff ) );
+			_acc >>= 8;
+			_num_bits -= 8;
+		}
+	}
+
+	// Small values in few bits: the number of bits, then the bits.
+	INLINE void write_varuint( uint32_t value )
+	{
+		int bits = 0;
+		while ( bits < 32 && ( value >> bits ) != 0 )
+		{
+			bits++;
+		}
+		write( bits, 6 );
+		if ( bits > 0 )
+		{
+			write( value, bits );
+		}
+	}
+
+	void finish( Datagram &dg )
+	{
+		if ( _num_bits > 0 )
+		{
+			_bytes.push_back( (unsigned char)( _acc & 0xff ) );
+			_acc = 0;
+			_num_bits = 0;
+		}
+		dg.add_uint32( (uint32_t)_bytes.size() );
+		dg.append_data( _bytes.data(), _bytes.size() );
+	}
+
+private:
+	pvector<unsigned char> _bytes;
+	uint64_t _acc;
+	int _num_bits;
+};
+
+class SnapshotBitReader
+{
+public:
+	SnapshotBitReader( const unsigned char *data, size_t size ) :
+		_data( data ),
+		_size( size ),
+		_pos( 0 ),
+		_acc( 0 ),
+		_num_bits( 0 ),
+		_overflow( false )
+	{
+	}
+
+	INLINE uint32_t read( int bits )
+	{
+		while ( _num_bits < bits )
+		{
+			if ( _pos >= _size )
+			{
+				_overflow = true;
+				return 0;
+			}
+			_acc |= (uint64_t)_data[_pos++] << _num_bits;
+			_num_bits += 8;
+		}
+		uint32_t value = (uint32_t)( bits < 32 ? ( _acc & ( ( 1ull << bits ) - 1 ) ) : ( _acc & 0xffffffffull ) );
+		_acc >>= bits;
+		_num_bits -= bits;
+		return value;
+	}
+
+	INLINE uint32_t read_varuint()
+	{
+		int bits = (int)read( 6 );
+		if ( bits == 0 || bits > 32 )
+		{
+			_overflow |= bits > 32;
+			return 0;
+		}
+		return read( bits );
+	}
+
+	INLINE bool is_overflow() const
+	{
+		return _overflow;
+	}
+
+private:
+	const unsigned char *_data;
+	size_t _size;
+	size_t _pos;
+	uint64_t _acc;
+	int _num_bits;
+	bool _overflow;
+};
+
+/**
+ * Writes a mask of the fields whose codes differ from the baseline, then the
+ * codes of those fields. A null baseline counts as all zeros.
+ */
+static void write_entity_fields( SnapshotBitWriter &writer, const EntitySnapshotLayout *layout,
+				 const uint32_t *codes, const uint32_t *base_codes )
+{
+	int num_fields = layout->get_num_fields();
+	for ( int i = 0; i < num_fields; i++ )
+	{
+		const EntitySnapshotLayout::field_t &field = layout->get_field( i );
+		bool changed = false;
+		for ( int c = 0; c < field.components && !changed; c++ )
+		{
+			uint32_t base = base_codes ? base_codes[field.offset + c] : 0u;
+			changed = codes[field.offset + c] != base;
+		}
+		writer.write( changed ? 1 : 0, 1 );
+		if ( changed )
+		{
+			for ( int c = 0; c < field.components; c++ )
+			{
+				writer.write( codes[field.offset + c], field.bits );
+			}
+		}
+	}
+}
+
+static void read_entity_fields( SnapshotBitReader &reader, const EntitySnapshotLayout *layout, uint32_t *codes )
+{
+	int num_fields = layout->get_num_fields();
+	for ( int i = 0; i < num_fields; i++ )
+	{
+		const EntitySnapshotLayout::field_t &field = layout->get_field( i );
+		if ( reader.read( 1 ) )
+		{
+			for ( int c = 0; c < field.components; c++ )
+			{
+				codes[field.offset + c] = reader.read( field.bits );
+			}
+		}
+	}
+}
+
+static bool codes_equal( const EntitySnapshotFrame::entity_t &a, const EntitySnapshotFrame::entity_t &b )
+{
+	return a.layout == b.layout && a.codes == b.codes;
+}
+
+EntitySnapshotLayout::EntitySnapshotLayout( int id ) :
+	_id( id ),
+	_num_values( 0 )
+{
+}
+
+int EntitySnapshotLayout::add_field( const std::string &name, int components, int bits,
+				     float min_value, float max_value )
+{
+	nassertr( bits > 0 && bits <= 32, -1 );
+	nassertr( bits == 32 || max_value > min_value, -1 );
+
+	field_t field;
+	field.name = name;
+	field.components = components;
+	field.offset = _num_values;
+	field.bits = bits;
+	field.min_value = min_value;
+	field.max_value = max_value;
+	_fields.push_back( field );
+
+	_num_values += components;
+
+	return (int)_fields.size() - 1;
+}
+
+/**
+ * Adds a float field. With fewer than 32 bits, the value is clamped to the
+ * indicated range and quantized to that many bits. Returns the field index.
+ */
+int EntitySnapshotLayout::add_float( const std::string &name, int bits, float min_value, float max_value )
+{
+	return add_field( name, 1, bits, min_value, max_value );
+}
+
+/**
+ * Adds a vector field. Each component is sent like a float field with the
+ * indicated bits and range. Returns the field index.
+ */
+int EntitySnapshotLayout::add_vec3( const std::string &name, int bits, float min_value, float max_value )
+{
+	return add_field( name, 3, bits, min_value, max_value );
+}
+
+int EntitySnapshotLayout::find_field( const std::string &name ) const
+{
+	for ( size_t i = 0; i < _fields.size(); i++ )
+	{
+		if ( _fields[i].name == name )
+		{
+			return (int)i;
+		}
+	}
+
+	return -1;
+}
+
+uint32_t EntitySnapshotLayout::quantize( int n, float value ) const
+{
+	const field_t &field = _fields[n];
+	if ( field.bits == 32 )
+	{
+		uint32_t code;
+		memcpy( &code, &value, sizeof( code ) );
+		return code;
+	}
+
+	// In double, since a float can't hold every code past 24 bits, and
+	// rounding up to 2^bits would wrap to 0 when written.
+	uint32_t max_code = ( 1u << field.bits ) - 1;
+	double frac = ( (double)value - field.min_value ) / ( (double)field.max_value - field.min_value );
+	frac = std::min( 1.0, std::max( 0.0, frac ) );
+	return (uint32_t)std::min( (double)max_code, frac * max_code + 0.5 );
+}
+
+float EntitySnapshotLayout::dequantize( int n, uint32_t code ) const
+{
+	const field_t &field = _fields[n];
+	if ( field.bits == 32 )
+	{
+		float value;
+		memcpy( &value, &code, sizeof( value ) );
+		return value;
+	}
+
+	uint32_t max_code = ( 1u << field.bits ) - 1;
+	return (float)( field.min_value + ( (double)field.max_value - field.min_value ) * ( (double)code / max_code ) );
+}
+
+EntitySnapshot::EntitySnapshot( EntitySnapshotLayout *layout ) :
+	_layout( layout ),
+	_group( nullptr )
+{
+	_values.resize( layout->get_num_values(), 0.0f );
+	_bindings.resize( layout->get_num_fields(), nullptr );
+}
+
+void EntitySnapshot::set_float( int field, float value )
+{
+	nassertv( field >= 0 && field < _layout->get_num_fields() );
+	_values[_layout->get_field( field ).offset] = value;
+}
+
+float EntitySnapshot::get_float( int field ) const
+{
+	nassertr( field >= 0 && field < _layout->get_num_fields(), 0.0f );
+	return _values[_layout->get_field( field ).offset];
+}
+
+void EntitySnapshot::set_vec3( int field, const LVector3f &value )
+{
+	nassertv( field >= 0 && field < _layout->get_num_fields() );
+	const EntitySnapshotLayout::field_t &f = _layout->get_field( field );
+	nassertv( f.components == 3 );
+	_values[f.offset] = value[0];
+	_values[f.offset + 1] = value[1];
+	_values[f.offset + 2] = value[2];
+}
+
+LVector3f EntitySnapshot::get_vec3( int field ) const
+{
+	nassertr( field >= 0 && field < _layout->get_num_fields(), LVector3f::zero() );
+	const EntitySnapshotLayout::field_t &f = _layout->get_field( field );
+	nassertr( f.components == 3, LVector3f::zero() );
+	return LVector3f( _values[f.offset], _values[f.offset + 1], _values[f.offset + 2] );
+}
+
+/**
+ * Binds the field to a variable, which capture() reads from and apply()
+ * writes to. The variable must outlive the binding.
+ */
+void EntitySnapshot::bind_float( int field, float *data )
+{
+	nassertv( field >= 0 && field < _layout->get_num_fields() );
+	nassertv( _layout->get_field( field ).components == 1 );
+	_bindings[field] = data;
+}
+
+void EntitySnapshot::bind_vec3( int field, LVector3f *data )
+{
+	nassertv( field >= 0 && field < _layout->get_num_fields() );
+	nassertv( _layout->get_field( field ).components == 3 );
+	_bindings[field] = data != nullptr ? &( *data )[0] : nullptr;
+}
+
+/**
+ * Reads the bound variables into the snapshot.
+ */
+void EntitySnapshot::capture()
+{
+	int num_fields = _layout->get_num_fields();
+	for ( int i = 0; i < num_fields; i++ )
+	{
+		if ( _bindings[i] != nullptr )
+		{
+			const EntitySnapshotLayout::field_t &field = _layout->get_field( i );
+			memcpy( &_values[field.offset], _bindings[i], sizeof( float ) * field.components );
+		}
+	}
+}
+
+/**
+ * Writes the snapshot to the bound variables, and latches the interpolated
+ * group, if there is one, so that its vars note the new values at changetime.
+ */
+void EntitySnapshot::apply( float changetime )
+{
+	int num_fields = _layout->get_num_fields();
+	for ( int i = 0; i < num_fields; i++ )
+	{
+		if ( _bindings[i] != nullptr )
+		{
+			const EntitySnapshotLayout::field_t &field = _layout->get_field( i );
+			memcpy( _bindings[i], &_values[field.offset], sizeof( float ) * field.components );
+		}
+	}
+
+	if ( _group != nullptr )
+	{
+		_group->on_latch_interpolated_vars( LATCH_SIMULATION_VAR, changetime );
+	}
+}
+
+EntitySnapshotFrame::EntitySnapshotFrame( int tick ) :
+	_tick( tick )
+{
+}
+
+SnapshotEncoder::SnapshotEncoder()
+{
+}
+
+/**
+ * Adds the entity to the snapshots, or replaces its state.
+ */
+void SnapshotEncoder::set_entity( int entity_id, EntitySnapshot *snapshot )
+{
+	nassertv( entity_id >= 0 && snapshot != nullptr );
+	_entities[entity_id] = snapshot;
+}
+
+void SnapshotEncoder::remove_entity( int entity_id )
+{
+	_entities.erase( entity_id );
+}
+
+/**
+ * Captures the state of every entity as the snapshot for this tick. Call
+ * once per tick, before writing the snapshots for the clients.
+ */
+void SnapshotEncoder::end_frame( int tick )
+{
+	PStatTimer timer( encode_collector );
+
+	nassertv( _frames.empty() || tick > _frames.back()->get_tick() );
+
+	PT( EntitySnapshotFrame ) frame = new EntitySnapshotFrame( tick );
+	for ( auto itr = _entities.begin(); itr != _entities.end(); ++itr )
+	{
+		EntitySnapshot *snapshot = itr->second;
+		snapshot->capture();
+
+		EntitySnapshotLayout *layout = snapshot->get_layout();
+		const float *values = snapshot->get_values();
+
+		EntitySnapshotFrame::entity_t &entity = frame->entities[itr->first];
+		entity.layout = layout;
+		entity.codes.resize( layout->get_num_values() );
+
+		int num_fields = layout->get_num_fields();
+		for ( int i = 0; i < num_fields; i++ )
+		{
+			const EntitySnapshotLayout::field_t &field = layout->get_field( i );
+			for ( int c = 0; c < field.components; c++ )
+			{
+				entity.codes[field.offset + c] = layout->quantize( i, values[field.offset + c] );
+			}
+		}
+	}
+
+	_frames.push_back( frame );
+	while ( (int)_frames.size() > std::max( 1, snapshot_history.get_value() ) )
+	{
+		_frames.pop_front();
+	}
+}
+
+EntitySnapshotFrame *SnapshotEncoder::find_frame( int tick ) const
+{
+	for ( auto itr = _frames.rbegin(); itr != _frames.rend(); ++itr )
+	{
+		if ( ( *itr )->get_tick() == tick )
+		{
+			return *itr;
+		}
+	}
+
+	return nullptr;
+}
+
+/**
+ * Appends the latest snapshot for the client to the datagram, compressed
+ * against the last snapshot that the client acknowledged.
+ */
+void SnapshotEncoder::write_snapshot( int client_id, Datagram &dg )
+{
+	nassertv( !_frames.empty() );
+
+	PStatTimer timer( encode_collector );
+
+	const EntitySnapshotFrame *frame = _frames.back();
+	const EntitySnapshotFrame *base = nullptr;
+	auto aitr = _client_acks.find( client_id );
+	if ( aitr != _client_acks.end() )
+	{
+		base = find_frame( aitr->second );
+	}
+
+	dg.add_int32( frame->get_tick() );
+	dg.add_int32( base != nullptr ? base->get_tick() : -1 );
+
+	SnapshotBitWriter writer;
+	int last_id = -1;
+
+	auto write_header = [&]( int entity_id, int op )
+	{
+		writer.write( 1, 1 );
+		writer.write_varuint( (uint32_t)( entity_id - last_id - 1 ) );
+		writer.write( op, 2 );
+		last_id = entity_id;
+	};
+
+	// Walk the two frames together, both are sorted by entity id.
+	auto itr = frame->entities.begin();
+	auto bitr = base != nullptr ? base->entities.begin() : frame->entities.end();
+	auto bend = base != nullptr ? base->entities.end() : frame->entities.end();
+	while ( itr != frame->entities.end() || bitr != bend )
+	{
+		if ( bitr == bend || ( itr != frame->entities.end() && itr->first < bitr->first ) )
+		{
+			write_header( itr->first, SNAPSHOT_OP_NEW );
+			writer.write_varuint( (uint32_t)itr->second.layout->get_id() );
+			write_entity_fields( writer, itr->second.layout, itr->second.codes.data(), nullptr );
+			++itr;
+		}
+		else if ( itr == frame->entities.end() || bitr->first < itr->first )
+		{
+			write_header( bitr->first, SNAPSHOT_OP_REMOVED );
+			++bitr;
+		}
+		else
+		{
+			if ( itr->second.layout != bitr->second.layout )
+			{
+				// Same id, different kind of entity. Send it as new.
+				write_header( itr->first, SNAPSHOT_OP_NEW );
+				writer.write_varuint( (uint32_t)itr->second.layout->get_id() );
+				write_entity_fields( writer, itr->second.layout, itr->second.codes.data(), nullptr );
+			}
+			else if ( !codes_equal( itr->second, bitr->second ) )
+			{
+				write_header( itr->first, SNAPSHOT_OP_CHANGED );
+				write_entity_fields( writer, itr->second.layout, itr->second.codes.data(),
+						     bitr->second.codes.data() );
+			}
+			++itr;
+			++bitr;
+		}
+	}
+
+	writer.write( 0, 1 );
+	writer.finish( dg );
+}
+
+/**
+ * Records that the client received the snapshot of the indicated tick, so
+ * that later snapshots are compressed against it.
+ */
+void SnapshotEncoder::ack_snapshot( int client_id, int tick )
+{
+	auto itr = _client_acks.find( client_id );
+	if ( itr == _client_acks.end() )
+	{
+		_client_acks[client_id] = tick;
+	}
+	else if ( tick > itr->second )
+	{
+		itr->second = tick;
+	}
+}
+
+void SnapshotEncoder::remove_client( int client_id )
+{
+	_client_acks.erase( client_id );
+}
+
+SnapshotDecoder::SnapshotDecoder() :
+	_last_tick( -1 )
+{
+}
+
+void SnapshotDecoder::add_layout( EntitySnapshotLayout *layout )
+{
+	_layouts[layout->get_id()] = layout;
+}
+
+/**
+ * Supplies the snapshot to read the entity into, so its fields can be bound
+ * before the entity shows up in a snapshot.
+ */
+void SnapshotDecoder::set_entity( int entity_id, EntitySnapshot *snapshot )
+{
+	_entities[entity_id] = snapshot;
+}
+
+EntitySnapshot *SnapshotDecoder::get_entity( int entity_id ) const
+{
+	auto itr = _entities.find( entity_id );
+	if ( itr == _entities.end() )
+	{
+		return nullptr;
+	}
+
+	return itr->second;
+}
+
+EntitySnapshotFrame *SnapshotDecoder::find_frame( int tick ) const
+{
+	for ( auto itr = _frames.rbegin(); itr != _frames.rend(); ++itr )
+	{
+		if ( ( *itr )->get_tick() == tick )
+		{
+			return *itr;
+		}
+	}
+
+	return nullptr;
+}
+
+/**
+ * Reads a snapshot written by SnapshotEncoder::write_snapshot(), and applies
+ * it to every entity in it at changetime. Returns false if the snapshot
+ * couldn't be read: it is older than the last one, it is compressed against
+ * a snapshot we no longer have, or it is corrupt.
+ */
+bool SnapshotDecoder::read_snapshot( DatagramIterator &dgi, float changetime )
+{
+	PStatTimer timer( decode_collector );
+
+	_new_entities.clear();
+	_removed_entities.clear();
+
+	int tick = dgi.get_int32();
+	int base_tick = dgi.get_int32();
+	size_t size = dgi.get_uint32();
+	if ( dgi.get_remaining_size() < size )
+	{
+		entitySnapshot_cat.error()
+			<< "Snapshot " << tick << " is truncated\n";
+		return false;
+	}
+
+	const unsigned char *data = (const unsigned char *)dgi.get_datagram().get_data() + dgi.get_current_index();
+	dgi.skip_bytes( size );
+
+	if ( tick <= _last_tick )
+	{
+		// Arrived out of order.
+		return false;
+	}
+
+	const EntitySnapshotFrame *base = nullptr;
+	if ( base_tick >= 0 )
+	{
+		base = find_frame( base_tick );
+		if ( base == nullptr )
+		{
+			entitySnapshot_cat.warning()
+				<< "Snapshot " << tick << " is against snapshot " << base_tick << ", which we don't have\n";
+			return false;
+		}
+	}
+
+	PT( EntitySnapshotFrame ) frame = new EntitySnapshotFrame( tick );
+	if ( base != nullptr )
+	{
+		frame->entities = base->entities;
+	}
+
+	SnapshotBitReader reader( data, size );
+	int last_id = -1;
+	while ( reader.read( 1 ) && !reader.is_overflow() )
+	{
+		int entity_id = last_id + 1 + (int)reader.read_varuint();
+		int op = (int)reader.read( 2 );
+		last_id = entity_id;
+
+		if ( op == SNAPSHOT_OP_NEW )
+		{
+			int layout_id = (int)reader.read_varuint();
+			auto litr = _layouts.find( layout_id );
+			if ( litr == _layouts.end() )
+			{
+				entitySnapshot_cat.error()
+					<< "Snapshot has entity " << entity_id << " with unknown layout " << layout_id << "\n";
+				return false;
+			}
+
+			EntitySnapshotFrame::entity_t &entity = frame->entities[entity_id];
+			entity.layout = litr->second;
+			entity.codes.assign( litr->second->get_num_values(), 0u );
+			read_entity_fields( reader, entity.layout, entity.codes.data() );
+		}
+		else if ( op == SNAPSHOT_OP_CHANGED )
+		{
+			auto eitr = frame->entities.find( entity_id );
+			if ( eitr == frame->entities.end() )
+			{
+				return false;
+			}
+			read_entity_fields( reader, eitr->second.layout, eitr->second.codes.data() );
+		}
+		else if ( op == SNAPSHOT_OP_REMOVED )
+		{
+			frame->entities.erase( entity_id );
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	if ( reader.is_overflow() )
+	{
+		entitySnapshot_cat.error()
+			<< "Snapshot " << tick << " is corrupt\n";
+		return false;
+	}
+
+	// Compare against the last snapshot we applied to find the entities that
+	// came and went. That isn't always the baseline.
+	const EntitySnapshotFrame *prev = !_frames.empty() ? _frames.back().p() : nullptr;
+	if ( prev != nullptr )
+	{
+		for ( auto itr = prev->entities.begin(); itr != prev->entities.end(); ++itr )
+		{
+			if ( frame->entities.find( itr->first ) == frame->entities.end() )
+			{
+				_removed_entities.push_back( itr->first );
+				_entities.erase( itr->first );
+			}
+		}
+	}
+
+	_frames.push_back( frame );
+	while ( (int)_frames.size() > std::max( 1, snapshot_history.get_value() ) )
+	{
+		_frames.pop_front();
+	}
+	_last_tick = tick;
+
+	// Now apply every entity, unchanged ones included, so each interpolated
+	// var gets a sample at this tick.
+	for ( auto itr = frame->entities.begin(); itr != frame->entities.end(); ++itr )
+	{
+		const EntitySnapshotFrame::entity_t &entity = itr->second;
+
+		bool is_new = prev == nullptr || prev->entities.find( itr->first ) == prev->entities.end();
+
+		PT( EntitySnapshot ) &snapshot = _entities[itr->first];
+		if ( snapshot == nullptr || snapshot->get_layout() != entity.layout.p() )
+		{
+			// The id was reused by an entity of another layout. The old
+			// snapshot's bindings don't fit, so the caller has to bind the
+			// new one as if the entity had just come in.
+			snapshot = new EntitySnapshot( entity.layout );
+			is_new = true;
+		}
+
+		if ( is_new )
+		{
+			_new_entities.push_back( itr->first );
+		}
+
+		const EntitySnapshotLayout *layout = entity.layout;
+		float *values = snapshot->get_values();
+		int num_fields = layout->get_num_fields();
+		for ( int i = 0; i < num_fields; i++ )
+		{
+			const EntitySnapshotLayout::field_t &field = layout->get_field( i );
+			for ( int c = 0; c < field.components; c++ )
+			{
+				values[field.offset + c] = layout->dequantize( i, entity.codes[field.offset + c] );
+			}
+		}
+
+		snapshot->apply( changetime );
+	}
+
+	return true;
+}
@@ -0,0 +1,308 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file entity_snapshot.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef ENTITY_SNAPSHOT_H
+#define ENTITY_SNAPSHOT_H
+
+#include "config_bsp.h"
+
+#include <referenceCount.h>
+#include <pointerTo.h>
+#include <datagram.h>
+#include <datagramIterator.h>
+#include <aa_luse.h>
+#include <pvector.h>
+#include <pmap.h>
+#include <pdeque.h>
+#include <vector_int.h>
+
+NotifyCategoryDeclNoExport(entitySnapshot);
+
+class CInterpolatedGroup;
+
+/**
+ * Describes the networked fields of a kind of entity, and how many bits each
+ * one is sent with. A field with fewer than 32 bits is quantized to that many
+ * bits over its range; a 32 bit field is sent as is.
+ *
+ * The server and the client must make the same layouts, with the same ids.
+ */
+class EXPCL_PANDABSP EntitySnapshotLayout : public ReferenceCount
+{
+PUBLISHED:
+	EntitySnapshotLayout( int id );
+
+	int add_float( const std::string &name, int bits = 32, float min_value = 0.0f, float max_value = 0.0f );
+	int add_vec3( const std::string &name, int bits = 32, float min_value = 0.0f, float max_value = 0.0f );
+
+	INLINE int get_id() const;
+	INLINE int get_num_fields() const;
+	INLINE const std::string &get_field_name( int n ) const;
+	int find_field( const std::string &name ) const;
+
+public:
+	struct field_t
+	{
+		std::string name;
+		int components;
+		// Index of the first component in the snapshot values.
+		int offset;
+		int bits;
+		float min_value;
+		float max_value;
+	};
+
+	INLINE const field_t &get_field( int n ) const;
+	INLINE int get_num_values() const;
+
+	uint32_t quantize( int field, float value ) const;
+	float dequantize( int field, uint32_t code ) const;
+
+private:
+	int add_field( const std::string &name, int components, int bits, float min_value, float max_value );
+
+private:
+	int _id;
+	pvector<field_t> _fields;
+	int _num_values;
+};
+
+INLINE int EntitySnapshotLayout::get_id() const
+{
+	return _id;
+}
+
+INLINE int EntitySnapshotLayout::get_num_fields() const
+{
+	return (int)_fields.size();
+}
+
+INLINE const std::string &EntitySnapshotLayout::get_field_name( int n ) const
+{
+	return _fields[n].name;
+}
+
+INLINE const EntitySnapshotLayout::field_t &EntitySnapshotLayout::get_field( int n ) const
+{
+	return _fields[n];
+}
+
+/**
+ * Returns the number of floats that a snapshot of this layout holds.
+ */
+INLINE int EntitySnapshotLayout::get_num_values() const
+{
+	return _num_values;
+}
+
+/**
+ * The networked field values of one entity.
+ *
+ * Each field can be bound to the variable that it is networking. On the
+ * server, capture() reads the bound variables. On the client, apply() writes
+ * them and latches the entity's CInterpolatedGroup, which notes the change on
+ * each of its interpolated vars.
+ */
+class EXPCL_PANDABSP EntitySnapshot : public ReferenceCount
+{
+PUBLISHED:
+	EntitySnapshot( EntitySnapshotLayout *layout );
+
+	INLINE EntitySnapshotLayout *get_layout() const;
+
+	void set_float( int field, float value );
+	float get_float( int field ) const;
+	void set_vec3( int field, const LVector3f &value );
+	LVector3f get_vec3( int field ) const;
+
+	void bind_float( int field, float *data );
+	void bind_vec3( int field, LVector3f *data );
+	INLINE void set_interpolated_group( CInterpolatedGroup *group );
+	INLINE CInterpolatedGroup *get_interpolated_group() const;
+
+	void capture();
+	void apply( float changetime );
+
+public:
+	INLINE float *get_values();
+	INLINE const float *get_values() const;
+
+private:
+	PT( EntitySnapshotLayout ) _layout;
+	pvector<float> _values;
+	// One per field, nullptr if the field isn't bound.
+	pvector<float *> _bindings;
+	CInterpolatedGroup *_group;
+};
+
+INLINE EntitySnapshotLayout *EntitySnapshot::get_layout() const
+{
+	return _layout;
+}
+
+INLINE void EntitySnapshot::set_interpolated_group( CInterpolatedGroup *group )
+{
+	_group = group;
+}
+
+INLINE CInterpolatedGroup *EntitySnapshot::get_interpolated_group() const
+{
+	return _group;
+}
+
+INLINE float *EntitySnapshot::get_values()
+{
+	return _values.data();
+}
+
+INLINE const float *EntitySnapshot::get_values() const
+{
+	return _values.data();
+}
+
+/**
+ * The quantized fields of every entity at one tick. Shared by the encoder and
+ * the decoder to keep their baselines.
+ */
+class EXPCL_PANDABSP EntitySnapshotFrame : public ReferenceCount
+{
+public:
+	struct entity_t
+	{
+		PT( EntitySnapshotLayout ) layout;
+		pvector<uint32_t> codes;
+	};
+
+	EntitySnapshotFrame( int tick );
+
+	INLINE int get_tick() const;
+
+	// Sorted by entity id.
+	pmap<int, entity_t> entities;
+
+private:
+	int _tick;
+};
+
+INLINE int EntitySnapshotFrame::get_tick() const
+{
+	return _tick;
+}
+
+/**
+ * Writes snapshots of the entities for each client, compressed against the
+ * last snapshot that the client acknowledged.
+ *
+ * Each tick, set the state of every networked entity, then call end_frame().
+ * write_snapshot() then writes the entities that were added, removed or
+ * changed since the client's baseline, with a mask of the fields that
+ * changed, bit-packed into a datagram that can be sent with NetworkSystem.
+ * A client with no baseline, or one that fell further behind than the
+ * history, gets every entity.
+ */
+class EXPCL_PANDABSP SnapshotEncoder : public ReferenceCount
+{
+PUBLISHED:
+	SnapshotEncoder();
+
+	void set_entity( int entity_id, EntitySnapshot *snapshot );
+	void remove_entity( int entity_id );
+
+	void end_frame( int tick );
+
+	void write_snapshot( int client_id, Datagram &dg );
+	void ack_snapshot( int client_id, int tick );
+	void remove_client( int client_id );
+
+	INLINE int get_num_entities() const;
+
+private:
+	EntitySnapshotFrame *find_frame( int tick ) const;
+
+private:
+	pmap<int, PT( EntitySnapshot )> _entities;
+	// Oldest first.
+	pdeque<PT( EntitySnapshotFrame )> _frames;
+	// Last acknowledged tick of each client.
+	pmap<int, int> _client_acks;
+};
+
+INLINE int SnapshotEncoder::get_num_entities() const
+{
+	return (int)_entities.size();
+}
+
+/**
+ * Reads the snapshots written by a SnapshotEncoder, and applies them to the
+ * entities. After each snapshot that is read, get_last_tick() should be sent
+ * back to the server, for SnapshotEncoder::ack_snapshot().
+ */
+class EXPCL_PANDABSP SnapshotDecoder : public ReferenceCount
+{
+PUBLISHED:
+	SnapshotDecoder();
+
+	void add_layout( EntitySnapshotLayout *layout );
+
+	void set_entity( int entity_id, EntitySnapshot *snapshot );
+	EntitySnapshot *get_entity( int entity_id ) const;
+
+	bool read_snapshot( DatagramIterator &dgi, float changetime );
+
+	INLINE int get_last_tick() const;
+
+	INLINE int get_num_new_entities() const;
+	INLINE int get_new_entity( int n ) const;
+	MAKE_SEQ( get_new_entities, get_num_new_entities, get_new_entity );
+	INLINE int get_num_removed_entities() const;
+	INLINE int get_removed_entity( int n ) const;
+	MAKE_SEQ( get_removed_entities, get_num_removed_entities, get_removed_entity );
+
+private:
+	EntitySnapshotFrame *find_frame( int tick ) const;
+
+private:
+	pmap<int, PT( EntitySnapshotLayout )> _layouts;
+	pmap<int, PT( EntitySnapshot )> _entities;
+	// Oldest first.
+	pdeque<PT( EntitySnapshotFrame )> _frames;
+	int _last_tick;
+
+	vector_int _new_entities;
+	vector_int _removed_entities;
+};
+
+INLINE int SnapshotDecoder::get_last_tick() const
+{
+	return _last_tick;
+}
+
+INLINE int SnapshotDecoder::get_num_new_entities() const
+{
+	return (int)_new_entities.size();
+}
+
+INLINE int SnapshotDecoder::get_new_entity( int n ) const
+{
+	return _new_entities[n];
+}
+
+INLINE int SnapshotDecoder::get_num_removed_entities() const
+{
+	return (int)_removed_entities.size();
+}
+
+INLINE int SnapshotDecoder::get_removed_entity( int n ) const
+{
+	return _removed_entities[n];
+}
+
+#endif // ENTITY_SNAPSHOT_H
@@ -12,9 +12,98 @@
 #include "interpolated.h"
 
 #include "configVariableDouble.h"
+#include "configVariableInt.h"
+#include "asyncTaskManager.h"
+#include "lightMutexHolder.h"
+#include "mutexHolder.h"
+#include "pStatCollector.h"
+#include "pStatTimer.h"
+#include "thread.h"
+
+#include <algorithm>
 
 static ConfigVariableDouble interp_amount( "smooth-lag", 0.1 );
 
+static ConfigVariableInt interpolate_threads
+( "interpolate-threads", 2, "Number of worker threads that CInterpolationSystem splits the groups "
+  "between, besides the calling thread. 0 interpolates everything on the calling thread." );
+static ConfigVariableInt interpolate_groups_per_claim
+( "interpolate-groups-per-claim", 32, "Number of groups that a thread takes to interpolate at a time. "
+  "Groups are only split between threads when there are more than this." );
+
+static PStatCollector interpolate_all_collector( "Interpolate" );
+static PStatCollector interpolate_gather_collector( "Interpolate:Gather" );
+static PStatCollector interpolate_sweep_collector( "Interpolate:Sweep" );
+
+CInterpolatedGroup::CInterpolatedGroup() :
+	_enabled( true ),
+	_needs_interpolation( true ),
+	_clock( ClockObject::get_global_clock() ),
+	_system_index( -1 )
+{
+	CInterpolationSystem::get_global_ptr()->add_group( this );
+}
+
+CInterpolatedGroup::CInterpolatedGroup( const CInterpolatedGroup &copy ) :
+	_enabled( copy._enabled ),
+	_needs_interpolation( copy._needs_interpolation ),
+	_var_map( copy._var_map ),
+	_clock( copy._clock ),
+	_system_index( -1 )
+{
+	setup_batch();
+	CInterpolationSystem::get_global_ptr()->add_group( this );
+}
+
+CInterpolatedGroup::~CInterpolatedGroup()
+{
+	CInterpolationSystem::get_global_ptr()->remove_group( this );
+}
+
+CInterpolatedGroup &CInterpolatedGroup::operator = ( const CInterpolatedGroup &copy )
+{
+	// We keep our own place in the system.
+	_needs_interpolation = copy._needs_interpolation;
+	_enabled = copy._enabled;
+	_var_map = copy._var_map;
+	_clock = copy._clock;
+	setup_batch();
+	return *this;
+}
+
+template <typename Type>
+static unsigned short get_var_kind( Type *data, IInterpolatedVar *watcher )
+{
+	return VarMapEntry_t::KIND_OTHER;
+}
+
+// Array vars go through Interpolate(), so check that the watcher is a single
+// value of the type.
+
+static unsigned short get_var_kind( float *data, IInterpolatedVar *watcher )
+{
+	return dynamic_cast<CInterpolatedVarArrayBase<float, false> *>( watcher ) ?
+		VarMapEntry_t::KIND_FLOAT : VarMapEntry_t::KIND_OTHER;
+}
+
+static unsigned short get_var_kind( LVector2f *data, IInterpolatedVar *watcher )
+{
+	return dynamic_cast<CInterpolatedVarArrayBase<LVector2f, false> *>( watcher ) ?
+		VarMapEntry_t::KIND_VEC2 : VarMapEntry_t::KIND_OTHER;
+}
+
+static unsigned short get_var_kind( LVector3f *data, IInterpolatedVar *watcher )
+{
+	return dynamic_cast<CInterpolatedVarArrayBase<LVector3f, false> *>( watcher ) ?
+		VarMapEntry_t::KIND_VEC3 : VarMapEntry_t::KIND_OTHER;
+}
+
+static unsigned short get_var_kind( LVector4f *data, IInterpolatedVar *watcher )
+{
+	return dynamic_cast<CInterpolatedVarArrayBase<LVector4f, false> *>( watcher ) ?
+		VarMapEntry_t::KIND_VEC4 : VarMapEntry_t::KIND_OTHER;
+}
+
 template <typename Type>
 void CInterpolatedGroup::add_var( Type *data, IInterpolatedVar *watcher, int type )
 {
@@ -49,7 +138,9 @@ void CInterpolatedGroup::add_var( Type *data, IInterpolatedVar *watcher, int typ
 		map.data = (void *)data;
 		map.watcher = watcher;
 		map.type = type;
+		map.kind = get_var_kind( data, watcher );
 		map.m_bNeedsToInterpolate = true;
+		map.lane = -1;
 		if ( type & EXCLUDE_AUTO_INTERPOLATE )
 		{
 			_var_map.m_Entries.push_back( map );
@@ -59,6 +150,8 @@ void CInterpolatedGroup::add_var( Type *data, IInterpolatedVar *watcher, int typ
 			_var_map.m_Entries.insert( _var_map.m_Entries.begin(), map );
 			++_var_map.m_nInterpolatedEntries;
 		}
+
+		setup_batch();
 	}
 
 	watcher->_Setup( (void *)data, type );
@@ -76,11 +169,55 @@ void CInterpolatedGroup::remove_var( Type *data, bool assert )
 				--_var_map.m_nInterpolatedEntries;
 
 			_var_map.m_Entries.erase( _var_map.m_Entries.begin() + i );
+			setup_batch();
 			return;
 		}
 	}
 }
 
+static int get_kind_components( unsigned short kind )
+{
+	switch ( kind )
+	{
+	case VarMapEntry_t::KIND_FLOAT:
+		return 1;
+	case VarMapEntry_t::KIND_VEC2:
+		return 2;
+	case VarMapEntry_t::KIND_VEC3:
+		return 3;
+	case VarMapEntry_t::KIND_VEC4:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Lays the batch out again for the vars we have now. Each var that can be
+ * batched gets a run of lanes, one for each of its components, that it keeps
+ * until the vars change again.
+ */
+void CInterpolatedGroup::setup_batch()
+{
+	_batch.clear();
+
+	for ( size_t i = 0; i < _var_map.m_Entries.size(); i++ )
+	{
+		VarMapEntry_t *e = &_var_map.m_Entries[i];
+		e->segment.invalidate();
+
+		int components = get_kind_components( e->kind );
+		if ( components > 0 && (int)i < _var_map.m_nInterpolatedEntries )
+		{
+			e->lane = _batch.add_lanes( (float *)e->data, components );
+		}
+		else
+		{
+			e->lane = -1;
+		}
+	}
+}
+
 void CInterpolatedGroup::on_latch_interpolated_vars( int flags, float changetime )
 {
 	bool update_last = ( flags & INTERPOLATE_OMIT_UPDATE_LAST_NETWORKED ) == 0;
@@ -143,3 +280,209 @@ bool CInterpolatedGroup::interp_interpolate( VarMapping_t *map, float curr_time
 
 	return done;
 }
+
+/**
+ * Sets the var in its lanes of the batch if it has any. Returns false if it
+ * has to be interpolated by itself.
+ */
+static bool batch_var( VarMapEntry_t *e, CInterpolationBatch &batch, float curr_time, int &no_more_changes )
+{
+	if ( e->lane < 0 )
+	{
+		return false;
+	}
+
+	switch ( e->kind )
+	{
+	case VarMapEntry_t::KIND_FLOAT:
+		return ( (CInterpolatedVarArrayBase<float, false> *)e->watcher )->AddToBatch( batch, e->lane, e->segment, curr_time, no_more_changes );
+	case VarMapEntry_t::KIND_VEC2:
+		return ( (CInterpolatedVarArrayBase<LVector2f, false> *)e->watcher )->AddToBatch( batch, e->lane, e->segment, curr_time, no_more_changes );
+	case VarMapEntry_t::KIND_VEC3:
+		return ( (CInterpolatedVarArrayBase<LVector3f, false> *)e->watcher )->AddToBatch( batch, e->lane, e->segment, curr_time, no_more_changes );
+	case VarMapEntry_t::KIND_VEC4:
+		return ( (CInterpolatedVarArrayBase<LVector4f, false> *)e->watcher )->AddToBatch( batch, e->lane, e->segment, curr_time, no_more_changes );
+	default:
+		return false;
+	}
+}
+
+bool CInterpolatedGroup::interp_batch( VarMapping_t *map, float curr_time )
+{
+	bool done = true;
+	if ( curr_time < map->m_lastInterpolationTime )
+	{
+		for ( int i = 0; i < map->m_nInterpolatedEntries; i++ )
+		{
+			VarMapEntry_t *e = &map->m_Entries[i];
+			e->m_bNeedsToInterpolate = true;
+		}
+	}
+	map->m_lastInterpolationTime = curr_time;
+
+	for ( int i = 0; i < map->m_nInterpolatedEntries; i++ )
+	{
+		VarMapEntry_t *e = &map->m_Entries[i];
+
+		if ( !e->m_bNeedsToInterpolate )
+			continue;
+
+		int no_more_changes;
+		if ( !batch_var( e, _batch, curr_time, no_more_changes ) )
+			no_more_changes = e->watcher->Interpolate( curr_time );
+
+		if ( no_more_changes )
+			e->m_bNeedsToInterpolate = false;
+		else
+			done = false;
+	}
+
+	return done;
+}
+
+CInterpolationSystem *CInterpolationSystem::_global_ptr = nullptr;
+
+CInterpolationSystem::CInterpolationSystem() :
+	_lock( "CInterpolationSystem" ),
+	_run_lock( "CInterpolationSystem::run" ),
+	_now( 0.0f ),
+	_allow_extrapolation( false ),
+	_last_timestamp( 0.0f ),
+	_groups_per_claim( 1 ),
+	_next_group( 0 )
+{
+}
+
+CInterpolationSystem *CInterpolationSystem::get_global_ptr()
+{
+	if ( !_global_ptr )
+	{
+		_global_ptr = new CInterpolationSystem;
+	}
+
+	return _global_ptr;
+}
+
+void CInterpolationSystem::add_group( CInterpolatedGroup *group )
+{
+	LightMutexHolder holder( _lock );
+
+	nassertv( group->_system_index == -1 );
+	group->_system_index = (int)_groups.size();
+	_groups.push_back( group );
+}
+
+void CInterpolationSystem::remove_group( CInterpolatedGroup *group )
+{
+	LightMutexHolder holder( _lock );
+
+	int index = group->_system_index;
+	nassertv( index >= 0 && index < (int)_groups.size() && _groups[index] == group );
+
+	// Move the last group into its place.
+	CInterpolatedGroup *last = _groups.back();
+	_groups[index] = last;
+	last->_system_index = index;
+	_groups.pop_back();
+
+	group->_system_index = -1;
+}
+
+/**
+ * Takes groups off of the list and interpolates them until there are none
+ * left.
+ */
+AsyncTask::DoneStatus CInterpolationSystem::interpolate_task( GenericAsyncTask *task, void *data )
+{
+	CInterpolationSystem *self = (CInterpolationSystem *)data;
+
+	// The context is per thread, so copy over what the calling thread had.
+	CInterpolationContext context;
+	CInterpolationContext::EnableExtrapolation( self->_allow_extrapolation );
+	CInterpolationContext::SetLastTimeStamp( self->_last_timestamp );
+
+	AtomicAdjust::Integer count = (AtomicAdjust::Integer)self->_run_groups.size();
+	while ( true )
+	{
+		AtomicAdjust::Integer end = AtomicAdjust::add( self->_next_group, self->_groups_per_claim );
+		AtomicAdjust::Integer start = end - self->_groups_per_claim;
+		if ( start >= count )
+		{
+			break;
+		}
+		end = std::min( end, count );
+
+		{
+			PStatTimer timer( interpolate_gather_collector );
+			for ( AtomicAdjust::Integer i = start; i < end; i++ )
+			{
+				self->_run_groups[i]->batch_interpolate( self->_now );
+			}
+		}
+
+		{
+			PStatTimer timer( interpolate_sweep_collector );
+			for ( AtomicAdjust::Integer i = start; i < end; i++ )
+			{
+				self->_run_groups[i]->run_batch();
+			}
+		}
+	}
+
+	return AsyncTask::DS_done;
+}
+
+/**
+ * Interpolates every group to the given time. Call this once a frame instead
+ * of calling interpolate() on each group.
+ */
+void CInterpolationSystem::interpolate_all( float now )
+{
+	PStatTimer timer( interpolate_all_collector );
+
+	MutexHolder run_holder( _run_lock );
+
+	// Work from a copy of the list, so that groups can still be added and
+	// removed while the threads are going.
+	{
+		LightMutexHolder holder( _lock );
+		_run_groups = _groups;
+	}
+
+	_now = now;
+	_allow_extrapolation = CInterpolationContext::IsExtrapolationAllowed();
+	_last_timestamp = CInterpolationContext::GetLastTimeStamp();
+	_groups_per_claim = std::max( 1, interpolate_groups_per_claim.get_value() );
+	AtomicAdjust::set( _next_group, 0 );
+
+	int num_threads = interpolate_threads.get_value();
+	if ( num_threads <= 0 || (int)_run_groups.size() <= _groups_per_claim || !Thread::is_threading_supported() )
+	{
+		num_threads = 0;
+	}
+
+	if ( num_threads == 0 )
+	{
+		interpolate_task( nullptr, this );
+		return;
+	}
+
+	AsyncTaskManager *mgr = AsyncTaskManager::get_global_ptr();
+	AsyncTaskChain *chain = mgr->make_task_chain( "bsp-interpolate" );
+	if ( chain->get_num_threads() != num_threads )
+	{
+		// Picks up interpolate-threads changing after the chain was made.
+		chain->set_num_threads( num_threads );
+	}
+
+	for ( int i = 0; i < num_threads; i++ )
+	{
+		PT( GenericAsyncTask ) task = new GenericAsyncTask( "interpolateGroups", interpolate_task, this );
+		task->set_task_chain( "bsp-interpolate" );
+		mgr->add( task );
+	}
+
+	// Help out, then wait for the stragglers.
+	interpolate_task( nullptr, this );
+	chain->wait_for_tasks();
+}
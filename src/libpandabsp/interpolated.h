@@ -15,15 +15,38 @@
 #include "interpolatedvar.h"
 
 #include "clockObject.h"
+#include "lightMutex.h"
+#include "pmutex.h"
+#include "asyncTask.h"
+#include "genericAsyncTask.h"
+#include "atomicAdjust.h"
 
 class VarMapEntry_t
 {
 public:
+	// What the watcher is, so that it can be batched without a virtual
+	// call. Anything other than a single float or float vector is
+	// interpolated by itself.
+	enum
+	{
+		KIND_OTHER,
+		KIND_FLOAT,
+		KIND_VEC2,
+		KIND_VEC3,
+		KIND_VEC4,
+	};
+
 	unsigned short type;
+	unsigned short kind;
 	unsigned short m_bNeedsToInterpolate; // Set to false when this var doesn't
 	// need Interpolate() called on it anymore.
 	void *data;
 	IInterpolatedVar *watcher;
+
+	// The first of the group's batch lanes that the var is interpolated in,
+	// or -1 if it isn't batched, and what it last put there.
+	int lane;
+	CInterpolationSegment segment;
 };
 
 class VarMapping_t
@@ -47,6 +70,10 @@ class EXPCL_PANDABSP CInterpolatedGroup
 {
 PUBLISHED:
 	CInterpolatedGroup();
+	CInterpolatedGroup( const CInterpolatedGroup &copy );
+	~CInterpolatedGroup();
+
+	CInterpolatedGroup &operator = ( const CInterpolatedGroup &copy );
 
 	void set_interpolation_enabled( bool enable );
 	bool interpolation_enabled() const;
@@ -74,23 +101,31 @@ PUBLISHED:
 
 private:
 	bool interp_interpolate( VarMapping_t *map, float curr_time );
+	bool interp_batch( VarMapping_t *map, float curr_time );
+
+	void setup_batch();
 
 public:
 	VarMapping_t *get_var_mapping();
 
+	void batch_interpolate( float now );
+	void run_batch();
+
 private:
 	bool _enabled;
 	bool _needs_interpolation;
 	VarMapping_t _var_map;
 	ClockObject *_clock;
-};
 
-INLINE CInterpolatedGroup::CInterpolatedGroup() :
-	_needs_interpolation( true ),
-	_enabled( true ),
-	_clock( ClockObject::get_global_clock() )
-{
-}
+	// Where the float and float vector vars are interpolated, with a fixed
+	// run of lanes for each var.
+	CInterpolationBatch _batch;
+
+	// Where we are in the CInterpolationSystem's list of groups.
+	int _system_index;
+
+	friend class CInterpolationSystem;
+};
 
 INLINE void CInterpolatedGroup::add_float( float *data, IInterpolatedVar *watcher, int type )
 {
@@ -122,6 +157,28 @@ INLINE void CInterpolatedGroup::interpolate( float now )
 	_needs_interpolation = !interp_interpolate( get_var_mapping(), now );
 }
 
+/**
+ * Like interpolate(), but sets what it can in the group's batch instead of
+ * writing it right away. run_batch() must be called to finish interpolating.
+ */
+INLINE void CInterpolatedGroup::batch_interpolate( float now )
+{
+	if ( !_needs_interpolation )
+	{
+		return;
+	}
+
+	_needs_interpolation = !interp_batch( get_var_mapping(), now );
+}
+
+/**
+ * Writes back the vars that batch_interpolate() set.
+ */
+INLINE void CInterpolatedGroup::run_batch()
+{
+	_batch.run();
+}
+
 INLINE void CInterpolatedGroup::set_interpolation_enabled( bool enabled )
 {
 	_enabled = enabled;
@@ -144,3 +201,58 @@ INLINE bool CInterpolatedGroup::needs_interpolation() const
 {
 	return _needs_interpolation;
 }
+
+/**
+ * Interpolates every CInterpolatedGroup at once, once per frame, instead of
+ * each one being interpolated on its own.
+ *
+ * The float and float vector vars of each group are interpolated in flat
+ * passes over the samples kept in the group's CInterpolationBatch. When there
+ * are enough groups, they are split up between worker threads, each of which
+ * has its own CInterpolationContext.
+ *
+ * The list of groups is copied at the start of interpolate_all(), and groups
+ * can be added and removed while it runs. A group that is in the copy must
+ * not be destroyed until interpolate_all() returns, though, so groups should
+ * only be destroyed on the thread that calls it.
+ */
+class EXPCL_PANDABSP CInterpolationSystem
+{
+PUBLISHED:
+	void interpolate_all( float now );
+
+	INLINE int get_num_groups() const;
+
+	static CInterpolationSystem *get_global_ptr();
+
+public:
+	void add_group( CInterpolatedGroup *group );
+	void remove_group( CInterpolatedGroup *group );
+
+private:
+	CInterpolationSystem();
+
+	static AsyncTask::DoneStatus interpolate_task( GenericAsyncTask *task, void *data );
+
+private:
+	LightMutex _lock;
+	pvector<CInterpolatedGroup *> _groups;
+
+	// Held for all of interpolate_all(), so that only one runs at a time.
+	Mutex _run_lock;
+
+	// Set up for the threads by interpolate_all().
+	pvector<CInterpolatedGroup *> _run_groups;
+	float _now;
+	bool _allow_extrapolation;
+	float _last_timestamp;
+	int _groups_per_claim;
+	AtomicAdjust::Integer _next_group;
+
+	static CInterpolationSystem *_global_ptr;
+};
+
+INLINE int CInterpolationSystem::get_num_groups() const
+{
+	return (int)_groups.size();
+}
@@ -5,9 +5,60 @@
 
 #include "interpolatedvar.h"
 
-CInterpolationContext *CInterpolationContext::s_pHead = NULL;
-bool CInterpolationContext::s_bAllowExtrapolation = false;
-float CInterpolationContext::s_flLastTimeStamp = 0;
+// Thread local, so that vars can be interpolated on more than one thread at
+// once. These can't be static members, since thread local data can't be
+// exported from the DLL.
+static thread_local CInterpolationContext *s_pHead = NULL;
+static thread_local bool s_bAllowExtrapolation = false;
+static thread_local float s_flLastTimeStamp = 0;
+
+CInterpolationContext::CInterpolationContext()
+{
+	m_bOldAllowExtrapolation = s_bAllowExtrapolation;
+	m_flOldLastTimeStamp = s_flLastTimeStamp;
+
+	// By default, disable extrapolation unless they call EnableExtrapolation.
+	s_bAllowExtrapolation = false;
+
+	// this is the context stack
+	m_pNext = s_pHead;
+	s_pHead = this;
+}
+
+CInterpolationContext::~CInterpolationContext()
+{
+	// restore values from prev stack element
+	s_bAllowExtrapolation = m_bOldAllowExtrapolation;
+	s_flLastTimeStamp = m_flOldLastTimeStamp;
+
+	assert( s_pHead == this );
+	s_pHead = m_pNext;
+}
+
+void CInterpolationContext::EnableExtrapolation( bool state )
+{
+	s_bAllowExtrapolation = state;
+}
+
+bool CInterpolationContext::IsThereAContext()
+{
+	return s_pHead != NULL;
+}
+
+bool CInterpolationContext::IsExtrapolationAllowed()
+{
+	return s_bAllowExtrapolation;
+}
+
+void CInterpolationContext::SetLastTimeStamp( float timestamp )
+{
+	s_flLastTimeStamp = timestamp;
+}
+
+float CInterpolationContext::GetLastTimeStamp()
+{
+	return s_flLastTimeStamp;
+}
 
 float g_flLastPacketTimestamp = 0;
 
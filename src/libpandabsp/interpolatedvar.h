@@ -9,8 +9,10 @@
 #include <clockObject.h>
 #include "config_bsp.h"
 #include "mathlib.h"
+#include "interpolation_batch.h"
 #ifndef CPPPARSER
 #include "lerp_functions.h"
+#include <type_traits>
 #else
 typedef uint8_t byte;
 #endif
@@ -56,65 +58,25 @@ INLINE void Interpolation_SetLastPacketTimeStamp( float timestamp )
 
 // Before calling Interpolate(), you can use this use this to setup the context
 // if you want to enable extrapolation.
+//
+// The context stack is kept per thread, so each thread that interpolates
+// needs to set up its own.
 class EXPCL_PANDABSP CInterpolationContext
 {
 PUBLISHED:
-	CInterpolationContext()
-	{
-		m_bOldAllowExtrapolation = s_bAllowExtrapolation;
-		m_flOldLastTimeStamp = s_flLastTimeStamp;
-
-		// By default, disable extrapolation unless they call EnableExtrapolation.
-		s_bAllowExtrapolation = false;
-
-		// this is the context stack
-		m_pNext = s_pHead;
-		s_pHead = this;
-	}
-
-	~CInterpolationContext()
-	{
-		// restore values from prev stack element
-		s_bAllowExtrapolation = m_bOldAllowExtrapolation;
-		s_flLastTimeStamp = m_flOldLastTimeStamp;
-
-		assert( s_pHead == this );
-		s_pHead = m_pNext;
-	}
-
-	static void EnableExtrapolation( bool state )
-	{
-		s_bAllowExtrapolation = state;
-	}
-
-	static bool IsThereAContext()
-	{
-		return s_pHead != NULL;
-	}
-
-	static bool IsExtrapolationAllowed()
-	{
-		return s_bAllowExtrapolation;
-	}
-
-	static void SetLastTimeStamp( float timestamp )
-	{
-		s_flLastTimeStamp = timestamp;
-	}
+	CInterpolationContext();
+	~CInterpolationContext();
 
-	static float GetLastTimeStamp()
-	{
-		return s_flLastTimeStamp;
-	}
+	static void EnableExtrapolation( bool state );
+	static bool IsThereAContext();
+	static bool IsExtrapolationAllowed();
+	static void SetLastTimeStamp( float timestamp );
+	static float GetLastTimeStamp();
 
 private:
 	CInterpolationContext *m_pNext;
 	bool m_bOldAllowExtrapolation;
 	float m_flOldLastTimeStamp;
-
-	static CInterpolationContext *s_pHead;
-	static bool s_bAllowExtrapolation;
-	static float s_flLastTimeStamp;
 };
 
 extern EXPCL_PANDABSP ConfigVariableDouble cl_extrapolate_amount;
@@ -555,6 +517,9 @@ PUBLISHED:
 public:
 	virtual void _Setup( void *data, int type );
 
+	bool AddToBatch( CInterpolationBatch &batch, int lane, CInterpolationSegment &segment,
+			 float currentTime, int &noMoreChanges );
+
 protected:
 	typedef CInterpolatedVarEntryBase<Type, IS_ARRAY> CInterpolatedVarEntry;
 	typedef CSimpleRingBuffer<CInterpolatedVarEntry> CVarHistory;
@@ -625,6 +590,9 @@ protected:
 	byte *m_bLooping;
 	float m_InterpolationAmount;
 	const char *m_pDebugName;
+	// Bumped whenever the history might have changed, so that AddToBatch()
+	// knows to write its samples again.
+	unsigned int m_nHistorySerial;
 };
 
 template <typename Type, bool IS_ARRAY>
@@ -639,6 +607,7 @@ inline CInterpolatedVarArrayBase<Type, IS_ARRAY>::CInterpolatedVarArrayBase(
 	m_LastNetworkedTime = 0;
 	m_LastNetworkedValue = NULL;
 	m_bLooping = NULL;
+	m_nHistorySerial = 0;
 }
 
 template <typename Type, bool IS_ARRAY>
@@ -759,6 +728,7 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::ClearHistory()
 		m_VarHistory[i].DeleteEntry();
 	}
 	m_VarHistory.RemoveAll();
+	++m_nHistorySerial;
 }
 
 template <typename Type, bool IS_ARRAY>
@@ -801,6 +771,7 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::AddToHead(
 
 	CInterpolatedVarEntry *e = &m_VarHistory[newslot];
 	e->NewEntry( values, m_nMaxCount, changeTime );
+	++m_nHistorySerial;
 }
 
 template <typename Type, bool IS_ARRAY>
@@ -1135,6 +1106,122 @@ inline int CInterpolatedVarArrayBase<Type, IS_ARRAY>::Interpolate(
 	return noMoreChanges;
 }
 
+/**
+ * Like Interpolate(), but instead of writing the value right away, sets each
+ * of its float components in the batch, starting at the given lane, which
+ * writes them when it is run. Only for single floats or float vectors.
+ *
+ * The samples are only written to the lanes when the segment being
+ * interpolated across differs from the one that segment last recorded;
+ * otherwise just the fraction is.
+ *
+ * Returns false if the var wants to extrapolate, which the batch doesn't do.
+ * Nothing is set in that case, and Interpolate() should be called instead.
+ */
+template <typename Type, bool IS_ARRAY>
+inline bool CInterpolatedVarArrayBase<Type, IS_ARRAY>::AddToBatch(
+	CInterpolationBatch &batch, int lane, CInterpolationSegment &segment,
+	float currentTime, int &noMoreChanges )
+{
+	static_assert( sizeof( Type ) % sizeof( float ) == 0,
+		       "AddToBatch() only works with float types" );
+	const int components = sizeof( Type ) / sizeof( float );
+	// Only a float can loop.
+	const bool can_loop = std::is_same<Type, float>::value;
+	// Lerp_Hermite() does a linear interpolation on angles.
+	const bool hermite_is_linear = std::is_same<Type, LVector3>::value;
+
+	assert( !IS_ARRAY && m_nMaxCount == 1 );
+
+	float interpolation_amount = m_InterpolationAmount;
+
+	noMoreChanges = 0;
+
+	CInterpolationInfo info;
+	if ( !GetInterpolationInfo( &info, currentTime, interpolation_amount,
+				    &noMoreChanges ) )
+		return true;
+
+	int mode;
+	if ( info.m_bHermite )
+	{
+		mode = CInterpolationSegment::MODE_HERMITE;
+	}
+	else if ( info.newer == info.older )
+	{
+		if ( CInterpolationContext::IsExtrapolationAllowed() )
+		{
+			// Let Interpolate() decide whether to extrapolate.
+			return false;
+		}
+
+		// Hold the newest value.
+		mode = CInterpolationSegment::MODE_HOLD;
+	}
+	else
+	{
+		mode = CInterpolationSegment::MODE_LERP;
+	}
+
+	if ( !segment.matches( m_nHistorySerial, mode, info.oldest, info.older, info.newer ) )
+	{
+		CVarHistory &history = m_VarHistory;
+		bool looping = can_loop && m_bLooping[0];
+
+		if ( mode == CInterpolationSegment::MODE_HERMITE )
+		{
+			CInterpolatedVarEntry *prev = &history[info.oldest];
+			CInterpolatedVarEntry *start = &history[info.older];
+			CInterpolatedVarEntry *end = &history[info.newer];
+
+			CInterpolatedVarEntry fixup;
+			fixup.Init( m_nMaxCount );
+			TimeFixup_Hermite( fixup, prev, start, end );
+
+			const float *p0 = (const float *)prev->GetValue();
+			const float *p1 = (const float *)start->GetValue();
+			const float *p2 = (const float *)end->GetValue();
+
+			for ( int c = 0; c < components; c++ )
+			{
+				if ( hermite_is_linear )
+					batch.set_lerp( lane + c, p1[c], p2[c], false );
+				else
+					batch.set_hermite( lane + c, p0[c], p1[c], p2[c], looping );
+			}
+		}
+		else if ( mode == CInterpolationSegment::MODE_HOLD )
+		{
+			const float *p2 = (const float *)history[info.newer].GetValue();
+			for ( int c = 0; c < components; c++ )
+			{
+				batch.set_lerp( lane + c, p2[c], p2[c], false );
+			}
+		}
+		else
+		{
+			const float *p1 = (const float *)history[info.older].GetValue();
+			const float *p2 = (const float *)history[info.newer].GetValue();
+			for ( int c = 0; c < components; c++ )
+			{
+				batch.set_lerp( lane + c, p1[c], p2[c], looping );
+			}
+		}
+
+		segment.set( m_nHistorySerial, mode, info.oldest, info.older, info.newer );
+	}
+
+	float frac = ( mode == CInterpolationSegment::MODE_HOLD ) ? 0.0f : info.frac;
+	for ( int c = 0; c < components; c++ )
+	{
+		batch.set_frac( lane + c, frac );
+	}
+
+	RemoveEntriesPreviousTo( currentTime - interpolation_amount -
+				 EXTRA_INTERPOLATION_HISTORY_STORED );
+	return true;
+}
+
 template <typename Type, bool IS_ARRAY>
 void CInterpolatedVarArrayBase<Type, IS_ARRAY>::GetDerivative(
 	Type *pOut, float currentTime )
@@ -1275,6 +1362,7 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::Copy(
 		CInterpolatedVarEntry *src = &pSrc->m_VarHistory[i];
 		dest->NewEntry( src->GetValue(), m_nMaxCount, src->changetime );
 	}
+	++m_nHistorySerial;
 }
 
 template <typename Type, bool IS_ARRAY>
@@ -1329,6 +1417,9 @@ inline Type *CInterpolatedVarArrayBase<Type, IS_ARRAY>::GetHistoryValue(
 	assert( iArrayIndex >= 0 && iArrayIndex < m_nMaxCount );
 	if ( m_VarHistory.IsIdxValid( index ) )
 	{
+		// The caller may write through this.
+		++m_nHistorySerial;
+
 		CInterpolatedVarEntry *entry = &m_VarHistory[index];
 		changetime = entry->changetime;
 		return &entry->GetValue()[iArrayIndex];
@@ -1351,6 +1442,7 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::SetHistoryValuesForItem(
 		CInterpolatedVarEntry *entry = &m_VarHistory[i];
 		entry->GetValue()[item] = value;
 	}
+	++m_nHistorySerial;
 }
 
 template <typename Type, bool IS_ARRAY>
@@ -1359,6 +1451,7 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::SetLooping(
 {
 	assert( iArrayIndex >= 0 && iArrayIndex < m_nMaxCount );
 	m_bLooping[iArrayIndex] = looping;
+	++m_nHistorySerial;
 }
 
 template <typename Type, bool IS_ARRAY>
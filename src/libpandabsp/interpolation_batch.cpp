@@ -0,0 +1,197 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file interpolation_batch.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "interpolation_batch.h"
+
+#include "mathlib/ssemath.h"
+
+/**
+ * Removes every lane.
+ */
+void CInterpolationBatch::clear()
+{
+	_t.clear();
+	_p0.clear();
+	_p1.clear();
+	_p2.clear();
+	_out.clear();
+	_hermite.clear();
+	_looping.clear();
+	_dest.clear();
+	_active.clear();
+	_any_active = false;
+}
+
+/**
+ * Adds count lanes that write back to dest[0] through dest[count - 1], and
+ * returns the first one. The lanes hold their value until they are set.
+ */
+int CInterpolationBatch::add_lanes( float *dest, int count )
+{
+	int first = (int)_dest.size();
+	for ( int i = 0; i < count; i++ )
+	{
+		_t.push_back( 0.0f );
+		_p0.push_back( dest[i] );
+		_p1.push_back( dest[i] );
+		_p2.push_back( dest[i] );
+		_out.push_back( dest[i] );
+		_hermite.push_back( 0 );
+		_looping.push_back( 0 );
+		_dest.push_back( dest + i );
+		_active.push_back( 0 );
+	}
+
+	return first;
+}
+
+/**
+ * Interpolates the lanes that were set since the last run, and writes them
+ * back.
+ */
+void CInterpolationBatch::run()
+{
+	if ( !_any_active )
+	{
+		return;
+	}
+
+	sweep();
+	scatter();
+
+	_any_active = false;
+}
+
+// The sweep runs four lanes at a time with fltx4, then finishes the last few
+// lanes one at a time. Both paths evaluate the same expressions in the same
+// order, so a lane gets the same result wherever it falls.
+
+/**
+ * Wraps x back into [0, 1) the way LoopingLerp() does, by dropping the whole
+ * part and adding one if that leaves it negative. FloorSIMD() rounds negative
+ * values toward zero on SSE but not everywhere, so the truncation is worked
+ * out from a corrected floor.
+ */
+static INLINE fltx4 wrap_x4( const fltx4 &x )
+{
+	fltx4 f = FloorSIMD( x );
+	f = MaskedAssign( CmpGtSIMD( f, x ), SubSIMD( f, Four_Ones ), f );
+
+	fltx4 whole = MaskedAssign( AndSIMD( CmpLtSIMD( x, Four_Zeros ), CmpGtSIMD( x, f ) ),
+				    AddSIMD( f, Four_Ones ), f );
+	fltx4 s = SubSIMD( x, whole );
+	return MaskedAssign( CmpLtSIMD( s, Four_Zeros ), AddSIMD( s, Four_Ones ), s );
+}
+
+/**
+ * Computes every lane, lerp and hermite alike, and keeps the one that the
+ * lane asked for. Same as Lerp(), LoopingLerp(), Lerp_Hermite() and
+ * LoopingLerp_Hermite().
+ */
+void CInterpolationBatch::sweep()
+{
+	size_t count = _dest.size();
+
+	const float *t = _t.data();
+	const float *p0 = _p0.data();
+	const float *p1 = _p1.data();
+	const float *p2 = _p2.data();
+	const unsigned int *hermite = _hermite.data();
+	const unsigned int *looping = _looping.data();
+	float *out = _out.data();
+
+	size_t i = 0;
+	for ( ; i + 4 <= count; i += 4 )
+	{
+		fltx4 t4 = LoadUnalignedSIMD( t + i );
+		fltx4 p04 = LoadUnalignedSIMD( p0 + i );
+		fltx4 p14 = LoadUnalignedSIMD( p1 + i );
+		fltx4 p24 = LoadUnalignedSIMD( p2 + i );
+
+		fltx4 loop4 = LoadUnalignedSIMD( looping + i );
+
+		// LoopingLerp() weighs the ends instead.
+		fltx4 lerp = MaskedAssign( loop4,
+					   AddSIMD( MulSIMD( p24, t4 ), MulSIMD( p14, SubSIMD( Four_Ones, t4 ) ) ),
+					   MaddSIMD( SubSIMD( p24, p14 ), t4, p14 ) );
+
+		fltx4 tsqr = MulSIMD( t4, t4 );
+		fltx4 tcube = MulSIMD( t4, tsqr );
+		fltx4 d1 = SubSIMD( p14, p04 );
+		fltx4 d2 = SubSIMD( p24, p14 );
+
+		fltx4 tsqr2 = MulSIMD( Four_Twos, tsqr );
+		fltx4 tsqr3 = MulSIMD( Four_Threes, tsqr );
+		fltx4 tcube2 = MulSIMD( Four_Twos, tcube );
+
+		fltx4 herm = MulSIMD( p14, AddSIMD( SubSIMD( tcube2, tsqr3 ), Four_Ones ) );
+		herm = AddSIMD( herm, MulSIMD( p24, SubSIMD( tsqr3, tcube2 ) ) );
+		herm = AddSIMD( herm, MulSIMD( d1, AddSIMD( SubSIMD( tcube, tsqr2 ), t4 ) ) );
+		herm = AddSIMD( herm, MulSIMD( d2, SubSIMD( tcube, tsqr ) ) );
+
+		fltx4 result = MaskedAssign( LoadUnalignedSIMD( hermite + i ), herm, lerp );
+
+		result = MaskedAssign( loop4, wrap_x4( result ), result );
+
+		StoreUnalignedSIMD( out + i, result );
+	}
+
+	for ( ; i < count; i++ )
+	{
+		if ( hermite[i] )
+		{
+			float tsqr = t[i] * t[i];
+			float tcube = t[i] * tsqr;
+			float d1 = p1[i] - p0[i];
+			float d2 = p2[i] - p1[i];
+
+			out[i] = p1[i] * ( 2 * tcube - 3 * tsqr + 1 ) +
+				p2[i] * ( -2 * tcube + 3 * tsqr ) +
+				d1 * ( tcube - 2 * tsqr + t[i] ) +
+				d2 * ( tcube - tsqr );
+		}
+		else if ( looping[i] )
+		{
+			out[i] = p2[i] * t[i] + p1[i] * ( 1.0f - t[i] );
+		}
+		else
+		{
+			out[i] = p1[i] + ( p2[i] - p1[i] ) * t[i];
+		}
+
+		if ( looping[i] )
+		{
+			out[i] -= (int)out[i];
+			if ( out[i] < 0.0f )
+				out[i] += 1.0f;
+		}
+	}
+}
+
+/**
+ * Writes back the lanes that were set, and unsets them.
+ */
+void CInterpolationBatch::scatter()
+{
+	size_t count = _dest.size();
+	float *const *dest = _dest.data();
+	const float *out = _out.data();
+	unsigned char *active = _active.data();
+
+	for ( size_t i = 0; i < count; i++ )
+	{
+		if ( active[i] )
+		{
+			*dest[i] = out[i];
+			active[i] = 0;
+		}
+	}
+}
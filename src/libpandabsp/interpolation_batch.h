@@ -0,0 +1,224 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file interpolation_batch.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef INTERPOLATION_BATCH_H
+#define INTERPOLATION_BATCH_H
+
+#include "config_bsp.h"
+#include "pvector.h"
+
+#include <cmath>
+
+/**
+ * Which history samples an interpolated var last wrote into its lanes. The var
+ * only writes its samples again when this changes, which is once per new
+ * sample rather than once per frame.
+ */
+class CInterpolationSegment
+{
+public:
+	enum
+	{
+		MODE_NONE,
+		MODE_HOLD,
+		MODE_LERP,
+		MODE_HERMITE,
+	};
+
+	INLINE CInterpolationSegment();
+
+	INLINE void invalidate();
+	INLINE bool matches( unsigned int serial, int mode, int oldest, int older, int newer ) const;
+	INLINE void set( unsigned int serial, int mode, int oldest, int older, int newer );
+
+private:
+	unsigned int _serial;
+	int _mode;
+	int _oldest;
+	int _older;
+	int _newer;
+};
+
+INLINE CInterpolationSegment::CInterpolationSegment()
+{
+	invalidate();
+}
+
+INLINE void CInterpolationSegment::invalidate()
+{
+	_serial = 0;
+	_mode = MODE_NONE;
+	_oldest = _older = _newer = -1;
+}
+
+INLINE bool CInterpolationSegment::matches( unsigned int serial, int mode, int oldest, int older, int newer ) const
+{
+	return _mode == mode && _serial == serial && _older == older &&
+		_newer == newer && _oldest == oldest;
+}
+
+INLINE void CInterpolationSegment::set( unsigned int serial, int mode, int oldest, int older, int newer )
+{
+	_serial = serial;
+	_mode = mode;
+	_oldest = oldest;
+	_older = older;
+	_newer = newer;
+}
+
+/**
+ * Keeps the samples of many interpolated vars in flat arrays, one lane per
+ * float component, so that they can all be interpolated in one pass over
+ * contiguous memory instead of one virtual call per var.
+ *
+ * Each var gets its lanes once, when it is added, and keeps them. A var only
+ * writes the samples of the segment it is interpolating across when it moves
+ * on to a new segment; every frame it just sets the fraction. run() then
+ * computes the lanes that were set, four at a time, straight out of the
+ * arrays, and writes each result back to the component it came from.
+ *
+ * A batch is only ever used by one thread at a time.
+ */
+class EXPCL_PANDABSP CInterpolationBatch
+{
+public:
+	INLINE CInterpolationBatch();
+
+	void clear();
+	int add_lanes( float *dest, int count );
+
+	INLINE void set_lerp( int lane, float p1, float p2, bool looping );
+	INLINE void set_hermite( int lane, float p0, float p1, float p2, bool looping );
+	INLINE void set_frac( int lane, float t );
+
+	INLINE size_t get_num_lanes() const;
+
+	void run();
+
+private:
+	void sweep();
+	void scatter();
+
+private:
+	pvector<float> _t;
+	pvector<float> _p0;
+	pvector<float> _p1;
+	pvector<float> _p2;
+	pvector<float> _out;
+
+	// All bits set for the lanes that are hermite or looping, so that the
+	// sweep can use them as masks.
+	pvector<unsigned int> _hermite;
+	pvector<unsigned int> _looping;
+
+	pvector<float *> _dest;
+
+	// Lanes that were set since the last run().
+	pvector<unsigned char> _active;
+	bool _any_active;
+};
+
+INLINE CInterpolationBatch::CInterpolationBatch() :
+	_any_active( false )
+{
+}
+
+/**
+ * Sets up a linear interpolation from p1 to p2. A looping value lives in
+ * [0, 1) and takes the short way around, like LoopingLerp().
+ */
+INLINE void CInterpolationBatch::set_lerp( int lane, float p1, float p2, bool looping )
+{
+	nassertv( lane >= 0 && lane < (int)_dest.size() );
+
+	if ( looping )
+	{
+		if ( std::fabs( p2 - p1 ) >= 0.5f )
+		{
+			if ( p1 < p2 )
+				p1 += 1.0f;
+			else
+				p2 += 1.0f;
+		}
+	}
+
+	_p0[lane] = p1;
+	_p1[lane] = p1;
+	_p2[lane] = p2;
+	_hermite[lane] = 0;
+	_looping[lane] = looping ? ~0u : 0u;
+}
+
+/**
+ * Sets up a hermite interpolation from p1 to p2, with p0 the sample before
+ * p1. A looping value is unwrapped the same way as LoopingLerp_Hermite().
+ */
+INLINE void CInterpolationBatch::set_hermite( int lane, float p0, float p1, float p2, bool looping )
+{
+	nassertv( lane >= 0 && lane < (int)_dest.size() );
+
+	if ( looping )
+	{
+		if ( std::fabs( p1 - p0 ) > 0.5f )
+		{
+			if ( p0 < p1 )
+				p0 += 1.0f;
+			else
+				p1 += 1.0f;
+		}
+
+		if ( std::fabs( p2 - p1 ) > 0.5f )
+		{
+			if ( p1 < p2 )
+			{
+				p1 += 1.0f;
+
+				if ( std::fabs( p1 - p0 ) > 0.5f )
+				{
+					if ( p0 < p1 )
+						p0 += 1.0f;
+					else
+						p1 += 1.0f;
+				}
+			}
+			else
+			{
+				p2 += 1.0f;
+			}
+		}
+	}
+
+	_p0[lane] = p0;
+	_p1[lane] = p1;
+	_p2[lane] = p2;
+	_hermite[lane] = ~0u;
+	_looping[lane] = looping ? ~0u : 0u;
+}
+
+/**
+ * Sets how far along its segment the lane is, and has the next run() write
+ * it back.
+ */
+INLINE void CInterpolationBatch::set_frac( int lane, float t )
+{
+	nassertv( lane >= 0 && lane < (int)_dest.size() );
+
+	_t[lane] = t;
+	_active[lane] = 1;
+	_any_active = true;
+}
+
+INLINE size_t CInterpolationBatch::get_num_lanes() const
+{
+	return _dest.size();
+}
+
+#endif // INTERPOLATION_BATCH_H
@@ -0,0 +1,282 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file lightvis_scheduler.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "lightvis_scheduler.h"
+#include "ambient_probes.h"
+#include "bsp_trace.h"
+
+#include <lightMutexHolder.h>
+#include <clockObject.h>
+#include <pStatCollector.h>
+#include <pstatTimer.h>
+#include <configVariableInt.h>
+
+#include <algorithm>
+
+static ConfigVariableInt cfg_lightvis_budget
+( "light-vis-budget", 32, "Most light visibility rays traced for dynamic nodes per frame." );
+static ConfigVariableInt cfg_lightvis_refresh
+( "light-vis-refresh-frames", 30, "Number of frames a cached light visibility result is used before it is traced again. "
+  "0 keeps results until the level is unloaded." );
+
+static PStatCollector lvs_trace_collector( "AmbientProbes:UpdateNodes:TraceLights" );
+static PStatCollector lvs_traces_pcollector( "Light visibility:Traces" );
+static PStatCollector lvs_budget_pcollector( "Light visibility:Budget" );
+static PStatCollector lvs_pending_pcollector( "Light visibility:Pending" );
+
+LightVisScheduler::LightVisScheduler() :
+        _frame( -1 ),
+        _budget_left( 0 ),
+        _traces_this_frame( 0 ),
+        _pending_lock( "LightVisScheduler-pending" )
+{
+}
+
+/**
+ * Makes a cache slot for every light that each leaf can potentially see.
+ */
+void LightVisScheduler::setup( const pvector<pvector<light_t *>> &light_pvs )
+{
+        clear();
+
+        _leaf_first.reserve( light_pvs.size() + 1 );
+        for ( size_t leaf = 0; leaf < light_pvs.size(); leaf++ )
+        {
+                _leaf_first.push_back( (int)_slot_light_ids.size() );
+                for ( size_t i = 0; i < light_pvs[leaf].size(); i++ )
+                {
+                        _slot_light_ids.push_back( light_pvs[leaf][i]->id );
+                }
+                // Sorted so find_slot() can binary search.
+                std::sort( _slot_light_ids.begin() + _leaf_first.back(), _slot_light_ids.end() );
+        }
+        _leaf_first.push_back( (int)_slot_light_ids.size() );
+
+        _slot_states.resize( _slot_light_ids.size(), 0 );
+        _pending_index.resize( _slot_light_ids.size(), -1 );
+}
+
+void LightVisScheduler::clear()
+{
+        LightMutexHolder holder( _pending_lock );
+
+        _leaf_first.clear();
+        _slot_light_ids.clear();
+        _slot_states.clear();
+        _pending.clear();
+        _pending_index.clear();
+
+        AtomicAdjust::set( _frame, -1 );
+        AtomicAdjust::set( _budget_left, 0 );
+        AtomicAdjust::set( _traces_this_frame, 0 );
+}
+
+/**
+ * Returns whether the light can be seen from the indicated leaf. pos is
+ * the point to trace from if the cached result is out of date. If there
+ * are no rays left this frame, the last result is returned and the trace
+ * is queued; a light that has never been traced counts as visible, so that
+ * it doesn't pop in late.
+ */
+bool LightVisScheduler::is_light_visible( int leaf, const light_t *light, const LPoint3 &pos,
+                                          const collbspdata_t *colldata )
+{
+        int frame = ClockObject::get_global_clock()->get_frame_count();
+        if ( AtomicAdjust::get( _frame ) != frame )
+        {
+                begin_frame( frame, colldata );
+        }
+
+        int slot = find_slot( leaf, light->id );
+        if ( slot < 0 )
+        {
+                // Not a light this leaf can see.
+                return false;
+        }
+
+        AtomicAdjust::Integer state = AtomicAdjust::get( _slot_states[slot] );
+        int result = (int)( state & 3 );
+        int traced = (int)( state >> 2 );
+        int refresh = cfg_lightvis_refresh.get_value();
+        if ( result != LVS_unknown && ( refresh <= 0 || frame - traced < refresh ) )
+        {
+                return result == LVS_visible;
+        }
+
+        if ( take_budget() )
+        {
+                bool visible = trace_light( pos, light, colldata );
+                store_result( slot, frame, visible );
+                return visible;
+        }
+
+        // Out of rays for this frame, go with what we had.
+        queue_trace( slot, light, pos, frame );
+        return result != LVS_occluded;
+}
+
+int LightVisScheduler::find_slot( int leaf, int light_id ) const
+{
+        if ( leaf < 0 || leaf + 1 >= (int)_leaf_first.size() )
+        {
+                return -1;
+        }
+
+        const int *first = _slot_light_ids.data() + _leaf_first[leaf];
+        const int *last = _slot_light_ids.data() + _leaf_first[leaf + 1];
+        const int *itr = std::lower_bound( first, last, light_id );
+        if ( itr == last || *itr != light_id )
+        {
+                return -1;
+        }
+
+        return (int)( itr - _slot_light_ids.data() );
+}
+
+/**
+ * Refills the budget for a new frame, spending up to half of it on traces
+ * that were queued in earlier frames. The queued traces are run after
+ * letting go of the pending lock, so culling threads queueing traces don't
+ * wait on them.
+ */
+void LightVisScheduler::begin_frame( int frame, const collbspdata_t *colldata )
+{
+        pvector<pendingtrace_t> to_trace;
+
+        {
+                LightMutexHolder holder( _pending_lock );
+
+                if ( AtomicAdjust::get( _frame ) == frame )
+                {
+                        // Another thread got here first.
+                        return;
+                }
+
+                lvs_traces_pcollector.set_level( (double)AtomicAdjust::get( _traces_this_frame ) );
+
+                int budget = std::max( 0, cfg_lightvis_budget.get_value() );
+                lvs_budget_pcollector.set_level( budget );
+
+                int queued_budget = std::min( ( budget + 1 ) / 2, (int)_pending.size() );
+                if ( queued_budget > 0 )
+                {
+                        // The longer a request has waited, the higher it goes, so
+                        // dim and distant lights still get traced eventually.
+                        std::partial_sort( _pending.begin(), _pending.begin() + queued_budget, _pending.end(),
+                                           [frame]( const pendingtrace_t &a, const pendingtrace_t &b )
+                        {
+                                return a.priority * ( 1 + frame - a.frame_queued ) >
+                                        b.priority * ( 1 + frame - b.frame_queued );
+                        } );
+
+                        to_trace.assign( _pending.begin(), _pending.begin() + queued_budget );
+                        _pending.erase( _pending.begin(), _pending.begin() + queued_budget );
+                        budget -= queued_budget;
+                }
+
+                for ( size_t i = 0; i < _pending_index.size(); i++ )
+                {
+                        _pending_index[i] = -1;
+                }
+                for ( size_t i = 0; i < _pending.size(); i++ )
+                {
+                        _pending_index[_pending[i].slot] = (int)i;
+                }
+
+                lvs_pending_pcollector.set_level( (double)_pending.size() );
+
+                AtomicAdjust::set( _traces_this_frame, queued_budget );
+                AtomicAdjust::set( _budget_left, budget );
+                AtomicAdjust::set( _frame, frame );
+        }
+
+        for ( size_t i = 0; i < to_trace.size(); i++ )
+        {
+                const pendingtrace_t &request = to_trace[i];
+                store_result( request.slot, frame, trace_light( request.pos, request.light, colldata ) );
+        }
+}
+
+bool LightVisScheduler::take_budget()
+{
+        while ( true )
+        {
+                AtomicAdjust::Integer budget = AtomicAdjust::get( _budget_left );
+                if ( budget <= 0 )
+                {
+                        return false;
+                }
+                if ( AtomicAdjust::compare_and_exchange( _budget_left, budget, budget - 1 ) == budget )
+                {
+                        AtomicAdjust::inc( _traces_this_frame );
+                        return true;
+                }
+        }
+}
+
+void LightVisScheduler::queue_trace( int slot, const light_t *light, const LPoint3 &pos, int frame )
+{
+        LightMutexHolder holder( _pending_lock );
+
+        float priority = get_priority( light, pos );
+
+        int index = _pending_index[slot];
+        if ( index >= 0 )
+        {
+                // Already queued, trace from the node that needs it most.
+                pendingtrace_t &request = _pending[index];
+                if ( priority > request.priority )
+                {
+                        request.priority = priority;
+                        request.pos = pos;
+                }
+                return;
+        }
+
+        pendingtrace_t request;
+        request.slot = slot;
+        request.light = light;
+        request.pos = pos;
+        request.priority = priority;
+        request.frame_queued = frame;
+        _pending_index[slot] = (int)_pending.size();
+        _pending.push_back( request );
+}
+
+INLINE void LightVisScheduler::store_result( int slot, int frame, bool visible )
+{
+        AtomicAdjust::set( _slot_states[slot], ( (AtomicAdjust::Integer)frame << 2 ) |
+                           ( visible ? LVS_visible : LVS_occluded ) );
+}
+
+bool LightVisScheduler::trace_light( const LPoint3 &pos, const light_t *light, const collbspdata_t *colldata )
+{
+        PStatTimer timer( lvs_trace_collector );
+
+        Ray ray( ( pos + LPoint3( 0, 0, 0.05 ) ) * 16, light->pos * 16, LPoint3::zero(), LPoint3::zero() );
+        Trace trace;
+        CM_BoxTrace( ray, 0, CONTENTS_SOLID, false, colldata, trace );
+
+        return !trace.has_hit();
+}
+
+/**
+ * Brighter and closer lights are traced first.
+ */
+float LightVisScheduler::get_priority( const light_t *light, const LPoint3 &pos )
+{
+        static const LVector3 lum_coeff( 0.3, 0.59, 0.11 );
+
+        float brightness = light->color.dot( lum_coeff );
+        float dist_sqr = ( light->pos - pos ).length_squared();
+
+        return brightness / std::max( dist_sqr, 1.0f );
+}
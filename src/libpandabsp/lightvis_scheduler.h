@@ -0,0 +1,91 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file lightvis_scheduler.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef LIGHTVIS_SCHEDULER_H
+#define LIGHTVIS_SCHEDULER_H
+
+#include "config_bsp.h"
+
+#include <pvector.h>
+#include <luse.h>
+#include <lightMutex.h>
+#include <atomicAdjust.h>
+
+struct light_t;
+struct collbspdata_t;
+
+/**
+ * Decides whether local lights are occluded from the leafs that can see
+ * them, spending no more than a fixed number of ray traces per frame.
+ *
+ * Results are cached per (leaf, light) and shared by every node in the
+ * leaf. A cached result is re-traced once it is older than the refresh
+ * interval. Traces that don't fit in a frame's budget are queued and run
+ * in later frames, the brightest and closest first, with requests that
+ * have waited longer moving up so every light eventually gets its turn.
+ */
+class EXPCL_PANDABSP LightVisScheduler
+{
+public:
+        LightVisScheduler();
+
+        void setup( const pvector<pvector<light_t *>> &light_pvs );
+        void clear();
+
+        bool is_light_visible( int leaf, const light_t *light, const LPoint3 &pos,
+                               const collbspdata_t *colldata );
+
+private:
+        enum
+        {
+                LVS_unknown = 0,
+                LVS_visible = 1,
+                LVS_occluded = 2,
+        };
+
+        struct pendingtrace_t
+        {
+                int slot;
+                const light_t *light;
+                LPoint3 pos;
+                float priority;
+                int frame_queued;
+        };
+
+        int find_slot( int leaf, int light_id ) const;
+        void begin_frame( int frame, const collbspdata_t *colldata );
+        bool take_budget();
+        void queue_trace( int slot, const light_t *light, const LPoint3 &pos, int frame );
+        void store_result( int slot, int frame, bool visible );
+
+        static bool trace_light( const LPoint3 &pos, const light_t *light, const collbspdata_t *colldata );
+        static float get_priority( const light_t *light, const LPoint3 &pos );
+
+private:
+        // The lights of leaf n occupy slots _leaf_first[n] to _leaf_first[n + 1].
+        pvector<int> _leaf_first;
+        pvector<int> _slot_light_ids;
+
+        // Frame the slot was last traced on, shifted up by two, ORed with
+        // the result.
+        pvector<AtomicAdjust::Integer> _slot_states;
+
+        AtomicAdjust::Integer _frame;
+        AtomicAdjust::Integer _budget_left;
+        AtomicAdjust::Integer _traces_this_frame;
+
+        LightMutex _pending_lock;
+        pvector<pendingtrace_t> _pending;
+        // Index of each slot's request in _pending, or -1.
+        pvector<int> _pending_index;
+};
+
+#endif // LIGHTVIS_SCHEDULER_H
@@ -13,6 +13,7 @@
 #include <frameBufferProperties.h>
 #include <cullFaceAttrib.h>
 #include "shader_generator.h"
+#include "bsp_viscontext.h"
 
 PlanarReflections::PlanarReflections( BSPShaderGenerator *shgen ) :
 	_shgen( shgen ),
@@ -52,6 +53,11 @@ PlanarReflections::PlanarReflections( BSPShaderGenerator *shgen ) :
 	_camera->set_camera_mask( CAMERA_REFLECTION );
 	_camera_np = NodePath( _camera );
 
+	// Only draw what is potentially visible from the main camera and in the
+	// reflected view.
+	PT( VisibilityContext ) vis_context = new VisibilityContext( VisibilityContext::VM_main_view_frustum );
+	vis_context->attach( _camera_np );
+
 	PT( DisplayRegion ) dr = _reflection_buffer->make_display_region();
 	dr->disable_clears();
 	dr->set_clear_depth_active( true );
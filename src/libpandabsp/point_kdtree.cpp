@@ -0,0 +1,268 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file point_kdtree.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "point_kdtree.h"
+
+#include <algorithm>
+
+// Most points in a leaf, one SIMD group of distances at most twice.
+#define KDTREE_LEAF_SIZE 8
+
+// Deeper than a balanced tree with this leaf size can ever be.
+#define KDTREE_MAX_DEPTH 64
+
+PointKDTree::PointKDTree() :
+        _num_points( 0 )
+{
+}
+
+void PointKDTree::clear()
+{
+        _nodes.clear();
+        _xs.clear();
+        _ys.clear();
+        _zs.clear();
+        _indices.clear();
+        _num_points = 0;
+}
+
+/**
+ * Builds the tree over the indicated points. Queries return indices into
+ * this array.
+ */
+void PointKDTree::build( const LPoint3 *points, size_t count )
+{
+        clear();
+
+        if ( count == 0 )
+        {
+                return;
+        }
+
+        _num_points = count;
+
+        pvector<int> order( count );
+        for ( size_t i = 0; i < count; i++ )
+        {
+                order[i] = (int)i;
+        }
+
+        size_t max_padded = count + ( count / KDTREE_LEAF_SIZE + 1 ) * 4;
+        _nodes.reserve( ( count / KDTREE_LEAF_SIZE + 1 ) * 2 );
+        _xs.reserve( max_padded );
+        _ys.reserve( max_padded );
+        _zs.reserve( max_padded );
+        _indices.reserve( max_padded );
+
+        build_node( order.data(), points, 0, (int)count );
+}
+
+int PointKDTree::build_node( int *order, const LPoint3 *points, int begin, int end )
+{
+        int idx = (int)_nodes.size();
+        _nodes.push_back( kdtreenode_t() );
+
+        if ( end - begin <= KDTREE_LEAF_SIZE )
+        {
+                add_leaf( _nodes[idx], order, points, begin, end );
+                return idx;
+        }
+
+        // Split along the axis the points are most spread out on.
+        LPoint3 mins = points[order[begin]];
+        LPoint3 maxs = mins;
+        for ( int i = begin + 1; i < end; i++ )
+        {
+                mins = mins.fmin( points[order[i]] );
+                maxs = maxs.fmax( points[order[i]] );
+        }
+        LVector3 size = maxs - mins;
+        int axis = 0;
+        if ( size[1] > size[axis] )
+                axis = 1;
+        if ( size[2] > size[axis] )
+                axis = 2;
+
+        // Points before the median are <= the split, points after are >= it.
+        int mid = ( begin + end ) / 2;
+        std::nth_element( order + begin, order + mid, order + end, [points, axis]( int a, int b )
+        {
+                return points[a][axis] < points[b][axis];
+        } );
+
+        float split = points[order[mid]][axis];
+
+        build_node( order, points, begin, mid );
+        int back = build_node( order, points, mid, end );
+
+        kdtreenode_t &node = _nodes[idx];
+        node.split = split;
+        node.axis = axis;
+        node.first = back;
+        node.count = 0;
+
+        return idx;
+}
+
+void PointKDTree::add_leaf( kdtreenode_t &node, const int *order, const LPoint3 *points, int begin, int end )
+{
+        node.split = 0.0f;
+        node.axis = -1;
+        node.first = (int)_xs.size();
+        node.count = end - begin;
+
+        for ( int i = begin; i < end; i++ )
+        {
+                const LPoint3 &point = points[order[i]];
+                _xs.push_back( point[0] );
+                _ys.push_back( point[1] );
+                _zs.push_back( point[2] );
+                _indices.push_back( order[i] );
+        }
+
+        // Pad the leaf so every group of four is full.
+        while ( _xs.size() & 3 )
+        {
+                _xs.push_back( FLT_MAX );
+                _ys.push_back( FLT_MAX );
+                _zs.push_back( FLT_MAX );
+                _indices.push_back( -1 );
+        }
+}
+
+/**
+ * Returns the index of the point closest to pos, or -1 if the tree is
+ * empty. If dist_sqr is given, it receives the squared distance.
+ */
+int PointKDTree::find_nearest( const LPoint3 &pos, float *dist_sqr ) const
+{
+        int index = -1;
+        float dist = FLT_MAX;
+        find_k_nearest( pos, 1, &index, &dist );
+
+        if ( dist_sqr != nullptr )
+        {
+                *dist_sqr = dist;
+        }
+
+        return index;
+}
+
+/**
+ * Finds the k points closest to pos. indices and dists_sqr must each hold
+ * k elements, and receive the points and their squared distances from the
+ * nearest to the farthest. Returns how many were found, which is less than
+ * k if the tree has fewer points.
+ */
+int PointKDTree::find_k_nearest( const LPoint3 &pos, int k, int *indices, float *dists_sqr ) const
+{
+        if ( _nodes.empty() || k <= 0 )
+        {
+                return 0;
+        }
+
+        const fltx4 px = ReplicateX4( pos[0] );
+        const fltx4 py = ReplicateX4( pos[1] );
+        const fltx4 pz = ReplicateX4( pos[2] );
+
+        int found = 0;
+        float worst = FLT_MAX;
+
+        // Subtrees still to visit, with the squared distance to their
+        // splitting plane.
+        int stack_node[KDTREE_MAX_DEPTH];
+        float stack_dist[KDTREE_MAX_DEPTH];
+        int stack_size = 0;
+
+        stack_node[stack_size] = 0;
+        stack_dist[stack_size] = 0.0f;
+        stack_size++;
+
+        while ( stack_size > 0 )
+        {
+                stack_size--;
+                if ( stack_dist[stack_size] >= worst )
+                {
+                        continue;
+                }
+                int i = stack_node[stack_size];
+
+                // Go down to the leaf on our side of each plane, remembering
+                // the other side.
+                const kdtreenode_t *node = &_nodes[i];
+                while ( node->axis >= 0 )
+                {
+                        float d = pos[node->axis] - node->split;
+                        int near_child = d < 0.0f ? i + 1 : node->first;
+                        int far_child = d < 0.0f ? node->first : i + 1;
+
+                        nassertr( stack_size < KDTREE_MAX_DEPTH, found );
+                        stack_node[stack_size] = far_child;
+                        stack_dist[stack_size] = d * d;
+                        stack_size++;
+
+                        i = near_child;
+                        node = &_nodes[i];
+                }
+
+                for ( int group = 0; group < node->count; group += 4 )
+                {
+                        int first = node->first + group;
+
+                        fltx4 dx = SubSIMD( LoadAlignedSIMD( &_xs[first] ), px );
+                        fltx4 dy = SubSIMD( LoadAlignedSIMD( &_ys[first] ), py );
+                        fltx4 dz = SubSIMD( LoadAlignedSIMD( &_zs[first] ), pz );
+                        fltx4 dist = MaddSIMD( dx, dx, MaddSIMD( dy, dy, MulSIMD( dz, dz ) ) );
+
+                        int lanes = std::min( 4, node->count - group );
+                        for ( int lane = 0; lane < lanes; lane++ )
+                        {
+                                float d = SubFloat( dist, lane );
+                                if ( d >= worst )
+                                {
+                                        continue;
+                                }
+
+                                // Insert it in order, dropping the farthest if
+                                // the buffer is full.
+                                int slot = found < k ? found++ : k - 1;
+                                while ( slot > 0 && dists_sqr[slot - 1] > d )
+                                {
+                                        dists_sqr[slot] = dists_sqr[slot - 1];
+                                        indices[slot] = indices[slot - 1];
+                                        slot--;
+                                }
+                                dists_sqr[slot] = d;
+                                indices[slot] = _indices[first + lane];
+
+                                if ( found == k )
+                                {
+                                        worst = dists_sqr[k - 1];
+                                }
+                        }
+                }
+        }
+
+        return found;
+}
+
+/**
+ * Finds the point closest to each of the indicated positions. out[i]
+ * receives the index of the point closest to pts[i], or -1 if the tree is
+ * empty.
+ */
+void PointKDTree::find_nearest_batch( const LPoint3 *pts, int *out, size_t count ) const
+{
+        for ( size_t i = 0; i < count; i++ )
+        {
+                out[i] = find_nearest( pts[i] );
+        }
+}
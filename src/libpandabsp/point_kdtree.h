@@ -0,0 +1,85 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file point_kdtree.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef POINT_KDTREE_H
+#define POINT_KDTREE_H
+
+#include "config_bsp.h"
+#include "mathlib/ssemath.h"
+
+#include <pvector.h>
+#include <luse.h>
+#include <referenceCount.h>
+
+/**
+ * A node of a PointKDTree. The front child of an interior node always
+ * directly follows it.
+ */
+struct kdtreenode_t
+{
+        // Splitting plane along the axis.
+        float split;
+
+        // 0, 1 or 2 for the splitting axis, or -1 if this is a leaf.
+        int axis;
+
+        // Interior node: index of the back child ( coordinates >= split ).
+        // Leaf: first point in the leaf, always a multiple of four.
+        int first;
+
+        // Number of points in the leaf.
+        int count;
+};
+
+/**
+ * A 3D k-d tree of points for nearest neighbour queries. The nodes live in
+ * one contiguous array and the points of each leaf are stored
+ * structure-of-arrays so they can be measured four at a time. Queries
+ * don't allocate any memory.
+ */
+class EXPCL_PANDABSP PointKDTree : public ReferenceCount
+{
+public:
+        PointKDTree();
+
+        void build( const LPoint3 *points, size_t count );
+        void clear();
+
+        INLINE size_t get_num_points() const
+        {
+                return _num_points;
+        }
+
+        int find_nearest( const LPoint3 &pos, float *dist_sqr = nullptr ) const;
+        int find_k_nearest( const LPoint3 &pos, int k, int *indices, float *dists_sqr ) const;
+
+        void find_nearest_batch( const LPoint3 *pts, int *out, size_t count ) const;
+
+private:
+        int build_node( int *order, const LPoint3 *points, int begin, int end );
+        void add_leaf( kdtreenode_t &node, const int *order, const LPoint3 *points, int begin, int end );
+
+private:
+        pvector<kdtreenode_t> _nodes;
+
+        // Points of every leaf, padded to a multiple of four with points
+        // that are infinitely far away.
+        pvector<float> _xs;
+        pvector<float> _ys;
+        pvector<float> _zs;
+
+        // Index the point was given to build() with.
+        pvector<int> _indices;
+
+        size_t _num_points;
+};
+
+#endif // POINT_KDTREE_H
@@ -145,16 +145,11 @@ void Py_BSPLoader::remove_py_entity( PyObject *obj )
 	}
 }
 
-bool Py_BSPLoader::read( const Filename &filename, bool is_transition )
+void Py_BSPLoader::finish_read( bool is_transition )
 {
-	if ( !BSPLoader::read( filename, is_transition ) )
-	{
-		return false;
-	}
+	BSPLoader::finish_read( is_transition );
 
 	spawn_entities();
-
-	return true;
 }
 
 void Py_BSPLoader::spawn_entities()
@@ -463,12 +458,9 @@ void Py_AI_BSPLoader::load_entities()
 	}
 }
 
-bool Py_AI_BSPLoader::read( const Filename &filename, bool is_transition )
+void Py_AI_BSPLoader::finish_read( bool is_transition )
 {
-	if ( !Py_BSPLoader::read( filename, is_transition ) )
-	{
-		return false;
-	}
+	Py_BSPLoader::finish_read( is_transition );
 
 	if ( is_transition )
 	{
@@ -518,8 +510,6 @@ bool Py_AI_BSPLoader::read( const Filename &filename, bool is_transition )
 
 		clear_transition_landmark();
 	}
-
-	return true;
 }
 
 void Py_AI_BSPLoader::load_geometry()
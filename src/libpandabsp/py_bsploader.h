@@ -38,7 +38,8 @@ PUBLISHED:
 
 	void remove_py_entity( PyObject *ent );
 
-	virtual bool read( const Filename &filename, bool is_transition = false );
+protected:
+	virtual void finish_read( bool is_transition );
 
 protected:
 	pvector<entitydef_t> _entities;
@@ -91,12 +92,11 @@ PUBLISHED:
 		_transition_source_landmark = NodePath();
 	}
 
-	virtual bool read( const Filename &filename, bool is_transition = false );
-
 protected:
 	virtual void load_geometry();
 	virtual void cleanup_entities( bool is_transition );
 	virtual void load_entities();
+	virtual void finish_read( bool is_transition );
 
 private:
 	// entity name to distributed object class
@@ -0,0 +1,436 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file shader_disk_cache.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "shader_disk_cache.h"
+#include "shader_spec.h"
+#include "shader_generator.h"
+
+#include <asyncTaskManager.h>
+#include <configVariableBool.h>
+#include <configVariableDouble.h>
+#include <configVariableFilename.h>
+#include <graphicsStateGuardian.h>
+#include <lightMutexHolder.h>
+#include <string_utils.h>
+#include <trueClock.h>
+#include <typedWritableReferenceCount.h>
+#include <virtualFileSystem.h>
+
+#include <iomanip>
+
+static ConfigVariableBool shader_disk_cache
+( "shader-disk-cache", true, "Keeps generated shaders on disk so they don't have to be generated "
+  "and compiled again next time." );
+static ConfigVariableFilename shader_disk_cache_dir
+( "shader-disk-cache-dir", Filename( "shadercache" ), "Where the shader disk cache is kept." );
+static ConfigVariableDouble shader_disk_cache_save_interval
+( "shader-disk-cache-save-interval", 30.0, "Seconds between writes of new shaders to the disk cache. "
+  "A shader is only written once it is this old, so that the GSG has had a chance to compile it." );
+static ConfigVariableBool shader_warmup
+( "shader-warmup", true, "Generates the shaders that were used in past sessions on a background "
+  "thread when a shader is added." );
+
+ShaderDiskCache::ShaderDiskCache() :
+        _lock( "ShaderDiskCache" ),
+        _last_save( 0.0 )
+{
+}
+
+ShaderDiskCache *ShaderDiskCache::get_global_ptr()
+{
+        static ShaderDiskCache cache;
+        return &cache;
+}
+
+bool ShaderDiskCache::is_enabled() const
+{
+        return shader_disk_cache.get_value();
+}
+
+Filename ShaderDiskCache::get_shader_filename( const ShaderSpec *spec, const std::string &defines ) const
+{
+        size_t hash = string_hash::add_hash( spec->get_source_hash(), defines );
+
+        std::ostringstream ss;
+        ss << std::hex << std::setw( sizeof( size_t ) * 2 ) << std::setfill( '0' ) << hash << ".bam";
+
+        return Filename( Filename( shader_disk_cache_dir.get_value(), spec->get_name() ), ss.str() );
+}
+
+Filename ShaderDiskCache::get_permutations_filename( const std::string &spec_name ) const
+{
+        return Filename( Filename( shader_disk_cache_dir.get_value(), spec_name ), "permutations.txt" );
+}
+
+/**
+ * Returns the permutations noted for the spec, reading them from disk the
+ * first time. Assumes the lock is held.
+ */
+ShaderDiskCache::speclist_t &ShaderDiskCache::get_spec_list( const std::string &spec_name )
+{
+        auto itr = _permutations.find( spec_name );
+        if ( itr != _permutations.end() )
+        {
+                return itr->second;
+        }
+
+        speclist_t &list = _permutations[spec_name];
+        list.loaded = true;
+        list.dirty = false;
+
+        VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
+        Filename filename = get_permutations_filename( spec_name );
+        if ( vfs->exists( filename ) )
+        {
+                std::string data = vfs->read_file( filename, true );
+                vector_string lines;
+                tokenize( data, lines, "\r\n", true );
+                for ( size_t i = 0; i < lines.size(); i++ )
+                {
+                        if ( !lines[i].empty() )
+                        {
+                                list.keys.insert( lines[i] );
+                        }
+                }
+        }
+
+        return list;
+}
+
+/**
+ * Returns the shader generated from the indicated source, if one was made
+ * earlier in this session or is on disk. Returns nullptr if the shader
+ * has to be made.
+ */
+PT( Shader ) ShaderDiskCache::find( const ShaderSpec *spec, const std::string &defines, const std::string &vshader,
+                                   const std::string &fshader, const std::string &gshader )
+{
+        std::string key = spec->get_name() + "\n" + defines;
+
+        {
+                LightMutexHolder holder( _lock );
+                auto itr = _shaders.find( key );
+                if ( itr != _shaders.end() )
+                {
+                        return itr->second.shader;
+                }
+        }
+
+        if ( !is_enabled() )
+        {
+                return nullptr;
+        }
+
+        VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
+        Filename filename = get_shader_filename( spec, defines );
+        if ( !vfs->exists( filename ) )
+        {
+                return nullptr;
+        }
+
+        vector_uchar data;
+        if ( !vfs->read_file( filename, data, true ) )
+        {
+                return nullptr;
+        }
+
+        PT( TypedWritableReferenceCount ) object = TypedWritableReferenceCount::decode_from_bam_stream( std::move( data ) );
+        if ( object == nullptr || !object->is_of_type( Shader::get_class_type() ) )
+        {
+                bspShaderGenerator_cat.warning()
+                        << "Ignoring unreadable cached shader " << filename << "\n";
+                return nullptr;
+        }
+
+        PT( Shader ) shader = DCAST( Shader, object );
+
+        // Hashes can collide, make sure it's really the same shader.
+        if ( shader->get_text( Shader::ST_vertex ) != vshader ||
+             shader->get_text( Shader::ST_fragment ) != fshader ||
+             shader->get_text( Shader::ST_geometry ) != gshader )
+        {
+                return nullptr;
+        }
+
+        shader->set_cache_compiled_shader( true );
+
+        LightMutexHolder holder( _lock );
+        auto itr = _shaders.find( key );
+        if ( itr != _shaders.end() )
+        {
+                // Another thread got to it first.
+                return itr->second.shader;
+        }
+
+        entry_t entry;
+        entry.shader = shader;
+        entry.filename = filename;
+        entry.saved = true;
+        entry.created = TrueClock::get_global_ptr()->get_short_time();
+        _shaders[key] = entry;
+
+        return shader;
+}
+
+/**
+ * Records a newly made shader, to be written out by a later save().
+ */
+void ShaderDiskCache::add( const ShaderSpec *spec, const std::string &defines, Shader *shader )
+{
+        // Keep the compiled program around so it goes in the bam file.
+        shader->set_cache_compiled_shader( true );
+
+        std::string key = spec->get_name() + "\n" + defines;
+
+        LightMutexHolder holder( _lock );
+        if ( _shaders.find( key ) != _shaders.end() )
+        {
+                return;
+        }
+
+        entry_t entry;
+        entry.shader = shader;
+        entry.filename = get_shader_filename( spec, defines );
+        entry.saved = !is_enabled();
+        entry.created = TrueClock::get_global_ptr()->get_short_time();
+        _shaders[key] = entry;
+}
+
+/**
+ * Remembers that the spec was asked for this permutation, so that the next
+ * session can make it ahead of time.
+ */
+void ShaderDiskCache::note_permutation( const ShaderSpec *spec, const ShaderPermutations *perms )
+{
+        if ( !is_enabled() )
+        {
+                return;
+        }
+
+        std::string key = perms->get_key();
+
+        LightMutexHolder holder( _lock );
+        speclist_t &list = get_spec_list( spec->get_name() );
+        if ( list.keys.insert( key ).second )
+        {
+                list.dirty = true;
+        }
+}
+
+/**
+ * Makes each permutation that the spec was asked for in past sessions on a
+ * background thread, and queues the shaders to be prepared on the GSG.
+ */
+void ShaderDiskCache::warm( ShaderSpec *spec, GraphicsStateGuardian *gsg )
+{
+        if ( !is_enabled() || !shader_warmup.get_value() )
+        {
+                return;
+        }
+
+        warmup_t *warmup = new warmup_t;
+        warmup->spec = spec;
+        warmup->prepared_objects = gsg != nullptr ? gsg->get_prepared_objects() : nullptr;
+        warmup->next_key = 0;
+
+        {
+                LightMutexHolder holder( _lock );
+                speclist_t &list = get_spec_list( spec->get_name() );
+                warmup->keys.assign( list.keys.begin(), list.keys.end() );
+        }
+
+        if ( warmup->keys.empty() )
+        {
+                delete warmup;
+                return;
+        }
+
+        bspShaderGenerator_cat.info()
+                << "Warming " << warmup->keys.size() << " permutations of shader " << spec->get_name() << "\n";
+
+        PT( GenericAsyncTask ) task = new GenericAsyncTask( "warmShaders-" + spec->get_name(), warmup_task, warmup );
+        task->set_upon_death( warmup_death );
+        task->set_task_chain( get_background_chain()->get_name() );
+        AsyncTaskManager::get_global_ptr()->add( task );
+}
+
+/**
+ * Returns the low priority chain that warming and saving run on.
+ */
+AsyncTaskChain *ShaderDiskCache::get_background_chain()
+{
+        AsyncTaskManager *mgr = AsyncTaskManager::get_global_ptr();
+        AsyncTaskChain *chain = mgr->find_task_chain( "bsp-shader-warmup" );
+        if ( chain == nullptr )
+        {
+                chain = mgr->make_task_chain( "bsp-shader-warmup" );
+                chain->set_num_threads( 1 );
+                chain->set_thread_priority( TP_low );
+        }
+
+        return chain;
+}
+
+/**
+ * Makes one permutation per run, so a level load isn't held up behind a
+ * long list.
+ */
+AsyncTask::DoneStatus ShaderDiskCache::warmup_task( GenericAsyncTask *task, void *data )
+{
+        warmup_t *warmup = (warmup_t *)data;
+
+        if ( warmup->next_key >= warmup->keys.size() )
+        {
+                return AsyncTask::DS_done;
+        }
+
+        PT( ShaderPermutations ) perms = new ShaderPermutations;
+        perms->add_key( warmup->keys[warmup->next_key++] );
+        perms->complete();
+
+        PT( Shader ) shader = BSPShaderGenerator::make_shader( warmup->spec, perms );
+        if ( shader != nullptr && warmup->prepared_objects != nullptr )
+        {
+                shader->prepare( warmup->prepared_objects );
+        }
+
+        return AsyncTask::DS_cont;
+}
+
+/**
+ * Frees the warmup when its task finishes or is removed.
+ */
+void ShaderDiskCache::warmup_death( GenericAsyncTask *task, bool clean_exit, void *data )
+{
+        delete (warmup_t *)data;
+}
+
+/**
+ * Writes the shaders and permutations that are new since the last save.
+ * Unless force is true, this does nothing until the save interval has
+ * passed, shaders younger than the interval wait for the next save, and
+ * the files are encoded and written on the background chain rather than
+ * the calling thread. A forced save writes before returning.
+ */
+void ShaderDiskCache::save( bool force )
+{
+        if ( !is_enabled() )
+        {
+                return;
+        }
+
+        double interval = shader_disk_cache_save_interval.get_value();
+        double now = TrueClock::get_global_ptr()->get_short_time();
+
+        savejob_t *job = new savejob_t;
+        pvector<std::pair<Filename, PT( Shader )>> &shaders = job->shaders;
+        pvector<std::pair<Filename, std::string>> &lists = job->lists;
+
+        {
+                LightMutexHolder holder( _lock );
+
+                if ( !force && now - _last_save < interval )
+                {
+                        delete job;
+                        return;
+                }
+                _last_save = now;
+
+                for ( auto itr = _shaders.begin(); itr != _shaders.end(); ++itr )
+                {
+                        entry_t &entry = itr->second;
+                        if ( entry.saved || ( !force && now - entry.created < interval ) )
+                        {
+                                continue;
+                        }
+                        entry.saved = true;
+                        shaders.push_back( std::make_pair( entry.filename, entry.shader ) );
+                }
+
+                for ( auto itr = _permutations.begin(); itr != _permutations.end(); ++itr )
+                {
+                        speclist_t &list = itr->second;
+                        if ( !list.dirty )
+                        {
+                                continue;
+                        }
+                        list.dirty = false;
+
+                        std::ostringstream ss;
+                        for ( auto kitr = list.keys.begin(); kitr != list.keys.end(); ++kitr )
+                        {
+                                ss << *kitr << "\n";
+                        }
+                        lists.push_back( std::make_pair( get_permutations_filename( itr->first ), ss.str() ) );
+                }
+        }
+
+        if ( shaders.empty() && lists.empty() )
+        {
+                delete job;
+                return;
+        }
+
+        if ( force )
+        {
+                write_files( job );
+                delete job;
+                return;
+        }
+
+        PT( GenericAsyncTask ) task = new GenericAsyncTask( "saveShaderCache", save_task, job );
+        task->set_upon_death( save_death );
+        task->set_task_chain( get_background_chain()->get_name() );
+        AsyncTaskManager::get_global_ptr()->add( task );
+}
+
+AsyncTask::DoneStatus ShaderDiskCache::save_task( GenericAsyncTask *task, void *data )
+{
+        write_files( (const savejob_t *)data );
+        return AsyncTask::DS_done;
+}
+
+void ShaderDiskCache::save_death( GenericAsyncTask *task, bool clean_exit, void *data )
+{
+        delete (savejob_t *)data;
+}
+
+void ShaderDiskCache::write_files( const savejob_t *job )
+{
+        const pvector<std::pair<Filename, PT( Shader )>> &shaders = job->shaders;
+        const pvector<std::pair<Filename, std::string>> &lists = job->lists;
+
+        VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
+
+        for ( size_t i = 0; i < shaders.size(); i++ )
+        {
+                const Filename &filename = shaders[i].first;
+                vector_uchar data;
+                if ( !shaders[i].second->encode_to_bam_stream( data ) )
+                {
+                        continue;
+                }
+
+                vfs->make_directory_full( filename.get_dirname() );
+                if ( !vfs->write_file( filename, data.data(), data.size(), false ) )
+                {
+                        bspShaderGenerator_cat.warning()
+                                << "Couldn't write cached shader " << filename << "\n";
+                }
+        }
+
+        for ( size_t i = 0; i < lists.size(); i++ )
+        {
+                const Filename &filename = lists[i].first;
+                vfs->make_directory_full( filename.get_dirname() );
+                vfs->write_file( filename, lists[i].second, false );
+        }
+}
@@ -0,0 +1,112 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file shader_disk_cache.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef SHADER_DISK_CACHE_H
+#define SHADER_DISK_CACHE_H
+
+#include "config_bsp.h"
+
+#include <shader.h>
+#include <filename.h>
+#include <lightMutex.h>
+#include <pmap.h>
+#include <pset.h>
+#include <vector_string.h>
+#include <genericAsyncTask.h>
+#include <preparedGraphicsObjects.h>
+
+class ShaderSpec;
+class ShaderPermutations;
+class GraphicsStateGuardian;
+
+/**
+ * Keeps generated shaders on disk between sessions.
+ *
+ * Each shader is written as a bam file named after its ShaderSpec, its
+ * #defines and the hash of the spec's source files. The Shader is flagged
+ * to cache its compiled program, so when the GSG supports program binaries
+ * the bam file carries the binary too, and the driver doesn't have to
+ * compile the GLSL again.
+ *
+ * The permutations that each spec was asked for are also written out. On
+ * the next launch they are generated and queued for preparation on a
+ * background thread before anything asks for them.
+ */
+class EXPCL_PANDABSP ShaderDiskCache
+{
+public:
+        ShaderDiskCache();
+
+        PT( Shader ) find( const ShaderSpec *spec, const std::string &defines, const std::string &vshader,
+                           const std::string &fshader, const std::string &gshader );
+        void add( const ShaderSpec *spec, const std::string &defines, Shader *shader );
+
+        void note_permutation( const ShaderSpec *spec, const ShaderPermutations *perms );
+        void warm( ShaderSpec *spec, GraphicsStateGuardian *gsg );
+
+        void save( bool force );
+
+        bool is_enabled() const;
+
+        static ShaderDiskCache *get_global_ptr();
+
+private:
+        struct entry_t
+        {
+                PT( Shader ) shader;
+                Filename filename;
+                bool saved;
+                double created;
+        };
+
+        struct warmup_t
+        {
+                PT( ShaderSpec ) spec;
+                // Held instead of the GSG, which may be closed while we are
+                // still warming.
+                PT( PreparedGraphicsObjects ) prepared_objects;
+                vector_string keys;
+                size_t next_key;
+        };
+
+        struct savejob_t
+        {
+                pvector<std::pair<Filename, PT( Shader )>> shaders;
+                pvector<std::pair<Filename, std::string>> lists;
+        };
+
+        struct speclist_t
+        {
+                pset<std::string> keys;
+                bool loaded;
+                bool dirty;
+        };
+
+        Filename get_shader_filename( const ShaderSpec *spec, const std::string &defines ) const;
+        Filename get_permutations_filename( const std::string &spec_name ) const;
+        speclist_t &get_spec_list( const std::string &spec_name );
+
+        static AsyncTaskChain *get_background_chain();
+        static AsyncTask::DoneStatus warmup_task( GenericAsyncTask *task, void *data );
+        static void warmup_death( GenericAsyncTask *task, bool clean_exit, void *data );
+        static AsyncTask::DoneStatus save_task( GenericAsyncTask *task, void *data );
+        static void save_death( GenericAsyncTask *task, bool clean_exit, void *data );
+        static void write_files( const savejob_t *job );
+
+private:
+        LightMutex _lock;
+
+        pmap<std::string, entry_t> _shaders;
+        pmap<std::string, speclist_t> _permutations;
+        double _last_save;
+};
+
+#endif // SHADER_DISK_CACHE_H
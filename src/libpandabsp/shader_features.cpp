@@ -15,10 +15,14 @@
 #include "shader_spec.h"
 
 #include <texturePool.h>
+#include <lightMutexHolder.h>
 
+static LightMutex brdf_lut_mutex( "BRDFLutMutex" );
 static PT( Texture ) brdf_lut = nullptr;
 static Texture *get_brdf_lut()
 {
+        LightMutexHolder holder( brdf_lut_mutex );
+
         if ( !brdf_lut )
         {
                 brdf_lut = TexturePool::load_texture( "materials/engine/brdf_lut.png" );
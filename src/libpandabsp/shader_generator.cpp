@@ -16,6 +16,7 @@
 #include "cubemaps.h"
 #include "aux_data_attrib.h"
 #include "bsploader.h"
+#include "shader_disk_cache.h"
 
 #include <pStatTimer.h>
 #include <config_pgraphnodes.h>
@@ -49,7 +50,6 @@
 using namespace std;
 
 static LightMutex cubemap_mutex( "CubemapMutex" );
-static LightMutex synthesize_mutex( "SynthesizeMutex" );
 
 static PStatCollector findmatshader_collector( "*:Munge:BSPShaderGen:FindMatShader" );
 static PStatCollector lookup_collector( "*:Munge:BSPShaderGen:Lookup" );
@@ -185,6 +185,16 @@ BSPShaderGenerator::BSPShaderGenerator( GraphicsOutput *output, GraphicsStateGua
                         cam->set_camera_mask( CAMERA_SHADOW );
                 }
 
+                // All of the cascades are rendered by the first camera. Only draw
+                // casters in the leafs that the main camera can see and that one of
+                // the cascades covers.
+                PT( VisibilityContext ) vis_context = new VisibilityContext( VisibilityContext::VM_main_view_frustum );
+                for ( int i = 0; i < pssm_splits; i++ )
+                {
+                        vis_context->add_frustum_camera( _pssm_rig->get_camera( i ) );
+                }
+                vis_context->attach( _pssm_rig->get_camera( 0 ) );
+
                 PT( DisplayRegion ) dr = _pssm_layered_buffer->make_display_region();
                 dr->disable_clears();
                 dr->set_clear_depth_active( true );
@@ -207,7 +217,18 @@ void BSPShaderGenerator::set_shader_quality( int quality )
 void BSPShaderGenerator::add_shader( PT( ShaderSpec ) shader )
 {
         _shaders[shader->get_name()] = shader;
-	//shader->precache();
+
+        // Make the permutations that were used last time in the background.
+        ShaderDiskCache::get_global_ptr()->warm( shader, _gsg );
+}
+
+/**
+ * Writes any shaders that are not yet in the disk cache right away, instead
+ * of waiting for the next save interval. Call this before shutting down.
+ */
+void BSPShaderGenerator::save_shader_cache()
+{
+        ShaderDiskCache::get_global_ptr()->save( true );
 }
 
 void BSPShaderGenerator::set_sun_light( const NodePath &np )
@@ -235,6 +256,8 @@ void BSPShaderGenerator::update()
 {
 	_planar_reflections->update();
 
+        ShaderDiskCache::get_global_ptr()->save( false );
+
         if ( want_pssm )
         {
                 if ( _sunlight.is_empty() & _has_shadow_sunlight )
@@ -311,7 +334,9 @@ CPT( RenderAttrib ) apply_node_inputs( const RenderState *rs, CPT( RenderAttrib
 CPT( ShaderAttrib ) BSPShaderGenerator::synthesize_shader( const RenderState *rs,
         const GeomVertexAnimationSpec &anim )
 {
-	LightMutexHolder holder( synthesize_mutex );
+        // This runs on any thread that munges states. Nothing here holds a
+        // lock for long: the shader cache locks per shard and compiles each
+        // permutation once.
 
         findmatshader_collector.start();
 
@@ -334,7 +359,8 @@ CPT( ShaderAttrib ) BSPShaderGenerator::synthesize_shader( const RenderState *rs
                 shader_name = mat->get_shader();
         }
 
-        if ( _shaders.find( shader_name ) == _shaders.end() )
+        auto sitr = _shaders.find( shader_name );
+        if ( sitr == _shaders.end() )
         {
                 // We haven't heard about this shader, they must've not called
                 // add_shader().
@@ -361,9 +387,7 @@ CPT( ShaderAttrib ) BSPShaderGenerator::synthesize_shader( const RenderState *rs
         findmatshader_collector.stop();
 
 	PT( ShaderPermutations ) permutations = new ShaderPermutations;
-        ShaderSpec *spec;
-
-        spec = _shaders[shader_name];
+        ShaderSpec *spec = sitr->second;
 
 	gen_perms_collector.start();
         spec->setup_permutations( *permutations, mat, rs, anim, this );
@@ -376,17 +400,15 @@ CPT( ShaderAttrib ) BSPShaderGenerator::synthesize_shader( const RenderState *rs
         if ( cache_shaders )
         {
 		PStatTimer timer( lookup_collector );
-#ifdef SHADER_PERMS_UNORDERED_MAP
-                auto itr = spec->_generated_shaders.find( permutations );
-                if ( itr != spec->_generated_shaders.end() )
-                {
-			CPT( ShaderAttrib ) shattr = itr->second;
-#else
-		int itr = spec->_generated_shaders.find( permutations );
-		if ( itr != -1 )
+		bool claimed;
+		CPT( ShaderAttrib ) shattr = spec->_generated_shaders.find_or_claim( permutations, claimed );
+		if ( claimed )
 		{
-			CPT( ShaderAttrib ) shattr = spec->_generated_shaders.get_data( itr );
-#endif
+			ShaderDiskCache::get_global_ptr()->note_permutation( spec, permutations );
+		}
+		else
+		{
+			nassertr( shattr != nullptr, nullptr );
                         shattr = DCAST( ShaderAttrib, apply_node_inputs( rs, shattr ) );
 
                         return shattr;
@@ -394,9 +416,14 @@ CPT( ShaderAttrib ) BSPShaderGenerator::synthesize_shader( const RenderState *rs
         }
 
 	synthesize_collector.start();
-	CPT( Shader ) shader = make_shader( spec, permutations );
+	PT( Shader ) shader = make_shader( spec, permutations );
 	synthesize_collector.stop();
 
+        if ( shader == nullptr && cache_shaders )
+        {
+                // Let anyone waiting on it go.
+                spec->_generated_shaders.fulfill( permutations, nullptr );
+        }
         nassertr( shader != nullptr, nullptr );
 
 	make_attrib_collector.start();
@@ -415,7 +442,7 @@ CPT( ShaderAttrib ) BSPShaderGenerator::synthesize_shader( const RenderState *rs
         CPT( ShaderAttrib ) attr = DCAST( ShaderAttrib, shattr );
 
         if ( cache_shaders )
-                spec->_generated_shaders[permutations] = attr;
+                spec->_generated_shaders.fulfill( permutations, attr );
 
         shattr = apply_node_inputs( rs, shattr );
         attr = DCAST( ShaderAttrib, shattr );
@@ -446,29 +473,48 @@ Texture *BSPShaderGenerator::get_identity_cubemap()
         return _identity_cubemap;
 }
 
-CPT( Shader ) BSPShaderGenerator::make_shader( const ShaderSpec *spec, const ShaderPermutations *perms )
+/**
+ * Returns the shader for the indicated permutation of the spec, from the
+ * shader disk cache if it is there.
+ */
+PT( Shader ) BSPShaderGenerator::make_shader( const ShaderSpec *spec, const ShaderPermutations *perms )
 {
 	std::ostringstream vshader, gshader, fshader;
+	std::string defines = perms->get_defines();
 
 	// Slip the defines into the shader source.
 	if ( spec->_vertex.has )
 	{
 		vshader << spec->_vertex.before_defines
-			<< "\n" << perms->permutations
+			<< "\n" << defines
 			<< spec->_vertex.after_defines;
 	}
 	if ( spec->_geom.has )
 	{
 		gshader << spec->_geom.before_defines
-			<< "\n" << perms->permutations
+			<< "\n" << defines
 			<< spec->_geom.after_defines;
 	}
 	if ( spec->_pixel.has )
 	{
 		fshader << spec->_pixel.before_defines
-			<< "\n" << perms->permutations
+			<< "\n" << defines
 			<< spec->_pixel.after_defines;
 	}
 
-	return Shader::make( Shader::SL_GLSL, vshader.str(), fshader.str(), gshader.str() );
+	ShaderDiskCache *cache = ShaderDiskCache::get_global_ptr();
+
+	PT( Shader ) shader = cache->find( spec, defines, vshader.str(), fshader.str(), gshader.str() );
+	if ( shader != nullptr )
+	{
+		return shader;
+	}
+
+	shader = Shader::make( Shader::SL_GLSL, vshader.str(), fshader.str(), gshader.str() );
+	if ( shader != nullptr )
+	{
+		cache->add( spec, defines, shader );
+	}
+
+	return shader;
 }
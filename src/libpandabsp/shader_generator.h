@@ -83,6 +83,8 @@ PUBLISHED:
 
         void add_shader( PT( ShaderSpec ) spec );
 
+        void save_shader_cache();
+
 	INLINE LVector3 get_sun_vector() const
 	{
 		return _sun_vector;
@@ -161,7 +163,7 @@ PUBLISHED:
         static void set_identity_cubemap( Texture *tex );
         static Texture *get_identity_cubemap();
 
-	static CPT( Shader ) make_shader( const ShaderSpec *spec, const ShaderPermutations *perms );
+	static PT( Shader ) make_shader( const ShaderSpec *spec, const ShaderPermutations *perms );
 
         void update();
 
@@ -18,6 +18,365 @@
 
 #include <virtualFileSystem.h>
 #include <colorBlendAttrib.h>
+#include <textureAttrib.h>
+#include <lightMutexHolder.h>
+#include <mutexHolder.h>
+#include <atomicAdjust.h>
+
+// Numbers given to #define names and values, shared by every shader. The
+// names and values only ever get added to, and each one is written before
+// the count that covers it is published, so they can be read up to the count
+// without the lock. The lock is only taken to give out a new number.
+static LightMutex perms_registry_mutex( "ShaderPermutationsRegistry" );
+static pmap<std::string, int> define_indices;
+static std::string define_names[SHADER_MAX_DEFINES];
+static AtomicAdjust::Integer num_define_names = 0;
+static pmap<std::string, int> value_indices;
+// Allocated a chunk at a time, so that they never move.
+#define VALUE_CHUNK_SIZE 256
+#define MAX_VALUE_CHUNKS 256
+static std::string *value_chunks[MAX_VALUE_CHUNKS];
+static AtomicAdjust::Integer num_value_strings = 0;
+
+// The numbers that this thread has already looked up, so that setting up a
+// permutation only takes the lock the first time the thread sees a name or
+// value.
+static thread_local pmap<std::string, int> thread_define_indices;
+static thread_local pmap<std::string, int> thread_value_indices;
+
+static INLINE const std::string &get_value_string( int index )
+{
+	return value_chunks[index / VALUE_CHUNK_SIZE][index % VALUE_CHUNK_SIZE];
+}
+
+/**
+ * Returns the number of the indicated #define name, giving it one if it
+ * doesn't have one yet. Returns -1 if there are too many names already.
+ */
+int ShaderPermutations::get_define_index( const std::string &name )
+{
+	auto titr = thread_define_indices.find( name );
+	if ( titr != thread_define_indices.end() )
+	{
+		return titr->second;
+	}
+
+	LightMutexHolder holder( perms_registry_mutex );
+
+	int index;
+	auto itr = define_indices.find( name );
+	if ( itr != define_indices.end() )
+	{
+		index = itr->second;
+	}
+	else
+	{
+		index = (int)AtomicAdjust::get( num_define_names );
+		if ( index >= SHADER_MAX_DEFINES )
+		{
+			bspShaderGenerator_cat.error()
+				<< "Too many shader #defines, can't add " << name << ". "
+				<< "Raise SHADER_MAX_DEFINES.\n";
+			return -1;
+		}
+
+		define_names[index] = name;
+		define_indices[name] = index;
+		AtomicAdjust::set( num_define_names, index + 1 );
+	}
+
+	thread_define_indices[name] = index;
+	return index;
+}
+
+/**
+ * Returns the number of the indicated #define value, giving it one if it
+ * doesn't have one yet. Returns -1, which stands for the value 1, if there
+ * are too many values already.
+ */
+int ShaderPermutations::get_value_index( const std::string &value )
+{
+	auto titr = thread_value_indices.find( value );
+	if ( titr != thread_value_indices.end() )
+	{
+		return titr->second;
+	}
+
+	LightMutexHolder holder( perms_registry_mutex );
+
+	int index;
+	auto itr = value_indices.find( value );
+	if ( itr != value_indices.end() )
+	{
+		index = itr->second;
+	}
+	else
+	{
+		index = (int)AtomicAdjust::get( num_value_strings );
+		int chunk = index / VALUE_CHUNK_SIZE;
+		if ( chunk >= MAX_VALUE_CHUNKS )
+		{
+			bspShaderGenerator_cat.error()
+				<< "Too many shader #define values, can't add " << value << ".\n";
+			return -1;
+		}
+
+		if ( value_chunks[chunk] == nullptr )
+		{
+			value_chunks[chunk] = new std::string[VALUE_CHUNK_SIZE];
+		}
+
+		value_chunks[chunk][index % VALUE_CHUNK_SIZE] = value;
+		value_indices[value] = index;
+		AtomicAdjust::set( num_value_strings, index + 1 );
+	}
+
+	thread_value_indices[value] = index;
+	return index;
+}
+
+/**
+ * Sets the #define with the indicated value number, or -1 for the value 1.
+ * Adding a #define again replaces its value.
+ */
+void ShaderPermutations::set_define( const std::string &key, int value )
+{
+	int define = get_define_index( key );
+	if ( define < 0 )
+	{
+		return;
+	}
+
+	defines.set( define );
+
+	auto itr = std::lower_bound( values.begin(), values.end(), define,
+		[]( const DefineValue &dv, int d )
+	{
+		return dv.define < d;
+	} );
+	bool found = itr != values.end() && itr->define == define;
+
+	if ( value < 0 )
+	{
+		if ( found )
+		{
+			values.erase( itr );
+		}
+	}
+	else if ( found )
+	{
+		itr->value = value;
+	}
+	else
+	{
+		values.insert( itr, { define, value } );
+	}
+}
+
+/**
+ * Called when all of the permutations have been added, computes the hash
+ * that the shader cache uses.
+ */
+void ShaderPermutations::complete()
+{
+	hash = size_t_hash::add_hash( hash, std::hash<DefineBits>()( defines ) );
+	for ( size_t i = 0; i < values.size(); i++ )
+	{
+		hash = int_hash::add_hash( hash, values[i].define );
+		hash = int_hash::add_hash( hash, values[i].value );
+	}
+	hash = int_hash::add_hash( hash, flags );
+}
+
+bool ShaderPermutations::operator == ( const ShaderPermutations &other ) const
+{
+	if ( hash != other.hash ||
+	     flags != other.flags ||
+	     defines != other.defines ||
+	     values != other.values ||
+	     inputs.size() != other.inputs.size() )
+	{
+		return false;
+	}
+
+	for ( size_t i = 0; i < inputs.size(); i++ )
+	{
+		if ( !( inputs[i] == other.inputs[i] ) )
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Returns the #defines as (name, value) pairs, sorted by name so that the
+ * same permutation comes out the same way in every session.
+ */
+pvector<std::pair<std::string, std::string>> ShaderPermutations::get_define_list() const
+{
+	pvector<std::pair<std::string, std::string>> list;
+
+	size_t num_names = (size_t)AtomicAdjust::get( num_define_names );
+	size_t v = 0;
+	for ( size_t i = 0; i < num_names; i++ )
+	{
+		if ( !defines.test( i ) )
+		{
+			continue;
+		}
+
+		while ( v < values.size() && values[v].define < (int)i )
+		{
+			v++;
+		}
+		if ( v < values.size() && values[v].define == (int)i )
+		{
+			list.push_back( std::make_pair( define_names[i], get_value_string( values[v].value ) ) );
+		}
+		else
+		{
+			list.push_back( std::make_pair( define_names[i], std::string( "1" ) ) );
+		}
+	}
+
+	std::sort( list.begin(), list.end() );
+	return list;
+}
+
+/**
+ * Returns the #define lines to slip into the shader source.
+ */
+std::string ShaderPermutations::get_defines() const
+{
+	std::ostringstream ss;
+
+	pvector<std::pair<std::string, std::string>> list = get_define_list();
+	for ( size_t i = 0; i < list.size(); i++ )
+	{
+		ss << "#define " << list[i].first << " " << list[i].second << "\n";
+	}
+
+	return ss.str();
+}
+
+/**
+ * Returns the #defines as one line of NAME=VALUE pairs separated by
+ * semicolons, the form that the shader disk cache keeps them in.
+ */
+std::string ShaderPermutations::get_key() const
+{
+	std::ostringstream ss;
+
+	pvector<std::pair<std::string, std::string>> list = get_define_list();
+	for ( size_t i = 0; i < list.size(); i++ )
+	{
+		if ( i != 0 )
+		{
+			ss << ";";
+		}
+		ss << list[i].first << "=" << list[i].second;
+	}
+
+	return ss.str();
+}
+
+/**
+ * Adds the #defines of a key made by get_key().
+ */
+void ShaderPermutations::add_key( const std::string &key )
+{
+	vector_string pairs;
+	tokenize( key, pairs, ";" );
+	for ( size_t i = 0; i < pairs.size(); i++ )
+	{
+		size_t eq = pairs[i].find( '=' );
+		if ( eq == std::string::npos )
+		{
+			continue;
+		}
+		add_permutation( pairs[i].substr( 0, eq ), pairs[i].substr( eq + 1 ) );
+	}
+}
+
+//====================================================================//
+
+ShaderCache::Shard::Shard() :
+	lock( "ShaderCacheShard" ),
+	cvar( lock )
+{
+}
+
+ShaderCache::ShaderCache()
+{
+}
+
+/**
+ * Returns the shader generated for the permutations. If there isn't one and
+ * nobody is making it, returns nullptr with claimed set, and the caller must
+ * make it and pass it to fulfill(). If another thread is making it, waits
+ * for that thread to finish.
+ */
+CPT( ShaderAttrib ) ShaderCache::find_or_claim( const ShaderPermutations *perms, bool &claimed )
+{
+	Shard &shard = get_shard( perms );
+	MutexHolder holder( shard.lock );
+
+	CPT( ShaderPermutations ) key = perms;
+	while ( true )
+	{
+		auto itr = shard.entries.find( key );
+		if ( itr == shard.entries.end() )
+		{
+			shard.entries[key] = new Entry;
+			claimed = true;
+			return nullptr;
+		}
+
+		PT( Entry ) entry = itr->second;
+		while ( !entry->ready )
+		{
+			shard.cvar.wait();
+		}
+
+		if ( entry->attr != nullptr )
+		{
+			claimed = false;
+			return entry->attr;
+		}
+
+		// The thread making it failed and let go of the entry. Look again,
+		// which claims it if nobody else has.
+	}
+}
+
+/**
+ * Stores the shader made for permutations claimed with find_or_claim() and
+ * wakes up anyone waiting on it. attr may be nullptr if the shader could
+ * not be made, in which case the next lookup tries again.
+ */
+void ShaderCache::fulfill( const ShaderPermutations *perms, const ShaderAttrib *attr )
+{
+	Shard &shard = get_shard( perms );
+	MutexHolder holder( shard.lock );
+
+	CPT( ShaderPermutations ) key = perms;
+	auto itr = shard.entries.find( key );
+	nassertv( itr != shard.entries.end() );
+
+	PT( Entry ) entry = itr->second;
+	entry->attr = attr;
+	entry->ready = true;
+	if ( attr == nullptr )
+	{
+		shard.entries.erase( itr );
+	}
+
+	shard.cvar.notify_all();
+}
+
+//====================================================================//
 
 void ShaderSpec::ShaderSource::read( const Filename &file )
 {
@@ -72,10 +431,17 @@ void ShaderSpec::read_shader_files( const Filename &vert_file,
         _vertex.read( vert_file );
         _pixel.read( pixel_file );
         _geom.read( geom_file );
+
+        _source_hash = 0u;
+        _source_hash = string_hash::add_hash( _source_hash, _vertex.full_source );
+        _source_hash = string_hash::add_hash( _source_hash, _pixel.full_source );
+        _source_hash = string_hash::add_hash( _source_hash, _geom.full_source );
 }
 
 ShaderConfig *ShaderSpec::get_shader_config( const BSPMaterial *mat )
 {
+        LightMutexHolder holder( _config_lock );
+
         int idx = _config_cache.find( mat );
         if ( idx == -1 )
         {
@@ -128,6 +494,20 @@ void ShaderSpec::setup_permutations( ShaderPermutations &result,
 	{
 		result.add_permutation( "STATIC_PROP_LIGHTING" );
 	}
+	if ( spa->is_instanced() )
+	{
+		// Per-instance transforms, and lighting from a buffer texture
+		// instead of a vertex column.
+		result.add_permutation( "STATIC_PROP_INSTANCED" );
+
+		const TextureAttrib *ta;
+		state->get_attrib_def( ta );
+		Texture *lighting = ta->get_on_texture( TextureStages::get_static_prop_lighting() );
+		if ( lighting )
+		{
+			result.add_input( ShaderInput( "staticPropLightingSampler", lighting ) );
+		}
+	}
 
 	result.add_permutation( "NEED_AUX_BLOOM" );
 	const BloomAttrib *ba;
@@ -17,13 +17,17 @@
 #include <pmap.h>
 #include <shaderAttrib.h>
 #include <geomVertexAnimationSpec.h>
+#include <lightMutex.h>
+#include <pmutex.h>
+#include <conditionVar.h>
+#include <string_utils.h>
 
+#include <bitset>
+#include <sstream>
 #include <unordered_map>
 
 #include "config_bsp.h"
 
-#define SHADER_PERMS_UNORDERED_MAP
-
 class RenderState;
 class BSPShaderGenerator;
 class BSPMaterial;
@@ -75,12 +79,20 @@ public:
         virtual void parse_from_material_keyvalues( const BSPMaterial *mat ) = 0;
 };
 
+// Most distinct #define names that all of the shaders can use together.
+#define SHADER_MAX_DEFINES 256
+
 /**
  * Represents a list of #defines and variable inputs to a shader that is being generated.
+ *
+ * Each #define name is given a number the first time it is used, and the
+ * set of #defines is kept as a bitset of those numbers. #defines with a
+ * value other than 1 also go in a small array of (name, value) numbers.
+ * Two ShaderPermutations can be compared and hashed without looking at any
+ * strings, the source text is only made when the shader is compiled.
  */
 class ShaderPermutations : public ReferenceCount
 {
-#ifdef SHADER_PERMS_UNORDERED_MAP
 public:
 	class Hasher
 	{
@@ -96,14 +108,27 @@ public:
 	public:
 		INLINE bool operator ()( const CPT( ShaderPermutations ) &a, const CPT( ShaderPermutations ) &b ) const
 		{
-			return a->hash == b->hash;
+			return *a == *b;
+		}
+	};
+
+	typedef std::bitset<SHADER_MAX_DEFINES> DefineBits;
+
+	struct DefineValue
+	{
+		int define;
+		int value;
+
+		INLINE bool operator == ( const DefineValue &other ) const
+		{
+			return define == other.define && value == other.value;
 		}
 	};
-#endif
 
 public:
-	std::ostringstream permutations_stream;
-	std::string permutations;
+	DefineBits defines;
+	// Sorted by define.
+	pvector<DefineValue> values;
 
 	int flags;
 	vector_int flag_indices;
@@ -120,6 +145,7 @@ PUBLISHED:
 		// This should be enough for most shaders
 		inputs.reserve( 32 );
 		flag_indices.reserve( 32 );
+		values.reserve( 8 );
 		hash = 0u;
 		flags = 0;
 	}
@@ -127,21 +153,23 @@ PUBLISHED:
         template<class T>
         INLINE void add_permutation( const std::string &key, const T &value )
         {
-		permutations_stream << "#define " << key << " " << value << "\n";
+		std::ostringstream ss;
+		ss << value;
+		add_permutation( key, ss.str() );
         }
 
-	INLINE void add_permutation( const std::string &key, const std::string &value = "1" )
+	INLINE void add_permutation( const std::string &key, int value )
 	{
-		add_permutation<std::string>( key, value );
+		set_define( key, value == 1 ? -1 : get_value_index( format_string( value ) ) );
 	}
 
-	INLINE void complete()
+	INLINE void add_permutation( const std::string &key, const std::string &value = "1" )
 	{
-		permutations = permutations_stream.str();
-		hash = string_hash::add_hash( hash, permutations );
-		hash = int_hash::add_hash( hash, flags );
+		set_define( key, value == "1" ? -1 : get_value_index( value ) );
 	}
 
+	void complete();
+
 	INLINE void add_input( const ShaderInput &inp )
         {
 		hash = inp.add_hash( hash );
@@ -158,6 +186,75 @@ PUBLISHED:
         {
 		return hash;
         }
+
+public:
+	bool operator == ( const ShaderPermutations &other ) const;
+
+	pvector<std::pair<std::string, std::string>> get_define_list() const;
+	std::string get_defines() const;
+	std::string get_key() const;
+	void add_key( const std::string &key );
+
+	static int get_define_index( const std::string &name );
+	static int get_value_index( const std::string &value );
+
+private:
+	void set_define( const std::string &key, int value );
+};
+
+/**
+ * The shaders that have been generated for a ShaderSpec, by permutation.
+ *
+ * The map is split into shards that each have their own lock, so that
+ * lookups from different threads rarely wait on each other. A permutation
+ * is only ever compiled once: the first thread to ask for it claims it,
+ * and any other thread that asks in the meantime waits for that one.
+ */
+class EXPCL_PANDABSP ShaderCache
+{
+public:
+	ShaderCache();
+
+	CPT( ShaderAttrib ) find_or_claim( const ShaderPermutations *perms, bool &claimed );
+	void fulfill( const ShaderPermutations *perms, const ShaderAttrib *attr );
+
+private:
+	class Entry : public ReferenceCount
+	{
+	public:
+		INLINE Entry() :
+			ready( false )
+		{
+		}
+
+		CPT( ShaderAttrib ) attr;
+		bool ready;
+	};
+
+	typedef std::unordered_map<CPT( ShaderPermutations ), PT( Entry ),
+		ShaderPermutations::Hasher, ShaderPermutations::Compare> Entries;
+
+	class Shard
+	{
+	public:
+		Shard();
+
+		Mutex lock;
+		ConditionVar cvar;
+		Entries entries;
+	};
+
+	enum
+	{
+		num_shards = 16,
+	};
+
+	INLINE Shard &get_shard( const ShaderPermutations *perms )
+	{
+		return _shards[( perms->get_hash() >> 4 ) % num_shards];
+	}
+
+	Shard _shards[num_shards];
 };
 
 /**
@@ -209,14 +306,15 @@ public:
 
         typedef SimpleHashMap<const BSPMaterial *, PT( ShaderConfig ), pointer_hash> ConfigCache;
         ConfigCache _config_cache;
+        // Shaders are generated on several threads at once.
+        LightMutex _config_lock;
+
+        ShaderCache _generated_shaders;
 
-#ifdef SHADER_PERMS_UNORDERED_MAP
-	typedef std::unordered_map<CPT( ShaderPermutations ), CPT( ShaderAttrib ), ShaderPermutations::Hasher, ShaderPermutations::Compare> GeneratedShaders;
-#else
-	typedef indirect_method_hash<const ShaderPermutations *, std::equal_to<const ShaderPermutations *>> ShaderPermutationHashMethod;
-	typedef SimpleHashMap<CPT( ShaderPermutations ), CPT( ShaderAttrib ), ShaderPermutationHashMethod> GeneratedShaders;
-#endif
-        GeneratedShaders _generated_shaders;
+        INLINE size_t get_source_hash() const
+        {
+                return _source_hash;
+        }
         
         ShaderSource _vertex;
         ShaderSource _pixel;
@@ -238,6 +336,10 @@ public:
 private:
 	void r_precache( ShaderPrecacheCombos &combos );
 
+        // Hash of the source of every stage, so the disk cache can tell
+        // when the shader files have changed.
+        size_t _source_hash;
+
         static TypeHandle _type_handle;
 };
 
@@ -0,0 +1,728 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file static_prop_loader.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "static_prop_loader.h"
+#include "static_props.h"
+#include "bsploader.h"
+#include "bsp_render.h"
+#include "bsp_material.h"
+#include "shader_generator.h"
+#include "mathlib.h"
+
+#include <asyncTaskManager.h>
+#include <boundingBox.h>
+#include <configVariableBool.h>
+#include <configVariableInt.h>
+#include <geomNode.h>
+#include <geomVertexReader.h>
+#include <geomVertexWriter.h>
+#include <loader.h>
+#include <modelNode.h>
+#include <nodePathCollection.h>
+#include <pStatCollector.h>
+#include <pstatTimer.h>
+#include <textureAttrib.h>
+#include <thread.h>
+
+static ConfigVariableInt cfg_prop_threads
+( "static-prop-threads", 4, "Number of threads that prepare the static props of a level while it loads. "
+  "0 prepares them on the loading thread." );
+static ConfigVariableBool cfg_prop_instancing
+( "static-prop-instancing", false, "Draws static props that share a model with hardware instancing. "
+  "The shaders must handle the STATIC_PROP_INSTANCED permutation." );
+static ConfigVariableInt cfg_prop_instances_per_batch
+( "static-prop-instances-per-batch", 256, "Most static props drawn by one instanced Geom." );
+
+static PStatCollector prep_collector( "BSP:StaticProps:Prepare" );
+static PStatCollector build_collector( "BSP:StaticProps:Build" );
+
+static PT( InternalName ) static_vertex_lighting_name = InternalName::make( "static_vertex_lighting" );
+static PT( InternalName ) instance_matrix_name = InternalName::make( "instance_matrix" );
+static PT( InternalName ) instance_lighting_offset_name = InternalName::make( "instance_lighting_offset" );
+
+static void collect_geom_nodes( PandaNode *node, pvector<GeomNode *> &list )
+{
+        if ( node->is_geom_node() )
+        {
+                list.push_back( DCAST( GeomNode, node ) );
+        }
+
+        for ( int i = 0; i < node->get_num_children(); i++ )
+        {
+                collect_geom_nodes( node->get_child( i ), list );
+        }
+}
+
+bool StaticPropLoader::batchkey_t::operator < ( const batchkey_t &other ) const
+{
+        if ( model != other.model )
+        {
+                return model < other.model;
+        }
+        if ( flags != other.flags )
+        {
+                return flags < other.flags;
+        }
+        if ( static_lighting != other.static_lighting )
+        {
+                return static_lighting < other.static_lighting;
+        }
+        return cubemap < other.cubemap;
+}
+
+StaticPropLoader::StaticPropLoader( BSPLoader *loader ) :
+        _loader( loader ),
+        _bspdata( loader->get_bspdata() ),
+        _result( loader->get_result() ),
+        _next_instance( 0 )
+{
+}
+
+/**
+ * Loads every static prop of the level under the loader's result.
+ */
+void StaticPropLoader::load()
+{
+        _proplighting = GetLumpView<colorrgbexp32_t>( _bspdata, LUMP_STATICPROPLIGHTING );
+
+        // Load each model once, up front.
+        _instances.reserve( _bspdata->dstaticprops.size() );
+        for ( size_t propnum = 0; propnum < _bspdata->dstaticprops.size(); propnum++ )
+        {
+                const dstaticprop_t *prop = &_bspdata->dstaticprops[propnum];
+
+                propmodel_t *model = load_model( prop->name );
+                if ( model == nullptr )
+                {
+                        continue;
+                }
+
+                propinstance_t inst;
+                inst.prop = prop;
+                inst.model = model;
+                inst.static_lighting = false;
+                inst.cubemap = nullptr;
+                inst.leaf = 0;
+                _instances.push_back( inst );
+        }
+
+        prepare_instances();
+
+        PStatTimer timer( build_collector );
+
+        bool instancing = cfg_prop_instancing.get_value();
+        pmap<batchkey_t, pvector<propinstance_t *>> batches;
+        for ( size_t i = 0; i < _instances.size(); i++ )
+        {
+                propinstance_t &inst = _instances[i];
+                const dstaticprop_t *prop = inst.prop;
+
+                // Props that are lit per node or have Geoms without baked lighting
+                // keep a node of their own. So do baked lit props that get hard
+                // flattened, since flattening makes new Geoms that can't be
+                // matched up with their lighting anymore.
+                bool can_instance = instancing &&
+                        ( prop->flags & STATICPROPFLAGS_DYNAMICLIGHTING ) == 0 &&
+                        ( inst.static_lighting ?
+                          ( inst.model->all_lit && ( prop->flags & STATICPROPFLAGS_HARDFLATTEN ) == 0 ) :
+                          ( prop->flags & STATICPROPFLAGS_NOLIGHTING ) != 0 );
+                if ( !can_instance )
+                {
+                        make_prop( inst );
+                        continue;
+                }
+
+                batchkey_t key;
+                key.model = inst.model;
+                key.flags = prop->flags & ~STATICPROPFLAGS_GROUPFLATTEN;
+                key.static_lighting = inst.static_lighting;
+                key.cubemap = inst.cubemap;
+                batches[key].push_back( &inst );
+        }
+
+        for ( auto itr = batches.begin(); itr != batches.end(); ++itr )
+        {
+                pvector<propinstance_t *> &instances = itr->second;
+                if ( instances.size() < 2 )
+                {
+                        make_prop( *instances[0] );
+                        continue;
+                }
+
+                // Neighboring props end up in the same batch, so batches
+                // still cull well.
+                std::sort( instances.begin(), instances.end(), []( const propinstance_t *a, const propinstance_t *b )
+                {
+                        return a->leaf < b->leaf;
+                } );
+
+                size_t per_batch = (size_t)std::max( 2, cfg_prop_instances_per_batch.get_value() );
+                for ( size_t first = 0; first < instances.size(); first += per_batch )
+                {
+                        size_t count = std::min( per_batch, instances.size() - first );
+                        pvector<propinstance_t *> batch( instances.begin() + first, instances.begin() + first + count );
+                        make_instanced_props( itr->first, batch );
+                }
+        }
+
+        // any props with the STATICPROPFLAGS_GROUPFLATTEN bit
+        // have been grouped together under a common node,
+        // aggressively flatten them together.
+        if ( !_prop_group.is_empty() )
+        {
+                _loader->clear_model_nodes_below( _prop_group );
+                _prop_group.flatten_strong();
+        }
+}
+
+/**
+ * Returns the model with the indicated name, loading it the first time.
+ */
+StaticPropLoader::propmodel_t *StaticPropLoader::load_model( const std::string &name )
+{
+        auto itr = _models.find( name );
+        if ( itr != _models.end() )
+        {
+                return itr->second.model.is_empty() ? nullptr : &itr->second;
+        }
+
+        propmodel_t &model = _models[name];
+        model.name = name;
+        model.use_cubemap = false;
+        model.all_lit = true;
+
+        PT( PandaNode ) proproot = Loader::get_global_ptr()->load_sync( name );
+        if ( proproot == nullptr )
+        {
+                bspfile_cat.warning()
+                        << "Could not load static prop " << name << "\n";
+                return nullptr;
+        }
+
+        model.model = NodePath( proproot );
+        model.model.clear_model_nodes();
+        model.model.flatten_light();
+
+        // p3rad lit the Geoms of the model in scene graph order.
+        pvector<GeomNode *> geomnodes;
+        collect_geom_nodes( model.model.node(), geomnodes );
+        for ( size_t i = 0; i < geomnodes.size(); i++ )
+        {
+                GeomNode *gn = geomnodes[i];
+
+                bool lit = gn->get_name() != "__lightsource__";
+#ifdef CIO
+                // game specific code, yuck
+                //
+                // don't apply vertex lighting to shadow models
+                for ( int j = 0; j < gn->get_num_geoms() && lit; j++ )
+                {
+                        lit = !is_drop_shadow( gn->get_geom_state( j ) );
+                }
+#endif
+
+                for ( int j = 0; j < gn->get_num_geoms(); j++ )
+                {
+                        if ( lit )
+                        {
+                                const BSPMaterialAttrib *bma;
+                                gn->get_geom_state( j )->get_attrib_def( bma );
+                                if ( bma->get_material() && bma->get_material()->has_env_cubemap() )
+                                {
+                                        model.use_cubemap = true;
+                                }
+                        }
+
+                        model.geom_index[gn->get_geom( j )] = (int)model.geoms.size();
+                        model.geoms.push_back( gn->get_geom( j ) );
+                        model.geom_lit.push_back( lit );
+                        model.all_lit &= lit;
+                }
+        }
+
+        model.model.calc_tight_bounds( model.mins, model.maxs );
+
+        return &model;
+}
+
+/**
+ * Works out the placement and baked lighting of the prop. Runs on any
+ * thread, and only touches the instance.
+ */
+void StaticPropLoader::prepare_instance( propinstance_t &inst )
+{
+        const dstaticprop_t *prop = inst.prop;
+
+        LPoint3 pos( prop->pos[0], prop->pos[1], prop->pos[2] );
+        LVecBase3 hpr( prop->hpr[1] - 90, prop->hpr[0], prop->hpr[2] );
+        LVecBase3 scale( prop->scale[0], prop->scale[1], prop->scale[2] );
+        inst.transform = TransformState::make_pos_hpr_scale( pos / 16.0, hpr, scale );
+        inst.leaf = _loader->do_find_leaf( pos / 16.0 );
+
+        if ( prop->first_vertex_data == -1 ||
+             ( prop->flags & STATICPROPFLAGS_STATICLIGHTING ) == 0 ||
+             ( prop->flags & STATICPROPFLAGS_DYNAMICLIGHTING ) != 0 )
+        {
+                return;
+        }
+
+        const propmodel_t *model = inst.model;
+
+        // check for a mismatch
+        if ( model->geoms.size() != (size_t)prop->num_vertex_datas )
+        {
+                bspfile_cat.warning()
+                        << "Static prop " << prop->name << " vertex data count mismatch. "
+                        << "Will appear fullbright. "
+                        << "Has the model been changed since last map compile?\n";
+                bspfile_cat.warning()
+                        << "Loaded model has " << model->geoms.size() << " unique vertex datas,\n"
+                        << "dstaticprop has " << prop->num_vertex_datas << "\n";
+                return;
+        }
+
+        inst.static_lighting = true;
+        inst.lighting.resize( model->geoms.size() );
+
+        // The lighting goes in an array of its own, next to the shared
+        // vertex arrays of the model.
+        CPT( GeomVertexArrayFormat ) lighting_format = GeomVertexArrayFormat::register_format(
+                new GeomVertexArrayFormat( static_vertex_lighting_name, 4, GeomEnums::NT_uint16, GeomEnums::C_color ) );
+
+        for ( int i = 0; i < prop->num_vertex_datas; i++ )
+        {
+                const dstaticpropvertexdata_t *dvdata = &_bspdata->dstaticpropvertexdatas[prop->first_vertex_data + i];
+                int num_rows = model->geoms[i]->get_vertex_data()->get_num_rows();
+
+                if ( dvdata->num_lighting_samples != num_rows )
+                {
+                        bspfile_cat.warning()
+                                << "For static prop " << prop->name << ":\n"
+                                << "number of lighting samples does not match number of vertices in vdata\n"
+                                << "number of lighting samples: " << dvdata->num_lighting_samples << "\n"
+                                << "number of vertices: " << num_rows << "\n";
+                        continue;
+                }
+
+                if ( !model->geom_lit[i] )
+                {
+                        continue;
+                }
+
+                PT( GeomVertexArrayData ) lighting = new GeomVertexArrayData( lighting_format, GeomEnums::UH_static );
+                lighting->unclean_set_num_rows( num_rows );
+                {
+                        GeomVertexWriter color_mod( lighting, 0 );
+                        for ( int j = 0; j < dvdata->num_lighting_samples; j++ )
+                        {
+                                const colorrgbexp32_t *sample = &_proplighting[dvdata->first_lighting_sample + j];
+                                LVector3 vtx_rgb;
+                                ColorRGBExp32ToVector( *sample, vtx_rgb );
+                                vtx_rgb /= 255.0f;
+                                color_mod.set_data4f( LColorf( vtx_rgb[0], vtx_rgb[1], vtx_rgb[2], 1.0 ) );
+                        }
+                }
+                inst.lighting[i] = lighting;
+        }
+
+        if ( model->use_cubemap )
+        {
+                cubemap_t *cm = _loader->find_closest_cubemap( pos / 16.0 );
+                if ( cm )
+                {
+                        inst.cubemap = cm->cubemap_tex;
+                }
+        }
+}
+
+/**
+ * Takes props off of the list and prepares them until there are none left.
+ */
+AsyncTask::DoneStatus StaticPropLoader::prepare_task( GenericAsyncTask *task, void *data )
+{
+        StaticPropLoader *self = (StaticPropLoader *)data;
+        PStatTimer timer( prep_collector );
+
+        AtomicAdjust::Integer count = (AtomicAdjust::Integer)self->_instances.size();
+        while ( true )
+        {
+                AtomicAdjust::Integer i = AtomicAdjust::get( self->_next_instance );
+                if ( i >= count )
+                {
+                        break;
+                }
+                if ( AtomicAdjust::compare_and_exchange( self->_next_instance, i, i + 1 ) != i )
+                {
+                        // Another thread took it.
+                        continue;
+                }
+
+                self->prepare_instance( self->_instances[i] );
+        }
+
+        return AsyncTask::DS_done;
+}
+
+void StaticPropLoader::prepare_instances()
+{
+        AtomicAdjust::set( _next_instance, 0 );
+
+        int num_threads = cfg_prop_threads.get_value();
+        if ( num_threads <= 0 || _instances.size() < 2 || !Thread::is_threading_supported() )
+        {
+                prepare_task( nullptr, this );
+                return;
+        }
+
+        AsyncTaskManager *mgr = AsyncTaskManager::get_global_ptr();
+        AsyncTaskChain *chain = mgr->find_task_chain( "bsp-props" );
+        if ( chain == nullptr )
+        {
+                chain = mgr->make_task_chain( "bsp-props" );
+                chain->set_num_threads( num_threads );
+        }
+
+        for ( int i = 0; i < num_threads; i++ )
+        {
+                PT( GenericAsyncTask ) task = new GenericAsyncTask( "prepareStaticProps", prepare_task, this );
+                task->set_task_chain( "bsp-props" );
+                mgr->add( task );
+        }
+
+        // Help out, then wait for the stragglers.
+        prepare_task( nullptr, this );
+        chain->wait_for_tasks();
+}
+
+/**
+ * Returns the format with the baked lighting array added on.
+ */
+CPT( GeomVertexFormat ) StaticPropLoader::get_lit_format( const GeomVertexFormat *format )
+{
+        auto itr = _lit_formats.find( format );
+        if ( itr != _lit_formats.end() )
+        {
+                return itr->second;
+        }
+
+        PT( GeomVertexFormat ) lit_format = new GeomVertexFormat( *format );
+        lit_format->add_array( GeomVertexArrayFormat::register_format(
+                new GeomVertexArrayFormat( static_vertex_lighting_name, 4, GeomEnums::NT_uint16, GeomEnums::C_color ) ) );
+        CPT( GeomVertexFormat ) registered = GeomVertexFormat::register_format( lit_format );
+        _lit_formats[format] = registered;
+
+        return registered;
+}
+
+/**
+ * Returns a GeomVertexData that shares the arrays of the model's and adds
+ * the prop's lighting.
+ */
+PT( GeomVertexData ) StaticPropLoader::make_lit_vertex_data( const GeomVertexData *vdata, GeomVertexArrayData *lighting )
+{
+        if ( vdata->has_column( static_vertex_lighting_name ) )
+        {
+                // The model already has a column for it, fill in a copy.
+                PT( GeomVertexData ) mod_vdata = new GeomVertexData( *vdata );
+                GeomVertexWriter color_mod( mod_vdata, static_vertex_lighting_name );
+                GeomVertexReader color_in( lighting, 0 );
+                while ( !color_in.is_at_end() )
+                {
+                        color_mod.set_data4f( color_in.get_data4f() );
+                }
+                return mod_vdata;
+        }
+
+        PT( GeomVertexData ) mod_vdata = new GeomVertexData( vdata->get_name(), get_lit_format( vdata->get_format() ),
+                                                             vdata->get_usage_hint() );
+        for ( size_t i = 0; i < vdata->get_num_arrays(); i++ )
+        {
+                mod_vdata->set_array( i, vdata->get_array( i ) );
+        }
+        mod_vdata->set_array( vdata->get_num_arrays(), lighting );
+        mod_vdata->set_transform_table( vdata->get_transform_table() );
+        mod_vdata->set_transform_blend_table( vdata->get_transform_blend_table() );
+        mod_vdata->set_slider_table( vdata->get_slider_table() );
+
+        return mod_vdata;
+}
+
+/**
+ * Returns true if the state has one of the fake drop shadow textures.
+ */
+bool StaticPropLoader::is_drop_shadow( const RenderState *state )
+{
+        const TextureAttrib *tattr;
+        if ( !state->get_attrib( tattr ) || tattr->get_num_on_stages() == 0 )
+        {
+                return false;
+        }
+
+        Texture *tex = tattr->get_on_texture( tattr->get_on_stage( 0 ) );
+        return tex->get_name().find( "square_drop_shadow" ) != std::string::npos ||
+                tex->get_name().find( "drop-shadow" ) != std::string::npos;
+}
+
+/**
+ * Applies the render state that the prop's flags call for.
+ */
+void StaticPropLoader::apply_prop_state( const NodePath &propnp, const NodePath &propmdl, int flags, bool static_lighting )
+{
+        if ( static_lighting || ( flags & STATICPROPFLAGS_NOLIGHTING ) != 0 )
+        {
+                // since this prop has static lighting applied to the vertices
+                // ignore any dynamic lights.
+                propnp.set_light_off( 1 );
+        }
+
+#ifdef CIO
+        if ( flags & STATICPROPFLAGS_LIGHTMAPSHADOWS ||
+             flags & STATICPROPFLAGS_REALSHADOWS )
+        {
+                // game specific code!
+
+                // we want to strip the fake drop shadows
+                // since we either have lightmap shadows
+                // or realtime depth shadows
+
+                // GeomNodes with the drop_shadow texture on any of the RenderStates
+                // will be completely removed. it's a little brute force, but should work.
+
+                NodePathCollection npc = propmdl.find_all_matches( "**/+GeomNode" );
+                for ( int i = 0; i < npc.get_num_paths(); i++ )
+                {
+                        NodePath np = npc[i];
+                        GeomNode *gn = DCAST( GeomNode, np.node() );
+                        for ( int j = 0; j < gn->get_num_geoms(); j++ )
+                        {
+                                if ( is_drop_shadow( gn->get_geom_state( j ) ) )
+                                {
+                                        np.remove_node();
+                                        break;
+                                }
+                        }
+                }
+        }
+#endif
+
+        if ( flags & STATICPROPFLAGS_DOUBLESIDE )
+        {
+                propmdl.set_two_sided( true, 1 );
+        }
+
+        if ( flags & STATICPROPFLAGS_HARDFLATTEN )
+        {
+                propmdl.clear_model_nodes();
+                propmdl.flatten_strong();
+        }
+
+        // No lightmap shadows,
+        // but depth-map shadows?
+        if ( ( flags & STATICPROPFLAGS_LIGHTMAPSHADOWS ) == 0 &&
+             ( flags & STATICPROPFLAGS_REALSHADOWS ) != 0 )
+        {
+                propnp.show_through( CAMERA_SHADOW );
+        }
+}
+
+/**
+ * Makes a node of its own for the prop.
+ */
+void StaticPropLoader::make_prop( propinstance_t &inst )
+{
+        const dstaticprop_t *prop = inst.prop;
+
+        PT( BSPProp ) propnode = new BSPProp( prop->name );
+        propnode->set_preserve_transform( ModelNode::PT_local );
+        NodePath propnp = _result.attach_new_node( propnode );
+        propnp.set_shader_auto( 1 );
+        propnp.set_transform( inst.transform );
+
+        // The copy shares the Geoms of the model.
+        NodePath propmdl = inst.model->model.copy_to( propnp );
+
+        if ( inst.static_lighting )
+        {
+                pvector<GeomNode *> geomnodes;
+                collect_geom_nodes( propmdl.node(), geomnodes );
+                for ( size_t i = 0; i < geomnodes.size(); i++ )
+                {
+                        GeomNode *gn = geomnodes[i];
+                        for ( int j = 0; j < gn->get_num_geoms(); j++ )
+                        {
+                                auto itr = inst.model->geom_index.find( gn->get_geom( j ) );
+                                if ( itr == inst.model->geom_index.end() || inst.lighting[itr->second] == nullptr )
+                                {
+                                        continue;
+                                }
+
+                                PT( Geom ) mod_geom = gn->get_geom( j )->make_copy();
+                                mod_geom->set_vertex_data( make_lit_vertex_data( mod_geom->get_vertex_data(),
+                                                                                 inst.lighting[itr->second] ) );
+                                gn->set_geom( j, mod_geom );
+                        }
+                }
+
+                if ( inst.cubemap != nullptr )
+                {
+                        propnp.set_texture( TextureStages::get_cubemap(), inst.cubemap );
+                }
+        }
+
+        // Indicate that any Geoms underneath this prop node are static prop geometry.
+        propnp.set_attrib( StaticPropAttrib::make( inst.static_lighting ) );
+
+        apply_prop_state( propnp, propmdl, prop->flags, inst.static_lighting );
+
+        // only do group flattening if the prop doesn't
+        // use dynamic lighting (ambient probes).
+        //
+        // grouping all of the static props together
+        // will mess up the origin on each prop and they
+        // won't be dynamically lit correctly.
+
+        if ( ( prop->flags & STATICPROPFLAGS_GROUPFLATTEN ) != 0 &&
+             ( prop->flags & STATICPROPFLAGS_DYNAMICLIGHTING ) == 0 )
+        {
+                if ( _prop_group.is_empty() )
+                {
+                        _prop_group = _result.attach_new_node( new BSPProp( "propGroupLeaf0" ) );
+                }
+                // move the prop underneath that leaf node group
+                propnp.wrt_reparent_to( _prop_group );
+        }
+}
+
+/**
+ * Makes one instanced copy of the model that draws all of the indicated
+ * props.
+ */
+void StaticPropLoader::make_instanced_props( const batchkey_t &key, const pvector<propinstance_t *> &instances )
+{
+        propmodel_t *model = key.model;
+        int num_instances = (int)instances.size();
+
+        // Not a BSPProp, the Geoms must not be flattened together with
+        // anything once they have per-instance arrays.
+        PT( ModelNode ) batchnode = new ModelNode( "propInstances-" + model->name );
+        batchnode->set_preserve_transform( ModelNode::PT_net );
+        NodePath batchnp = _result.attach_new_node( batchnode );
+        batchnp.set_shader_auto( 1 );
+
+        NodePath propmdl = model->model.copy_to( batchnp );
+        apply_prop_state( batchnp, propmdl, key.flags, key.static_lighting );
+
+        if ( key.cubemap != nullptr )
+        {
+                batchnp.set_texture( TextureStages::get_cubemap(), key.cubemap );
+        }
+
+        // Every Geom of the batch draws all of the instances, so they
+        // all get the bounds of all of the instances.
+        PT( BoundingBox ) bounds = new BoundingBox;
+        for ( int i = 0; i < num_instances; i++ )
+        {
+                PT( BoundingBox ) inst_bounds = new BoundingBox( model->mins, model->maxs );
+                inst_bounds->xform( instances[i]->transform->get_mat() );
+                bounds->extend_by( inst_bounds );
+        }
+
+        // The baked lighting of every instance goes in one buffer texture,
+        // a Geom's lighting for an instance starts at its offset.
+        pvector<pvector<int>> lighting_offsets( model->geoms.size(), pvector<int>( num_instances, 0 ) );
+        PT( Texture ) lighting_tex;
+        if ( key.static_lighting )
+        {
+                int num_texels = 0;
+                for ( size_t g = 0; g < model->geoms.size(); g++ )
+                {
+                        for ( int i = 0; i < num_instances; i++ )
+                        {
+                                lighting_offsets[g][i] = num_texels;
+                                num_texels += model->geoms[g]->get_vertex_data()->get_num_rows();
+                        }
+                }
+
+                lighting_tex = new Texture( "propInstanceLighting-" + model->name );
+                lighting_tex->setup_buffer_texture( std::max( num_texels, 1 ), Texture::T_unsigned_short,
+                                                    Texture::F_rgba16, GeomEnums::UH_static );
+                PTA_uchar image = lighting_tex->modify_ram_image();
+                memset( image.p(), 0, image.size() );
+
+                for ( size_t g = 0; g < model->geoms.size(); g++ )
+                {
+                        for ( int i = 0; i < num_instances; i++ )
+                        {
+                                const GeomVertexArrayData *lighting = instances[i]->lighting[g];
+                                if ( lighting == nullptr )
+                                {
+                                        continue;
+                                }
+                                CPT( GeomVertexArrayDataHandle ) handle = lighting->get_handle();
+                                memcpy( image.p() + lighting_offsets[g][i] * 4 * sizeof( uint16_t ),
+                                        handle->get_read_pointer( true ), handle->get_data_size_bytes() );
+                        }
+                }
+
+                batchnp.set_texture( TextureStages::get_static_prop_lighting(), lighting_tex );
+        }
+
+        PT( GeomVertexArrayFormat ) instance_array = new GeomVertexArrayFormat;
+        instance_array->add_column( instance_matrix_name, 4, GeomEnums::NT_float32, GeomEnums::C_matrix );
+        instance_array->add_column( instance_lighting_offset_name, 1, GeomEnums::NT_float32, GeomEnums::C_other );
+        instance_array->set_divisor( 1 );
+        CPT( GeomVertexArrayFormat ) instance_format = GeomVertexArrayFormat::register_format( instance_array );
+
+        pvector<GeomNode *> geomnodes;
+        collect_geom_nodes( propmdl.node(), geomnodes );
+        for ( size_t n = 0; n < geomnodes.size(); n++ )
+        {
+                GeomNode *gn = geomnodes[n];
+                for ( int j = 0; j < gn->get_num_geoms(); j++ )
+                {
+                        auto itr = model->geom_index.find( gn->get_geom( j ) );
+                        int g = itr != model->geom_index.end() ? itr->second : -1;
+
+                        PT( GeomVertexArrayData ) instance_data = new GeomVertexArrayData( instance_format, GeomEnums::UH_static );
+                        instance_data->unclean_set_num_rows( num_instances );
+                        {
+                                GeomVertexWriter matrix( instance_data, instance_matrix_name );
+                                GeomVertexWriter offset( instance_data, instance_lighting_offset_name );
+                                for ( int i = 0; i < num_instances; i++ )
+                                {
+                                        matrix.set_matrix4f( LCAST( float, instances[i]->transform->get_mat() ) );
+                                        offset.set_data1f( g >= 0 ? (float)lighting_offsets[g][i] : 0.0f );
+                                }
+                        }
+
+                        CPT( GeomVertexData ) vdata = gn->get_geom( j )->get_vertex_data();
+                        PT( GeomVertexFormat ) format = new GeomVertexFormat( *vdata->get_format() );
+                        format->add_array( instance_format );
+
+                        PT( GeomVertexData ) mod_vdata = new GeomVertexData( vdata->get_name(),
+                                                                             GeomVertexFormat::register_format( format ),
+                                                                             vdata->get_usage_hint() );
+                        for ( size_t a = 0; a < vdata->get_num_arrays(); a++ )
+                        {
+                                mod_vdata->set_array( a, vdata->get_array( a ) );
+                        }
+                        mod_vdata->set_array( vdata->get_num_arrays(), instance_data );
+
+                        PT( Geom ) mod_geom = gn->get_geom( j )->make_copy();
+                        mod_geom->set_vertex_data( mod_vdata );
+                        mod_geom->set_bounds( bounds );
+                        gn->set_geom( j, mod_geom );
+                }
+        }
+
+        batchnp.set_instance_count( num_instances );
+        batchnp.set_attrib( StaticPropAttrib::make( key.static_lighting, true ) );
+}
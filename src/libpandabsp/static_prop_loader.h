@@ -0,0 +1,120 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file static_prop_loader.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef STATIC_PROP_LOADER_H
+#define STATIC_PROP_LOADER_H
+
+#include "config_bsp.h"
+#include "bspfile.h"
+
+#include <nodePath.h>
+#include <geom.h>
+#include <geomVertexData.h>
+#include <geomVertexArrayData.h>
+#include <geomVertexFormat.h>
+#include <transformState.h>
+#include <texture.h>
+#include <pmap.h>
+#include <pvector.h>
+#include <atomicAdjust.h>
+#include <genericAsyncTask.h>
+
+class BSPLoader;
+
+/**
+ * Creates the static props of a level.
+ *
+ * Each model is loaded once. Every prop that uses it shares its vertex
+ * arrays, and a prop with baked lighting only adds its own array for the
+ * lighting. The lighting and placement of the props is worked out on
+ * several threads before the scene graph is built.
+ *
+ * With static-prop-instancing, props that share a model and the same flags
+ * are drawn as one instanced Geom per Geom of the model. Each instance has
+ * a transform and, for baked lighting, an offset into a buffer texture
+ * that holds the lighting of every instance.
+ */
+class EXPCL_PANDABSP StaticPropLoader
+{
+public:
+        StaticPropLoader( BSPLoader *loader );
+
+        void load();
+
+private:
+        struct propmodel_t
+        {
+                std::string name;
+                NodePath model;
+                // Each Geom of the model, in the order that p3rad lit them.
+                pvector<CPT( Geom )> geoms;
+                // Whether the baked lighting is applied to the Geom.
+                pvector<bool> geom_lit;
+                pmap<const Geom *, int> geom_index;
+                bool use_cubemap;
+                bool all_lit;
+                LPoint3 mins;
+                LPoint3 maxs;
+        };
+
+        struct propinstance_t
+        {
+                const dstaticprop_t *prop;
+                propmodel_t *model;
+                CPT( TransformState ) transform;
+                bool static_lighting;
+                // The baked lighting of each Geom of the model, or null.
+                pvector<PT( GeomVertexArrayData )> lighting;
+                Texture *cubemap;
+                int leaf;
+        };
+
+        struct batchkey_t
+        {
+                propmodel_t *model;
+                int flags;
+                bool static_lighting;
+                Texture *cubemap;
+
+                bool operator < ( const batchkey_t &other ) const;
+        };
+
+        propmodel_t *load_model( const std::string &name );
+        void prepare_instance( propinstance_t &inst );
+        static AsyncTask::DoneStatus prepare_task( GenericAsyncTask *task, void *data );
+        void prepare_instances();
+
+        void make_prop( propinstance_t &inst );
+        void make_instanced_props( const batchkey_t &key, const pvector<propinstance_t *> &instances );
+        void apply_prop_state( const NodePath &propnp, const NodePath &propmdl, int flags, bool static_lighting );
+
+        CPT( GeomVertexFormat ) get_lit_format( const GeomVertexFormat *format );
+        PT( GeomVertexData ) make_lit_vertex_data( const GeomVertexData *vdata, GeomVertexArrayData *lighting );
+
+        static bool is_drop_shadow( const RenderState *state );
+
+private:
+        BSPLoader *_loader;
+        bspdata_t *_bspdata;
+        NodePath _result;
+        // Where the STATICPROPFLAGS_GROUPFLATTEN props are flattened together.
+        NodePath _prop_group;
+
+        lumpview_t<colorrgbexp32_t> _proplighting;
+
+        pmap<std::string, propmodel_t> _models;
+        pvector<propinstance_t> _instances;
+        AtomicAdjust::Integer _next_instance;
+
+        pmap<const GeomVertexFormat *, CPT( GeomVertexFormat )> _lit_formats;
+};
+
+#endif // STATIC_PROP_LOADER_H
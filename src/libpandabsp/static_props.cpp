@@ -13,10 +13,11 @@
 
 IMPLEMENT_ATTRIB( StaticPropAttrib );
 
-CPT( RenderAttrib ) StaticPropAttrib::make( bool static_lighting )
+CPT( RenderAttrib ) StaticPropAttrib::make( bool static_lighting, bool instanced )
 {
 	StaticPropAttrib *attr = new StaticPropAttrib;
 	attr->_static_lighting = static_lighting;
+	attr->_instanced = instanced;
 	return return_new( attr );
 }
 
@@ -27,6 +28,10 @@ int StaticPropAttrib::compare_to_impl( const RenderAttrib *other ) const
 	{
 		return _static_lighting < spa_other->_static_lighting ? -1 : 1;
 	}
+	if ( _instanced != spa_other->_instanced )
+	{
+		return _instanced < spa_other->_instanced ? -1 : 1;
+	}
 	return 0;
 }
 
@@ -34,5 +39,6 @@ size_t StaticPropAttrib::get_hash_impl() const
 {
 	size_t hash = 0;
 	hash = int_hash::add_hash( hash, (int)_static_lighting );
+	hash = int_hash::add_hash( hash, (int)_instanced );
 	return hash;
 }
\ No newline at end of file
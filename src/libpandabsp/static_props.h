@@ -21,20 +21,28 @@ class EXPCL_PANDABSP StaticPropAttrib : RenderAttrib
 private:
 	INLINE StaticPropAttrib() :
 		RenderAttrib(),
-		_static_lighting( false )
+		_static_lighting( false ),
+		_instanced( false )
 	{
 	}
 
 PUBLISHED:
-	static CPT( RenderAttrib ) make( bool static_lighting = true );
+	static CPT( RenderAttrib ) make( bool static_lighting = true, bool instanced = false );
 
 	INLINE bool has_static_lighting() const
 	{
 		return _static_lighting;
 	}
 
+	// True if the Geoms draw several props with hardware instancing.
+	INLINE bool is_instanced() const
+	{
+		return _instanced;
+	}
+
 private:
 	bool _static_lighting;
+	bool _instanced;
 };
 
 #endif // STATICPROPS_H
\ No newline at end of file
@@ -0,0 +1,330 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file network_io_thread.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "network_io_thread.h"
+#include "configVariableInt.h"
+#include "lightMutexHolder.h"
+#include "trueClock.h"
+
+#include <algorithm>
+
+static ConfigVariableInt network_io_ring_size
+( "network-io-ring-size", 4096, "Number of messages that can be waiting between the network I/O thread "
+  "and the game thread in each direction." );
+
+// Most messages taken off the outbound ring or received from one source
+// per poll.
+static constexpr size_t IO_BATCH_SIZE = 256;
+
+void NetworkIOThread::StatusCallbacks::OnSteamNetConnectionStatusChanged( SteamNetConnectionStatusChangedCallback_t *pCallback )
+{
+	m_pThread->m_pendingEvents.push_back( *pCallback );
+}
+
+NetworkIOThread::NetworkIOThread( ISteamNetworkingSockets *pInterface, double flPollRate ) :
+	Thread( "network-io", "network-io" ),
+	m_pInterface( pInterface ),
+	m_inbound( network_io_ring_size ),
+	m_outbound( network_io_ring_size ),
+	m_events( 256 ),
+	m_sourceLock( "NetworkIOThread" ),
+	m_bRunning( true ),
+	m_flPollInterval( 0.0 )
+{
+	m_callbacks.m_pThread = this;
+	m_scratch.resize( IO_BATCH_SIZE );
+	set_poll_rate( flPollRate );
+}
+
+NetworkIOThread::~NetworkIOThread()
+{
+	stop();
+}
+
+/**
+ * Stops the thread and waits for it to finish. Sends that are still waiting
+ * are sent from here, in order, and received messages that the game thread
+ * hasn't picked up are released. Called from the game thread.
+ */
+void NetworkIOThread::stop()
+{
+	if ( !m_bRunning.exchange( false ) )
+	{
+		return;
+	}
+
+	if ( is_started() )
+	{
+		join();
+	}
+
+	// The thread is gone, so we can take both sides of the rings now.
+	NetworkInboundMessage inbound;
+	while ( m_inbound.pop( inbound ) )
+	{
+		inbound.pMsg->Release();
+	}
+	for ( auto itr = m_received.begin(); itr != m_received.end(); ++itr )
+	{
+		for ( size_t i = 0; i < itr->second.size(); i++ )
+		{
+			itr->second[i]->Release();
+		}
+	}
+	m_received.clear();
+
+	pvector<ISteamNetworkingMessage *> msgs;
+	ISteamNetworkingMessage *pMsg;
+	while ( m_outbound.pop( pMsg ) )
+	{
+		msgs.push_back( pMsg );
+	}
+	msgs.insert( msgs.end(), m_overflow.begin(), m_overflow.end() );
+	m_overflow.clear();
+	send_network_messages( m_pInterface, msgs.data(), (int)msgs.size() );
+}
+
+void NetworkIOThread::set_poll_rate( double flPollRate )
+{
+	m_flPollInterval = flPollRate > 0.0 ? 1.0 / flPollRate : 0.0;
+}
+
+void NetworkIOThread::add_poll_group( uint32_t hPollGroup )
+{
+	m_received[source_key( hPollGroup, true )];
+
+	LightMutexHolder holder( m_sourceLock );
+	if ( std::find( m_pollGroups.begin(), m_pollGroups.end(), hPollGroup ) == m_pollGroups.end() )
+	{
+		m_pollGroups.push_back( hPollGroup );
+	}
+}
+
+void NetworkIOThread::add_connection( uint32_t hConn )
+{
+	m_received[source_key( hConn, false )];
+
+	LightMutexHolder holder( m_sourceLock );
+	if ( std::find( m_connections.begin(), m_connections.end(), hConn ) == m_connections.end() )
+	{
+		m_connections.push_back( hConn );
+	}
+}
+
+/**
+ * Stops receiving from the connection. Its messages that haven't been
+ * picked up yet are released.
+ */
+void NetworkIOThread::remove_connection( uint32_t hConn )
+{
+	{
+		LightMutexHolder holder( m_sourceLock );
+		auto itr = std::find( m_connections.begin(), m_connections.end(), hConn );
+		if ( itr != m_connections.end() )
+		{
+			m_connections.erase( itr );
+		}
+	}
+
+	// Anything of its still in the inbound ring is dropped by sort_inbound().
+	auto itr = m_received.find( source_key( hConn, false ) );
+	if ( itr != m_received.end() )
+	{
+		for ( size_t i = 0; i < itr->second.size(); i++ )
+		{
+			itr->second[i]->Release();
+		}
+		m_received.erase( itr );
+	}
+}
+
+/**
+ * Returns true if the poll group or connection was given to the thread, so
+ * its messages should be taken from pop_messages().
+ */
+bool NetworkIOThread::has_source( uint32_t hSource, bool bPollGroup ) const
+{
+	return m_received.find( source_key( hSource, bPollGroup ) ) != m_received.end();
+}
+
+/**
+ * Pops up to nMax of the messages that the thread received from the poll
+ * group or connection, and returns how many were popped. The caller takes
+ * ownership of them.
+ */
+size_t NetworkIOThread::pop_messages( uint32_t hSource, bool bPollGroup, ISteamNetworkingMessage **ppMsgs, size_t nMax )
+{
+	sort_inbound();
+
+	auto itr = m_received.find( source_key( hSource, bPollGroup ) );
+	if ( itr == m_received.end() )
+	{
+		return 0;
+	}
+
+	pdeque<ISteamNetworkingMessage *> &msgs = itr->second;
+	size_t nCount = std::min( nMax, msgs.size() );
+	std::copy( msgs.begin(), msgs.begin() + nCount, ppMsgs );
+	msgs.erase( msgs.begin(), msgs.begin() + nCount );
+	return nCount;
+}
+
+/**
+ * Takes everything off the inbound ring and queues it under the source that
+ * it came from.
+ */
+void NetworkIOThread::sort_inbound()
+{
+	NetworkInboundMessage inbound;
+	while ( m_inbound.pop( inbound ) )
+	{
+		auto itr = m_received.find( inbound.source );
+		if ( itr == m_received.end() )
+		{
+			// The source was removed after this was received.
+			inbound.pMsg->Release();
+			continue;
+		}
+
+		itr->second.push_back( inbound.pMsg );
+	}
+}
+
+/**
+ * Hands a message to the I/O thread to send, taking ownership of it. If the
+ * outbound ring is full, the message waits behind the others that didn't
+ * fit, so messages always leave in the order that they were pushed.
+ */
+void NetworkIOThread::push_message( ISteamNetworkingMessage *pMsg )
+{
+	flush_overflow();
+
+	if ( !m_overflow.empty() || !m_outbound.push( pMsg ) )
+	{
+		m_overflow.push_back( pMsg );
+	}
+}
+
+/**
+ * Moves as many of the sends that didn't fit before into the outbound ring
+ * as fit now.
+ */
+void NetworkIOThread::flush_overflow()
+{
+	while ( !m_overflow.empty() && m_outbound.push( m_overflow.front() ) )
+	{
+		m_overflow.pop_front();
+	}
+}
+
+void NetworkIOThread::thread_main()
+{
+	TrueClock *clock = TrueClock::get_global_ptr();
+
+	while ( m_bRunning )
+	{
+		double flStart = clock->get_short_time();
+
+		poll();
+
+		double flSleep = m_flPollInterval - ( clock->get_short_time() - flStart );
+		if ( flSleep > 0.0 )
+		{
+			Thread::sleep( flSleep );
+		}
+		else
+		{
+			Thread::consider_yield();
+		}
+	}
+}
+
+void NetworkIOThread::poll()
+{
+	m_pInterface->RunCallbacks( &m_callbacks );
+	post_events();
+
+	send_outbound();
+	receive_inbound();
+}
+
+/**
+ * Moves the status changes that the callbacks picked up over to the game
+ * thread. Whatever doesn't fit waits for the next poll, so none are lost.
+ */
+void NetworkIOThread::post_events()
+{
+	while ( !m_pendingEvents.empty() )
+	{
+		if ( !m_events.push( m_pendingEvents.front() ) )
+		{
+			break;
+		}
+		m_pendingEvents.pop_front();
+	}
+}
+
+void NetworkIOThread::send_outbound()
+{
+	size_t nMsgs;
+	while ( ( nMsgs = m_outbound.pop_many( m_scratch.data(), m_scratch.size() ) ) != 0 )
+	{
+		send_network_messages( m_pInterface, m_scratch.data(), (int)nMsgs );
+	}
+}
+
+/**
+ * Receives from each source only as many messages as the inbound ring has
+ * room for. The rest stay queued in the library until the game thread has
+ * caught up.
+ */
+void NetworkIOThread::receive_inbound()
+{
+	LightMutexHolder holder( m_sourceLock );
+
+	auto receive = [this]( uint32_t hSource, bool bPollGroup )
+	{
+		while ( true )
+		{
+			int nMax = (int)std::min( m_inbound.get_free_space(), m_scratch.size() );
+			if ( nMax <= 0 )
+			{
+				return;
+			}
+
+			int nMsgs = bPollGroup ?
+				m_pInterface->ReceiveMessagesOnPollGroup( hSource, m_scratch.data(), nMax ) :
+				m_pInterface->ReceiveMessagesOnConnection( hSource, m_scratch.data(), nMax );
+			uint64_t source = source_key( hSource, bPollGroup );
+			for ( int i = 0; i < nMsgs; i++ )
+			{
+				NetworkInboundMessage inbound;
+				inbound.source = source;
+				inbound.pMsg = m_scratch[i];
+				m_inbound.push( inbound );
+			}
+
+			if ( nMsgs < nMax )
+			{
+				return;
+			}
+		}
+	};
+
+	for ( size_t i = 0; i < m_pollGroups.size(); i++ )
+	{
+		receive( m_pollGroups[i], true );
+	}
+	for ( size_t i = 0; i < m_connections.size(); i++ )
+	{
+		receive( m_connections[i], false );
+	}
+}
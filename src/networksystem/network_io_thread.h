@@ -0,0 +1,145 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file network_io_thread.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef NETWORK_IO_THREAD_H
+#define NETWORK_IO_THREAD_H
+
+#include "config_networksystem.h"
+#include "network_ring.h"
+#include "thread.h"
+#include "lightMutex.h"
+#include "pvector.h"
+#include "pdeque.h"
+#include "pmap.h"
+
+#include <steam/steamnetworkingsockets.h>
+#include <steam/steamnetworkingtypes.h>
+
+#include <atomic>
+
+/**
+ * A message received by the network I/O thread, with the poll group or
+ * connection that it was received from.
+ */
+struct NetworkInboundMessage
+{
+	uint64_t source;
+	ISteamNetworkingMessage *pMsg;
+};
+
+/**
+ * Sends the messages with one call into the library, taking ownership of
+ * them. Returns the number of messages that were sent.
+ */
+extern int send_network_messages( ISteamNetworkingSockets *pInterface, ISteamNetworkingMessage *const *ppMsgs,
+				  int nMsgs );
+
+/**
+ * Thread that owns the polling of the networking library for NetworkSystem.
+ *
+ * At the poll rate it runs the library callbacks, sends the messages that the
+ * game thread pushed to the outbound ring, and receives messages from its
+ * poll groups and connections into the inbound ring. Connection status
+ * changes go to the game thread through the event ring. Each ring has exactly
+ * one producer and one consumer, so no locks are taken to pass messages.
+ *
+ * On the game thread side, received messages are sorted into a queue per
+ * source, so receiving from one source never returns another's messages.
+ * Sends that don't fit in the outbound ring wait behind it in order, and
+ * are never sent past the messages that are already in the ring.
+ */
+class NetworkIOThread : public Thread
+{
+public:
+	NetworkIOThread( ISteamNetworkingSockets *pInterface, double flPollRate );
+	virtual ~NetworkIOThread();
+
+	void stop();
+
+	void set_poll_rate( double flPollRate );
+
+	void add_poll_group( uint32_t hPollGroup );
+	void add_connection( uint32_t hConn );
+	void remove_connection( uint32_t hConn );
+
+	// Called from the game thread.
+	bool has_source( uint32_t hSource, bool bPollGroup ) const;
+	size_t pop_messages( uint32_t hSource, bool bPollGroup, ISteamNetworkingMessage **ppMsgs, size_t nMax );
+	INLINE bool pop_event( SteamNetConnectionStatusChangedCallback_t &event );
+	void push_message( ISteamNetworkingMessage *pMsg );
+	void flush_overflow();
+
+protected:
+	virtual void thread_main();
+
+private:
+	class StatusCallbacks : public ISteamNetworkingSocketsCallbacks
+	{
+	public:
+		virtual void OnSteamNetConnectionStatusChanged( SteamNetConnectionStatusChangedCallback_t *pCallback ) override;
+
+		NetworkIOThread *m_pThread;
+	};
+
+	void poll();
+	void send_outbound();
+	void receive_inbound();
+	void post_events();
+
+	void sort_inbound();
+
+	INLINE static uint64_t source_key( uint32_t hSource, bool bPollGroup );
+
+private:
+	ISteamNetworkingSockets *m_pInterface;
+	StatusCallbacks m_callbacks;
+
+	NetworkRing<NetworkInboundMessage> m_inbound;
+	NetworkRing<ISteamNetworkingMessage *> m_outbound;
+	// Whole callback data, so the game thread can call the same virtual
+	// that the library would have called.
+	NetworkRing<SteamNetConnectionStatusChangedCallback_t> m_events;
+
+	// Events that didn't fit in the event ring yet. Only touched by the
+	// I/O thread.
+	pdeque<SteamNetConnectionStatusChangedCallback_t> m_pendingEvents;
+	pvector<ISteamNetworkingMessage *> m_scratch;
+
+	// Only touched by the game thread. Received messages wait here until
+	// their source is received from, and sends that didn't fit in the
+	// outbound ring wait in m_overflow.
+	pmap<uint64_t, pdeque<ISteamNetworkingMessage *>> m_received;
+	pdeque<ISteamNetworkingMessage *> m_overflow;
+
+	// Guards the sources, which the game thread changes rarely.
+	LightMutex m_sourceLock;
+	pvector<uint32_t> m_pollGroups;
+	pvector<uint32_t> m_connections;
+
+	std::atomic<bool> m_bRunning;
+	std::atomic<double> m_flPollInterval;
+};
+
+INLINE bool NetworkIOThread::pop_event( SteamNetConnectionStatusChangedCallback_t &event )
+{
+	return m_events.pop( event );
+}
+
+/**
+ * Poll group and connection handles come from different counters, so the
+ * kind of source is part of the key.
+ */
+INLINE uint64_t NetworkIOThread::source_key( uint32_t hSource, bool bPollGroup )
+{
+	return ( (uint64_t)bPollGroup << 32 ) | hSource;
+}
+
+#endif // NETWORK_IO_THREAD_H
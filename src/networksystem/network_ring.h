@@ -0,0 +1,145 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file network_ring.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#ifndef NETWORK_RING_H
+#define NETWORK_RING_H
+
+#include "config_networksystem.h"
+#include "pvector.h"
+
+#include <atomic>
+
+/**
+ * Fixed size ring buffer for passing items from one thread to one other
+ * thread without locking. Only one thread may push and only one other thread
+ * may pop.
+ */
+template<class T>
+class NetworkRing
+{
+public:
+	INLINE NetworkRing( size_t nCapacity = 1024 );
+
+	INLINE bool push( const T &item );
+	INLINE bool pop( T &item );
+	INLINE size_t pop_many( T *pItems, size_t nMax );
+
+	INLINE size_t get_capacity() const;
+	INLINE size_t get_free_space() const;
+	INLINE bool is_empty() const;
+
+private:
+	pvector<T> m_items;
+	size_t m_nMask;
+
+	// Each index only ever written by one side. Kept on their own cache
+	// lines so the two threads don't fight over them.
+	alignas( 64 ) std::atomic<size_t> m_nHead; // Next to pop.
+	alignas( 64 ) std::atomic<size_t> m_nTail; // Next to push.
+};
+
+/**
+ * The capacity is rounded up to a power of two.
+ */
+template<class T>
+INLINE NetworkRing<T>::NetworkRing( size_t nCapacity ) :
+	m_nHead( 0 ),
+	m_nTail( 0 )
+{
+	size_t nSize = 1;
+	while ( nSize < nCapacity )
+	{
+		nSize <<= 1;
+	}
+	m_items.resize( nSize );
+	m_nMask = nSize - 1;
+}
+
+/**
+ * Called from the producer thread. Returns false if the ring is full.
+ */
+template<class T>
+INLINE bool NetworkRing<T>::push( const T &item )
+{
+	size_t nTail = m_nTail.load( std::memory_order_relaxed );
+	if ( nTail - m_nHead.load( std::memory_order_acquire ) >= m_items.size() )
+	{
+		return false;
+	}
+
+	m_items[nTail & m_nMask] = item;
+	m_nTail.store( nTail + 1, std::memory_order_release );
+	return true;
+}
+
+/**
+ * Called from the consumer thread. Returns false if the ring is empty.
+ */
+template<class T>
+INLINE bool NetworkRing<T>::pop( T &item )
+{
+	size_t nHead = m_nHead.load( std::memory_order_relaxed );
+	if ( nHead == m_nTail.load( std::memory_order_acquire ) )
+	{
+		return false;
+	}
+
+	item = m_items[nHead & m_nMask];
+	m_nHead.store( nHead + 1, std::memory_order_release );
+	return true;
+}
+
+/**
+ * Called from the consumer thread. Pops up to nMax items at once and returns
+ * how many were popped.
+ */
+template<class T>
+INLINE size_t NetworkRing<T>::pop_many( T *pItems, size_t nMax )
+{
+	size_t nHead = m_nHead.load( std::memory_order_relaxed );
+	size_t nCount = m_nTail.load( std::memory_order_acquire ) - nHead;
+	if ( nCount > nMax )
+	{
+		nCount = nMax;
+	}
+
+	for ( size_t i = 0; i < nCount; i++ )
+	{
+		pItems[i] = m_items[( nHead + i ) & m_nMask];
+	}
+	m_nHead.store( nHead + nCount, std::memory_order_release );
+	return nCount;
+}
+
+template<class T>
+INLINE size_t NetworkRing<T>::get_capacity() const
+{
+	return m_items.size();
+}
+
+/**
+ * Only exact from the producer thread; there may be more space by the time
+ * this returns.
+ */
+template<class T>
+INLINE size_t NetworkRing<T>::get_free_space() const
+{
+	return m_items.size() - ( m_nTail.load( std::memory_order_acquire ) -
+				  m_nHead.load( std::memory_order_acquire ) );
+}
+
+template<class T>
+INLINE bool NetworkRing<T>::is_empty() const
+{
+	return m_nHead.load( std::memory_order_acquire ) == m_nTail.load( std::memory_order_acquire );
+}
+
+#endif // NETWORK_RING_H
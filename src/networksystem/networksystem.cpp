@@ -10,9 +10,249 @@
  */
 
 #include "networksystem.h"
+#include "network_io_thread.h"
+
+#include "configVariableBool.h"
+#include "configVariableDouble.h"
+#include "pset.h"
+#include "vector_uchar.h"
+
+#include <steam/isteamnetworkingutils.h>
+
+#include <algorithm>
+
+static ConfigVariableBool network_coalesce_sends
+( "network-coalesce-sends", true, "If true, datagrams queued with queue_datagram() are handed to the "
+  "networking library with Nagle enabled, so the ones going to the same connection can be packed into "
+  "the same packets, and each connection is flushed once by flush_queued_datagrams()." );
+
+static ConfigVariableDouble network_io_poll_rate
+( "network-io-poll-rate", 500.0, "Times per second that the network I/O thread polls for messages and "
+  "sends the ones that are waiting, see NetworkSystem::start_io_thread()." );
+
+/**
+ * The payload of a datagram that is being sent to several connections. Every
+ * library message that is sent from it holds a reference, and the library
+ * drops it when it is done with the message.
+ */
+class NetworkSendBuffer : public ReferenceCount
+{
+public:
+	NetworkSendBuffer( const Datagram &dg ) :
+		m_data( (const unsigned char *)dg.get_data(),
+			(const unsigned char *)dg.get_data() + dg.get_length() )
+	{
+	}
+
+	vector_uchar m_data;
+};
+
+static void free_send_buffer( ISteamNetworkingMessage *pMsg )
+{
+	NetworkSendBuffer *pBuf = (NetworkSendBuffer *)(intptr_t)pMsg->m_nUserData;
+	unref_delete( pBuf );
+}
+
+static ISteamNetworkingMessage *make_send_message( NetworkSendBuffer *pBuf, NetworkConnectionHandle hConn,
+						   int flags )
+{
+	ISteamNetworkingMessage *pMsg = SteamNetworkingUtils()->AllocateMessage( 0 );
+	pMsg->m_pData = pBuf->m_data.data();
+	pMsg->m_cbSize = (uint32)pBuf->m_data.size();
+	pMsg->m_conn = hConn;
+	pMsg->m_nFlags = flags;
+	pMsg->m_nUserData = (int64)(intptr_t)pBuf;
+	pMsg->m_pfnFreeData = free_send_buffer;
+	pBuf->ref();
+
+	return pMsg;
+}
+
+/**
+ * Makes a message that sends the datagram to one connection.
+ */
+static ISteamNetworkingMessage *make_send_message( const Datagram &dg, NetworkConnectionHandle hConn, int flags )
+{
+	ISteamNetworkingMessage *pMsg = SteamNetworkingUtils()->AllocateMessage( (int)dg.get_length() );
+	memcpy( pMsg->m_pData, dg.get_data(), dg.get_length() );
+	pMsg->m_conn = hConn;
+	pMsg->m_nFlags = flags;
+
+	return pMsg;
+}
+
+int send_network_messages( ISteamNetworkingSockets *pInterface, ISteamNetworkingMessage *const *ppMsgs, int nMsgs )
+{
+	if ( nMsgs <= 0 )
+	{
+		return 0;
+	}
+
+	pvector<int64> results( nMsgs );
+	pset<NetworkConnectionHandle> conns;
+	if ( network_coalesce_sends )
+	{
+		for ( int i = 0; i < nMsgs; i++ )
+		{
+			conns.insert( ppMsgs[i]->m_conn );
+		}
+	}
+
+	pInterface->SendMessages( nMsgs, ppMsgs, results.data() );
+
+	for ( auto itr = conns.begin(); itr != conns.end(); ++itr )
+	{
+		pInterface->FlushMessagesOnConnection( *itr );
+	}
+
+	int nSent = 0;
+	for ( int i = 0; i < nMsgs; i++ )
+	{
+		if ( results[i] > 0 )
+		{
+			nSent++;
+		}
+	}
+
+	return nSent;
+}
 
 NetworkSystem *NetworkSystem::s_pGlobalPtr = nullptr;
 
+/**
+ * Takes ownership of the library message, and releases the one that we held
+ * before. The payload isn't copied.
+ */
+void NetworkMessage::set_message( ISteamNetworkingMessage *pMsg )
+{
+	nassertv( m_nViews == 0 );
+
+	release();
+	m_pMsg = pMsg;
+	hConn = pMsg->GetConnection();
+	dg.clear();
+	m_bHasDatagram = false;
+}
+
+/**
+ * Gives the buffer of the library message back to the library. The message
+ * is empty afterwards.
+ */
+void NetworkMessage::release()
+{
+	if ( m_pMsg )
+	{
+		nassertv( m_nViews == 0 );
+		m_pMsg->Release();
+		m_pMsg = nullptr;
+		dg.clear();
+		dgi.assign( dg );
+		m_bHasDatagram = true;
+	}
+}
+
+/**
+ * Returns the payload of the message without copying it.
+ */
+const unsigned char *NetworkMessage::get_data() const
+{
+	return m_pMsg ? (const unsigned char *)m_pMsg->m_pData : (const unsigned char *)dg.get_data();
+}
+
+size_t NetworkMessage::get_data_size() const
+{
+	return m_pMsg ? (size_t)m_pMsg->m_cbSize : dg.get_length();
+}
+
+void NetworkMessage::fill_datagram()
+{
+	dg.assign( m_pMsg->m_pData, (size_t)m_pMsg->m_cbSize );
+	dgi.assign( dg );
+	m_bHasDatagram = true;
+}
+
+#ifdef HAVE_PYTHON
+/**
+ * Exposes the payload to Python as a read-only buffer. The view holds a
+ * reference to the message, so the payload stays alive with it.
+ */
+int NetworkMessage::__getbuffer__( PyObject *self, Py_buffer *view, int flags )
+{
+	if ( PyBuffer_FillInfo( view, self, (void *)get_data(), (Py_ssize_t)get_data_size(), 1, flags ) != 0 )
+	{
+		return -1;
+	}
+
+	m_nViews++;
+	return 0;
+}
+
+void NetworkMessage::__releasebuffer__( PyObject *self, Py_buffer *view )
+{
+	m_nViews--;
+}
+#endif
+
+NetworkMessageBatch::NetworkMessageBatch( int maxMessages ) :
+	m_nMessages( 0 )
+{
+	nassertv( maxMessages > 0 );
+	m_pMessages.resize( maxMessages, nullptr );
+	m_messages.resize( maxMessages );
+	for ( int i = 0; i < maxMessages; i++ )
+	{
+		m_messages[i] = new NetworkMessage;
+	}
+}
+
+NetworkMessageBatch::~NetworkMessageBatch()
+{
+	release();
+}
+
+/**
+ * Gives the buffers of the received messages back to the networking library,
+ * except for the messages that are still referenced outside of the batch.
+ * The batch is empty afterwards.
+ */
+void NetworkMessageBatch::release()
+{
+	for ( int i = 0; i < m_nMessages; i++ )
+	{
+		if ( m_messages[i]->get_ref_count() == 1 )
+		{
+			m_messages[i]->release();
+		}
+		m_pMessages[i] = nullptr;
+	}
+	m_nMessages = 0;
+}
+
+/**
+ * Releases the messages from the last receive and returns the array that
+ * the next receive should fill in, get_max_messages() long.
+ */
+ISteamNetworkingMessage **NetworkMessageBatch::begin_receive()
+{
+	release();
+	return m_pMessages.data();
+}
+
+void NetworkMessageBatch::end_receive( int nMsgCount )
+{
+	m_nMessages = std::max( 0, nMsgCount );
+	for ( int i = 0; i < m_nMessages; i++ )
+	{
+		if ( m_messages[i]->get_ref_count() != 1 )
+		{
+			// Someone kept the message from an earlier receive. Leave it to
+			// them, with its payload.
+			m_messages[i] = new NetworkMessage;
+		}
+		m_messages[i]->set_message( m_pMessages[i] );
+	}
+}
+
 NetworkSystem::NetworkSystem()
 {
 	SteamNetworkingErrMsg errMsg;
@@ -27,6 +267,14 @@ NetworkSystem::NetworkSystem()
 
 NetworkSystem::~NetworkSystem()
 {
+	stop_io_thread();
+
+	for ( size_t i = 0; i < m_queuedMsgs.size(); i++ )
+	{
+		m_queuedMsgs[i]->Release();
+	}
+	m_queuedMsgs.clear();
+
 	if ( m_pInterface )
 	{
 		GameNetworkingSockets_KillInstance( m_pInterface );
@@ -57,11 +305,30 @@ void NetworkCallbacks::on_connection_status_changed( NetworkConnectionHandle hCo
 
 void NetworkSystem::close_connection( NetworkConnectionHandle hConn )
 {
+	remove_io_connection( hConn );
 	m_pInterface->CloseConnection( hConn, 0, nullptr, false );
 }
 
+/**
+ * Calls the callbacks for the connection status changes since the last call.
+ * While the I/O thread is running, these are the changes that it has picked
+ * up, and the callbacks are still called on this thread, with the library's
+ * callback data as it was when the thread picked the change up.
+ */
 void NetworkSystem::run_callbacks( NetworkCallbacks *pCallbacks )
 {
+	if ( m_pIOThread )
+	{
+		m_pIOThread->flush_overflow();
+
+		SteamNetConnectionStatusChangedCallback_t event;
+		while ( m_pIOThread->pop_event( event ) )
+		{
+			pCallbacks->OnSteamNetConnectionStatusChanged( &event );
+		}
+		return;
+	}
+
 	m_pInterface->RunCallbacks( pCallbacks );
 }
 
@@ -75,18 +342,40 @@ bool NetworkSystem::set_connection_poll_group( NetworkConnectionHandle hConn, Ne
 	return m_pInterface->SetConnectionPollGroup( hConn, hPollGroup );
 }
 
+/**
+ * Receives up to nMax messages from the poll group or connection. If the I/O
+ * thread is receiving from it, these are the messages that the thread has
+ * received from it, otherwise they come straight from the library.
+ */
+int NetworkSystem::receive_messages( uint32_t hSource, bool bPollGroup, ISteamNetworkingMessage **ppMsgs, int nMax )
+{
+	if ( m_pIOThread && m_pIOThread->has_source( hSource, bPollGroup ) )
+	{
+		return (int)m_pIOThread->pop_messages( hSource, bPollGroup, ppMsgs, (size_t)nMax );
+	}
+
+	return bPollGroup ?
+		m_pInterface->ReceiveMessagesOnPollGroup( hSource, ppMsgs, nMax ) :
+		m_pInterface->ReceiveMessagesOnConnection( hSource, ppMsgs, nMax );
+}
+
+/**
+ * Receives the next waiting message on the connection into msg, without
+ * copying the payload. Returns false if there wasn't one.
+ */
 bool NetworkSystem::receive_message_on_connection( NetworkConnectionHandle hConn, NetworkMessage &msg )
 {
+	// A Python view of the message's current payload still exists.
+	nassertr( !msg.has_views(), false );
+
 	ISteamNetworkingMessage *pMsg = nullptr;
-	int nMsgCount = m_pInterface->ReceiveMessagesOnConnection( hConn, &pMsg, 1 );
+	int nMsgCount = receive_messages( hConn, false, &pMsg, 1 );
 	if ( !pMsg || nMsgCount != 1 )
 	{
 		return false;
 	}
 
-	msg.dg = Datagram( pMsg->m_pData, pMsg->m_cbSize );
-	msg.dgi.assign( msg.dg );
-	msg.hConn = pMsg->GetConnection();
+	msg.set_message( pMsg );
 
 	return true;
 }
@@ -117,11 +406,181 @@ bool NetworkSystem::get_connection_info( NetworkConnectionHandle hConn, NetworkC
 void NetworkSystem::send_datagram( NetworkConnectionHandle hConn, const Datagram &dg,
 				   NetworkSystem::NetworkSendFlags flags )
 {
+	if ( m_pIOThread )
+	{
+		m_pIOThread->push_message( make_send_message( dg, hConn, flags ) );
+		return;
+	}
+
 	m_pInterface->SendMessageToConnection(
 		hConn, dg.get_data(),
 		dg.get_length(), flags, nullptr );
 }
 
+/**
+ * Sends the datagram to each of the connections with one call into the
+ * library. The payload is copied once and shared by all of the messages.
+ *
+ * If pResults is not null, it receives the result for each connection: the
+ * message number if it was sent, or the negated EResult if it wasn't. While
+ * the I/O thread is running, the messages are handed to it instead and every
+ * result is 0.
+ */
+void NetworkSystem::send_datagram_to_many( const NetworkConnectionHandle *pConns, int nConns, const Datagram &dg,
+					   NetworkSystem::NetworkSendFlags flags, int64_t *pResults )
+{
+	if ( nConns <= 0 )
+	{
+		return;
+	}
+
+	PT( NetworkSendBuffer ) pBuf = new NetworkSendBuffer( dg );
+
+	pvector<ISteamNetworkingMessage *> msgs( nConns );
+	for ( int i = 0; i < nConns; i++ )
+	{
+		msgs[i] = make_send_message( pBuf, pConns[i], flags );
+	}
+
+	if ( m_pIOThread )
+	{
+		for ( int i = 0; i < nConns; i++ )
+		{
+			m_pIOThread->push_message( msgs[i] );
+			if ( pResults )
+			{
+				pResults[i] = 0;
+			}
+		}
+		return;
+	}
+
+	m_pInterface->SendMessages( nConns, msgs.data(), (int64 *)pResults );
+}
+
+/**
+ * Queues the datagram to be sent to each of the connections by the next
+ * flush_queued_datagrams(). The payload is copied once and shared.
+ */
+void NetworkSystem::queue_datagram_to_many( const NetworkConnectionHandle *pConns, int nConns, const Datagram &dg,
+					    NetworkSystem::NetworkSendFlags flags )
+{
+	if ( nConns <= 0 )
+	{
+		return;
+	}
+
+	int nFlags = flags;
+	if ( network_coalesce_sends && ( nFlags & NSF_no_delay ) == 0 )
+	{
+		nFlags &= ~NSF_no_nagle;
+	}
+
+	PT( NetworkSendBuffer ) pBuf = new NetworkSendBuffer( dg );
+	for ( int i = 0; i < nConns; i++ )
+	{
+		m_queuedMsgs.push_back( make_send_message( pBuf, pConns[i], nFlags ) );
+	}
+}
+
+void NetworkSystem::queue_datagram( NetworkConnectionHandle hConn, const Datagram &dg,
+				    NetworkSystem::NetworkSendFlags flags )
+{
+	queue_datagram_to_many( &hConn, 1, dg, flags );
+}
+
+/**
+ * Sends everything that was queued since the last flush with one call into
+ * the library, then flushes each connection that was sent to. Call this once
+ * per tick. Returns the number of datagrams that were sent.
+ *
+ * While the I/O thread is running, the datagrams are handed to it instead,
+ * and the number handed over is returned.
+ */
+int NetworkSystem::flush_queued_datagrams()
+{
+	int nMsgs = (int)m_queuedMsgs.size();
+	if ( nMsgs == 0 )
+	{
+		return 0;
+	}
+
+	if ( m_pIOThread )
+	{
+		for ( int i = 0; i < nMsgs; i++ )
+		{
+			m_pIOThread->push_message( m_queuedMsgs[i] );
+		}
+		m_queuedMsgs.clear();
+
+		return nMsgs;
+	}
+
+	int nSent = send_network_messages( m_pInterface, m_queuedMsgs.data(), nMsgs );
+	m_queuedMsgs.clear();
+
+	return nSent;
+}
+
+#ifdef HAVE_PYTHON
+bool NetworkSystem::get_connection_list( PyObject *pConnections, pvector<NetworkConnectionHandle> &conns )
+{
+	PyObject *pSeq = PySequence_Fast( pConnections, "connections must be a sequence of connection handles" );
+	if ( !pSeq )
+	{
+		return false;
+	}
+
+	Py_ssize_t nConns = PySequence_Fast_GET_SIZE( pSeq );
+	conns.resize( nConns );
+	for ( Py_ssize_t i = 0; i < nConns; i++ )
+	{
+		conns[i] = (NetworkConnectionHandle)PyLong_AsUnsignedLong( PySequence_Fast_GET_ITEM( pSeq, i ) );
+	}
+	Py_DECREF( pSeq );
+
+	return !PyErr_Occurred();
+}
+
+/**
+ * Sends the datagram to each connection in the sequence with one call into
+ * the library. Returns a list with the result for each connection: the
+ * message number if it was sent, or the negated EResult if it wasn't.
+ */
+PyObject *NetworkSystem::send_datagram_to_many( PyObject *pConnections, const Datagram &dg,
+						NetworkSystem::NetworkSendFlags flags )
+{
+	pvector<NetworkConnectionHandle> conns;
+	if ( !get_connection_list( pConnections, conns ) )
+	{
+		return nullptr;
+	}
+
+	pvector<int64_t> results( conns.size() );
+	send_datagram_to_many( conns.data(), (int)conns.size(), dg, flags, results.data() );
+
+	PyObject *pResults = PyList_New( (Py_ssize_t)results.size() );
+	for ( size_t i = 0; i < results.size(); i++ )
+	{
+		PyList_SET_ITEM( pResults, (Py_ssize_t)i, PyLong_FromLongLong( results[i] ) );
+	}
+
+	return pResults;
+}
+
+void NetworkSystem::queue_datagram_to_many( PyObject *pConnections, const Datagram &dg,
+					    NetworkSystem::NetworkSendFlags flags )
+{
+	pvector<NetworkConnectionHandle> conns;
+	if ( !get_connection_list( pConnections, conns ) )
+	{
+		return;
+	}
+
+	queue_datagram_to_many( conns.data(), (int)conns.size(), dg, flags );
+}
+#endif
+
 NetworkConnectionHandle NetworkSystem::connect_by_IP_address( const NetAddress &addr )
 {
 	SteamNetworkingIPAddr steamAddr;
@@ -132,22 +591,156 @@ NetworkConnectionHandle NetworkSystem::connect_by_IP_address( const NetAddress &
 	return handle;
 }
 
+/**
+ * Receives the next waiting message on the poll group into msg, without
+ * copying the payload. Returns false if there wasn't one.
+ */
 bool NetworkSystem::receive_message_on_poll_group( NetworkPollGroupHandle hPollGroup, NetworkMessage &msg )
 {
+	nassertr( !msg.has_views(), false );
+
 	ISteamNetworkingMessage *pMsg = nullptr;
-	int nMsgCount = m_pInterface->ReceiveMessagesOnPollGroup( hPollGroup, &pMsg, 1 );
+	int nMsgCount = receive_messages( hPollGroup, true, &pMsg, 1 );
 	if ( !pMsg || nMsgCount != 1 )
 	{
 		return false;
 	}
 
-	msg.dg = Datagram( pMsg->m_pData, pMsg->m_cbSize );
-	msg.dgi.assign( msg.dg );
-	msg.hConn = pMsg->GetConnection();
+	msg.set_message( pMsg );
 
 	return true;
 }
 
+/**
+ * Receives as many of the waiting messages on the connection as fit in the
+ * batch. Returns the number of messages received.
+ */
+int NetworkSystem::receive_messages_on_connection( NetworkConnectionHandle hConn, NetworkMessageBatch *pBatch )
+{
+	ISteamNetworkingMessage **ppMsgs = pBatch->begin_receive();
+	int nMsgCount = receive_messages( hConn, false, ppMsgs, pBatch->get_max_messages() );
+	pBatch->end_receive( nMsgCount );
+
+	return pBatch->get_num_messages();
+}
+
+/**
+ * Receives as many of the waiting messages on the poll group as fit in the
+ * batch. Returns the number of messages received.
+ */
+int NetworkSystem::receive_messages_on_poll_group( NetworkPollGroupHandle hPollGroup, NetworkMessageBatch *pBatch )
+{
+	ISteamNetworkingMessage **ppMsgs = pBatch->begin_receive();
+	int nMsgCount = receive_messages( hPollGroup, true, ppMsgs, pBatch->get_max_messages() );
+	pBatch->end_receive( nMsgCount );
+
+	return pBatch->get_num_messages();
+}
+
+/**
+ * Starts a thread that polls the networking library at the indicated rate,
+ * or network-io-poll-rate if it is 0. While it runs, acks and connection
+ * status changes are handled no matter how long the game thread's frames
+ * take.
+ *
+ * The thread receives the messages of the poll groups and connections given
+ * to add_io_poll_group() and add_io_connection(). Receiving from one of
+ * those then returns the messages that the thread has received from it;
+ * other poll groups and connections are still received from directly. The
+ * sends are handed to the thread in order, and run_callbacks() calls the
+ * callbacks for the status changes that the thread saw.
+ *
+ * The other calls, such as connecting, accepting, closing and querying
+ * connections, still go straight to the library from the calling thread.
+ * GameNetworkingSockets takes its own lock around every interface call, so
+ * this is safe while the thread polls; such a call may just wait for the
+ * thread's current library call to return. Only the polling itself, that is
+ * running the callbacks, receiving from the thread's sources and sending, is
+ * left to the thread alone, since those are the calls whose order matters.
+ */
+bool NetworkSystem::start_io_thread( double pollRate )
+{
+	if ( !m_pInterface )
+	{
+		return false;
+	}
+
+	if ( m_pIOThread )
+	{
+		return true;
+	}
+
+	if ( !Thread::is_threading_supported() )
+	{
+		networksystem_cat.warning()
+			<< "Threading is not supported, network I/O stays on the game thread\n";
+		return false;
+	}
+
+	if ( pollRate <= 0.0 )
+	{
+		pollRate = network_io_poll_rate;
+	}
+
+	PT( NetworkIOThread ) pThread = new NetworkIOThread( m_pInterface, pollRate );
+	if ( !pThread->start( TP_high, true ) )
+	{
+		networksystem_cat.error()
+			<< "Unable to start the network I/O thread\n";
+		return false;
+	}
+
+	m_pIOThread = pThread;
+	return true;
+}
+
+/**
+ * Stops the I/O thread. Sends that it hadn't gotten to yet are sent from
+ * here. Messages that it received and the game thread hasn't yet picked up
+ * are dropped.
+ */
+void NetworkSystem::stop_io_thread()
+{
+	if ( m_pIOThread )
+	{
+		m_pIOThread->stop();
+		m_pIOThread = nullptr;
+	}
+}
+
+bool NetworkSystem::is_io_thread_running() const
+{
+	return m_pIOThread != nullptr;
+}
+
+void NetworkSystem::set_io_poll_rate( double pollRate )
+{
+	if ( m_pIOThread )
+	{
+		m_pIOThread->set_poll_rate( pollRate );
+	}
+}
+
+void NetworkSystem::add_io_poll_group( NetworkPollGroupHandle hPollGroup )
+{
+	nassertv( m_pIOThread != nullptr );
+	m_pIOThread->add_poll_group( hPollGroup );
+}
+
+void NetworkSystem::add_io_connection( NetworkConnectionHandle hConn )
+{
+	nassertv( m_pIOThread != nullptr );
+	m_pIOThread->add_connection( hConn );
+}
+
+void NetworkSystem::remove_io_connection( NetworkConnectionHandle hConn )
+{
+	if ( m_pIOThread )
+	{
+		m_pIOThread->remove_connection( hConn );
+	}
+}
+
 NetworkPollGroupHandle NetworkSystem::create_poll_group()
 {
 	return m_pInterface->CreatePollGroup();
@@ -22,6 +22,7 @@
 #include "netAddress.h"
 #include "datagramIterator.h"
 #include "pdeque.h"
+#include "pvector.h"
 
 #ifdef HAVE_PYTHON
 #include "py_panda.h"
@@ -33,6 +34,7 @@
 #else
 class ISteamNetworkingSocketsCallbacks;
 class ISteamNetworkingSockets;
+class ISteamNetworkingMessage;
 #endif
 
 typedef uint32_t NetworkListenSocketHandle;
@@ -42,25 +44,88 @@ static constexpr NetworkConnectionHandle INVALID_NETWORK_CONNECTION_HANDLE = 0U;
 static constexpr NetworkListenSocketHandle INVALID_NETWORK_LISTEN_SOCKET_HANDLE = 0U;
 static constexpr NetworkPollGroupHandle INVALID_NETWORK_POLL_GROUP_HANDLe = 0U;
 
-class EXPCL_NETWORKSYSTEM NetworkMessage
+/**
+ * A message received from a connection. The payload stays in the buffer of
+ * the networking library's message, which is released when this message is
+ * destroyed or received into again, so reading it doesn't copy it.
+ *
+ * From Python, memoryview(msg) is a read-only view of the payload that keeps
+ * the message alive. get_datagram() and get_datagram_iterator() copy the
+ * payload into a Datagram the first time that they are called.
+ */
+class EXPCL_NETWORKSYSTEM NetworkMessage : public ReferenceCount
 {
 PUBLISHED:
+	NetworkMessage();
+	NetworkMessage( const NetworkMessage &copy ) = delete;
+	~NetworkMessage();
+
 	const Datagram &get_datagram();
 	DatagramIterator &get_datagram_iterator();
 	NetworkConnectionHandle get_connection();
+	size_t get_data_size() const;
+
+#ifdef HAVE_PYTHON
+	int __getbuffer__( PyObject *self, Py_buffer *view, int flags );
+	void __releasebuffer__( PyObject *self, Py_buffer *view );
+#endif
 
 	Datagram dg;
 	DatagramIterator dgi;
 	NetworkConnectionHandle hConn;
+
+public:
+	NetworkMessage &operator = ( const NetworkMessage &copy ) = delete;
+
+	const unsigned char *get_data() const;
+	INLINE bool has_views() const;
+
+	void set_message( ISteamNetworkingMessage *pMsg );
+	void release();
+
+private:
+	void fill_datagram();
+
+	// The library message that we were received into. We own it.
+	ISteamNetworkingMessage *m_pMsg;
+	// Number of Python buffer views of the payload that are still alive.
+	// The payload can't be replaced until they are all gone.
+	int m_nViews;
+	bool m_bHasDatagram;
 };
 
+INLINE NetworkMessage::NetworkMessage() :
+	hConn( 0 ),
+	m_pMsg( nullptr ),
+	m_nViews( 0 ),
+	m_bHasDatagram( true )
+{
+}
+
+INLINE NetworkMessage::~NetworkMessage()
+{
+	release();
+}
+
+/**
+ * The datagram of a received message is only filled in when it is asked
+ * for.
+ */
 INLINE const Datagram &NetworkMessage::get_datagram()
 {
+	if ( !m_bHasDatagram )
+	{
+		fill_datagram();
+	}
 	return dg;
 }
 
 INLINE DatagramIterator &NetworkMessage::get_datagram_iterator()
 {
+	if ( !m_bHasDatagram )
+	{
+		fill_datagram();
+	}
 	return dgi;
 }
 
@@ -69,8 +134,81 @@ INLINE NetworkConnectionHandle NetworkMessage::get_connection()
 	return hConn;
 }
 
+INLINE bool NetworkMessage::has_views() const
+{
+	return m_nViews != 0;
+}
+
+/**
+ * A reusable array of received messages. Receiving into a batch drains up to
+ * get_max_messages() messages in one call. The library's message buffers
+ * are released together when the batch is received into again, released or
+ * destroyed, except for the messages that someone kept a reference to,
+ * which stay valid for as long as they are kept. Those slots get new
+ * messages on the next receive.
+ *
+ * The messages can be iterated over from Python:
+ *
+ *     while net.receive_messages_on_poll_group(group, batch):
+ *         for msg in batch:
+ *             data = memoryview(msg)
+ */
+class EXPCL_NETWORKSYSTEM NetworkMessageBatch : public ReferenceCount
+{
+PUBLISHED:
+	NetworkMessageBatch( int maxMessages = 256 );
+	~NetworkMessageBatch();
+
+	INLINE int get_max_messages() const;
+	INLINE int get_num_messages() const;
+	INLINE PT( NetworkMessage ) get_message( int n ) const;
+	MAKE_SEQ( get_messages, get_num_messages, get_message );
+
+	INLINE size_t size() const;
+	INLINE PT( NetworkMessage ) operator []( size_t n ) const;
+
+	void release();
+
+public:
+	ISteamNetworkingMessage **begin_receive();
+	void end_receive( int nMsgCount );
+
+private:
+	pvector<ISteamNetworkingMessage *> m_pMessages;
+	pvector<PT( NetworkMessage )> m_messages;
+	int m_nMessages;
+};
+
+INLINE int NetworkMessageBatch::get_max_messages() const
+{
+	return (int)m_pMessages.size();
+}
+
+INLINE int NetworkMessageBatch::get_num_messages() const
+{
+	return m_nMessages;
+}
+
+INLINE PT( NetworkMessage ) NetworkMessageBatch::get_message( int n ) const
+{
+	nassertr( n >= 0 && n < m_nMessages, nullptr );
+	return m_messages[n];
+}
+
+INLINE size_t NetworkMessageBatch::size() const
+{
+	return (size_t)m_nMessages;
+}
+
+INLINE PT( NetworkMessage ) NetworkMessageBatch::operator []( size_t n ) const
+{
+	nassertr( n < (size_t)m_nMessages, nullptr );
+	return m_messages[n];
+}
+
 class NetworkConnectionInfo;
 class NetworkCallbacks;
+class NetworkIOThread;
 
 class EXPCL_NETWORKSYSTEM NetworkSystem
 {
@@ -107,23 +245,67 @@ PUBLISHED:
 	bool get_connection_info( NetworkConnectionHandle hConn, NetworkConnectionInfo *pInfo );
 	void send_datagram( NetworkConnectionHandle hConn, const Datagram &dg,
 			    NetworkSendFlags flags = NSF_reliable );
+#ifdef HAVE_PYTHON
+	PyObject *send_datagram_to_many( PyObject *pConnections, const Datagram &dg,
+					 NetworkSendFlags flags = NSF_reliable );
+	void queue_datagram_to_many( PyObject *pConnections, const Datagram &dg,
+				     NetworkSendFlags flags = NSF_reliable );
+#endif
+	void queue_datagram( NetworkConnectionHandle hConn, const Datagram &dg,
+			     NetworkSendFlags flags = NSF_reliable );
+	int flush_queued_datagrams();
+	INLINE int get_num_queued_datagrams() const;
 	void close_connection( NetworkConnectionHandle hConn );
 	void run_callbacks( NetworkCallbacks *pCallbacks );
 	bool accept_connection( NetworkConnectionHandle hConn );
 	bool set_connection_poll_group( NetworkConnectionHandle hConn, NetworkPollGroupHandle hPollGroup );
 	bool receive_message_on_connection( NetworkConnectionHandle hConn, NetworkMessage &msg );
 	bool receive_message_on_poll_group( NetworkPollGroupHandle hPollGroup, NetworkMessage &msg );
+	int receive_messages_on_connection( NetworkConnectionHandle hConn, NetworkMessageBatch *pBatch );
+	int receive_messages_on_poll_group( NetworkPollGroupHandle hPollGroup, NetworkMessageBatch *pBatch );
 	NetworkPollGroupHandle create_poll_group();
 	NetworkListenSocketHandle create_listen_socket( int port );
 
+	bool start_io_thread( double pollRate = 0.0 );
+	void stop_io_thread();
+	bool is_io_thread_running() const;
+	void set_io_poll_rate( double pollRate );
+	void add_io_poll_group( NetworkPollGroupHandle hPollGroup );
+	void add_io_connection( NetworkConnectionHandle hConn );
+	void remove_io_connection( NetworkConnectionHandle hConn );
+
 PUBLISHED:
 	static NetworkSystem *get_global_ptr();
 
+public:
+	void send_datagram_to_many( const NetworkConnectionHandle *pConns, int nConns, const Datagram &dg,
+				    NetworkSendFlags flags = NSF_reliable, int64_t *pResults = nullptr );
+	void queue_datagram_to_many( const NetworkConnectionHandle *pConns, int nConns, const Datagram &dg,
+				     NetworkSendFlags flags = NSF_reliable );
+
+private:
+	int receive_messages( uint32_t hSource, bool bPollGroup, ISteamNetworkingMessage **ppMsgs, int nMax );
+
+#ifdef HAVE_PYTHON
+	static bool get_connection_list( PyObject *pConnections, pvector<NetworkConnectionHandle> &conns );
+#endif
+
 private:
 	ISteamNetworkingSockets *m_pInterface;
+
+	// Messages from queue_datagram(), sent by the next flush_queued_datagrams().
+	pvector<ISteamNetworkingMessage *> m_queuedMsgs;
+
+	// Polls the library on its own thread when running, see start_io_thread().
+	PT( NetworkIOThread ) m_pIOThread;
 	static NetworkSystem *s_pGlobalPtr;
 };
 
+INLINE int NetworkSystem::get_num_queued_datagrams() const
+{
+	return (int)m_queuedMsgs.size();
+}
+
 INLINE NetworkSystem *NetworkSystem::get_global_ptr()
 {
 	if ( !s_pGlobalPtr )
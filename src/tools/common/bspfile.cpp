@@ -15,6 +15,65 @@ int				g_max_map_lightdata = DEFAULT_MAX_MAP_LIGHTDATA;
 
 bspdata_t *g_bspdata = nullptr;
 
+bspdata_t::bspdata_t( bool reserve ) :
+        reserve_max( reserve ),
+        nummodels( 0 ),
+        visdatasize( 0 ),
+        numtexrefs( 0 ),
+        entdatasize( 0 ),
+        numleafs( 0 ),
+        numplanes( 0 ),
+        numvertexes( 0 ),
+        numnodes( 0 ),
+        numtexinfo( 0 ),
+        numfaces( 0 ),
+        numorigfaces( 0 ),
+        numedges( 0 ),
+        nummarksurfaces( 0 ),
+        numsurfedges( 0 ),
+        numentities( 0 )
+{
+        if ( reserve_max )
+        {
+                dmodels.alloc_max();
+                dvisdata.alloc_max();
+                dtexrefs.alloc_max();
+                dentdata.alloc_max();
+                dleafs.alloc_max();
+                dplanes.alloc_max();
+                dvertexes.alloc_max();
+                dnodes.alloc_max();
+                texinfo.alloc_max();
+                dfaces.alloc_max();
+                dorigfaces.alloc_max();
+                dedges.alloc_max();
+                dmarksurfaces.alloc_max();
+                dsurfedges.alloc_max();
+                entities.alloc_max();
+        }
+}
+
+/**
+ * Returns the number of bytes allocated for lump storage, not including
+ * lumps that are still in a mapped file image.
+ */
+size_t bspdata_t::get_memory_usage() const
+{
+        return lump_memory_usage( dmodels ) + lump_memory_usage( dvisdata ) + lump_memory_usage( dtexrefs ) +
+                lump_memory_usage( dentdata ) + lump_memory_usage( dleafs ) + lump_memory_usage( dplanes ) +
+                lump_memory_usage( dvertexes ) + lump_memory_usage( dnodes ) + lump_memory_usage( texinfo ) +
+                lump_memory_usage( dfaces ) + lump_memory_usage( dorigfaces ) + lump_memory_usage( dedges ) +
+                lump_memory_usage( dmarksurfaces ) + lump_memory_usage( dsurfedges ) + lump_memory_usage( entities ) +
+                lump_memory_usage( leafambientlighting ) + lump_memory_usage( leafambientindex ) +
+                lump_memory_usage( dbrushes ) + lump_memory_usage( dbrushsides ) + lump_memory_usage( dleafbrushes ) +
+                lump_memory_usage( dstaticprops ) + lump_memory_usage( dstaticpropvertexdatas ) +
+                lump_memory_usage( staticproplighting ) + lump_memory_usage( vertnormals ) +
+                lump_memory_usage( vertnormalindices ) + lump_memory_usage( cubemapdata ) + lump_memory_usage( cubemaps ) +
+                lump_memory_usage( leaflightvis ) + lump_memory_usage( probegrid ) + lump_memory_usage( probegridsamples ) +
+                lump_memory_usage( probegridbricks ) +
+                lump_memory_usage( bouncedlightdata ) + lump_memory_usage( sunlightdata ) + lump_memory_usage( lightdata );
+}
+
 map<string, contents_t> g_tex_contents;
 
 /*
@@ -90,19 +149,30 @@ int             CompressVis( const byte* const src, const unsigned int src_lengt
 //      
 // =====================================================================================
 void            DecompressVis( bspdata_t *data, const byte* src, byte* const dest, const unsigned int dest_length )
+{
+        lumpview_t<byte> visdata = GetLumpView<byte>( data, LUMP_VISIBILITY );
+        DecompressVis( visdata.data(), (int)visdata.size(), data->dmodels[0].visleafs, src, dest, dest_length );
+}
+
+// =====================================================================================
+//  DecompressVis
+//      Works directly on a visibility lump, which may still be in the mapped file image.
+// =====================================================================================
+void            DecompressVis( const byte *visdata, const int visdatasize, const int visleafs,
+                               const byte* src, byte* const dest, const unsigned int dest_length )
 {
         unsigned int    current_length = 0;
         int             c;
         byte*           out;
         int             row;
 
-        row = ( data->dmodels[0].visleafs + 7 ) >> 3; // same as the length used by VIS program in CompressVis
+        row = ( visleafs + 7 ) >> 3; // same as the length used by VIS program in CompressVis
                                                   // The wrong size will cause DecompressVis to spend extremely long time once the source pointer runs into the invalid area in g_dvisdata (for example, in BuildFaceLights, some faces could hang for a few seconds), and sometimes to crash.
         out = dest;
 
         do
         {
-                hlassume( src - data->dvisdata < data->visdatasize, assume_DECOMPRESSVIS_OVERFLOW );
+                hlassume( src - visdata < visdatasize, assume_DECOMPRESSVIS_OVERFLOW );
                 if ( *src )
                 {
                         current_length++;
@@ -114,7 +184,7 @@ void            DecompressVis( bspdata_t *data, const byte* src, byte* const des
                         continue;
                 }
 
-                hlassume( &src[1] - data->dvisdata < data->visdatasize, assume_DECOMPRESSVIS_OVERFLOW );
+                hlassume( &src[1] - visdata < visdatasize, assume_DECOMPRESSVIS_OVERFLOW );
                 c = src[1];
                 src += 2;
                 while ( c )
@@ -312,6 +382,41 @@ static void     SwapBSPFile( bspdata_t *data, const bool todisk )
                 idx->num_ambient_samples = LittleShort( idx->num_ambient_samples );
         }
 
+        // leaf light visibility
+        for ( i = 0; i < (int)data->leaflightvis.size(); i++ )
+        {
+                data->leaflightvis[i] = LittleLong( data->leaflightvis[i] );
+        }
+
+        // probe grid
+        for ( i = 0; i < (int)data->probegrid.size(); i++ )
+        {
+                dprobegrid_t *grid = &data->probegrid[i];
+                for ( int j = 0; j < 3; j++ )
+                {
+                        grid->origin[j] = LittleFloat( grid->origin[j] );
+                        grid->size[j] = LittleLong( grid->size[j] );
+                }
+                grid->spacing = LittleFloat( grid->spacing );
+        }
+        for ( i = 0; i < (int)data->probegridsamples.size(); i++ )
+        {
+                dprobegridsample_t *sample = &data->probegridsamples[i];
+                for ( int j = 0; j < 6; j++ )
+                {
+                        for ( int k = 0; k < 3; k++ )
+                        {
+                                sample->cube[j][k] = LittleFloat( sample->cube[j][k] );
+                        }
+                }
+        }
+        for ( i = 0; i < (int)data->probegridbricks.size(); i++ )
+        {
+                dprobegridbrick_t *brick = &data->probegridbricks[i];
+                brick->firstsample = LittleLong( brick->firstsample );
+                brick->numsamples = LittleLong( brick->numsamples );
+        }
+
         // brush
         for ( i = 0; i < (int)data->dbrushes.size(); i++ )
         {
@@ -336,6 +441,50 @@ static void     SwapBSPFile( bspdata_t *data, const bool todisk )
         }
 }
 
+// =====================================================================================
+//  NumHeaderLumps
+//      Number of lumps in the header of a file of the given version
+// =====================================================================================
+static int      NumHeaderLumps( const int version )
+{
+        switch ( version )
+        {
+        case 33:
+                // Before LUMP_LEAFLIGHTVIS.
+                return LUMP_LEAFLIGHTVIS;
+        case 34:
+                // Before the probe grid lumps.
+                return LUMP_PROBEGRID;
+        case 35:
+                // Before the probe grid was split into bricks.
+                return LUMP_PROBEGRIDBRICKS;
+        default:
+                return HEADER_LUMPS;
+        }
+}
+
+static size_t   BSPHeaderSize( const int version )
+{
+        return sizeof( int ) * 2 + sizeof( lump_t ) * NumHeaderLumps( version );
+}
+
+// =====================================================================================
+//  GetHeaderLump
+//      Returns the lump from the header, or an empty lump if the file is from
+//      before the lump was added
+// =====================================================================================
+static const lump_t *GetHeaderLump( const dheader_t* const header, const int lump )
+{
+        static const lump_t empty_lump = { 0, 0 };
+
+        if ( lump >= NumHeaderLumps( header->version ) )
+        {
+                return &empty_lump;
+        }
+
+        return &header->lumps[lump];
+}
+
 // =====================================================================================
 //  CopyLump
 //      balh
@@ -344,8 +493,8 @@ static int      CopyLump( int lump, void* dest, int size, const dheader_t* const
 {
         int             length, ofs;
 
-        length = header->lumps[lump].filelen;
-        ofs = header->lumps[lump].fileofs;
+        length = GetHeaderLump( header, lump )->filelen;
+        ofs = GetHeaderLump( header, lump )->fileofs;
 
         if ( length % size )
         {
@@ -366,10 +515,23 @@ static int      CopyLump( int lump, void* dest, int size, const dheader_t* const
 template<class T>
 static int CopyLump( int lump, pvector<T> &dest, const dheader_t* const header )
 {
-        dest.resize( header->lumps[lump].filelen / sizeof( T ) );
+        dest.resize( GetHeaderLump( header, lump )->filelen / sizeof( T ) );
         return CopyLump( lump, dest.data(), sizeof( T ), header );
 }
 
+template<class T, int MAXCOUNT>
+static int CopyLump( int lump, bsplump_t<T, MAXCOUNT> &dest, const dheader_t* const header, const bool reserve_max )
+{
+        size_t count = GetHeaderLump( header, lump )->filelen / sizeof( T );
+        if ( reserve_max && count < (size_t)MAXCOUNT )
+        {
+                // The tools may add entries past what was in the file.
+                count = MAXCOUNT;
+        }
+        dest.alloc( count );
+        return CopyLump( lump, (T *)dest, sizeof( T ), header );
+}
+
 
 // =====================================================================================
 //  LoadBSPFile
@@ -383,45 +545,61 @@ bspdata_t            *LoadBSPFile( const char* const filename )
 }
 
 // =====================================================================================
-//  LoadBSPImage
-//      balh
+//  SwapBSPHeader
+//      Swaps the header in place and validates it. Headers of older versions
+//      are shorter, so only the lumps that the version has are swapped.
 // =====================================================================================
-bspdata_t            *LoadBSPImage( dheader_t* const header )
+static bool     SwapBSPHeader( dheader_t* const header )
 {
-        unsigned int     i;
+        int              i;
 
-        // swap the header
-        for ( i = 0; i < sizeof( dheader_t ) / 4; i++ )
-        {
-                ( (int*)header )[i] = LittleLong( ( (int*)header )[i] );
-        }
+        header->ident = LittleLong( header->ident );
+        header->version = LittleLong( header->version );
 
         if ( header->ident != PBSP_MAGIC )
         {
                 Error( "Not a valid PBSP file. Ident of file is %i, not %i", header->ident, PBSP_MAGIC );
+                return false;
+        }
+
+        if ( header->version < BSPVERSION_OLDEST || header->version > BSPVERSION )
+        {
+                Error( "BSP is version %i, not %i through %i", header->version, BSPVERSION_OLDEST, BSPVERSION );
+                return false;
         }
 
-        if ( header->version != BSPVERSION )
+        for ( i = 0; i < NumHeaderLumps( header->version ); i++ )
         {
-                Error( "BSP is version %i, not %i", header->version, BSPVERSION );
+                header->lumps[i].fileofs = LittleLong( header->lumps[i].fileofs );
+                header->lumps[i].filelen = LittleLong( header->lumps[i].filelen );
         }
 
-        bspdata_t *data = new bspdata_t;
+        return true;
+}
 
-        data->nummodels = CopyLump( LUMP_MODELS, data->dmodels, sizeof( dmodel_t ), header );
-        data->numvertexes = CopyLump( LUMP_VERTEXES, data->dvertexes, sizeof( dvertex_t ), header );
-        data->numplanes = CopyLump( LUMP_PLANES, data->dplanes, sizeof( dplane_t ), header );
-        data->numleafs = CopyLump( LUMP_LEAFS, data->dleafs, sizeof( dleaf_t ), header );
-        data->numnodes = CopyLump( LUMP_NODES, data->dnodes, sizeof( dnode_t ), header );
-        data->numtexinfo = CopyLump( LUMP_TEXINFO, data->texinfo, sizeof( texinfo_t ), header );
-        data->numfaces = CopyLump( LUMP_FACES, data->dfaces, sizeof( dface_t ), header );
-        //data->numorigfaces = CopyLump( LUMP_ORIGFACES, data->dorigfaces, sizeof( dface_t ), header );
-        data->nummarksurfaces = CopyLump( LUMP_MARKSURFACES, data->dmarksurfaces, sizeof( data->dmarksurfaces[0] ), header );
-        data->numsurfedges = CopyLump( LUMP_SURFEDGES, data->dsurfedges, sizeof( data->dsurfedges[0] ), header );
-        data->numedges = CopyLump( LUMP_EDGES, data->dedges, sizeof( dedge_t ), header );
-        data->numtexrefs = CopyLump( LUMP_TEXTURES, data->dtexrefs, sizeof( texref_t ), header );
-        data->visdatasize = CopyLump( LUMP_VISIBILITY, data->dvisdata, 1, header );
-        data->entdatasize = CopyLump( LUMP_ENTITIES, data->dentdata, 1, header );
+// =====================================================================================
+//  CopyBSPLumps
+//      Copies every lump that isn't flagged in lazylumps out of the image
+// =====================================================================================
+static void     CopyBSPLumps( bspdata_t *data, const dheader_t* const header, const unsigned int lazylumps )
+{
+        data->nummodels = CopyLump( LUMP_MODELS, data->dmodels, header, data->reserve_max );
+        data->numvertexes = CopyLump( LUMP_VERTEXES, data->dvertexes, header, data->reserve_max );
+        data->numplanes = CopyLump( LUMP_PLANES, data->dplanes, header, data->reserve_max );
+        data->numleafs = CopyLump( LUMP_LEAFS, data->dleafs, header, data->reserve_max );
+        data->numnodes = CopyLump( LUMP_NODES, data->dnodes, header, data->reserve_max );
+        data->numtexinfo = CopyLump( LUMP_TEXINFO, data->texinfo, header, data->reserve_max );
+        data->numfaces = CopyLump( LUMP_FACES, data->dfaces, header, data->reserve_max );
+        //data->numorigfaces = CopyLump( LUMP_ORIGFACES, data->dorigfaces, header, data->reserve_max );
+        data->nummarksurfaces = CopyLump( LUMP_MARKSURFACES, data->dmarksurfaces, header, data->reserve_max );
+        data->numsurfedges = CopyLump( LUMP_SURFEDGES, data->dsurfedges, header, data->reserve_max );
+        data->numedges = CopyLump( LUMP_EDGES, data->dedges, header, data->reserve_max );
+        data->numtexrefs = CopyLump( LUMP_TEXTURES, data->dtexrefs, header, data->reserve_max );
+        if ( lazylumps & LUMP_BIT( LUMP_VISIBILITY ) )
+                data->visdatasize = GetHeaderLump( header, LUMP_VISIBILITY )->filelen;
+        else
+                data->visdatasize = CopyLump( LUMP_VISIBILITY, data->dvisdata, header, data->reserve_max );
+        data->entdatasize = CopyLump( LUMP_ENTITIES, data->dentdata, header, data->reserve_max );
 
         // new lumps uses STL vectors and templates!
         CopyLump( LUMP_BRUSHES, data->dbrushes, header );
@@ -429,19 +607,33 @@ bspdata_t            *LoadBSPImage( dheader_t* const header )
         CopyLump( LUMP_LEAFBRUSHES, data->dleafbrushes, header );
         CopyLump( LUMP_LEAFAMBIENTINDEX, data->leafambientindex, header );
         CopyLump( LUMP_LEAFAMBIENTLIGHTING, data->leafambientlighting, header );
-	CopyLump( LUMP_BOUNCEDLIGHTING, data->bouncedlightdata, header );
-        CopyLump( LUMP_DIRECTLIGHTING, data->lightdata, header );
-	CopyLump( LUMP_DIRECTSUNLIGHTING, data->sunlightdata, header );
+        if ( !( lazylumps & LUMP_BIT( LUMP_BOUNCEDLIGHTING ) ) )
+                CopyLump( LUMP_BOUNCEDLIGHTING, data->bouncedlightdata, header );
+        if ( !( lazylumps & LUMP_BIT( LUMP_DIRECTLIGHTING ) ) )
+                CopyLump( LUMP_DIRECTLIGHTING, data->lightdata, header );
+        if ( !( lazylumps & LUMP_BIT( LUMP_DIRECTSUNLIGHTING ) ) )
+                CopyLump( LUMP_DIRECTSUNLIGHTING, data->sunlightdata, header );
         CopyLump( LUMP_STATICPROPS, data->dstaticprops, header );
         CopyLump( LUMP_STATICPROPVERTEXDATA, data->dstaticpropvertexdatas, header );
-        CopyLump( LUMP_STATICPROPLIGHTING, data->staticproplighting, header );
+        if ( !( lazylumps & LUMP_BIT( LUMP_STATICPROPLIGHTING ) ) )
+                CopyLump( LUMP_STATICPROPLIGHTING, data->staticproplighting, header );
         CopyLump( LUMP_VERTNORMALS, data->vertnormals, header );
         CopyLump( LUMP_VERTNORMALINDICES, data->vertnormalindices, header );
-        CopyLump( LUMP_CUBEMAPDATA, data->cubemapdata, header );
+        if ( !( lazylumps & LUMP_BIT( LUMP_CUBEMAPDATA ) ) )
+                CopyLump( LUMP_CUBEMAPDATA, data->cubemapdata, header );
         CopyLump( LUMP_CUBEMAPS, data->cubemaps, header );
+        CopyLump( LUMP_LEAFLIGHTVIS, data->leaflightvis, header );
+        CopyLump( LUMP_PROBEGRID, data->probegrid, header );
+        CopyLump( LUMP_PROBEGRIDSAMPLES, data->probegridsamples, header );
+        CopyLump( LUMP_PROBEGRIDBRICKS, data->probegridbricks, header );
+}
 
-        Free( header );                                          // everything has been copied out
-
+// =====================================================================================
+//  FinishBSPLoad
+//      Swaps the copied lumps and computes the checksums
+// =====================================================================================
+static void     FinishBSPLoad( bspdata_t *data )
+{
                                                                  //
                                                                  // swap everything
                                                                  //      
@@ -459,13 +651,193 @@ bspdata_t            *LoadBSPImage( dheader_t* const header )
         data->dsurfedges_checksum = FastChecksum( data->dsurfedges, data->numsurfedges * sizeof( data->dsurfedges[0] ) );
         data->dedges_checksum = FastChecksum( data->dedges, data->numedges * sizeof( data->dedges[0] ) );
         data->dtexrefs_checksum = FastChecksum( data->dtexrefs, data->numedges * sizeof( data->dtexrefs[0] ) );
-        data->dvisdata_checksum = FastChecksum( data->dvisdata, data->visdatasize * sizeof( data->dvisdata[0] ) );
-        data->dlightdata_checksum = FastChecksum( data->lightdata.data(), data->lightdata.size() * sizeof( colorrgbexp32_t ) );
+        // Lumps still in the file image are left alone; checksumming them would
+        // fault the whole lump in at load time.
+        data->dvisdata_checksum = 0;
+        if ( IsLumpResident( data, LUMP_VISIBILITY ) )
+        {
+                lumpview_t<byte> visdata = GetLumpView<byte>( data, LUMP_VISIBILITY );
+                data->dvisdata_checksum = FastChecksum( visdata.data(), visdata.size() );
+        }
+        data->dlightdata_checksum = 0;
+        if ( IsLumpResident( data, LUMP_DIRECTLIGHTING ) )
+        {
+                lumpview_t<colorrgbexp32_t> lightdata = GetLumpView<colorrgbexp32_t>( data, LUMP_DIRECTLIGHTING );
+                data->dlightdata_checksum = FastChecksum( lightdata.data(), lightdata.size() * sizeof( colorrgbexp32_t ) );
+        }
         data->dentdata_checksum = FastChecksum( data->dentdata, data->entdatasize * sizeof( data->dentdata[0] ) );
+}
+
+// =====================================================================================
+//  LoadBSPImage
+//      balh
+// =====================================================================================
+bspdata_t            *LoadBSPImage( dheader_t* const header )
+{
+        if ( !SwapBSPHeader( header ) )
+        {
+                return nullptr;
+        }
+
+        bspdata_t *data = new bspdata_t( true );
+        CopyBSPLumps( data, header, 0 );
+
+        Free( header );                                          // everything has been copied out
+
+        FinishBSPLoad( data );
+
+        return data;
+}
+
+// =====================================================================================
+//  LoadBSPImage
+//      Loads from a mapped file image without copying the lumps in lazylumps.
+//      The image is kept alive by the returned bspdata_t until all of them have
+//      been materialized.
+// =====================================================================================
+bspdata_t            *LoadBSPImage( BSPMappedImage *image, const unsigned int lazylumps )
+{
+        nassertr( image != nullptr && image->is_valid(), nullptr );
+
+        dheader_t *header = (dheader_t *)image->get_base();
+        if ( !image->is_range_valid( 0, sizeof( int ) * 2 ) ||
+             !image->is_range_valid( 0, BSPHeaderSize( LittleLong( header->version ) ) ) )
+        {
+                Error( "Not a valid PBSP file. File is too small to contain a header" );
+        }
+
+        if ( !SwapBSPHeader( header ) )
+        {
+                return nullptr;
+        }
+
+        for ( int i = 0; i < NumHeaderLumps( header->version ); i++ )
+        {
+                if ( header->lumps[i].fileofs < 0 || header->lumps[i].filelen < 0 ||
+                     !image->is_range_valid( header->lumps[i].fileofs, header->lumps[i].filelen ) )
+                {
+                        Error( "LoadBSPImage: lump %i lies outside of the file (offset %i, length %i)",
+                               i, header->lumps[i].fileofs, header->lumps[i].filelen );
+                }
+        }
+
+        // Only allocate what is in the file.
+        bspdata_t *data = new bspdata_t( false );
+        data->image = image;
+
+#ifdef WORDS_BIGENDIAN
+        // The lumps in the image are little endian and can't be used in place.
+        data->lazylumps = 0;
+#else
+        data->lazylumps = lazylumps & BSP_LAZY_LUMPS;
+#endif
+
+        CopyBSPLumps( data, header, data->lazylumps );
+        FinishBSPLoad( data );
+
+        if ( data->lazylumps == 0 )
+        {
+                // Nothing references the image anymore.
+                data->image = nullptr;
+        }
 
         return data;
 }
 
+// =====================================================================================
+//  GetLumpData
+//      Returns the lump from the file image if it hasn't been materialized,
+//      otherwise from the bspdata_t.
+// =====================================================================================
+unsigned char *GetLumpData( bspdata_t *data, const int lump, size_t &length )
+{
+        if ( !IsLumpResident( data, lump ) )
+        {
+                const dheader_t *header = (const dheader_t *)data->image->get_base();
+                length = GetHeaderLump( header, lump )->filelen;
+                return data->image->get_base() + GetHeaderLump( header, lump )->fileofs;
+        }
+
+        switch ( lump )
+        {
+        case LUMP_VISIBILITY:
+                length = data->visdatasize;
+                return data->dvisdata;
+        case LUMP_BOUNCEDLIGHTING:
+                length = data->bouncedlightdata.size() * sizeof( colorrgbexp32_t );
+                return (unsigned char *)data->bouncedlightdata.data();
+        case LUMP_DIRECTLIGHTING:
+                length = data->lightdata.size() * sizeof( colorrgbexp32_t );
+                return (unsigned char *)data->lightdata.data();
+        case LUMP_DIRECTSUNLIGHTING:
+                length = data->sunlightdata.size() * sizeof( colorrgbexp32_t );
+                return (unsigned char *)data->sunlightdata.data();
+        case LUMP_STATICPROPLIGHTING:
+                length = data->staticproplighting.size() * sizeof( colorrgbexp32_t );
+                return (unsigned char *)data->staticproplighting.data();
+        case LUMP_CUBEMAPDATA:
+                length = data->cubemapdata.size() * sizeof( colorrgbexp32_t );
+                return (unsigned char *)data->cubemapdata.data();
+        default:
+                Error( "GetLumpData: lump %i cannot be viewed", lump );
+                length = 0;
+                return nullptr;
+        }
+}
+
+// =====================================================================================
+//  MaterializeLump
+//      Copies a lazily loaded lump out of the file image into the bspdata_t,
+//      so it can be modified or written back out.
+// =====================================================================================
+void            MaterializeLump( bspdata_t *data, const int lump )
+{
+        if ( IsLumpResident( data, lump ) )
+        {
+                return;
+        }
+
+        const dheader_t *header = (const dheader_t *)data->image->get_base();
+
+        switch ( lump )
+        {
+        case LUMP_VISIBILITY:
+                data->visdatasize = CopyLump( LUMP_VISIBILITY, data->dvisdata, header, data->reserve_max );
+                break;
+        case LUMP_BOUNCEDLIGHTING:
+                CopyLump( LUMP_BOUNCEDLIGHTING, data->bouncedlightdata, header );
+                break;
+        case LUMP_DIRECTLIGHTING:
+                CopyLump( LUMP_DIRECTLIGHTING, data->lightdata, header );
+                break;
+        case LUMP_DIRECTSUNLIGHTING:
+                CopyLump( LUMP_DIRECTSUNLIGHTING, data->sunlightdata, header );
+                break;
+        case LUMP_STATICPROPLIGHTING:
+                CopyLump( LUMP_STATICPROPLIGHTING, data->staticproplighting, header );
+                break;
+        case LUMP_CUBEMAPDATA:
+                CopyLump( LUMP_CUBEMAPDATA, data->cubemapdata, header );
+                break;
+        }
+
+        data->lazylumps &= ~LUMP_BIT( lump );
+
+        if ( data->lazylumps == 0 )
+        {
+                // Everything has been copied out, release the file image.
+                data->image = nullptr;
+        }
+}
+
+void            MaterializeAllLumps( bspdata_t *data )
+{
+        for ( int i = 0; i < HEADER_LUMPS && data->lazylumps != 0; i++ )
+        {
+                MaterializeLump( data, i );
+        }
+}
+
 //
 // =====================================================================================
 //
@@ -501,6 +873,9 @@ void            WriteBSPFile( bspdata_t *data, const char* const filename )
         header = &outheader;
         memset( header, 0, sizeof( dheader_t ) );
 
+        // Pull in anything that was left in the file image.
+        MaterializeAllLumps( data );
+
         SwapBSPFile( data, true );
 
         header->ident = LittleLong( PBSP_MAGIC );
@@ -542,6 +917,10 @@ void            WriteBSPFile( bspdata_t *data, const char* const filename )
         AddLump( LUMP_VERTNORMALINDICES, data->vertnormalindices, header, bspfile );
         AddLump( LUMP_CUBEMAPDATA, data->cubemapdata, header, bspfile );
         AddLump( LUMP_CUBEMAPS, data->cubemaps, header, bspfile );
+        AddLump( LUMP_LEAFLIGHTVIS, data->leaflightvis, header, bspfile );
+        AddLump( LUMP_PROBEGRID, data->probegrid, header, bspfile );
+        AddLump( LUMP_PROBEGRIDSAMPLES, data->probegridsamples, header, bspfile );
+        AddLump( LUMP_PROBEGRIDBRICKS, data->probegridbricks, header, bspfile );
 
         fseek( bspfile, 0, SEEK_SET );
         SafeWrite( bspfile, header, sizeof( dheader_t ) );
@@ -1015,7 +1394,6 @@ return NULL;
 #endif
 */
 
-#define ENTRIES(a)		(sizeof(a)/sizeof(*(a)))
 #define ENTRYSIZE(a)	(sizeof(*(a)))
 
 // =====================================================================================
@@ -1044,6 +1422,16 @@ static int      GlobUsage( const char* const szItem, const int itemstorage, cons
         return itemstorage;
 }
 
+// =====================================================================================
+//  LumpMemoryUsage
+//      print out how much memory is allocated for a lump
+// =====================================================================================
+template<class LUMP>
+static void     LumpMemoryUsage( const char* const szItem, const LUMP &lump )
+{
+        Log( "%-13s %9u\n", szItem, (unsigned int)lump_memory_usage( lump ) );
+}
+
 // =====================================================================================
 //  PrintBSPFileSizes
 //      Dumps info about current file
@@ -1059,24 +1447,24 @@ void            PrintBSPFileSizes(bspdata_t *data)
         Log( "Object names  Objects/Maxobjs  Memory / Maxmem  Fullness\n" );
         Log( "------------  ---------------  ---------------  --------\n" );
 
-        totalmemory += ArrayUsage( "models", data->nummodels, ENTRIES( data->dmodels ), ENTRYSIZE( data->dmodels ) );
+        totalmemory += ArrayUsage( "models", data->nummodels, data->dmodels.max_count(), ENTRYSIZE( data->dmodels ) );
         totalmemory += ArrayUsage( "planes", data->numplanes, MAX_MAP_PLANES, ENTRYSIZE( data->dplanes ) );
-        totalmemory += ArrayUsage( "vertexes", data->numvertexes, ENTRIES( data->dvertexes ), ENTRYSIZE( data->dvertexes ) );
-        totalmemory += ArrayUsage( "nodes", data->numnodes, ENTRIES( data->dnodes ), ENTRYSIZE( data->dnodes ) );
+        totalmemory += ArrayUsage( "vertexes", data->numvertexes, data->dvertexes.max_count(), ENTRYSIZE( data->dvertexes ) );
+        totalmemory += ArrayUsage( "nodes", data->numnodes, data->dnodes.max_count(), ENTRYSIZE( data->dnodes ) );
         totalmemory += ArrayUsage( "texinfos", data->numtexinfo, MAX_MAP_TEXINFO, ENTRYSIZE( data->texinfo ) );
-        totalmemory += ArrayUsage( "faces", data->numfaces, ENTRIES( data->dfaces ), ENTRYSIZE( data->dfaces ) );
-        //totalmemory += ArrayUsage( "origfaces", data->numorigfaces, ENTRIES( data->dorigfaces ), ENTRYSIZE( data->dorigfaces ) );
+        totalmemory += ArrayUsage( "faces", data->numfaces, data->dfaces.max_count(), ENTRYSIZE( data->dfaces ) );
+        //totalmemory += ArrayUsage( "origfaces", data->numorigfaces, data->dorigfaces.max_count(), ENTRYSIZE( data->dorigfaces ) );
         totalmemory += ArrayUsage( "* worldfaces", ( data->nummodels > 0 ? data->dmodels[0].numfaces : 0 ), MAX_MAP_WORLDFACES, 0 );
         totalmemory += ArrayUsage( "leaves", data->numleafs, MAX_MAP_LEAFS, ENTRYSIZE( data->dleafs ) );
         totalmemory += ArrayUsage( "* worldleaves", ( data->nummodels > 0 ? data->dmodels[0].visleafs : 0 ), MAX_MAP_LEAFS_ENGINE, 0 );
-        totalmemory += ArrayUsage( "marksurfaces", data->nummarksurfaces, ENTRIES( data->dmarksurfaces ), ENTRYSIZE( data->dmarksurfaces ) );
-        totalmemory += ArrayUsage( "surfedges", data->numsurfedges, ENTRIES( data->dsurfedges ), ENTRYSIZE( data->dsurfedges ) );
-        totalmemory += ArrayUsage( "edges", data->numedges, ENTRIES( data->dedges ), ENTRYSIZE( data->dedges ) );
-        totalmemory += ArrayUsage( "texrefs", data->numtexrefs, ENTRIES( data->dtexrefs ), ENTRYSIZE( data->dtexrefs ) );
+        totalmemory += ArrayUsage( "marksurfaces", data->nummarksurfaces, data->dmarksurfaces.max_count(), ENTRYSIZE( data->dmarksurfaces ) );
+        totalmemory += ArrayUsage( "surfedges", data->numsurfedges, data->dsurfedges.max_count(), ENTRYSIZE( data->dsurfedges ) );
+        totalmemory += ArrayUsage( "edges", data->numedges, data->dedges.max_count(), ENTRYSIZE( data->dedges ) );
+        totalmemory += ArrayUsage( "texrefs", data->numtexrefs, data->dtexrefs.max_count(), ENTRYSIZE( data->dtexrefs ) );
 
         totalmemory += GlobUsage( "lightdata", data->lightdata.size(), g_max_map_lightdata );
-        totalmemory += GlobUsage( "visdata", data->visdatasize, sizeof( data->dvisdata ) );
-        totalmemory += GlobUsage( "entdata", data->entdatasize, sizeof( data->dentdata ) );
+        totalmemory += GlobUsage( "visdata", data->visdatasize, data->dvisdata.max_count() );
+        totalmemory += GlobUsage( "entdata", data->entdatasize, data->dentdata.max_count() );
         if ( numallocblocks == -1 )
         {
                 Log( "* AllocBlock    [ not available to the " PLATFORM_VERSIONSTRING " version ]\n" );
@@ -1093,6 +1481,45 @@ void            PrintBSPFileSizes(bspdata_t *data)
         }
 
         Log( "=== Total BSP file data space used: %d bytes ===\n", totalmemory );
+
+        Log( "\n" );
+        Log( "Lump memory   Allocated\n" );
+        Log( "------------  ---------\n" );
+        LumpMemoryUsage( "models", data->dmodels );
+        LumpMemoryUsage( "planes", data->dplanes );
+        LumpMemoryUsage( "vertexes", data->dvertexes );
+        LumpMemoryUsage( "nodes", data->dnodes );
+        LumpMemoryUsage( "texinfos", data->texinfo );
+        LumpMemoryUsage( "faces", data->dfaces );
+        LumpMemoryUsage( "origfaces", data->dorigfaces );
+        LumpMemoryUsage( "leaves", data->dleafs );
+        LumpMemoryUsage( "marksurfaces", data->dmarksurfaces );
+        LumpMemoryUsage( "surfedges", data->dsurfedges );
+        LumpMemoryUsage( "edges", data->dedges );
+        LumpMemoryUsage( "texrefs", data->dtexrefs );
+        LumpMemoryUsage( "visdata", data->dvisdata );
+        LumpMemoryUsage( "entdata", data->dentdata );
+        LumpMemoryUsage( "entities", data->entities );
+        LumpMemoryUsage( "brushes", data->dbrushes );
+        LumpMemoryUsage( "brushsides", data->dbrushsides );
+        LumpMemoryUsage( "leafbrushes", data->dleafbrushes );
+        LumpMemoryUsage( "leafambient", data->leafambientlighting );
+        LumpMemoryUsage( "leafambindex", data->leafambientindex );
+        LumpMemoryUsage( "staticprops", data->dstaticprops );
+        LumpMemoryUsage( "propvertdata", data->dstaticpropvertexdatas );
+        LumpMemoryUsage( "proplighting", data->staticproplighting );
+        LumpMemoryUsage( "vertnormals", data->vertnormals );
+        LumpMemoryUsage( "vertnormidx", data->vertnormalindices );
+        LumpMemoryUsage( "cubemaps", data->cubemaps );
+        LumpMemoryUsage( "cubemapdata", data->cubemapdata );
+        LumpMemoryUsage( "leaflightvis", data->leaflightvis );
+        LumpMemoryUsage( "probegrid", data->probegrid );
+        LumpMemoryUsage( "probegridsamples", data->probegridsamples );
+        LumpMemoryUsage( "probegridbricks", data->probegridbricks );
+        LumpMemoryUsage( "lightdata", data->lightdata );
+        LumpMemoryUsage( "sunlightdata", data->sunlightdata );
+        LumpMemoryUsage( "bouncedlight", data->bouncedlightdata );
+        Log( "=== Total BSP lump memory allocated: %u bytes ===\n", (unsigned int)data->get_memory_usage() );
 }
 
 
@@ -1141,7 +1568,7 @@ bool            ParseEntity(bspdata_t *data)
                 Error( "ParseEntity: { not found" );
         }
 
-        if ( data->numentities == MAX_MAP_ENTITIES )
+        if ( data->numentities >= (int)data->entities.capacity() )
         {
                 Error( "data->numentities == MAX_MAP_ENTITIES" );
         }
@@ -1205,6 +1632,22 @@ bool            ParseEntity(bspdata_t *data)
 void            ParseEntities(bspdata_t *data)
 {
         data->numentities = 0;
+
+        if ( !data->reserve_max )
+        {
+                // Every entity opens with a brace, so this is an upper bound
+                // on the number of entities we are about to parse.
+                int numbraces = 0;
+                for ( int i = 0; i < data->entdatasize; i++ )
+                {
+                        if ( data->dentdata[i] == '{' )
+                        {
+                                numbraces++;
+                        }
+                }
+                data->entities.ensure( numbraces < MAX_MAP_ENTITIES ? numbraces : MAX_MAP_ENTITIES );
+        }
+
         ParseFromMemory( data->dentdata, data->entdatasize );
 
         while ( ParseEntity(data) )
@@ -1670,7 +2113,7 @@ LRGBColor dface_AvgLightColor( bspdata_t *data, dface_t *face, int style )
         return avg;
 }
 
-INLINE colorrgbexp32_t *SampleLightData( pvector<colorrgbexp32_t> &data, const dface_t *face, int ofs, int luxel, int style, int bump )
+INLINE colorrgbexp32_t *SampleLightData( const lumpview_t<colorrgbexp32_t> &data, const dface_t *face, int ofs, int luxel, int style, int bump )
 {
 	int luxels = ( face->lightmap_size[0] + 1 ) * ( face->lightmap_size[1] + 1 );
 	int bump_count = face->bumped_lightmap ? NUM_BUMP_VECTS + 1 : 1;
@@ -1679,17 +2122,17 @@ INLINE colorrgbexp32_t *SampleLightData( pvector<colorrgbexp32_t> &data, const d
 
 INLINE colorrgbexp32_t *SampleLightmap( bspdata_t *data, const dface_t *face, int luxel, int style, int bump )
 {
-	return SampleLightData( data->lightdata, face, face->lightofs, luxel, style, bump );
+	return SampleLightData( GetLumpView<colorrgbexp32_t>( data, LUMP_DIRECTLIGHTING ), face, face->lightofs, luxel, style, bump );
 }
 
 colorrgbexp32_t *SampleSunLightmap( bspdata_t *data, const dface_t *face, int luxel, int style, int bump )
 {
-	return SampleLightData( data->sunlightdata, face, face->sunlightofs, luxel, style, bump );
+	return SampleLightData( GetLumpView<colorrgbexp32_t>( data, LUMP_DIRECTSUNLIGHTING ), face, face->sunlightofs, luxel, style, bump );
 }
 
 colorrgbexp32_t *SampleBouncedLightmap( bspdata_t *data, const dface_t *face, int luxel )
 {
-	return &data->bouncedlightdata[face->bouncedlightofs + luxel];
+	return &GetLumpView<colorrgbexp32_t>( data, LUMP_BOUNCEDLIGHTING )[face->bouncedlightofs + luxel];
 }
 
 int GetNumWorldLeafs( bspdata_t *bspdata )
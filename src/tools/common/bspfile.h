@@ -2,6 +2,7 @@
 #define BSPFILE_H__
 #include "cmdlib.h" //--vluzacn
 #include "mathlib.h"
+#include "bspmapping.h"
 
 #include <pvector.h>
 
@@ -101,7 +102,10 @@
 #define MAX_LIGHTSTYLES 64
 //=============================================================================
 
-#define BSPVERSION  33
+#define BSPVERSION  36
+// Oldest version that can still be loaded. Lumps that were added after the
+// version of a file load empty.
+#define BSPVERSION_OLDEST 33
 #define TOOLVERSION 4
 
 // One hammer unit is 1/16th of a foot.
@@ -150,10 +154,22 @@ enum
         LUMP_VERTNORMALINDICES,
         LUMP_CUBEMAPDATA,
         LUMP_CUBEMAPS,
+        LUMP_LEAFLIGHTVIS,
+        LUMP_PROBEGRID,
+        LUMP_PROBEGRIDSAMPLES,
+        LUMP_PROBEGRIDBRICKS,
 
 	HEADER_LUMPS,
 };
 
+#define LUMP_BIT( lump ) ( 1u << ( lump ) )
+
+// Bulk lumps that are left in the file image by LoadBSPImage( BSPMappedImage * )
+// until something asks for them with MaterializeLump() or GetLumpView().
+#define BSP_LAZY_LUMPS ( LUMP_BIT( LUMP_VISIBILITY ) | LUMP_BIT( LUMP_BOUNCEDLIGHTING ) | \
+                         LUMP_BIT( LUMP_DIRECTLIGHTING ) | LUMP_BIT( LUMP_DIRECTSUNLIGHTING ) | \
+                         LUMP_BIT( LUMP_STATICPROPLIGHTING ) | LUMP_BIT( LUMP_CUBEMAPDATA ) )
+
 typedef struct
 {
         float           mins[3], maxs[3];
@@ -292,6 +308,40 @@ struct dleafambientlighting_t
         unsigned char x, y, z, pad; // pad is unused
 };
 
+#define LEAFLIGHTVIS_WORDS( numlights ) ( ( ( numlights ) + 31 ) / 32 )
+
+// Regular grid of ambient probes over the world, optionally baked by p3rad.
+struct dprobegrid_t
+{
+        // Position of the first probe and distance between probes, in hammer units.
+        float origin[3];
+        float spacing;
+        // Number of probes along each axis, x varies fastest.
+        int size[3];
+};
+
+// Ambient cube of a grid probe, in the same order and space as the per-leaf
+// ambient cubes: +x, -x, +y, -y, +z, -z.
+struct dprobegridsample_t
+{
+        float cube[6][3];
+};
+
+// The probes of the grid are stored in bricks of PROBEGRID_BRICK_SIZE probes
+// along each axis, so that stretches of the grid that are all inside of solid
+// don't take up a sample per probe.
+#define PROBEGRID_BRICK_SIZE 4
+#define PROBEGRID_BRICK_PROBES ( PROBEGRID_BRICK_SIZE * PROBEGRID_BRICK_SIZE * PROBEGRID_BRICK_SIZE )
+
+// One per brick, x varies fastest. A brick has either PROBEGRID_BRICK_PROBES
+// samples, x varying fastest, or a single sample that all of its probes
+// share. Bricks on the far edges of the grid are stored whole too.
+struct dprobegridbrick_t
+{
+        int firstsample;
+        int numsamples;
+};
+
 struct dleafambientindex_t
 {
         unsigned short num_ambient_samples;
@@ -435,62 +485,144 @@ entity_t;
 // BSP File Data
 //
 
-struct bspdata_t
+/**
+ * Storage for a lump of fixed-size records. It decays to a T * like the
+ * plain T[MAXCOUNT] array it replaces, so existing code that indexes,
+ * offsets or memcpy's into it keeps working, but it only holds as many
+ * entries as were allocated.
+ */
+template<class T, int MAXCOUNT>
+class bsplump_t
+{
+public:
+        INLINE operator T *()
+        {
+                return _storage.data();
+        }
+
+        INLINE operator const T *() const
+        {
+                return _storage.data();
+        }
+
+        // Resizes the lump to exactly count entries, keeping the existing ones.
+        INLINE void alloc( size_t count )
+        {
+                _storage.resize( count );
+                _storage.shrink_to_fit();
+        }
+
+        INLINE void alloc_max()
+        {
+                alloc( MAXCOUNT );
+        }
+
+        // Grows the lump to at least count entries.
+        INLINE void ensure( size_t count )
+        {
+                if ( count > _storage.size() )
+                {
+                        alloc( count );
+                }
+        }
+
+        INLINE size_t capacity() const
+        {
+                return _storage.size();
+        }
+
+        INLINE size_t get_memory_usage() const
+        {
+                return _storage.capacity() * sizeof( T );
+        }
+
+        static INLINE int max_count()
+        {
+                return MAXCOUNT;
+        }
+
+private:
+        pvector<T> _storage;
+};
+
+template<class T>
+INLINE size_t lump_memory_usage( const pvector<T> &lump )
+{
+        return lump.capacity() * sizeof( T );
+}
+
+template<class T, int MAXCOUNT>
+INLINE size_t lump_memory_usage( const bsplump_t<T, MAXCOUNT> &lump )
+{
+        return lump.get_memory_usage();
+}
+
+struct _BSPEXPORT bspdata_t
 {
+        // reserve_max allocates every fixed-record lump at its MAX_MAP_* size,
+        // which the compile tools rely on since they write past the current
+        // counts. The game loads with reserve_max off and only allocates what
+        // is in the file.
+        bspdata_t( bool reserve_max = true );
+
+        size_t get_memory_usage() const;
+
+        bool     reserve_max;
+
         int      nummodels;
-        dmodel_t dmodels[MAX_MAP_MODELS];
+        bsplump_t<dmodel_t, MAX_MAP_MODELS> dmodels;
         int      dmodels_checksum;
 
         int      visdatasize;
-        byte     dvisdata[MAX_MAP_VISIBILITY];
+        bsplump_t<byte, MAX_MAP_VISIBILITY> dvisdata;
         int      dvisdata_checksum;
 
         int      numtexrefs;
-        texref_t dtexrefs[MAX_MAP_TEXTURES];                                  // (dtexlump_t)
+        bsplump_t<texref_t, MAX_MAP_TEXTURES> dtexrefs;                                  // (dtexlump_t)
         int      dtexrefs_checksum;
 
         int      entdatasize;
-        char     dentdata[MAX_MAP_ENTSTRING];
+        bsplump_t<char, MAX_MAP_ENTSTRING> dentdata;
         int      dentdata_checksum;
 
         int      numleafs;
-        dleaf_t  dleafs[MAX_MAP_LEAFS];
+        bsplump_t<dleaf_t, MAX_MAP_LEAFS> dleafs;
         int      dleafs_checksum;
 
         int      numplanes;
-        dplane_t dplanes[MAX_INTERNAL_MAP_PLANES];
+        bsplump_t<dplane_t, MAX_INTERNAL_MAP_PLANES> dplanes;
         int      dplanes_checksum;
 
         int      numvertexes;
-        dvertex_t dvertexes[MAX_MAP_VERTS];
+        bsplump_t<dvertex_t, MAX_MAP_VERTS> dvertexes;
         int      dvertexes_checksum;
 
         int      numnodes;
-        dnode_t  dnodes[MAX_MAP_NODES];
+        bsplump_t<dnode_t, MAX_MAP_NODES> dnodes;
         int      dnodes_checksum;
 
         int      numtexinfo;
-        texinfo_t texinfo[MAX_INTERNAL_MAP_TEXINFO];
+        bsplump_t<texinfo_t, MAX_INTERNAL_MAP_TEXINFO> texinfo;
         int      texinfo_checksum;
 
         int      numfaces;
-        dface_t  dfaces[MAX_MAP_FACES];
+        bsplump_t<dface_t, MAX_MAP_FACES> dfaces;
         int      dfaces_checksum;
 
         int	numorigfaces;
-        dface_t	dorigfaces[MAX_MAP_FACES];
+        bsplump_t<dface_t, MAX_MAP_FACES> dorigfaces;
         int	dorigfaces_checksum;
 
         int      numedges;
-        dedge_t  dedges[MAX_MAP_EDGES];
+        bsplump_t<dedge_t, MAX_MAP_EDGES> dedges;
         int      dedges_checksum;
 
         int      nummarksurfaces;
-        unsigned short dmarksurfaces[MAX_MAP_MARKSURFACES];
+        bsplump_t<unsigned short, MAX_MAP_MARKSURFACES> dmarksurfaces;
         int      dmarksurfaces_checksum;
 
         int      numsurfedges;
-        int      dsurfedges[MAX_MAP_SURFEDGES];
+        bsplump_t<int, MAX_MAP_SURFEDGES> dsurfedges;
         int      dsurfedges_checksum;
 
         pvector<dleafambientlighting_t> leafambientlighting;
@@ -506,23 +638,45 @@ struct bspdata_t
         pvector<colorrgbexp32_t> cubemapdata;
         pvector<dcubemap_t> cubemaps;
 
+        // For each leaf, a bitset of the lights that can be seen from somewhere
+        // in the leaf, LEAFLIGHTVIS_WORDS( number of lights ) words per leaf.
+        // Lights are numbered in the order of the light entities, the same as
+        // the light ids of AmbientProbeManager.
+        pvector<unsigned int> leaflightvis;
+
+        // Empty if the map was compiled without a probe grid.
+        pvector<dprobegrid_t> probegrid;
+        pvector<dprobegridsample_t> probegridsamples;
+        pvector<dprobegridbrick_t> probegridbricks;
+
 	pvector<colorrgbexp32_t> bouncedlightdata;
 	pvector<colorrgbexp32_t> sunlightdata;
 	pvector<colorrgbexp32_t> lightdata;
 	int      dlightdata_checksum;
 
         int      numentities;
-        entity_t entities[MAX_MAP_ENTITIES];
+        bsplump_t<entity_t, MAX_MAP_ENTITIES> entities;
+
+        // File image the lumps were loaded from, if loaded with LoadBSPImage( BSPMappedImage * ).
+        // Lumps with their bit set in lazylumps still live only in the image.
+        PT( BSPMappedImage ) image;
+        unsigned int lazylumps = 0;
 };
 
 extern _BSPEXPORT bspdata_t *g_bspdata;
 
 extern _BSPEXPORT void     DecompressVis( bspdata_t *data, const byte* src, byte* const dest, const unsigned int dest_length );
+extern _BSPEXPORT void     DecompressVis( const byte *visdata, const int visdatasize, const int visleafs,
+                                          const byte* src, byte* const dest, const unsigned int dest_length );
 extern _BSPEXPORT int      CompressVis( const byte* const src, const unsigned int src_length,
                              byte* dest, unsigned int dest_length );
 
 extern _BSPEXPORT bspdata_t     *LoadBSPImage( dheader_t* header );
+extern _BSPEXPORT bspdata_t     *LoadBSPImage( BSPMappedImage *image, const unsigned int lazylumps = BSP_LAZY_LUMPS );
 extern _BSPEXPORT bspdata_t     *LoadBSPFile( const char* const filename );
+extern _BSPEXPORT unsigned char *GetLumpData( bspdata_t *data, const int lump, size_t &length );
+extern _BSPEXPORT void     MaterializeLump( bspdata_t *data, const int lump );
+extern _BSPEXPORT void     MaterializeAllLumps( bspdata_t *data );
 extern _BSPEXPORT void     WriteBSPFile( bspdata_t *data, const char* const filename );
 extern _BSPEXPORT void     PrintBSPFileSizes( bspdata_t *data );
 #ifdef PLATFORM_CAN_CALC_EXTENT
@@ -558,6 +712,23 @@ extern _BSPEXPORT entity_t* EntityForModel( bspdata_t *data, int modnum );
 
 extern _BSPEXPORT int FastChecksum( const void* const buffer, int bytes );
 
+/**
+ * Returns a typed view of the lump, straight out of the file image if it
+ * has not been materialized yet. Only valid for the lumps in BSP_LAZY_LUMPS.
+ */
+template<class T>
+INLINE lumpview_t<T> GetLumpView( bspdata_t *data, const int lump )
+{
+        size_t length;
+        unsigned char *ptr = GetLumpData( data, lump, length );
+        return lumpview_t<T>( (T *)ptr, length / sizeof( T ) );
+}
+
+INLINE bool IsLumpResident( const bspdata_t *data, const int lump )
+{
+        return ( data->lazylumps & LUMP_BIT( lump ) ) == 0;
+}
+
 //
 // Texture Related Stuff
 //
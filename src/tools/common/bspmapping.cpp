@@ -0,0 +1,197 @@
+/**
+ * PANDA3D BSP TOOLS
+ * Copyright (c) CIO Team. All rights reserved.
+ *
+ * @file bspmapping.cpp
+ * @author Brian Lach
+ * @date October 18, 2020
+ */
+
+#include "bspmapping.h"
+
+#include <virtualFileSystem.h>
+#include <subfileInfo.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+BSPMappedImage::BSPMappedImage() :
+        _base( nullptr ),
+        _size( 0 ),
+        _view( nullptr ),
+        _view_size( 0 ),
+#ifdef _WIN32
+        _file( INVALID_HANDLE_VALUE ),
+        _mapping( nullptr )
+#else
+        _fd( -1 )
+#endif
+{
+}
+
+BSPMappedImage::~BSPMappedImage()
+{
+        close();
+}
+
+/**
+ * Opens the BSP file through the VirtualFileSystem. If the file (or the
+ * multifile subfile) can be accessed directly on disk it is mapped
+ * copy-on-write, otherwise the whole file is read once into memory.
+ */
+bool BSPMappedImage::open( const Filename &filename )
+{
+        close();
+
+        VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
+        PT( VirtualFile ) vfile = vfs->get_file( filename );
+        if ( vfile == nullptr )
+        {
+                return false;
+        }
+
+        SubfileInfo info;
+        if ( vfile->get_system_info( info ) && !info.is_empty() && info.get_size() > 0 )
+        {
+                if ( map_file( info.get_filename(), (size_t)info.get_start(), (size_t)info.get_size() ) )
+                {
+                        return true;
+                }
+        }
+
+        // Couldn't map it, fall back to a single read.
+        if ( !vfile->read_file( _buffer, true ) )
+        {
+                _buffer.clear();
+                return false;
+        }
+
+        _base = _buffer.data();
+        _size = _buffer.size();
+
+        return true;
+}
+
+void BSPMappedImage::close()
+{
+        unmap_file();
+
+        _buffer.clear();
+        _buffer.shrink_to_fit();
+
+        _base = nullptr;
+        _size = 0;
+}
+
+bool BSPMappedImage::is_range_valid( size_t offset, size_t length ) const
+{
+        return offset <= _size && length <= _size - offset;
+}
+
+bool BSPMappedImage::map_file( const Filename &os_file, size_t start, size_t length )
+{
+        std::string os_name = os_file.to_os_specific();
+
+#ifdef _WIN32
+        SYSTEM_INFO sysinfo;
+        GetSystemInfo( &sysinfo );
+        size_t granularity = sysinfo.dwAllocationGranularity;
+#else
+        size_t granularity = (size_t)sysconf( _SC_PAGESIZE );
+#endif
+
+        size_t aligned_start = start - ( start % granularity );
+        size_t slop = start - aligned_start;
+
+#ifdef _WIN32
+        _file = CreateFileA( os_name.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr );
+        if ( _file == INVALID_HANDLE_VALUE )
+        {
+                return false;
+        }
+
+        _mapping = CreateFileMappingA( _file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr );
+        if ( _mapping == nullptr )
+        {
+                unmap_file();
+                return false;
+        }
+
+        unsigned long long ofs = aligned_start;
+        _view = MapViewOfFile( _mapping, FILE_MAP_COPY, (DWORD)( ofs >> 32 ), (DWORD)( ofs & 0xFFFFFFFF ),
+                               slop + length );
+        if ( _view == nullptr )
+        {
+                unmap_file();
+                return false;
+        }
+#else
+        _fd = ::open( os_name.c_str(), O_RDONLY );
+        if ( _fd < 0 )
+        {
+                return false;
+        }
+
+        // Mapped private so the loader can byte-swap the header in place
+        // without touching the file.
+        void *view = mmap( nullptr, slop + length, PROT_READ | PROT_WRITE, MAP_PRIVATE, _fd, (off_t)aligned_start );
+        if ( view == MAP_FAILED )
+        {
+                unmap_file();
+                return false;
+        }
+        _view = view;
+#endif
+
+        _view_size = slop + length;
+        _base = (unsigned char *)_view + slop;
+        _size = length;
+
+        return true;
+}
+
+void BSPMappedImage::unmap_file()
+{
+#ifdef _WIN32
+        if ( _view != nullptr )
+        {
+                UnmapViewOfFile( _view );
+        }
+        if ( _mapping != nullptr )
+        {
+                CloseHandle( _mapping );
+                _mapping = nullptr;
+        }
+        if ( _file != INVALID_HANDLE_VALUE )
+        {
+                CloseHandle( _file );
+                _file = INVALID_HANDLE_VALUE;
+        }
+#else
+        if ( _view != nullptr )
+        {
+                munmap( _view, _view_size );
+        }
+        if ( _fd >= 0 )
+        {
+                ::close( _fd );
+                _fd = -1;
+        }
+#endif
+
+        if ( _view != nullptr )
+        {
+                _view = nullptr;
+                _view_size = 0;
+                _base = nullptr;
+                _size = 0;
+        }
+}
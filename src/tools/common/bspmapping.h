@@ -0,0 +1,139 @@
+/**
+ * PANDA3D BSP TOOLS
+ * Copyright (c) CIO Team. All rights reserved.
+ *
+ * @file bspmapping.h
+ * @author Brian Lach
+ * @date October 18, 2020
+ *
+ * @desc Read-only view of a BSP file image. The file is memory mapped
+ *       when it lives on disk (or uncompressed inside a multifile),
+ *       otherwise it is read into a single owned buffer.
+ */
+
+#ifndef BSPMAPPING_H
+#define BSPMAPPING_H
+
+#include "common_config.h"
+
+#include <referenceCount.h>
+#include <pointerTo.h>
+#include <filename.h>
+#include <vector_uchar.h>
+#include <pnotify.h>
+
+/**
+ * Typed, bounds-checked window into a lump. The view does not own the
+ * memory it points at; it is only valid for as long as the bspdata_t
+ * (and the file image behind it) that produced it.
+ */
+template<class T>
+struct lumpview_t
+{
+        T *base;
+        size_t count;
+
+        lumpview_t() :
+                base( nullptr ),
+                count( 0 )
+        {
+        }
+
+        lumpview_t( T *b, size_t c ) :
+                base( b ),
+                count( c )
+        {
+        }
+
+        INLINE T &operator [] ( size_t n ) const
+        {
+                nassertr( n < count, base[0] );
+                return base[n];
+        }
+
+        INLINE T *data() const
+        {
+                return base;
+        }
+
+        INLINE size_t size() const
+        {
+                return count;
+        }
+
+        INLINE bool empty() const
+        {
+                return count == 0;
+        }
+
+        INLINE T *begin() const
+        {
+                return base;
+        }
+
+        INLINE T *end() const
+        {
+                return base + count;
+        }
+};
+
+class _BSPEXPORT BSPMappedImage : public ReferenceCount
+{
+public:
+        BSPMappedImage();
+        ~BSPMappedImage();
+
+        bool open( const Filename &filename );
+        void close();
+
+        INLINE unsigned char *get_base() const
+        {
+                return _base;
+        }
+
+        INLINE size_t get_size() const
+        {
+                return _size;
+        }
+
+        INLINE bool is_mapped() const
+        {
+                return _view != nullptr;
+        }
+
+        INLINE bool is_valid() const
+        {
+                return _base != nullptr;
+        }
+
+        bool is_range_valid( size_t offset, size_t length ) const;
+
+private:
+        bool map_file( const Filename &os_file, size_t start, size_t length );
+        void unmap_file();
+
+private:
+        // Start of the BSP image, either inside the mapping or the buffer.
+        unsigned char *_base;
+        size_t _size;
+
+        // The mapping itself. Mappings must begin on an allocation granularity
+        // boundary, so for multifile subfiles _view may lie before _base.
+        void *_view;
+        size_t _view_size;
+
+#ifdef _WIN32
+        // The file and mapping HANDLEs, kept opaque so that includers don't
+        // need <windows.h>.
+        void *_file;
+        void *_mapping;
+#else
+        int _fd;
+#endif
+
+        // Used when the file cannot be mapped, such as when it is compressed
+        // or encrypted inside a multifile.
+        vector_uchar _buffer;
+};
+
+#endif // BSPMAPPING_H
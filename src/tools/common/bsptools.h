@@ -103,12 +103,20 @@ struct _BSPEXPORT Trace
         fltx4 sse_inv_delta;
         fltx4 sse_extents;
 
+        // bounds of the whole sweep, extents included
+        fltx4 sse_sweep_mins;
+        fltx4 sse_sweep_maxs;
+
         INLINE void load_simd()
         {
                 sse_start = LoadAlignedSIMD( LVector4( start_pos, 0 ).get_data() );
                 sse_extents = LoadAlignedSIMD( LVector4( extents, 0 ).get_data() );
                 sse_delta = LoadAlignedSIMD( LVector4( delta, 0 ).get_data() );
                 sse_inv_delta = LoadAlignedSIMD( LVector4( inv_delta, 0 ).get_data() );
+
+                fltx4 sse_end = AddSIMD( sse_start, sse_delta );
+                sse_sweep_mins = SubSIMD( MinSIMD( sse_start, sse_end ), sse_extents );
+                sse_sweep_maxs = AddSIMD( MaxSIMD( sse_start, sse_end ), sse_extents );
         }
 
         collbspdata_t *bspdata;
@@ -487,6 +487,423 @@ static void ComputeLeafAmbientLighting( int thread )
         }
 }
 
+struct LeafVisLight
+{
+        LVector3 pos;
+        int leaf;
+        bool sun;
+};
+
+static pvector<LeafVisLight> leaf_vis_lights;
+static int leaf_light_words;
+
+/**
+ * Fills in the bits of the lights that can be seen from somewhere in the
+ * leaf. Lights are traced from the ambient samples of the leaf, its center
+ * and its corners, so the bits err on the side of visible.
+ */
+static void ComputeLeafLightVisibility( int thread )
+{
+        pvector<byte> pvs( ( MAX_MAP_LEAFS + 7 ) / 8 );
+
+        while ( true )
+        {
+                int leaf_id = GetThreadWork();
+                if ( leaf_id == -1 )
+                {
+                        break;
+                }
+
+                const dleaf_t *leaf = &g_bspdata->dleafs[leaf_id];
+                if ( leaf->contents == CONTENTS_SOLID )
+                {
+                        continue;
+                }
+
+                if ( g_bspdata->visdatasize && leaf->visofs != -1 )
+                {
+                        DecompressVis( g_bspdata, &g_bspdata->dvisdata[leaf->visofs], pvs.data(), (unsigned int)pvs.size() );
+                }
+                else
+                {
+                        memset( pvs.data(), 255, pvs.size() );
+                }
+
+                pvector<LVector3> points;
+                const vector_ambientsample &samples = leaf_ambient_samples[leaf_id];
+                for ( size_t i = 0; i < samples.size(); i++ )
+                {
+                        points.push_back( samples[i].pos );
+                }
+                LVector3 mins( leaf->mins[0] + 1, leaf->mins[1] + 1, leaf->mins[2] + 1 );
+                LVector3 maxs( leaf->maxs[0] - 1, leaf->maxs[1] - 1, leaf->maxs[2] - 1 );
+                points.push_back( ( mins + maxs ) * 0.5f );
+                for ( int corner = 0; corner < 8; corner++ )
+                {
+                        points.push_back( LVector3( ( corner & 1 ) ? maxs[0] : mins[0],
+                                                    ( corner & 2 ) ? maxs[1] : mins[1],
+                                                    ( corner & 4 ) ? maxs[2] : mins[2] ) );
+                }
+
+                unsigned int *bits = &g_bspdata->leaflightvis[leaf_id * leaf_light_words];
+                for ( size_t l = 0; l < leaf_vis_lights.size(); l++ )
+                {
+                        const LeafVisLight &light = leaf_vis_lights[l];
+
+                        // the sun is traced separately at runtime
+                        if ( light.sun )
+                        {
+                                continue;
+                        }
+
+                        if ( light.leaf != leaf_id && !PVSCheck( pvs.data(), light.leaf ) )
+                        {
+                                continue;
+                        }
+
+                        vec3_t end;
+                        VectorCopy( light.pos, end );
+                        for ( size_t i = 0; i < points.size(); i++ )
+                        {
+                                vec3_t start;
+                                VectorCopy( points[i], start );
+                                if ( RADTrace::test_line( start, end ) != CONTENTS_SOLID )
+                                {
+                                        bits[l >> 5] |= 1u << ( l & 31 );
+                                        break;
+                                }
+                        }
+                }
+        }
+}
+
+static void compute_leaf_light_visibility( int numleafs )
+{
+        // Number the lights like AmbientProbeManager does, every entity with
+        // a classname starting with "light".
+        leaf_vis_lights.clear();
+        for ( int i = 0; i < g_bspdata->numentities; i++ )
+        {
+                entity_t *ent = &g_bspdata->entities[i];
+                const char *classname = ValueForKey( ent, "classname" );
+                if ( strncmp( classname, "light", 5 ) )
+                {
+                        continue;
+                }
+
+                vec3_t origin;
+                GetVectorDForKey( ent, "origin", origin );
+
+                LeafVisLight light;
+                VectorCopy( origin, light.pos );
+                light.leaf = (int)( PointInLeafD( origin ) - g_bspdata->dleafs );
+                light.sun = !strncmp( classname, "light_environment", 18 );
+                leaf_vis_lights.push_back( light );
+        }
+
+        leaf_light_words = LEAFLIGHTVIS_WORDS( (int)leaf_vis_lights.size() );
+
+        g_bspdata->leaflightvis.clear();
+        g_bspdata->leaflightvis.resize( numleafs * leaf_light_words, 0u );
+
+        if ( leaf_light_words > 0 )
+        {
+                NamedRunThreadsOn( numleafs, g_estimate, ComputeLeafLightVisibility );
+        }
+}
+
+// Most probes a grid may have, the spacing is widened until it fits. Bricks
+// that are all inside of solid are stored as one sample, so the file
+// usually holds far fewer.
+#define MAX_PROBEGRID_SAMPLES ( 1 << 20 )
+
+static dprobegrid_t probe_grid;
+static pvector<dprobegridsample_t> probe_grid_samples;
+// Bytes, not bools, since threads write neighboring probes at once.
+static pvector<unsigned char> probe_grid_valid;
+
+static void store_probe_cube( const LVector3 *cube, dprobegridsample_t &sample )
+{
+        for ( int i = 0; i < 6; i++ )
+        {
+                VectorCopy( cube[i], sample.cube[i] );
+        }
+}
+
+static void ComputeProbeGridSample( int thread )
+{
+        while ( true )
+        {
+                int probe = GetThreadWork();
+                if ( probe == -1 )
+                {
+                        break;
+                }
+
+                int x = probe % probe_grid.size[0];
+                int y = ( probe / probe_grid.size[0] ) % probe_grid.size[1];
+                int z = probe / ( probe_grid.size[0] * probe_grid.size[1] );
+
+                LVector3 pos( probe_grid.origin[0] + x * probe_grid.spacing,
+                              probe_grid.origin[1] + y * probe_grid.spacing,
+                              probe_grid.origin[2] + z * probe_grid.spacing );
+
+                if ( PointInLeaf( pos )->contents == CONTENTS_SOLID )
+                {
+                        // Filled in from its neighbors later.
+                        probe_grid_valid[probe] = 0;
+                        continue;
+                }
+
+                LVector3 cube[6];
+                compute_ambient_from_spherical_samples( thread, pos, cube );
+                store_probe_cube( cube, probe_grid_samples[probe] );
+                probe_grid_valid[probe] = 1;
+        }
+}
+
+/**
+ * Gives probes that ended up inside walls the average of their valid
+ * neighbors, a layer at a time, so light doesn't fade to black when a model
+ * gets close to a wall.
+ */
+static void dilate_probe_grid()
+{
+        static const int offsets[6][3] = {
+                { 1, 0, 0 }, { -1, 0, 0 },
+                { 0, 1, 0 }, { 0, -1, 0 },
+                { 0, 0, 1 }, { 0, 0, -1 }
+        };
+
+        pvector<int> filled;
+        do
+        {
+                filled.clear();
+                for ( int z = 0; z < probe_grid.size[2]; z++ )
+                {
+                        for ( int y = 0; y < probe_grid.size[1]; y++ )
+                        {
+                                for ( int x = 0; x < probe_grid.size[0]; x++ )
+                                {
+                                        int probe = x + probe_grid.size[0] * ( y + probe_grid.size[1] * z );
+                                        if ( probe_grid_valid[probe] )
+                                        {
+                                                continue;
+                                        }
+
+                                        dprobegridsample_t sum;
+                                        memset( &sum, 0, sizeof( sum ) );
+                                        int count = 0;
+                                        for ( int i = 0; i < 6; i++ )
+                                        {
+                                                int nx = x + offsets[i][0];
+                                                int ny = y + offsets[i][1];
+                                                int nz = z + offsets[i][2];
+                                                if ( nx < 0 || ny < 0 || nz < 0 ||
+                                                     nx >= probe_grid.size[0] || ny >= probe_grid.size[1] || nz >= probe_grid.size[2] )
+                                                {
+                                                        continue;
+                                                }
+
+                                                int neighbor = nx + probe_grid.size[0] * ( ny + probe_grid.size[1] * nz );
+                                                if ( !probe_grid_valid[neighbor] )
+                                                {
+                                                        continue;
+                                                }
+
+                                                for ( int j = 0; j < 6; j++ )
+                                                {
+                                                        VectorAdd( sum.cube[j], probe_grid_samples[neighbor].cube[j], sum.cube[j] );
+                                                }
+                                                count++;
+                                        }
+
+                                        if ( count == 0 )
+                                        {
+                                                continue;
+                                        }
+
+                                        for ( int j = 0; j < 6; j++ )
+                                        {
+                                                VectorScale( sum.cube[j], 1.0f / count, probe_grid_samples[probe].cube[j] );
+                                        }
+                                        filled.push_back( probe );
+                                }
+                        }
+                }
+
+                // Only mark them now so this layer doesn't feed itself.
+                for ( size_t i = 0; i < filled.size(); i++ )
+                {
+                        probe_grid_valid[filled[i]] = 1;
+                }
+        } while ( !filled.empty() );
+}
+
+/**
+ * Stores the grid a brick at a time. A brick whose probes are all inside of
+ * solid only gets one sample, the average of what its probes were dilated
+ * to, since nothing is lit from inside of it and only its faces get blended
+ * with the probes next to them.
+ */
+static void store_probe_grid_bricks( const pvector<unsigned char> &in_air )
+{
+        int bricks[3];
+        for ( int i = 0; i < 3; i++ )
+        {
+                bricks[i] = ( probe_grid.size[i] + PROBEGRID_BRICK_SIZE - 1 ) / PROBEGRID_BRICK_SIZE;
+        }
+
+        g_bspdata->probegridsamples.clear();
+        g_bspdata->probegridbricks.clear();
+
+        int numsolid = 0;
+        for ( int bz = 0; bz < bricks[2]; bz++ )
+        {
+                for ( int by = 0; by < bricks[1]; by++ )
+                {
+                        for ( int bx = 0; bx < bricks[0]; bx++ )
+                        {
+                                bool solid = true;
+                                dprobegridsample_t sum;
+                                memset( &sum, 0, sizeof( sum ) );
+                                int count = 0;
+
+                                int probes[PROBEGRID_BRICK_PROBES];
+                                for ( int i = 0; i < PROBEGRID_BRICK_PROBES; i++ )
+                                {
+                                        int x = bx * PROBEGRID_BRICK_SIZE + i % PROBEGRID_BRICK_SIZE;
+                                        int y = by * PROBEGRID_BRICK_SIZE + ( i / PROBEGRID_BRICK_SIZE ) % PROBEGRID_BRICK_SIZE;
+                                        int z = bz * PROBEGRID_BRICK_SIZE + i / ( PROBEGRID_BRICK_SIZE * PROBEGRID_BRICK_SIZE );
+                                        if ( x >= probe_grid.size[0] || y >= probe_grid.size[1] || z >= probe_grid.size[2] )
+                                        {
+                                                // Past the edge of the grid.
+                                                probes[i] = -1;
+                                                continue;
+                                        }
+
+                                        int probe = x + probe_grid.size[0] * ( y + probe_grid.size[1] * z );
+                                        probes[i] = probe;
+                                        if ( in_air[probe] )
+                                        {
+                                                solid = false;
+                                        }
+
+                                        for ( int j = 0; j < 6; j++ )
+                                        {
+                                                VectorAdd( sum.cube[j], probe_grid_samples[probe].cube[j], sum.cube[j] );
+                                        }
+                                        count++;
+                                }
+
+                                dprobegridbrick_t brick;
+                                brick.firstsample = (int)g_bspdata->probegridsamples.size();
+                                if ( solid )
+                                {
+                                        for ( int j = 0; j < 6; j++ )
+                                        {
+                                                VectorScale( sum.cube[j], 1.0f / count, sum.cube[j] );
+                                        }
+                                        g_bspdata->probegridsamples.push_back( sum );
+                                        brick.numsamples = 1;
+                                        numsolid++;
+                                }
+                                else
+                                {
+                                        dprobegridsample_t empty;
+                                        memset( &empty, 0, sizeof( empty ) );
+                                        for ( int i = 0; i < PROBEGRID_BRICK_PROBES; i++ )
+                                        {
+                                                // The probes past the edge are never sampled.
+                                                g_bspdata->probegridsamples.push_back( probes[i] != -1 ? probe_grid_samples[probes[i]] : empty );
+                                        }
+                                        brick.numsamples = PROBEGRID_BRICK_PROBES;
+                                }
+                                g_bspdata->probegridbricks.push_back( brick );
+                        }
+                }
+        }
+
+        Log( "Probe grid: %i of %i bricks inside of solid, %i samples stored\n",
+             numsolid, (int)g_bspdata->probegridbricks.size(), (int)g_bspdata->probegridsamples.size() );
+}
+
+/**
+ * Bakes a regular grid of ambient probes over the world, g_probegrid units
+ * apart, for the engine to interpolate between.
+ */
+static void compute_probe_grid()
+{
+        g_bspdata->probegrid.clear();
+        g_bspdata->probegridsamples.clear();
+
+        if ( g_probegrid <= 0.0 )
+        {
+                return;
+        }
+
+        const dmodel_t *world = &g_bspdata->dmodels[0];
+
+        float spacing = (float)g_probegrid;
+        int size[3];
+        while ( true )
+        {
+                for ( int i = 0; i < 3; i++ )
+                {
+                        size[i] = (int)std::ceil( ( world->maxs[i] - world->mins[i] ) / spacing ) + 1;
+                        size[i] = max( size[i], 2 );
+                }
+                if ( (double)size[0] * size[1] * size[2] <= MAX_PROBEGRID_SAMPLES )
+                {
+                        break;
+                }
+                spacing *= 2.0f;
+        }
+
+        if ( spacing != (float)g_probegrid )
+        {
+                Warning( "Probe grid spacing of %.1f is too fine for this map, using %.1f\n", g_probegrid, spacing );
+        }
+
+        for ( int i = 0; i < 3; i++ )
+        {
+                probe_grid.origin[i] = world->mins[i];
+                probe_grid.size[i] = size[i];
+        }
+        probe_grid.spacing = spacing;
+
+        int numprobes = size[0] * size[1] * size[2];
+        probe_grid_samples.clear();
+        probe_grid_samples.resize( numprobes );
+        probe_grid_valid.clear();
+        probe_grid_valid.resize( numprobes, 0 );
+
+        NamedRunThreadsOn( numprobes, g_estimate, ComputeProbeGridSample );
+
+        int numvalid = 0;
+        for ( int i = 0; i < numprobes; i++ )
+        {
+                if ( probe_grid_valid[i] )
+                {
+                        numvalid++;
+                }
+        }
+        if ( numvalid == 0 )
+        {
+                Warning( "Every probe of the probe grid is in solid, not writing it\n" );
+                return;
+        }
+
+        // Which probes were outside of solid before dilation filled the rest in.
+        pvector<unsigned char> in_air = probe_grid_valid;
+        dilate_probe_grid();
+
+        g_bspdata->probegrid.push_back( probe_grid );
+        store_probe_grid_bricks( in_air );
+
+        Log( "Probe grid: %i x %i x %i probes, %i outside of solid\n", size[0], size[1], size[2], numvalid );
+}
+
 void LeafAmbientLighting::
 compute_per_leaf_ambient_lighting()
 {
@@ -582,7 +999,11 @@ compute_per_leaf_ambient_lighting()
                         //g_leafambientindex[i].first_ambient_sample = ret_leaf;
                 }
         }
-        
+
+        // bake which lights each leaf can see, tracing from the samples we just placed
+        compute_leaf_light_visibility( numleafs );
+
+        compute_probe_grid();
 }
 
 #endif
\ No newline at end of file
@@ -183,6 +183,7 @@ vec_t			g_translucentdepth = DEFAULT_TRANSLUCENTDEPTH;
 vec_t			g_blur = DEFAULT_BLUR;
 bool			g_noemitterrange = DEFAULT_NOEMITTERRANGE;
 vec_t			g_texlightgap = DEFAULT_TEXLIGHTGAP;
+vec_t			g_probegrid = DEFAULT_PROBEGRID;
 
 // Misc
 int             leafparents[MAX_MAP_LEAFS];
@@ -1910,6 +1911,7 @@ static void     Usage()
         Log( "   -blur #        : Enlarge lightmap sample to blur the lightmap.\n" );
         Log( "   -noemitterrange: Don't fix pointy texlights.\n" );
         Log( "   -nobleedfix    : Don't fix wall bleeding problem for large blur value.\n" );
+        Log( "   -probegrid #   : Bake a grid of ambient probes # units apart for dynamic models (0=off).\n" );
         Log( "   -drawpatch     : Export light patch positions to file 'mapname_patch.pts'.\n" );
         Log( "   -drawsample x y z r    : Export light sample positions in an area to file 'mapname_sample.pts'.\n" );
         Log( "   -drawedge      : Export smooth edge positions to file 'mapname_edge.pts'.\n" );
@@ -2095,6 +2097,9 @@ static void     Settings()
         Log( "blur size            [ %17s ] [ %17s ]\n", buf1, buf2 );
         Log( "no emitter range     [ %17s ] [ %17s ]\n", g_noemitterrange ? "on" : "off", DEFAULT_NOEMITTERRANGE ? "on" : "off" );
         Log( "wall bleeding fix    [ %17s ] [ %17s ]\n", g_bleedfix ? "on" : "off", DEFAULT_BLEEDFIX ? "on" : "off" );
+        safe_snprintf( buf1, sizeof( buf1 ), "%3.3f", g_probegrid );
+        safe_snprintf( buf2, sizeof( buf2 ), "%3.3f", DEFAULT_PROBEGRID );
+        Log( "probe grid spacing   [ %17s ] [ %17s ]\n", buf1, buf2 );
 
         Log( "\n\n" );
 }
@@ -2593,6 +2598,17 @@ int             main( const int argc, char** argv )
                                                 Usage();
                                         }
                                 }
+                                else if ( !strcasecmp( argv[i], "-probegrid" ) )
+                                {
+                                        if ( i + 1 < argc )
+                                        {
+                                                g_probegrid = atof( argv[++i] );
+                                        }
+                                        else
+                                        {
+                                                Usage();
+                                        }
+                                }
 
                                 else if ( argv[i][0] == '-' )
                                 {
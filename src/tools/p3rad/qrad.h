@@ -136,6 +136,7 @@
 #define DEFAULT_NOEMITTERRANGE false
 #define DEFAULT_BLEEDFIX true
 #define DEFAULT_TEXLIGHTGAP 0.0
+#define DEFAULT_PROBEGRID 0.0 // no probe grid
 
 #define		TRANSFER_EPSILON		0.0000001
 
@@ -550,6 +551,7 @@ extern bool g_bleedfix;
 extern vec_t g_maxdiscardedlight;
 extern vec3_t g_maxdiscardedpos;
 extern vec_t g_texlightgap;
+extern vec_t g_probegrid;
 extern float g_skysamplescale;
 
 extern void     DetermineLightmapMemory();